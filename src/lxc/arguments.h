@@ -87,6 +87,7 @@ struct lxc_arguments {
 	uint64_t fssize;
 	char *lvname, *vgname, *thinpool;
 	char *zfsroot, *lowerdir, *dir;
+	int shiftids;
 
 	/* auto-start */
 	int all;
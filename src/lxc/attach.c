@@ -26,12 +26,14 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <sys/param.h>
 #include <sys/prctl.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/syscall.h>
 #include <sys/wait.h>
@@ -151,48 +153,55 @@ static void lxc_proc_put_context_info(struct lxc_proc_context_info *ctx)
 	free(ctx);
 }
 
-static int lxc_attach_to_ns(pid_t pid, int which)
+/* according to <http://article.gmane.org/gmane.linux.kernel.containers.lxc.devel/1429>,
+ * the file for user namepsaces in /proc/$pid/ns will be called
+ * 'user' once the kernel supports it
+ */
+static char *ns_names[] = { "user", "mnt", "pid", "uts", "ipc", "net" };
+static int ns_flags[] = {
+	CLONE_NEWUSER, CLONE_NEWNS, CLONE_NEWPID, CLONE_NEWUTS, CLONE_NEWIPC,
+	CLONE_NEWNET
+};
+#define LXC_ATTACH_NS_COUNT (sizeof(ns_names) / sizeof(char *))
+
+/*
+ * lxc_attach_ns_open: open the namespace files of a process
+ *
+ * @procfd : fd of the /proc/<pid> directory of the process
+ * @which  : CLONE_NEW* flags of the namespaces to open, -1 for all
+ * @fd     : array of LXC_ATTACH_NS_COUNT fds, filled in with -1 for the
+ *           namespaces which were not opened
+ * @lenient: skip the namespaces the kernel doesn't know about instead
+ *           of failing
+ */
+static int lxc_attach_ns_open(int procfd, int which, int fd[], bool lenient)
 {
 	char path[MAXPATHLEN];
-	/* according to <http://article.gmane.org/gmane.linux.kernel.containers.lxc.devel/1429>,
-	 * the file for user namepsaces in /proc/$pid/ns will be called
-	 * 'user' once the kernel supports it
-	 */
-	static char *ns[] = { "user", "mnt", "pid", "uts", "ipc", "net" };
-	static int flags[] = {
-		CLONE_NEWUSER, CLONE_NEWNS, CLONE_NEWPID, CLONE_NEWUTS, CLONE_NEWIPC,
-		CLONE_NEWNET
-	};
-	static const int size = sizeof(ns) / sizeof(char *);
-	int fd[size];
 	int i, j, saved_errno;
 
-
-	snprintf(path, MAXPATHLEN, "/proc/%d/ns", pid);
-	if (access(path, X_OK)) {
-		ERROR("Does this kernel version support 'attach' ?");
-		return -1;
-	}
-
-	for (i = 0; i < size; i++) {
+	for (i = 0; i < LXC_ATTACH_NS_COUNT; i++) {
 		/* ignore if we are not supposed to attach to that
 		 * namespace
 		 */
-		if (which != -1 && !(which & flags[i])) {
+		if (which != -1 && !(which & ns_flags[i])) {
 			fd[i] = -1;
 			continue;
 		}
 
-		snprintf(path, MAXPATHLEN, "/proc/%d/ns/%s", pid, ns[i]);
-		fd[i] = open(path, O_RDONLY | O_CLOEXEC);
+		snprintf(path, MAXPATHLEN, "ns/%s", ns_names[i]);
+		fd[i] = openat(procfd, path, O_RDONLY | O_CLOEXEC);
 		if (fd[i] < 0) {
+			if (lenient && errno == ENOENT)
+				continue;
+
 			saved_errno = errno;
 
 			/* close all already opened file descriptors before
 			 * we return an error, so we don't leak them
 			 */
 			for (j = 0; j < i; j++)
-				close(fd[j]);
+				if (fd[j] >= 0)
+					close(fd[j]);
 
 			errno = saved_errno;
 			SYSERROR("failed to open '%s'", path);
@@ -200,24 +209,76 @@ static int lxc_attach_to_ns(pid_t pid, int which)
 		}
 	}
 
-	for (i = 0; i < size; i++) {
-		if (fd[i] >= 0 && setns(fd[i], 0) != 0) {
-			saved_errno = errno;
+	return 0;
+}
 
-			for (j = i; j < size; j++)
-				close(fd[j]);
+/* setns() into the namespaces in @which (-1 for all) opened in @fd */
+static int lxc_attach_ns_enter(int fd[], int which)
+{
+	int i;
 
-			errno = saved_errno;
-			SYSERROR("failed to set namespace '%s'", ns[i]);
+	for (i = 0; i < LXC_ATTACH_NS_COUNT; i++) {
+		if (which != -1 && !(which & ns_flags[i]))
+			continue;
+
+		if (fd[i] < 0) {
+			if (which == -1)
+				continue;
+			ERROR("namespace '%s' is not available", ns_names[i]);
 			return -1;
 		}
 
-		close(fd[i]);
+		if (setns(fd[i], 0) != 0) {
+			SYSERROR("failed to set namespace '%s'", ns_names[i]);
+			return -1;
+		}
 	}
 
 	return 0;
 }
 
+static void lxc_attach_ns_close(int fd[])
+{
+	int i;
+
+	for (i = 0; i < LXC_ATTACH_NS_COUNT; i++) {
+		if (fd[i] >= 0)
+			close(fd[i]);
+		fd[i] = -1;
+	}
+}
+
+static int lxc_attach_to_ns(pid_t pid, int which)
+{
+	char path[MAXPATHLEN];
+	int fd[LXC_ATTACH_NS_COUNT];
+	int procfd, ret, saved_errno;
+
+	snprintf(path, MAXPATHLEN, "/proc/%d/ns", pid);
+	if (access(path, X_OK)) {
+		ERROR("Does this kernel version support 'attach' ?");
+		return -1;
+	}
+
+	snprintf(path, MAXPATHLEN, "/proc/%d", pid);
+	procfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (procfd < 0) {
+		SYSERROR("failed to open '%s'", path);
+		return -1;
+	}
+
+	ret = lxc_attach_ns_open(procfd, which, fd, false);
+	close(procfd);
+	if (ret < 0)
+		return -1;
+
+	ret = lxc_attach_ns_enter(fd, -1);
+	saved_errno = errno;
+	lxc_attach_ns_close(fd);
+	errno = saved_errno;
+	return ret;
+}
+
 static int lxc_attach_remount_sys_proc(void)
 {
 	int ret;
@@ -635,7 +696,221 @@ static bool fetch_seccomp(const char *name, const char *lxcpath,
 	return true;
 }
 
+/*
+ * The part of lxc_attach() which only depends on the running container, so
+ * that it can be looked up once and reused for many attaches. See
+ * lxc_attach_ctx_new().
+ * @init_pid    : pid of the container's init
+ * @procfd      : /proc/<init_pid>, becomes stale once init exits, which
+ *                tells us the context has to be refreshed
+ * @clone_flags : namespaces the container was started with
+ * @ns_fd       : the namespaces of init, -1 when not available
+ * @init_ctx    : capabilities, personality and lsm label of init
+ * @container   : the container, with its seccomp policy loaded
+ */
+struct lxc_attach_ctx {
+	char *name;
+	char *lxcpath;
+	pid_t init_pid;
+	int procfd;
+	int clone_flags;
+	int ns_fd[LXC_ATTACH_NS_COUNT];
+	struct lxc_proc_context_info *init_ctx;
+	struct lxc_container *container;
+};
+
+static void lxc_attach_ctx_clear(struct lxc_attach_ctx *ctx)
+{
+	lxc_attach_ns_close(ctx->ns_fd);
+	if (ctx->procfd >= 0)
+		close(ctx->procfd);
+	ctx->procfd = -1;
+	if (ctx->init_ctx)
+		lxc_proc_put_context_info(ctx->init_ctx);
+	ctx->init_ctx = NULL;
+	if (ctx->container)
+		lxc_container_put(ctx->container);
+	ctx->container = NULL;
+	ctx->init_pid = -1;
+}
+
+static int lxc_attach_ctx_fill(struct lxc_attach_ctx *ctx)
+{
+	char path[MAXPATHLEN];
+
+	ctx->init_pid = lxc_cmd_get_init_pid(ctx->name, ctx->lxcpath);
+	if (ctx->init_pid < 0) {
+		ERROR("failed to get the init pid");
+		return -1;
+	}
+
+	ctx->clone_flags = lxc_cmd_get_clone_flags(ctx->name, ctx->lxcpath);
+	if (ctx->clone_flags == -1) {
+		ERROR("failed to automatically determine the "
+		      "namespaces which the container unshared");
+		return -1;
+	}
+
+	snprintf(path, MAXPATHLEN, "/proc/%d", ctx->init_pid);
+	ctx->procfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx->procfd < 0) {
+		SYSERROR("failed to open '%s'", path);
+		return -1;
+	}
+
+	if (lxc_attach_ns_open(ctx->procfd, -1, ctx->ns_fd, true) < 0)
+		return -1;
+
+	ctx->init_ctx = lxc_proc_get_context_info(ctx->init_pid);
+	if (!ctx->init_ctx) {
+		ERROR("failed to get context of the init process, pid = %ld",
+		      (long)ctx->init_pid);
+		return -1;
+	}
+
+	ctx->container = lxc_container_new(ctx->name, ctx->lxcpath);
+	if (!ctx->container || !ctx->container->lxc_conf ||
+			lxc_read_seccomp_config(ctx->container->lxc_conf) < 0) {
+		WARN("Failed to get seccomp policy");
+		if (ctx->container)
+			lxc_container_put(ctx->container);
+		ctx->container = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * lxc_attach_ctx_new: look up everything needed to attach to a running
+ * container once, so that lxc_attach_ctx_run() doesn't have to query the
+ * container's command socket or parse /proc each time.
+ *
+ * @name    : the container name
+ * @lxcpath : the lxcpath of the container
+ *
+ * Returns the attach context, to be freed with lxc_attach_ctx_free(), or
+ * NULL on error.
+ */
+struct lxc_attach_ctx *lxc_attach_ctx_new(const char *name, const char *lxcpath)
+{
+	struct lxc_attach_ctx *ctx;
+	int i;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		SYSERROR("Could not allocate memory.");
+		return NULL;
+	}
+
+	ctx->procfd = -1;
+	for (i = 0; i < LXC_ATTACH_NS_COUNT; i++)
+		ctx->ns_fd[i] = -1;
+
+	ctx->name = strdup(name);
+	ctx->lxcpath = strdup(lxcpath);
+	if (!ctx->name || !ctx->lxcpath) {
+		SYSERROR("Could not allocate memory.");
+		goto out_error;
+	}
+
+	if (lxc_attach_ctx_fill(ctx) < 0)
+		goto out_error;
+
+	return ctx;
+
+out_error:
+	lxc_attach_ctx_free(ctx);
+	return NULL;
+}
+
+void lxc_attach_ctx_free(struct lxc_attach_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	lxc_attach_ctx_clear(ctx);
+	free(ctx->name);
+	free(ctx->lxcpath);
+	free(ctx);
+}
+
+/* make sure @ctx still describes the running container */
+static int lxc_attach_ctx_validate(struct lxc_attach_ctx *ctx)
+{
+	struct stat st;
+
+	if (ctx->procfd >= 0 && fstatat(ctx->procfd, "ns", &st, 0) == 0)
+		return 0;
+
+	INFO("init of %s has exited, refreshing the attach context", ctx->name);
+	lxc_attach_ctx_clear(ctx);
+	return lxc_attach_ctx_fill(ctx);
+}
+
+/*
+ * Copy the cached init context for one attach, picking up the seccomp
+ * policy only if this attach wants it, as fetch_seccomp() would.
+ */
+static struct lxc_proc_context_info *lxc_attach_ctx_info(struct lxc_attach_ctx *ctx,
+		lxc_attach_options_t *options)
+{
+	struct lxc_proc_context_info *info;
+
+	info = malloc(sizeof(*info));
+	if (!info) {
+		SYSERROR("Could not allocate memory.");
+		return NULL;
+	}
+	*info = *ctx->init_ctx;
+	info->container = NULL;
+
+	if (ctx->init_ctx->lsm_label) {
+		info->lsm_label = strdup(ctx->init_ctx->lsm_label);
+		if (!info->lsm_label) {
+			SYSERROR("Could not allocate memory.");
+			free(info);
+			return NULL;
+		}
+	}
+
+	if ((options->namespaces & CLONE_NEWNS) &&
+			(options->attach_flags & LXC_ATTACH_LSM) &&
+			lxc_container_get(ctx->container))
+		info->container = ctx->container;
+
+	return info;
+}
+
+static int __lxc_attach(const char* name, const char* lxcpath,
+		struct lxc_attach_ctx *ctx, lxc_attach_exec_t exec_function,
+		void* exec_payload, lxc_attach_options_t* options,
+		pid_t* attached_process);
+
 int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_function, void* exec_payload, lxc_attach_options_t* options, pid_t* attached_process)
+{
+	return __lxc_attach(name, lxcpath, NULL, exec_function, exec_payload,
+			options, attached_process);
+}
+
+/*
+ * lxc_attach_ctx_run: same as lxc_attach(), using a context from
+ * lxc_attach_ctx_new(). If the container was restarted in the meantime,
+ * @ctx is refreshed first.
+ */
+int lxc_attach_ctx_run(struct lxc_attach_ctx *ctx, lxc_attach_exec_t exec_function,
+		void* exec_payload, lxc_attach_options_t* options,
+		pid_t* attached_process)
+{
+	if (lxc_attach_ctx_validate(ctx) < 0)
+		return -1;
+
+	return __lxc_attach(ctx->name, ctx->lxcpath, ctx, exec_function,
+			exec_payload, options, attached_process);
+}
+
+static int __lxc_attach(const char* name, const char* lxcpath,
+		struct lxc_attach_ctx *ctx, lxc_attach_exec_t exec_function,
+		void* exec_payload, lxc_attach_options_t* options,
+		pid_t* attached_process)
 {
 	int ret, status;
 	pid_t init_pid, pid, attached_pid, expected;
@@ -647,20 +922,27 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	if (!options)
 		options = &attach_static_default_options;
 
-	init_pid = lxc_cmd_get_init_pid(name, lxcpath);
-	if (init_pid < 0) {
-		ERROR("failed to get the init pid");
-		return -1;
-	}
+	if (ctx) {
+		init_pid = ctx->init_pid;
+		init_ctx = lxc_attach_ctx_info(ctx, options);
+		if (!init_ctx)
+			return -1;
+	} else {
+		init_pid = lxc_cmd_get_init_pid(name, lxcpath);
+		if (init_pid < 0) {
+			ERROR("failed to get the init pid");
+			return -1;
+		}
 
-	init_ctx = lxc_proc_get_context_info(init_pid);
-	if (!init_ctx) {
-		ERROR("failed to get context of the init process, pid = %ld", (long)init_pid);
-		return -1;
-	}
+		init_ctx = lxc_proc_get_context_info(init_pid);
+		if (!init_ctx) {
+			ERROR("failed to get context of the init process, pid = %ld", (long)init_pid);
+			return -1;
+		}
 
-	if (!fetch_seccomp(name, lxcpath, init_ctx, options))
-		WARN("Failed to get seccomp policy");
+		if (!fetch_seccomp(name, lxcpath, init_ctx, options))
+			WARN("Failed to get seccomp policy");
+	}
 
 	cwd = getcwd(NULL, 0);
 
@@ -668,7 +950,10 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	 * by asking lxc-start, if necessary
 	 */
 	if (options->namespaces == -1) {
-		options->namespaces = lxc_cmd_get_clone_flags(name, lxcpath);
+		if (ctx)
+			options->namespaces = ctx->clone_flags;
+		else
+			options->namespaces = lxc_cmd_get_clone_flags(name, lxcpath);
 		/* call failed */
 		if (options->namespaces == -1) {
 			ERROR("failed to automatically determine the "
@@ -842,7 +1127,12 @@ int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_fun
 	/* attach now, create another subprocess later, since pid namespaces
 	 * only really affect the children of the current process
 	 */
-	ret = lxc_attach_to_ns(init_pid, options->namespaces);
+	if (ctx) {
+		/* the namespace fds must not leak into the attached process */
+		ret = lxc_attach_ns_enter(ctx->ns_fd, options->namespaces);
+		lxc_attach_ns_close(ctx->ns_fd);
+	} else
+		ret = lxc_attach_to_ns(init_pid, options->namespaces);
 	if (ret < 0) {
 		ERROR("failed to enter the namespace");
 		shutdown(ipc_sockets[1], SHUT_RDWR);
@@ -38,4 +38,12 @@ struct lxc_proc_context_info {
 
 extern int lxc_attach(const char* name, const char* lxcpath, lxc_attach_exec_t exec_function, void* exec_payload, lxc_attach_options_t* options, pid_t* attached_process);
 
+struct lxc_attach_ctx;
+
+extern struct lxc_attach_ctx *lxc_attach_ctx_new(const char *name, const char *lxcpath);
+extern void lxc_attach_ctx_free(struct lxc_attach_ctx *ctx);
+extern int lxc_attach_ctx_run(struct lxc_attach_ctx *ctx, lxc_attach_exec_t exec_function,
+		void* exec_payload, lxc_attach_options_t* options,
+		pid_t* attached_process);
+
 #endif
@@ -28,6 +28,7 @@
  * libraries like liblvm2
  */
 #define _GNU_SOURCE
+#include <ctype.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
@@ -41,6 +42,7 @@
 #include <libgen.h>
 #include <linux/loop.h>
 #include <dirent.h>
+#include <sys/vfs.h>
 
 #include "lxc.h"
 #include "config.h"
@@ -52,6 +54,8 @@
 #include "namespace.h"
 #include "parse.h"
 #include "lxclock.h"
+#include "lxczfs.h"
+#include "deltacopy.h"
 
 #ifndef BLKGETSIZE64
 #define BLKGETSIZE64 _IOR(0x12,114,size_t)
@@ -61,6 +65,45 @@
 #define LO_FLAGS_AUTOCLEAR 4
 #endif
 
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+#ifndef LOOP_CTL_GET_FREE
+#define LOOP_CTL_GET_FREE 0x4C82
+#endif
+
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+	__u32 fd;
+	__u32 block_size;
+	struct loop_info64 info;
+	__u64 __reserved[8];
+};
+#endif
+
+#ifndef FITRIM
+struct fstrim_range {
+	__u64 start;
+	__u64 len;
+	__u64 minlen;
+};
+#define FITRIM _IOWR('X', 121, struct fstrim_range)
+#endif
+
+#ifndef BTRFS_SUPER_MAGIC
+#define BTRFS_SUPER_MAGIC 0x9123683E
+#endif
+
+#ifndef ZFS_SUPER_MAGIC
+#define ZFS_SUPER_MAGIC 0x2fc12fc1
+#endif
+
 #define DEFAULT_FS_SIZE 1073741824
 #define DEFAULT_FSTYPE "ext3"
 
@@ -528,6 +571,90 @@ static const struct bdev_ops dir_ops = {
 // sake of flexibility let's always bind-mount.
 //
 
+/* decode the octal escapes (\040 for ' ' and the like) of a mountinfo field */
+static void mountinfo_unescape(char *s)
+{
+	char *d = s;
+
+	while (*s) {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*d++ = ((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0');
+			s += 4;
+			continue;
+		}
+		*d++ = *s++;
+	}
+	*d = '\0';
+}
+
+/*
+ * The name of the zfs dataset mounted on @path, NULL if there is none.  The
+ * last mount on a mountpoint is the one which is visible, so the last
+ * matching mountinfo line counts.
+ */
+static char *zfs_mounted_dataset(const char *path)
+{
+	char *real, *line = NULL, *mnt, *fstype, *src, *p;
+	char *dataset = NULL;
+	size_t len = 0;
+	FILE *f;
+	int i;
+
+	real = realpath(path, NULL);
+	if (!real)
+		return NULL;
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f) {
+		free(real);
+		return NULL;
+	}
+
+	/* id parent maj:min root mountpoint options [optional...] - fstype source ... */
+	while (getline(&line, &len, f) != -1) {
+		for (mnt = line, i = 0; mnt && i < 4; i++) {
+			mnt = strchr(mnt, ' ');
+			if (mnt)
+				mnt++;
+		}
+		if (!mnt)
+			continue;
+		fstype = strstr(mnt, " - ");
+		if (!fstype)
+			continue;
+		fstype += 3;
+		p = strchr(mnt, ' ');
+		*p = '\0';
+		mountinfo_unescape(mnt);
+		if (strcmp(mnt, real) != 0)
+			continue;
+
+		free(dataset);
+		dataset = NULL;
+		if (strncmp(fstype, "zfs ", 4) != 0)
+			continue;
+		src = fstype + 4;
+		p = strchr(src, ' ');
+		if (p)
+			*p = '\0';
+		mountinfo_unescape(src);
+		dataset = strdup(src);
+	}
+
+	fclose(f);
+	free(line);
+	free(real);
+	return dataset;
+}
+
+static bool zfs_is_mountpoint(const char *path)
+{
+	char *dataset = zfs_mounted_dataset(path);
+
+	free(dataset);
+	return dataset != NULL;
+}
+
 static int zfs_list_entry(const char *path, char *output, size_t inlen)
 {
 	struct lxc_popen_FILE *f;
@@ -593,41 +720,97 @@ static int zfs_umount(struct bdev *bdev)
 	return umount(bdev->dest);
 }
 
+/*
+ * The name of the dataset of the zfs rootfs @path, from /proc/self/mountinfo
+ * or, if it isn't mounted, from 'zfs list'.  NULL if there is none.
+ */
+static char *zfs_dataset(const char *path)
+{
+	char *output, *p;
+
+	if ((output = zfs_mounted_dataset(path)) != NULL)
+		return output;
+
+	output = malloc(MAXPATHLEN);
+	if (!output)
+		return NULL;
+	if (!zfs_list_entry(path, output, MAXPATHLEN)) {
+		free(output);
+		return NULL;
+	}
+	// the dataset is output up to ' '
+	if ((p = index(output, ' ')) == NULL) {
+		free(output);
+		return NULL;
+	}
+	*p = '\0';
+	return output;
+}
+
+/*
+ * The zfsroot the dataset of rootfs @path is in, or the configured one if
+ * @path is not on zfs.  Returns an allocated string.
+ */
+static char *zfs_root(const char *path)
+{
+	char *dataset, *p;
+
+	dataset = zfs_dataset(path);
+	if (!dataset) {
+		const char *root = lxc_global_config_value("lxc.bdev.zfs.root");
+
+		return root ? strdup(root) : NULL;
+	}
+	if ((p = strrchr(dataset, '/')) == NULL) {
+		free(dataset);
+		return NULL;
+	}
+	*p = '\0';
+	return dataset;
+}
+
 static int zfs_clone(const char *opath, const char *npath, const char *oname,
-			const char *nname, const char *lxcpath, int snapshot)
+			const char *nname, const char *lxcpath, int snapshot,
+			bool snapshot_taken)
 {
-	// use the 'zfs list | grep opath' entry to get the zfsroot
-	char output[MAXPATHLEN], option[MAXPATHLEN], *p;
-	const char *zfsroot = output;
-	int ret;
+	char option[MAXPATHLEN], mountpoint[MAXPATHLEN];
+	char dev[MAXPATHLEN], path1[MAXPATHLEN];
+	char *zfsroot;
+	int ret = -1;
 	pid_t pid;
 
-	if (zfs_list_entry(opath, output, MAXPATHLEN)) {
-		// zfsroot is output up to ' '
-		if ((p = index(output, ' ')) == NULL)
-			return -1;
-		*p = '\0';
-		if ((p = strrchr(output, '/')) == NULL)
-			return -1;
-		*p = '\0';
-	} else
-		zfsroot = lxc_global_config_value("lxc.bdev.zfs.root");
+	zfsroot = zfs_root(opath);
+	if (!zfsroot)
+		return -1;
 
-	ret = snprintf(option, MAXPATHLEN, "-omountpoint=%s/%s/rootfs",
-		lxcpath, nname);
+	ret = snprintf(mountpoint, MAXPATHLEN, "%s/%s/rootfs", lxcpath, nname);
 	if (ret < 0  || ret >= MAXPATHLEN)
-		return -1;
+		goto err;
+	ret = snprintf(option, MAXPATHLEN, "-omountpoint=%s", mountpoint);
+	if (ret < 0  || ret >= MAXPATHLEN)
+		goto err;
+	ret = snprintf(dev, MAXPATHLEN, "%s/%s", zfsroot, nname);
+	if (ret < 0  || ret >= MAXPATHLEN)
+		goto err;
+	// the snapshot is zfsroot/oname@nname
+	ret = snprintf(path1, MAXPATHLEN, "%s/%s@%s", zfsroot, oname, nname);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		goto err;
+	free(zfsroot);
+
+	if (snapshot)
+		ret = lxc_zfs_clone(path1, dev, mountpoint, !snapshot_taken);
+	else
+		ret = lxc_zfs_create(dev, mountpoint);
+	if (ret != -ENOSYS)
+		return ret;
 
+	// no libzfs_core, run the zfs commands instead
 	// zfs create -omountpoint=$lxcpath/$lxcname $zfsroot/$nname
 	if (!snapshot) {
 		if ((pid = fork()) < 0)
 			return -1;
 		if (!pid) {
-			char dev[MAXPATHLEN];
-
-			ret = snprintf(dev, MAXPATHLEN, "%s/%s", zfsroot, nname);
-			if (ret < 0  || ret >= MAXPATHLEN)
-				exit(1);
 			execlp("zfs", "zfs", "create", option, dev, NULL);
 			exit(1);
 		}
@@ -636,43 +819,42 @@ static int zfs_clone(const char *opath, const char *npath, const char *oname,
 		// if snapshot, do
 		// 'zfs snapshot zfsroot/oname@nname
 		// zfs clone zfsroot/oname@nname zfsroot/nname
-		char path1[MAXPATHLEN], path2[MAXPATHLEN];
-
-		ret = snprintf(path1, MAXPATHLEN, "%s/%s@%s", zfsroot,
-			oname, nname);
-		if (ret < 0 || ret >= MAXPATHLEN)
-			return -1;
-		(void) snprintf(path2, MAXPATHLEN, "%s/%s", zfsroot, nname);
-
-		// if the snapshot exists, delete it
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			execlp("zfs", "zfs", "destroy", path1, NULL);
-			exit(1);
-		}
-		// it probably doesn't exist so destroy probably will fail.
-		(void) wait_for_pid(pid);
-
-		// run first (snapshot) command
-		if ((pid = fork()) < 0)
-			return -1;
-		if (!pid) {
-			execlp("zfs", "zfs", "snapshot", path1, NULL);
-			exit(1);
+		// unless bdev_snapshot_many() already took the snapshot
+		if (!snapshot_taken) {
+			// if the snapshot exists, delete it
+			if ((pid = fork()) < 0)
+				return -1;
+			if (!pid) {
+				execlp("zfs", "zfs", "destroy", path1, NULL);
+				exit(1);
+			}
+			// it probably doesn't exist so destroy probably will fail.
+			(void) wait_for_pid(pid);
+
+			// run first (snapshot) command
+			if ((pid = fork()) < 0)
+				return -1;
+			if (!pid) {
+				execlp("zfs", "zfs", "snapshot", path1, NULL);
+				exit(1);
+			}
+			if (wait_for_pid(pid) < 0)
+				return -1;
 		}
-		if (wait_for_pid(pid) < 0)
-			return -1;
 
 		// run second (clone) command
 		if ((pid = fork()) < 0)
 			return -1;
 		if (!pid) {
-			execlp("zfs", "zfs", "clone", option, path1, path2, NULL);
+			execlp("zfs", "zfs", "clone", option, path1, dev, NULL);
 			exit(1);
 		}
 		return wait_for_pid(pid);
 	}
+
+err:
+	free(zfsroot);
+	return -1;
 }
 
 static int zfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
@@ -700,7 +882,8 @@ static int zfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldna
 	if ((new->dest = strdup(new->src)) == NULL)
 		return -1;
 
-	return zfs_clone(orig->src, new->src, oldname, cname, lxcpath, snap);
+	return zfs_clone(orig->src, new->src, oldname, cname, lxcpath, snap,
+			 orig->snapshots_taken);
 }
 
 /*
@@ -710,33 +893,40 @@ static int zfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldna
  */
 static int zfs_destroy(struct bdev *orig)
 {
+	char *dataset;
 	pid_t pid;
-	char output[MAXPATHLEN], *p;
-
-	if ((pid = fork()) < 0)
-		return -1;
-	if (pid)
-		return wait_for_pid(pid);
+	int ret;
 
-	if (!zfs_list_entry(orig->src, output, MAXPATHLEN)) {
+	dataset = zfs_dataset(orig->src);
+	if (!dataset) {
 		ERROR("Error: zfs entry for %s not found", orig->src);
 		return -1;
 	}
 
-	// zfs mount is output up to ' '
-	if ((p = index(output, ' ')) == NULL)
-		return -1;
-	*p = '\0';
+	ret = lxc_zfs_destroy(dataset, orig->src);
+	if (ret != -ENOSYS)
+		goto out;
 
-	execlp("zfs", "zfs", "destroy", output, NULL);
-	exit(1);
+	if ((pid = fork()) < 0) {
+		ret = -1;
+		goto out;
+	}
+	if (!pid) {
+		execlp("zfs", "zfs", "destroy", dataset, NULL);
+		exit(1);
+	}
+	ret = wait_for_pid(pid);
+
+out:
+	free(dataset);
+	return ret;
 }
 
 static int zfs_create(struct bdev *bdev, const char *dest, const char *n,
 			struct bdev_specs *specs)
 {
 	const char *zfsroot;
-	char option[MAXPATHLEN];
+	char option[MAXPATHLEN], dev[MAXPATHLEN];
 	int ret;
 	pid_t pid;
 
@@ -754,6 +944,14 @@ static int zfs_create(struct bdev *bdev, const char *dest, const char *n,
 		return -1;
 	}
 
+	ret = snprintf(dev, MAXPATHLEN, "%s/%s", zfsroot, n);
+	if (ret < 0  || ret >= MAXPATHLEN)
+		return -1;
+
+	ret = lxc_zfs_create(dev, bdev->dest);
+	if (ret != -ENOSYS)
+		return ret;
+
 	ret = snprintf(option, MAXPATHLEN, "-omountpoint=%s", bdev->dest);
 	if (ret < 0  || ret >= MAXPATHLEN)
 		return -1;
@@ -762,14 +960,62 @@ static int zfs_create(struct bdev *bdev, const char *dest, const char *n,
 	if (pid)
 		return wait_for_pid(pid);
 
-	char dev[MAXPATHLEN];
-	ret = snprintf(dev, MAXPATHLEN, "%s/%s", zfsroot, n);
-	if (ret < 0  || ret >= MAXPATHLEN)
-		exit(1);
 	execlp("zfs", "zfs", "create", option, dev, NULL);
 	exit(1);
 }
 
+/*
+ * 'zfs snapshot' the snapshots bdev_snapshot_many() wants for zfs_clone(),
+ * all in one go.
+ */
+static int zfs_snapshot_many(struct bdev *orig, const char *oname,
+			     const char **newnames, int count)
+{
+	char **snaps, *zfsroot;
+	int i, len, ret = -1;
+	pid_t pid;
+
+	zfsroot = zfs_root(orig->src);
+	if (!zfsroot)
+		return -1;
+	snaps = calloc(count + 3, sizeof(char *));
+	if (!snaps)
+		goto out;
+
+	// 'zfs snapshot zfsroot/oname@nname...', as zfs_clone() names them
+	snaps[0] = "zfs";
+	snaps[1] = "snapshot";
+	for (i = 0; i < count; i++) {
+		len = strlen(zfsroot) + strlen(oname) + strlen(newnames[i]) + 3;
+		snaps[i + 2] = malloc(len);
+		if (!snaps[i + 2])
+			goto out;
+		snprintf(snaps[i + 2], len, "%s/%s@%s", zfsroot, oname,
+			 newnames[i]);
+	}
+
+	ret = lxc_zfs_snapshot((const char **)snaps + 2, count);
+	if (ret == -ENOSYS) {
+		if ((pid = fork()) < 0) {
+			ret = -1;
+			goto out;
+		}
+		if (!pid) {
+			execvp("zfs", snaps);
+			exit(1);
+		}
+		ret = wait_for_pid(pid);
+	}
+out:
+	if (snaps) {
+		for (i = 2; i < count + 2; i++)
+			free(snaps[i]);
+		free(snaps);
+	}
+	free(zfsroot);
+	return ret;
+}
+
 static const struct bdev_ops zfs_ops = {
 	.detect = &zfs_detect,
 	.mount = &zfs_mount,
@@ -840,42 +1086,247 @@ static int lvm_umount(struct bdev *bdev)
 	return umount(bdev->dest);
 }
 
-static int lvm_compare_lv_attr(const char *path, int pos, const char expected) {
-	struct lxc_popen_FILE *f;
-	int ret, len, status, start=0;
-	char *cmd, output[12];
-	const char *lvscmd = "lvs --unbuffered --noheadings -o lv_attr %s 2>/dev/null";
+/*
+ * The lv_attr of the LVs seen so far, so that checking whether an LV is thin
+ * doesn't run lvs, which rescans all PVs, each time.  A miss runs lvs for
+ * the whole VG at once.  Entries are keyed on /dev/$vg/$lv and hold the
+ * lv_uuid, which the device-mapper uuid of an LV with a device ends in, so
+ * an LV which was removed and created again isn't taken for the old one.
+ * Protected by process_lock().
+ */
+struct lvm_lv {
+	char *path;
+	char attr[16];
+	char uuid[40];
+	struct lvm_lv *next;
+};
 
-	len = strlen(lvscmd) + strlen(path) - 1;
-	cmd = alloca(len);
+static struct lvm_lv *lvm_lvs;
 
-	ret = snprintf(cmd, len, lvscmd, path);
-	if (ret < 0 || ret >= len)
+/*
+ * Whether @name is made of the characters lvm allows in VG and LV names
+ * and can't be taken for an option, so that it can be put as it is in the
+ * commands fed to the lvm shell.
+ */
+static bool lvm_valid_name(const char *name)
+{
+	if (!*name || *name == '-')
+		return false;
+	for (; *name; name++) {
+		if (!isalnum((unsigned char)*name) && !strchr("+_.-", *name))
+			return false;
+	}
+	return true;
+}
+
+/*
+ * split /dev/$vg/$lv, returns -1 if @path isn't of that form or the names
+ * aren't valid lvm names
+ */
+static int lvm_split_path(const char *path, char *vg, char *lv, size_t len)
+{
+	const char *p;
+
+	if (strncmp(path, "/dev/", 5) != 0)
+		return -1;
+	path += 5;
+	p = strchr(path, '/');
+	if (!p || p == path || p - path >= len || strchr(p + 1, '/') ||
+	    !p[1] || strlen(p + 1) >= len)
 		return -1;
+	memcpy(vg, path, p - path);
+	vg[p - path] = '\0';
+	strcpy(lv, p + 1);
+	if (!lvm_valid_name(vg) || !lvm_valid_name(lv))
+		return -1;
+	return 0;
+}
 
-	f = lxc_popen(cmd);
+/* called with process_lock held */
+static struct lvm_lv *lvm_lv_lookup(const char *path)
+{
+	struct lvm_lv *lv;
+
+	for (lv = lvm_lvs; lv; lv = lv->next) {
+		if (strcmp(lv->path, path) == 0)
+			return lv;
+	}
+	return NULL;
+}
+
+/* called with process_lock held */
+static void lvm_lv_forget(const char *prefix)
+{
+	struct lvm_lv *lv, **prev = &lvm_lvs;
+	size_t len = strlen(prefix);
+
+	while ((lv = *prev)) {
+		if (strncmp(lv->path, prefix, len) == 0) {
+			*prev = lv->next;
+			free(lv->path);
+			free(lv);
+			continue;
+		}
+		prev = &lv->next;
+	}
+}
 
+/*
+ * (Re)load the attributes of all LVs of @vg with a single lvs.  Returns -1
+ * if lvs failed, for instance because there is no such VG.
+ */
+static int lvm_load_vg(const char *vg)
+{
+	struct lxc_popen_FILE *f;
+	char cmd[MAXPATHLEN], line[MAXPATHLEN], prefix[MAXPATHLEN];
+	char vgname[MAXPATHLEN], lvname[MAXPATHLEN], attr[16], uuid[64];
+	struct lvm_lv *head = NULL, *lv, *next;
+	int ret, status;
+	char *p, *q;
+
+	ret = snprintf(cmd, MAXPATHLEN, "lvs --unbuffered --noheadings "
+			"-o vg_name,lv_name,lv_attr,lv_uuid %s 2>/dev/null", vg);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	f = lxc_popen(cmd);
 	if (f == NULL) {
 		SYSERROR("popen failed");
 		return -1;
 	}
+	while (fgets(line, MAXPATHLEN, f->f)) {
+		if (sscanf(line, "%s %s %15s %63s", vgname, lvname, attr, uuid) != 4)
+			continue;
+		lv = malloc(sizeof(*lv));
+		if (!lv)
+			break;
+		lv->path = malloc(strlen(vgname) + strlen(lvname) + 7);
+		if (!lv->path) {
+			free(lv);
+			break;
+		}
+		sprintf(lv->path, "/dev/%s/%s", vgname, lvname);
+		strcpy(lv->attr, attr);
+		for (p = uuid, q = lv->uuid; *p && q < lv->uuid + sizeof(lv->uuid) - 1; p++) {
+			if (*p != '-')
+				*q++ = *p;
+		}
+		*q = '\0';
+		lv->next = head;
+		head = lv;
+	}
+	status = lxc_pclose(f);
+	if (status < 0 || WEXITSTATUS(status)) {
+		for (lv = head; lv; lv = next) {
+			next = lv->next;
+			free(lv->path);
+			free(lv);
+		}
+		return -1;
+	}
 
-	ret = fgets(output, 12, f->f) == NULL;
+	snprintf(prefix, MAXPATHLEN, "/dev/%s/", vg);
+	process_lock();
+	lvm_lv_forget(prefix);
+	for (lv = head; lv; lv = next) {
+		next = lv->next;
+		lv->next = lvm_lvs;
+		lvm_lvs = lv;
+	}
+	process_unlock();
+	return 0;
+}
 
-	status = lxc_pclose(f);
+/* called with process_lock held */
+static void lvm_lv_drop(const char *path)
+{
+	struct lvm_lv *lv, **prev;
+
+	for (prev = &lvm_lvs; (lv = *prev); prev = &lv->next) {
+		if (strcmp(lv->path, path) == 0) {
+			*prev = lv->next;
+			free(lv->path);
+			free(lv);
+			return;
+		}
+	}
+}
+
+/*
+ * Is the cached LV with @attr and @uuid still the LV at @path?  Thin pools
+ * and inactive LVs have no device, so they are taken on trust; any other LV
+ * whose device is gone was removed since the cache was loaded.
+ */
+static bool lvm_lv_current(const char *path, const char *attr,
+			   const char *uuid)
+{
+	char devp[MAXPATHLEN], buf[128];
+	struct stat st;
+	size_t len;
+	FILE *f;
+	int ret;
 
-	if (ret || WEXITSTATUS(status))
+	if (attr[0] == 't' || strlen(attr) < 5 || attr[4] != 'a')
+		return true;
+	if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode))
+		return false;
+	ret = snprintf(devp, MAXPATHLEN, "/sys/dev/block/%d:%d/dm/uuid",
+			major(st.st_rdev), minor(st.st_rdev));
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+	f = fopen(devp, "r");
+	if (!f)
+		return false;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return false;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\n")] = '\0';
+	len = strlen(uuid);
+	return strlen(buf) >= len && strcmp(buf + strlen(buf) - len, uuid) == 0;
+}
+
+/* lv_attr of /dev/$vg/$lv @path into @attr, -1 if there is no such LV */
+static int lvm_lv_attr(const char *path, char *attr)
+{
+	char vg[MAXPATHLEN], lvname[MAXPATHLEN], uuid[40];
+	struct lvm_lv *lv;
+	int tries;
+
+	if (lvm_split_path(path, vg, lvname, MAXPATHLEN) < 0)
+		return -1;
+
+	for (tries = 0; tries < 2; tries++) {
+		process_lock();
+		lv = lvm_lv_lookup(path);
+		if (lv) {
+			strcpy(attr, lv->attr);
+			strcpy(uuid, lv->uuid);
+		}
+		process_unlock();
+		if (lv && lvm_lv_current(path, attr, uuid))
+			return 0;
+		if (lv) {
+			process_lock();
+			lvm_lv_drop(path);
+			process_unlock();
+		}
+		if (tries == 0 && lvm_load_vg(vg) < 0)
+			return -1;
+	}
+	return -1;
+}
+
+static int lvm_compare_lv_attr(const char *path, int pos, const char expected)
+{
+	char attr[16];
+
+	if (lvm_lv_attr(path, attr) < 0)
 		// Assume either vg or lvs do not exist, default
 		// comparison to false.
 		return 0;
 
-	len = strlen(output);
-	while(start < len && output[start] == ' ') start++;
-
-	if (start + pos < len && output[start + pos] == expected)
-		return 1;
-
-	return 0;
+	return pos < strlen(attr) && attr[pos] == expected;
 }
 
 static int lvm_is_thin_volume(const char *path)
@@ -900,51 +1351,52 @@ static int do_lvm_create(const char *path, uint64_t size, const char *thinpool)
 	int ret, pid, len;
 	char sz[24], *pathdup, *vg, *lv, *tp = NULL;
 
-	if ((pid = fork()) < 0) {
-		SYSERROR("failed fork");
-		return -1;
-	}
-	if (pid > 0)
-		return wait_for_pid(pid);
-
 	// specify bytes to lvcreate
 	ret = snprintf(sz, 24, "%"PRIu64"b", size);
 	if (ret < 0 || ret >= 24)
-		exit(1);
+		return -1;
 
-	pathdup = strdup(path);
-	if (!pathdup)
-		exit(1);
+	pathdup = alloca(strlen(path) + 1);
+	strcpy(pathdup, path);
 
 	lv = strrchr(pathdup, '/');
 	if (!lv)
-		exit(1);
+		return -1;
 
 	*lv = '\0';
 	lv++;
 
 	vg = strrchr(pathdup, '/');
 	if (!vg)
-		exit(1);
+		return -1;
 	vg++;
 
+	// look the thin pool up here rather than in the child, so that the
+	// answer stays cached
 	if (thinpool) {
 		len = strlen(pathdup) + strlen(thinpool) + 2;
 		tp = alloca(len);
 
 		ret = snprintf(tp, len, "%s/%s", pathdup, thinpool);
 		if (ret < 0 || ret >= len)
-			exit(1);
+			return -1;
 
 		ret = lvm_is_thin_pool(tp);
 		INFO("got %d for thin pool at path: %s", ret, tp);
 		if (ret < 0)
-			exit(1);
+			return -1;
 
 		if (!ret)
 			tp = NULL;
 	}
 
+	if ((pid = fork()) < 0) {
+		SYSERROR("failed fork");
+		return -1;
+	}
+	if (pid > 0)
+		return wait_for_pid(pid);
+
 	if (!tp)
 	    execlp("lvcreate", "lvcreate", "-L", sz, vg, "-n", lv, (char *)NULL);
 	else
@@ -957,38 +1409,30 @@ static int do_lvm_create(const char *path, uint64_t size, const char *thinpool)
 static int lvm_snapshot(const char *orig, const char *path, uint64_t size)
 {
 	int ret, pid;
-	char sz[24], *pathdup, *lv;
-
-	if ((pid = fork()) < 0) {
-		SYSERROR("failed fork");
-		return -1;
-	}
-	if (pid > 0)
-		return wait_for_pid(pid);
+	char sz[24], *lv;
 
 	// specify bytes to lvcreate
 	ret = snprintf(sz, 24, "%"PRIu64"b", size);
 	if (ret < 0 || ret >= 24)
-		exit(1);
+		return -1;
 
-	pathdup = strdup(path);
-	if (!pathdup)
-		exit(1);
-	lv = strrchr(pathdup, '/');
-	if (!lv) {
-		free(pathdup);
-		exit(1);
-	}
-	*lv = '\0';
+	lv = strrchr(path, '/');
+	if (!lv)
+		return -1;
 	lv++;
 
 	// check if the original lv is backed by a thin pool, in which case we
 	// cannot specify a size that's different from the original size.
 	ret = lvm_is_thin_volume(orig);
-	if (ret == -1) {
-		free(pathdup);
+	if (ret == -1)
+		return -1;
+
+	if ((pid = fork()) < 0) {
+		SYSERROR("failed fork");
 		return -1;
 	}
+	if (pid > 0)
+		return wait_for_pid(pid);
 
 	if (!ret) {
 		ret = execlp("lvcreate", "lvcreate", "-s", "-L", sz, "-n", lv, orig, (char *)NULL);
@@ -996,10 +1440,147 @@ static int lvm_snapshot(const char *orig, const char *path, uint64_t size)
 		ret = execlp("lvcreate", "lvcreate", "-s", "-n", lv, orig, (char *)NULL);
 	}
 
-	free(pathdup);
 	exit(1);
 }
 
+/*
+ * Run @cmds, one lvm command per line, in a single lvm shell, so that
+ * the PVs are only scanned once for all of them.
+ */
+static int lvm_shell(const char *cmds)
+{
+	FILE *in;
+	pid_t pid;
+
+	in = tmpfile();
+	if (!in) {
+		SYSERROR("Failed to create a temporary file");
+		return -1;
+	}
+	if (fputs(cmds, in) == EOF || fflush(in) == EOF) {
+		SYSERROR("Failed to write the lvm commands");
+		fclose(in);
+		return -1;
+	}
+	rewind(in);
+
+	if ((pid = fork()) < 0) {
+		SYSERROR("failed fork");
+		fclose(in);
+		return -1;
+	}
+	if (!pid) {
+		int null = open("/dev/null", O_WRONLY);
+
+		if (dup2(fileno(in), 0) < 0)
+			exit(1);
+		// the shell echoes a prompt for each command
+		if (null >= 0)
+			dup2(null, 1);
+		execlp("lvm", "lvm", (char *)NULL);
+		SYSERROR("execlp");
+		exit(1);
+	}
+	fclose(in);
+	return wait_for_pid(pid);
+}
+
+/*
+ * Create the snapshots @paths of @orig, @size bytes each unless they are
+ * thin, in one lvm shell.  Either all of them are created or none is.
+ */
+static int lvm_snapshot_many(const char *orig, char **paths, int count,
+			     uint64_t size)
+{
+	char vg[MAXPATHLEN], lv[MAXPATHLEN], nvg[MAXPATHLEN], nlv[MAXPATHLEN];
+	char *cmds = NULL, *p;
+	int i, j, thin, len, created = 0, ret = -1;
+	struct lvm_lv *found;
+
+	if (lvm_split_path(orig, vg, lv, MAXPATHLEN) < 0)
+		return -1;
+	if (lvm_load_vg(vg) < 0)
+		return -1;
+	thin = lvm_is_thin_volume(orig);
+
+	// the names go into the lvm shell's input as they are
+	len = 1;
+	for (i = 0; i < count; i++) {
+		if (lvm_split_path(paths[i], nvg, nlv, MAXPATHLEN) < 0 ||
+		    strcmp(nvg, vg) != 0) {
+			ERROR("%s is not an LV of %s which can be batched",
+			      paths[i], vg);
+			return -1;
+		}
+		// the second lvcreate would fail, but the LV be found twice
+		for (j = 0; j < i; j++) {
+			if (strcmp(paths[i], paths[j]) == 0) {
+				ERROR("%s is given more than once", paths[i]);
+				return -1;
+			}
+		}
+		len += strlen(paths[i]) + strlen(orig) + 64;
+	}
+	cmds = malloc(len);
+	if (!cmds)
+		return -1;
+
+	// none of them may exist yet
+	p = cmds;
+	process_lock();
+	for (i = 0; i < count; i++) {
+		if (lvm_lv_lookup(paths[i])) {
+			process_unlock();
+			ERROR("%s already exists", paths[i]);
+			goto out;
+		}
+		lvm_split_path(paths[i], nvg, nlv, MAXPATHLEN);
+		if (thin)
+			p += sprintf(p, "lvcreate -s -n %s %s\n", nlv, orig);
+		else
+			p += sprintf(p, "lvcreate -s -L %"PRIu64"b -n %s %s\n",
+				     size, nlv, orig);
+	}
+	process_unlock();
+
+	if (lvm_shell(cmds) < 0)
+		WARN("lvm shell reported a failure creating snapshots of %s", orig);
+
+	// see which of them made it
+	if (lvm_load_vg(vg) < 0)
+		goto out;
+	process_lock();
+	for (i = 0; i < count; i++) {
+		found = lvm_lv_lookup(paths[i]);
+		if (found)
+			created++;
+	}
+	process_unlock();
+	if (created == count) {
+		ret = 0;
+		goto out;
+	}
+
+	// all or nothing, remove the ones which were created
+	ERROR("Only %d of %d snapshots of %s were created", created, count, orig);
+	p = cmds;
+	p += sprintf(p, "lvremove -f");
+	process_lock();
+	for (i = 0; i < count; i++) {
+		if (lvm_lv_lookup(paths[i]))
+			p += sprintf(p, " %s", paths[i]);
+	}
+	process_unlock();
+	sprintf(p, "\n");
+	if (created && lvm_shell(cmds) < 0)
+		ERROR("Failed to remove the snapshots of %s", orig);
+	lvm_load_vg(vg);
+
+out:
+	free(cmds);
+	return ret;
+}
+
 // this will return 1 for physical disks, qemu-nbd, loop, etc
 // right now only lvm is a block device
 static int is_blktype(struct bdev *b)
@@ -1073,6 +1654,9 @@ static int lvm_clonepaths(struct bdev *orig, struct bdev *new, const char *oldna
 	}
 
 	if (snap) {
+		// bdev_snapshot_many() may have created it already
+		if (orig->snapshots_taken)
+			return 0;
 		if (lvm_snapshot(orig->src, new->src, size) < 0) {
 			ERROR("could not create %s snapshot of %s", new->src, orig->src);
 			return -1;
@@ -1096,6 +1680,10 @@ static int lvm_destroy(struct bdev *orig)
 {
 	pid_t pid;
 
+	process_lock();
+	lvm_lv_forget(orig->src);
+	process_unlock();
+
 	if ((pid = fork()) < 0)
 		return -1;
 	if (!pid) {
@@ -1387,9 +1975,291 @@ out:
 	return ret;
 }
 
+#define BTRFS_IOC_TREE_SEARCH _IOWR(BTRFS_IOCTL_MAGIC, 17, \
+		struct btrfs_ioctl_search_args)
+#define BTRFS_IOC_INO_LOOKUP _IOWR(BTRFS_IOCTL_MAGIC, 18, \
+		struct btrfs_ioctl_ino_lookup_args)
+#define BTRFS_IOC_START_SYNC _IOR(BTRFS_IOCTL_MAGIC, 24, unsigned long long)
+#define BTRFS_IOC_WAIT_SYNC _IOW(BTRFS_IOCTL_MAGIC, 22, unsigned long long)
+#define BTRFS_IOC_SUBVOL_SYNC_WAIT _IOW(BTRFS_IOCTL_MAGIC, 65, \
+		struct btrfs_ioctl_subvol_wait)
+
+#define BTRFS_ROOT_TREE_OBJECTID 1ULL
+#define BTRFS_FIRST_FREE_OBJECTID 256ULL
+#define BTRFS_ROOT_REF_KEY 156
+#define BTRFS_INO_LOOKUP_PATH_MAX 4080
+
+struct btrfs_ioctl_search_key {
+	unsigned long long tree_id;
+	unsigned long long min_objectid;
+	unsigned long long max_objectid;
+	unsigned long long min_offset;
+	unsigned long long max_offset;
+	unsigned long long min_transid;
+	unsigned long long max_transid;
+	unsigned int min_type;
+	unsigned int max_type;
+	unsigned int nr_items;
+	unsigned int unused;
+	unsigned long long unused1;
+	unsigned long long unused2;
+	unsigned long long unused3;
+	unsigned long long unused4;
+};
+
+struct btrfs_ioctl_search_header {
+	unsigned long long transid;
+	unsigned long long objectid;
+	unsigned long long offset;
+	unsigned int type;
+	unsigned int len;
+};
+
+#define BTRFS_SEARCH_ARGS_BUFSIZE (4096 - sizeof(struct btrfs_ioctl_search_key))
+
+struct btrfs_ioctl_search_args {
+	struct btrfs_ioctl_search_key key;
+	char buf[BTRFS_SEARCH_ARGS_BUFSIZE];
+};
+
+struct btrfs_ioctl_ino_lookup_args {
+	unsigned long long treeid;
+	unsigned long long objectid;
+	char name[BTRFS_INO_LOOKUP_PATH_MAX];
+};
+
+struct btrfs_ioctl_subvol_wait {
+	unsigned long long subvolid;
+	unsigned int mode;
+	unsigned int count;
+};
+
+/* the item of a subvolume in the root tree pointing at a child subvolume */
+struct btrfs_root_ref {
+	unsigned long long dirid;
+	unsigned long long sequence;
+	unsigned short name_len;
+} __attribute__ ((__packed__));
+
+/*
+ * A subvolume nested below the one being snapshotted or destroyed: its path
+ * relative to that one, and its id.
+ */
+struct btrfs_nested {
+	char *path;
+	unsigned long long id;
+};
+
+struct btrfs_nested_list {
+	struct btrfs_nested *subvols;
+	int nr, alloc;
+};
+
+static unsigned long long btrfs_subvol_id(int fd)
+{
+	struct btrfs_ioctl_ino_lookup_args args;
+
+	memset(&args, 0, sizeof(args));
+	args.objectid = BTRFS_FIRST_FREE_OBJECTID;
+	if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args) < 0)
+		return 0;
+	return args.treeid;
+}
+
+/*
+ * Append the subvolumes nested in subvolume @id, which is at @prefix below
+ * the top one, to @list.  Children come before their parent, which is the
+ * order they can be deleted in.  Reversed, it is the order they can be
+ * snapshotted in.
+ */
+static int btrfs_list_nested(int fd, unsigned long long id, const char *prefix,
+			     struct btrfs_nested_list *list)
+{
+	struct btrfs_ioctl_search_args args;
+	struct btrfs_ioctl_search_header sh;
+	struct btrfs_ioctl_ino_lookup_args lookup;
+	struct btrfs_root_ref ref;
+	unsigned long off;
+	char *path;
+	int i, len;
+
+	memset(&args, 0, sizeof(args));
+	args.key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	args.key.min_objectid = args.key.max_objectid = id;
+	args.key.min_type = args.key.max_type = BTRFS_ROOT_REF_KEY;
+	args.key.max_offset = (unsigned long long)-1;
+	args.key.max_transid = (unsigned long long)-1;
+
+	for (;;) {
+		args.key.nr_items = 4096;
+		if (ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args) < 0) {
+			SYSERROR("Error searching the subvolumes below %s",
+				 *prefix ? prefix : "the rootfs");
+			return -1;
+		}
+		if (args.key.nr_items == 0)
+			return 0;
+
+		off = 0;
+		for (i = 0; i < args.key.nr_items; i++) {
+			memcpy(&sh, args.buf + off, sizeof(sh));
+			off += sizeof(sh);
+			args.key.min_offset = sh.offset + 1;
+			if (sh.type != BTRFS_ROOT_REF_KEY) {
+				off += sh.len;
+				continue;
+			}
+			memcpy(&ref, args.buf + off, sizeof(ref));
+
+			// the directory the child is in, relative to @id
+			memset(&lookup, 0, sizeof(lookup));
+			lookup.treeid = id;
+			lookup.objectid = ref.dirid;
+			if (ioctl(fd, BTRFS_IOC_INO_LOOKUP, &lookup) < 0) {
+				SYSERROR("Error looking up subvolume %llu", sh.offset);
+				return -1;
+			}
+
+			len = strlen(prefix) + strlen(lookup.name) + ref.name_len + 2;
+			path = malloc(len);
+			if (!path)
+				return -1;
+			snprintf(path, len, "%s%s%s%.*s", prefix, *prefix ? "/" : "",
+				 lookup.name, ref.name_len,
+				 args.buf + off + sizeof(ref));
+			off += sh.len;
+
+			if (btrfs_list_nested(fd, sh.offset, path, list) < 0) {
+				free(path);
+				return -1;
+			}
+			if (list->nr == list->alloc) {
+				struct btrfs_nested *n;
+
+				n = realloc(list->subvols, (list->alloc + 16) *
+					    sizeof(*n));
+				if (!n) {
+					free(path);
+					return -1;
+				}
+				list->subvols = n;
+				list->alloc += 16;
+			}
+			list->subvols[list->nr].path = path;
+			list->subvols[list->nr].id = sh.offset;
+			list->nr++;
+		}
+		if (args.key.min_offset == 0)
+			return 0;
+	}
+}
+
+static void btrfs_free_nested(struct btrfs_nested_list *list)
+{
+	int i;
+
+	for (i = 0; i < list->nr; i++)
+		free(list->subvols[i].path);
+	free(list->subvols);
+}
+
+/*
+ * Snapshot or delete the subvolume named @name in the directory @dirfd.
+ * With @srcfd set, snapshot it from there.
+ */
+static int btrfs_subvol_ioctl(int dirfd, const char *name, int srcfd)
+{
+	struct btrfs_ioctl_vol_args_v2 args_v2;
+	struct btrfs_ioctl_vol_args args;
+
+	if (srcfd >= 0) {
+		memset(&args_v2, 0, sizeof(args_v2));
+		args_v2.fd = srcfd;
+		strncpy(args_v2.name, name, BTRFS_SUBVOL_NAME_MAX);
+		args_v2.name[BTRFS_SUBVOL_NAME_MAX-1] = 0;
+		return ioctl(dirfd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2);
+	}
+
+	memset(&args, 0, sizeof(args));
+	strncpy(args.name, name, BTRFS_SUBVOL_NAME_MAX);
+	args.name[BTRFS_SUBVOL_NAME_MAX-1] = 0;
+	return ioctl(dirfd, BTRFS_IOC_SNAP_DESTROY, &args);
+}
+
+/*
+ * Snapshot the subvolume nested at @rel below @orig into the copy of its
+ * place below @new, which a snapshot has as an empty directory.
+ */
+static int btrfs_snapshot_nested(const char *orig, const char *new,
+				 const char *rel)
+{
+	char src[MAXPATHLEN], dst[MAXPATHLEN], *name;
+	int srcfd = -1, dirfd = -1, ret = -1;
+
+	if (snprintf(src, MAXPATHLEN, "%s/%s", orig, rel) >= MAXPATHLEN ||
+	    snprintf(dst, MAXPATHLEN, "%s/%s", new, rel) >= MAXPATHLEN)
+		return -1;
+	if (rmdir(dst) < 0 && errno != ENOENT) {
+		SYSERROR("Error removing the placeholder of %s", dst);
+		return -1;
+	}
+	name = strrchr(dst, '/');
+	*name++ = '\0';
+
+	srcfd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (srcfd < 0) {
+		SYSERROR("Error opening %s", src);
+		goto out;
+	}
+	dirfd = open(dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd < 0) {
+		SYSERROR("Error opening %s", dst);
+		goto out;
+	}
+	ret = btrfs_subvol_ioctl(dirfd, name, srcfd);
+	if (ret < 0)
+		SYSERROR("Error snapshotting %s", src);
+
+out:
+	if (dirfd >= 0)
+		close(dirfd);
+	if (srcfd >= 0)
+		close(srcfd);
+	return ret;
+}
+
+/*
+ * Delete a snapshot which could not be completed: the nested snapshots
+ * made from @nested->subvols[@from] on, innermost first, then the snapshot
+ * @name of @new itself in the directory @dirfd.
+ */
+static void btrfs_snapshot_undo(const char *new, int dirfd, const char *name,
+				struct btrfs_nested_list *nested, int from)
+{
+	char path[MAXPATHLEN], *p;
+	int fd, i;
+
+	for (i = from; i < nested->nr; i++) {
+		if (snprintf(path, MAXPATHLEN, "%s/%s", new,
+			     nested->subvols[i].path) >= MAXPATHLEN)
+			continue;
+		p = strrchr(path, '/');
+		*p++ = '\0';
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		if (btrfs_subvol_ioctl(fd, p, -1) < 0)
+			SYSERROR("Error deleting the nested snapshot %s/%s", path, p);
+		close(fd);
+	}
+	if (btrfs_subvol_ioctl(dirfd, name, -1) < 0)
+		SYSERROR("Error deleting the incomplete snapshot %s", new);
+}
+
 static int btrfs_snapshot(const char *orig, const char *new)
 {
-	int fd = -1, fddst = -1, ret = -1;
+	int fd = -1, fddst = -1, ret = -1, i;
+	struct btrfs_nested_list nested = { NULL, 0, 0 };
 	struct btrfs_ioctl_vol_args_v2  args;
 	char *newdir, *newname, *newfull = NULL;
 
@@ -1422,8 +2292,30 @@ static int btrfs_snapshot(const char *orig, const char *new)
 	args.name[BTRFS_SUBVOL_NAME_MAX-1] = 0;
 	ret = ioctl(fddst, BTRFS_IOC_SNAP_CREATE_V2, &args);
 	INFO("btrfs: snapshot create ioctl returned %d", ret);
+	if (ret < 0)
+		goto out;
+
+	// a snapshot has its nested subvolumes as empty directories, snapshot
+	// them into place too, parents first
+	if (btrfs_list_nested(fd, btrfs_subvol_id(fd), "", &nested) < 0) {
+		btrfs_snapshot_undo(new, fddst, newname, &nested, nested.nr);
+		ret = -1;
+		goto out;
+	}
+	for (i = nested.nr - 1; i >= 0; i--) {
+		ret = btrfs_snapshot_nested(orig, new, nested.subvols[i].path);
+		if (ret < 0)
+			break;
+	}
+	if (ret < 0) {
+		btrfs_snapshot_undo(new, fddst, newname, &nested, i + 1);
+		goto out;
+	}
+	if (nested.nr)
+		INFO("btrfs: snapshotted %d nested subvolumes of %s", nested.nr, orig);
 
 out:
+	btrfs_free_nested(&nested);
 	if (fddst != -1)
 		close(fddst);
 	if (fd != -1)
@@ -1478,12 +2370,20 @@ static int btrfs_clonepaths(struct bdev *orig, struct bdev *new, const char *old
 	return btrfs_subvolume_create(new->dest);
 }
 
+/*
+ * Delete the subvolume of @orig along with the subvolumes nested in it, the
+ * innermost first.  The kernel frees their space in the background.
+ * Unless lxc.bdev.btrfs.async_destroy is off, that is not waited for.
+ */
 static int btrfs_destroy(struct bdev *orig)
 {
-	int ret, fd = -1;
-	struct btrfs_ioctl_vol_args  args;
+	int ret = -1, fd = -1, dirfd = -1, i;
+	struct btrfs_nested_list nested = { NULL, 0, 0 };
+	struct btrfs_ioctl_subvol_wait wait;
+	const char *async;
 	char *path = orig->src;
-	char *p, *newfull = strdup(path);
+	char *p, *newfull = strdup(path), nestedpath[MAXPATHLEN];
+	unsigned long long id = 0, transid;
 
 	if (!newfull) {
 		ERROR("Error: out of memory");
@@ -1498,21 +2398,75 @@ static int btrfs_destroy(struct bdev *orig)
 	}
 	*p = '\0';
 
-	fd = open(newfull, O_RDONLY);
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR("Error opening %s", path);
+		goto out;
+	}
+	id = btrfs_subvol_id(fd);
+	if (btrfs_list_nested(fd, id, "", &nested) < 0)
+		goto out;
+	for (i = 0; i < nested.nr; i++) {
+		ret = snprintf(nestedpath, MAXPATHLEN, "%s/%s", path,
+			       nested.subvols[i].path);
+		if (ret < 0 || ret >= MAXPATHLEN) {
+			ret = -1;
+			goto out;
+		}
+		p = strrchr(nestedpath, '/');
+		*p++ = '\0';
+		dirfd = open(nestedpath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dirfd < 0) {
+			SYSERROR("Error opening %s", nestedpath);
+			ret = -1;
+			goto out;
+		}
+		ret = btrfs_subvol_ioctl(dirfd, p, -1);
+		close(dirfd);
+		if (ret < 0) {
+			SYSERROR("Error deleting nested subvolume %s/%s",
+				 nestedpath, p);
+			goto out;
+		}
+	}
+
+	close(fd);
+	fd = open(newfull, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
 	if (fd < 0) {
 		ERROR("Error opening %s", newfull);
-		free(newfull);
-		return -1;
+		ret = -1;
+		goto out;
 	}
+	ret = btrfs_subvol_ioctl(fd, strrchr(path, '/') + 1, -1);
+	INFO("btrfs: snapshot destroy ioctl returned %d, with %d nested subvolumes",
+	     ret, nested.nr);
+	if (ret < 0)
+		goto out;
 
-	memset(&args, 0, sizeof(args));
-	strncpy(args.name, p+1, BTRFS_SUBVOL_NAME_MAX);
-	args.name[BTRFS_SUBVOL_NAME_MAX-1] = 0;
-	ret = ioctl(fd, BTRFS_IOC_SNAP_DESTROY, &args);
-	INFO("btrfs: snapshot create ioctl returned %d", ret);
+	async = lxc_global_config_value("lxc.bdev.btrfs.async_destroy");
+	if (async && strcmp(async, "0") == 0) {
+		// commit the deletion, then wait for the cleaner where the
+		// kernel can tell
+		if (ioctl(fd, BTRFS_IOC_START_SYNC, &transid) < 0 ||
+		    ioctl(fd, BTRFS_IOC_WAIT_SYNC, &transid) < 0)
+			SYSERROR("Error committing the deletion of %s", path);
+		memset(&wait, 0, sizeof(wait));
+		for (i = 0; i <= nested.nr; i++) {
+			wait.subvolid = i < nested.nr ? nested.subvols[i].id : id;
+			if (ioctl(fd, BTRFS_IOC_SUBVOL_SYNC_WAIT, &wait) < 0 &&
+			    errno != ENOENT) {
+				DEBUG("Not waiting for the btrfs cleaner: %s",
+				      strerror(errno));
+				break;
+			}
+		}
+	}
 
+out:
+	btrfs_free_nested(&nested);
+	if (fd >= 0)
+		close(fd);
 	free(newfull);
-	close(fd);
 	return ret;
 }
 
@@ -1564,7 +2518,7 @@ static int find_free_loopdev(int *retfd, char *namep)
 			break;
 		if (strncmp(direntp->d_name, "loop", 4) != 0)
 			continue;
-		fd = openat(dirfd(dir), direntp->d_name, O_RDWR);
+		fd = openat(dirfd(dir), direntp->d_name, O_RDWR | O_CLOEXEC);
 		if (fd < 0)
 			continue;
 		if (ioctl(fd, LOOP_GET_STATUS64, &lo) == 0 || errno != ENXIO) {
@@ -1586,34 +2540,105 @@ static int find_free_loopdev(int *retfd, char *namep)
 	return 0;
 }
 
-static int loop_mount(struct bdev *bdev)
+/*
+ * Ask /dev/loop-control for a free loop device, which it creates if need
+ * be, rather than probing each /dev/loop*.  Without loop-control, or in a
+ * container where the node of the new device doesn't show up, fall back
+ * to probing.
+ */
+static int get_free_loopdev(int *retfd, char *namep)
 {
-	int lfd, ffd = -1, ret = -1;
+	int ctl, n, fd;
+
+	ctl = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+	if (ctl < 0)
+		return find_free_loopdev(retfd, namep);
+	n = ioctl(ctl, LOOP_CTL_GET_FREE);
+	close(ctl);
+	if (n < 0)
+		return find_free_loopdev(retfd, namep);
+
+	snprintf(namep, 100, "/dev/loop%d", n);
+	fd = open(namep, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return find_free_loopdev(retfd, namep);
+
+	*retfd = fd;
+	return 0;
+}
+
+/*
+ * Attach backing file @ffd to loop device @lfd with autoclear set.  Where
+ * the kernel has LOOP_CONFIGURE that is a single ioctl, so the device is
+ * never seen attached but not set up.  Returns 0, or -1 with errno set to
+ * EBUSY if someone else attached to the device since it was found free.
+ */
+static int loop_attach(int lfd, int ffd, bool direct_io)
+{
+	struct loop_config config;
 	struct loop_info64 lo;
+	int saved_errno;
+
+	memset(&config, 0, sizeof(config));
+	config.fd = ffd;
+	config.info.lo_flags = LO_FLAGS_AUTOCLEAR;
+	if (direct_io)
+		config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+	if (ioctl(lfd, LOOP_CONFIGURE, &config) == 0)
+		return 0;
+	if (errno != EINVAL && errno != ENOTTY)
+		return -1;
+
+	if (ioctl(lfd, LOOP_SET_FD, ffd) < 0)
+		return -1;
+	memset(&lo, 0, sizeof(lo));
+	lo.lo_flags = LO_FLAGS_AUTOCLEAR;
+	if (ioctl(lfd, LOOP_SET_STATUS64, &lo) < 0) {
+		saved_errno = errno;
+		ioctl(lfd, LOOP_CLR_FD, 0);
+		errno = saved_errno;
+		return -1;
+	}
+	// the backing file may not support it, which is fine
+	if (direct_io && ioctl(lfd, LOOP_SET_DIRECT_IO, 1) < 0)
+		DEBUG("No direct I/O on the loop device: %s", strerror(errno));
+	return 0;
+}
+
+/* how often to look for another loop device when one was taken from us */
+#define LOOP_ATTACH_TRIES 32
+
+static int loop_mount(struct bdev *bdev)
+{
+	int lfd = -1, ffd = -1, ret = -1, tries;
+	const char *direct_io;
 	char loname[100];
 
 	if (strcmp(bdev->type, "loop"))
 		return -22;
 	if (!bdev->src || !bdev->dest)
 		return -22;
-	if (find_free_loopdev(&lfd, loname) < 0)
-		return -22;
 
-	ffd = open(bdev->src + 5, O_RDWR);
+	ffd = open(bdev->src + 5, O_RDWR | O_CLOEXEC);
 	if (ffd < 0) {
-		SYSERROR("Error opening backing file %s", bdev->src);
-		goto out;
-	}
-
-	if (ioctl(lfd, LOOP_SET_FD, ffd) < 0) {
-		SYSERROR("Error attaching backing file to loop dev");
-		goto out;
-	}
-	memset(&lo, 0, sizeof(lo));
-	lo.lo_flags = LO_FLAGS_AUTOCLEAR;
-	if (ioctl(lfd, LOOP_SET_STATUS64, &lo) < 0) {
-		SYSERROR("Error setting autoclear on loop dev");
-		goto out;
+		SYSERROR("Error opening backing file %s", bdev->src);
+		return -22;
+	}
+
+	direct_io = lxc_global_config_value("lxc.bdev.loop.direct_io");
+	for (tries = 0; ; tries++) {
+		if (get_free_loopdev(&lfd, loname) < 0) {
+			lfd = -1;
+			goto out;
+		}
+		if (loop_attach(lfd, ffd, direct_io && strcmp(direct_io, "0")) == 0)
+			break;
+		if (errno != EBUSY || tries == LOOP_ATTACH_TRIES) {
+			SYSERROR("Error attaching backing file to loop dev");
+			goto out;
+		}
+		close(lfd);
+		lfd = -1;
 	}
 
 	ret = mount_unknown_fs(loname, bdev->dest, bdev->mntopts);
@@ -1623,15 +2648,48 @@ static int loop_mount(struct bdev *bdev)
 		bdev->lofd = lfd;
 
 out:
-	if (ffd > -1)
-		close(ffd);
+	close(ffd);
 	if (ret < 0) {
-		close(lfd);
+		if (lfd > -1)
+			close(lfd);
 		bdev->lofd = -1;
 	}
 	return ret;
 }
 
+/*
+ * Loop images are sparse unless lxc.bdev.loop.sparse is off, in which case
+ * they are allocated in full when created.
+ */
+static bool loop_sparse(void)
+{
+	const char *sparse = lxc_global_config_value("lxc.bdev.loop.sparse");
+
+	return !sparse || strcmp(sparse, "0") != 0;
+}
+
+/*
+ * Have the filesystem on the loop device mounted at @dest discard its free
+ * blocks, which the loop driver turns into holes in the image.
+ */
+static void loop_trim(const char *dest)
+{
+	struct fstrim_range range;
+	int fd;
+
+	fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	memset(&range, 0, sizeof(range));
+	range.len = (__u64)-1;
+	if (ioctl(fd, FITRIM, &range) < 0)
+		DEBUG("Not trimming %s: %s", dest, strerror(errno));
+	else
+		INFO("Trimmed %llu bytes from %s", (unsigned long long)range.len,
+		     dest);
+	close(fd);
+}
+
 static int loop_umount(struct bdev *bdev)
 {
 	int ret;
@@ -1640,6 +2698,8 @@ static int loop_umount(struct bdev *bdev)
 		return -22;
 	if (!bdev->src || !bdev->dest)
 		return -22;
+	if (loop_sparse())
+		loop_trim(bdev->dest);
 	ret = umount(bdev->dest);
 	if (bdev->lofd >= 0) {
 		close(bdev->lofd);
@@ -1648,6 +2708,90 @@ static int loop_umount(struct bdev *bdev)
 	return ret;
 }
 
+/* is the image @path still attached to a loop device */
+static bool loop_file_attached(const char *path)
+{
+	char real[MAXPATHLEN], sysfs[MAXPATHLEN], backing[MAXPATHLEN];
+	struct dirent *direntp;
+	DIR *dir;
+	FILE *f;
+	bool found = false;
+	int ret;
+
+	if (!realpath(path, real))
+		return false;
+	dir = opendir("/sys/block");
+	if (!dir)
+		return false;
+	while (!found && (direntp = readdir(dir))) {
+		if (strncmp(direntp->d_name, "loop", 4) != 0)
+			continue;
+		ret = snprintf(sysfs, MAXPATHLEN, "/sys/block/%s/loop/backing_file",
+			       direntp->d_name);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			continue;
+		f = fopen(sysfs, "r");
+		if (!f)
+			continue;
+		if (fgets(backing, sizeof(backing), f)) {
+			backing[strcspn(backing, "\n")] = '\0';
+			found = strcmp(backing, real) == 0;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	return found;
+}
+
+void bdev_trim_rootfs(struct lxc_conf *conf)
+{
+	struct bdev *bdev;
+	pid_t pid;
+	int i;
+
+	if (!conf->rootfs.path || !conf->rootfs.mount || am_unpriv() ||
+	    !loop_sparse())
+		return;
+	bdev = bdev_init(conf->rootfs.path, conf->rootfs.mount, NULL);
+	if (!bdev)
+		return;
+	if (strcmp(bdev->type, "loop") != 0)
+		goto out;
+
+	/*
+	 * The container's own mount goes away with its mount namespace, give
+	 * it a moment: the filesystem must not be mounted twice.
+	 */
+	for (i = 0; loop_file_attached(bdev->src + 5); i++) {
+		if (i == 10) {
+			DEBUG("Not trimming %s, it is still in use", bdev->src);
+			goto out;
+		}
+		usleep(100000);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("Failed to fork to trim %s", bdev->src);
+		goto out;
+	}
+	if (pid == 0) {
+		if (unshare(CLONE_NEWNS) < 0 ||
+		    (detect_shared_rootfs() &&
+		     mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL)))
+			exit(1);
+		// loop_umount() trims
+		if (bdev->ops->mount(bdev) < 0 || bdev->ops->umount(bdev) < 0)
+			exit(1);
+		exit(0);
+	}
+	if (wait_for_pid(pid) < 0)
+		WARN("Failed to trim %s", bdev->src);
+
+out:
+	bdev_put(bdev);
+}
+
 static int do_loop_create(const char *path, uint64_t size, const char *fstype)
 {
 	int fd, ret;
@@ -1655,15 +2799,18 @@ static int do_loop_create(const char *path, uint64_t size, const char *fstype)
 	fd = creat(path, S_IRUSR|S_IWUSR);
 	if (fd < 0)
 		return -1;
-	if (lseek(fd, size, SEEK_SET) < 0) {
-		SYSERROR("Error seeking to set new loop file size");
+	if (ftruncate(fd, size) < 0) {
+		SYSERROR("Error setting new loop file size");
 		close(fd);
 		return -1;
 	}
-	if (write(fd, "1", 1) != 1) {
-		SYSERROR("Error creating new loop file");
-		close(fd);
-		return -1;
+	if (!loop_sparse() && fallocate(fd, 0, 0, size) < 0) {
+		if (errno != EOPNOTSUPP) {
+			SYSERROR("Error allocating new loop file");
+			close(fd);
+			return -1;
+		}
+		INFO("%s can't be allocated in advance, it stays sparse", path);
 	}
 	ret = close(fd);
 	if (ret < 0) {
@@ -1681,6 +2828,51 @@ static int do_loop_create(const char *path, uint64_t size, const char *fstype)
 	return 0;
 }
 
+/*
+ * Copy the image of a loop container as a whole: the extents are shared
+ * where the filesystem can reflink, else only the data is copied so the
+ * copy is as sparse as the original.
+ */
+static int loop_copy_image(const char *src, const char *dest)
+{
+	int srcfd, destfd, ret;
+	struct stat st;
+
+	srcfd = open(src, O_RDONLY | O_CLOEXEC);
+	if (srcfd < 0) {
+		SYSERROR("Error opening %s", src);
+		return -1;
+	}
+	destfd = open(dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+		      S_IRUSR|S_IWUSR);
+	if (destfd < 0) {
+		SYSERROR("Error creating %s", dest);
+		close(srcfd);
+		return -1;
+	}
+
+	ret = lxc_reflink_file(srcfd, destfd);
+	if (ret < 0) {
+		SYSERROR("Error copying %s to %s", src, dest);
+	} else {
+		INFO("%s %s to %s", ret ? "Reflinked" : "Copied", src, dest);
+		ret = 0;
+		if (!loop_sparse() && fstat(destfd, &st) == 0 &&
+		    fallocate(destfd, 0, 0, st.st_size) < 0 &&
+		    errno != EOPNOTSUPP)
+			WARN("Error allocating %s: %s", dest, strerror(errno));
+	}
+
+	close(srcfd);
+	if (close(destfd) < 0 && ret == 0) {
+		SYSERROR("Error closing %s", dest);
+		ret = -1;
+	}
+	if (ret < 0)
+		unlink(dest);
+	return ret;
+}
+
 /*
  * No idea what the original blockdev will be called, but the copy will be
  * called $lxcpath/$lxcname/rootdev
@@ -1722,9 +2914,10 @@ static int loop_clonepaths(struct bdev *orig, struct bdev *new, const char *oldn
 	if (ret < 0 || ret >= len)
 		return -1;
 
-	// it's tempting to say: if orig->src == loopback and !newsize, then
-	// copy the loopback file.  However, we'd have to make sure to
-	// correctly keep holes!  So punt for now.
+	// a loop image of the same size is copied as a whole by
+	// bdev_copy_from(), keeping holes, rather than mkfs and rsync
+	if (strcmp(orig->type, "loop") == 0 && !newsize)
+		return 0;
 
 	if (is_blktype(orig)) {
 		if (!newsize && blk_getsize(orig, &size) < 0) {
@@ -1887,13 +3080,20 @@ static int overlayfs_umount(struct bdev *bdev)
 	return umount(bdev->dest);
 }
 
-struct rsync_data_char {
+/*
+ * @lower is set to flatten @src, an overlayfs upper layer, and @lower into
+ * @dest rather than to copy @src
+ */
+struct delta_copy_data {
 	char *src;
 	char *dest;
+	char *lower;
 };
 
-static int rsync_delta(struct rsync_data_char *data)
+static int copy_delta(struct delta_copy_data *data)
 {
+	int ret;
+
 	if (setgid(0) < 0) {
 		ERROR("Failed to setgid to 0");
 		return -1;
@@ -1904,18 +3104,22 @@ static int rsync_delta(struct rsync_data_char *data)
 		ERROR("Failed to setuid to 0");
 		return -1;
 	}
-	if (do_rsync(data->src, data->dest) < 0) {
-		ERROR("rsyncing %s to %s", data->src, data->dest);
+	if (data->lower)
+		ret = lxc_flatten_overlay(data->lower, data->src, data->dest, 0);
+	else
+		ret = lxc_copy_delta(data->src, data->dest, 0);
+	if (ret < 0) {
+		ERROR("copying %s to %s", data->src, data->dest);
 		return -1;
 	}
 
 	return 0;
 }
 
-static int rsync_delta_wrapper(void *data)
+static int copy_delta_wrapper(void *data)
 {
-	struct rsync_data_char *arg = data;
-	return rsync_delta(arg);
+	struct delta_copy_data *arg = data;
+	return copy_delta(arg);
 }
 
 static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldname,
@@ -1976,9 +3180,11 @@ static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char
 	} else if (strcmp(orig->type, "overlayfs") == 0) {
 		// What exactly do we want to do here?
 		// I think we want to use the original lowerdir, with a
-		// private delta which is originally rsynced from the
-		// original delta
-		char *osrc, *odelta, *nsrc, *ndelta;
+		// private delta which is originally copied from the
+		// original delta.  Flattened, the clone gets its own lowerdir
+		// with the original delta merged in, and an empty delta.
+		char *osrc, *odelta, *nsrc, *ndelta, *nlower = NULL;
+		struct delta_copy_data cdata;
 		int len, ret;
 		if (!(osrc = strdup(orig->src)))
 			return -22;
@@ -2002,29 +3208,47 @@ static int overlayfs_clonepaths(struct bdev *orig, struct bdev *new, const char
 		}
 		if (am_unpriv() && chown_mapped_root(ndelta, conf) < 0)
 			WARN("Failed to update ownership of %s", ndelta);
-		struct rsync_data_char rdata;
-		rdata.src = odelta;
-		rdata.dest = ndelta;
+
+		cdata.src = odelta;
+		cdata.dest = ndelta;
+		cdata.lower = NULL;
+		if (new->flatten) {
+			// if we have /var/lib/lxc/c2/rootfs, then the lowerdir
+			// will be /var/lib/lxc/c2/lower0
+			if (strlen(new->dest) < 6 || !(nlower = strdup(new->dest))) {
+				free(osrc);
+				free(ndelta);
+				return -22;
+			}
+			strcpy(&nlower[strlen(nlower)-6], "lower0");
+			cdata.dest = nlower;
+			cdata.lower = nsrc;
+		}
 		if (am_unpriv())
-			ret = userns_exec_1(conf, rsync_delta_wrapper, &rdata);
+			ret = userns_exec_1(conf, copy_delta_wrapper, &cdata);
 		else
-			ret = rsync_delta(&rdata);
+			ret = copy_delta(&cdata);
 		if (ret) {
 			free(osrc);
 			free(ndelta);
+			free(nlower);
 			ERROR("copying overlayfs delta");
 			return -1;
 		}
+		if (nlower)
+			nsrc = nlower;
 		len = strlen(nsrc) + strlen(ndelta) + 12;
 		new->src = malloc(len);
 		if (!new->src) {
 			free(osrc);
 			free(ndelta);
+			free(nlower);
 			return -ENOMEM;
 		}
 		ret = snprintf(new->src, len, "overlayfs:%s:%s", nsrc, ndelta);
 		free(osrc);
 		free(ndelta);
+		free(nlower);
 		if (ret < 0 || ret >= len)
 			return -ENOMEM;
 	} else {
@@ -2268,7 +3492,7 @@ static int aufs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldn
 	} else if (strcmp(orig->type, "aufs") == 0) {
 		// What exactly do we want to do here?
 		// I think we want to use the original lowerdir, with a
-		// private delta which is originally rsynced from the
+		// private delta which is originally copied from the
 		// original delta
 		char *osrc, *odelta, *nsrc, *ndelta;
 		int len, ret;
@@ -2286,7 +3510,7 @@ static int aufs_clonepaths(struct bdev *orig, struct bdev *new, const char *oldn
 			free(osrc);
 			return -ENOMEM;
 		}
-		if (do_rsync(odelta, ndelta) < 0) {
+		if (lxc_copy_delta(odelta, ndelta, 0) < 0) {
 			free(osrc);
 			free(ndelta);
 			ERROR("copying aufs delta");
@@ -2410,46 +3634,199 @@ void bdev_put(struct bdev *bdev)
 	free(bdev);
 }
 
-struct bdev *bdev_get(const char *type)
+static const struct bdev_type *bdev_query_type(const char *name, size_t len)
 {
 	int i;
-	struct bdev *bdev;
 
 	for (i=0; i<numbdevs; i++) {
-		if (strcmp(bdevs[i].name, type) == 0)
-			break;
+		if (strlen(bdevs[i].name) == len &&
+		    strncmp(bdevs[i].name, name, len) == 0)
+			return &bdevs[i];
 	}
-	if (i == numbdevs)
+	return NULL;
+}
+
+struct bdev *bdev_get(const char *type)
+{
+	const struct bdev_type *t;
+	struct bdev *bdev;
+
+	t = bdev_query_type(type, strlen(type));
+	if (!t)
 		return NULL;
 	bdev = malloc(sizeof(struct bdev));
 	if (!bdev)
 		return NULL;
 	memset(bdev, 0, sizeof(struct bdev));
-	bdev->ops = bdevs[i].ops;
-	bdev->type = bdevs[i].name;
+	bdev->ops = t->ops;
+	bdev->type = t->name;
 	return bdev;
 }
 
-struct bdev *bdev_init(const char *src, const char *dst, const char *mntopts)
+/*
+ * Backing store detection
+ *
+ * Asking each bdevs[] entry in turn is expensive, zfs comes first and
+ * zfs_detect() runs and scans 'zfs list'.  So settle what can be settled
+ * cheaply first: an explicit "type:" prefix, then the kind of file and the
+ * filesystem the path is on.  Only a directory on zfs which is not itself
+ * the mountpoint of a dataset still needs the zfs tool.
+ *
+ * Results for existing paths are cached.  An entry only holds as long as
+ * the path still is the same inode, so a rootfs which is re-created or
+ * mounted over is detected anew.
+ */
+#define BDEV_CACHE_BUCKETS 1024
+#define BDEV_CACHE_MAX 8192
+
+struct bdev_cache_entry {
+	char *path;
+	uint64_t hash;
+	dev_t dev;
+	ino_t ino;
+	const struct bdev_type *type;
+	struct bdev_cache_entry *next;
+};
+
+static struct bdev_cache_entry *bdev_cache[BDEV_CACHE_BUCKETS];
+static int bdev_cache_count;
+
+/* called with process_lock held */
+static void bdev_cache_flush(void)
 {
+	struct bdev_cache_entry *e, *next;
 	int i;
-	struct bdev *bdev;
 
-	for (i=0; i<numbdevs; i++) {
-		int r;
-		r = bdevs[i].ops->detect(src);
-		if (r)
-			break;
+	for (i = 0; i < BDEV_CACHE_BUCKETS; i++) {
+		for (e = bdev_cache[i]; e; e = next) {
+			next = e->next;
+			free(e->path);
+			free(e);
+		}
+		bdev_cache[i] = NULL;
+	}
+	bdev_cache_count = 0;
+}
+
+static const struct bdev_type *bdev_cache_get(const char *path, uint64_t hash,
+					      const struct stat *st)
+{
+	const struct bdev_type *type = NULL;
+	struct bdev_cache_entry *e;
+
+	process_lock();
+	for (e = bdev_cache[hash % BDEV_CACHE_BUCKETS]; e; e = e->next) {
+		if (e->hash != hash || strcmp(e->path, path) != 0)
+			continue;
+		if (e->dev == st->st_dev && e->ino == st->st_ino)
+			type = e->type;
+		break;
+	}
+	process_unlock();
+	return type;
+}
+
+static void bdev_cache_put(const char *path, uint64_t hash,
+			   const struct stat *st, const struct bdev_type *type)
+{
+	struct bdev_cache_entry *e, **head;
+
+	process_lock();
+	head = &bdev_cache[hash % BDEV_CACHE_BUCKETS];
+	for (e = *head; e; e = e->next) {
+		if (e->hash == hash && strcmp(e->path, path) == 0)
+			goto update;
+	}
+
+	/* a host with that many rootfs paths is rare, just start over */
+	if (bdev_cache_count >= BDEV_CACHE_MAX) {
+		bdev_cache_flush();
+		head = &bdev_cache[hash % BDEV_CACHE_BUCKETS];
+	}
+	e = malloc(sizeof(*e));
+	if (!e)
+		goto out;
+	e->path = strdup(path);
+	if (!e->path) {
+		free(e);
+		goto out;
+	}
+	e->hash = hash;
+	e->next = *head;
+	*head = e;
+	bdev_cache_count++;
+
+update:
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->type = type;
+out:
+	process_unlock();
+}
+
+static const struct bdev_type *bdev_detect(const char *path)
+{
+	const struct bdev_type *type;
+	struct statfs sfs;
+	struct stat st;
+	uint64_t hash;
+	char *p;
+
+	/* an explicit "type:" prefix leaves it to that type alone */
+	p = strchr(path, ':');
+	if (p && (type = bdev_query_type(path, p - path)))
+		return type->ops->detect(path) ? type : NULL;
+
+	if (stat(path, &st) < 0) {
+		/* a zfs dataset which is not mounted at the moment */
+		if (access("/dev/zfs", F_OK) == 0 && zfs_detect(path))
+			return bdev_query_type("zfs", 3);
+		return NULL;
+	}
+	if (!S_ISDIR(st.st_mode) && !S_ISBLK(st.st_mode))
+		return NULL;
+
+	hash = fnv_64a_buf((void *)path, strlen(path), FNV1A_64_INIT);
+	type = bdev_cache_get(path, hash, &st);
+	if (type)
+		return type;
+
+	if (S_ISBLK(st.st_mode)) {
+		if (!lvm_detect(path))
+			return NULL;
+		type = bdev_query_type("lvm", 3);
+	} else if (statfs(path, &sfs) < 0) {
+		type = bdev_query_type("dir", 3);
+	} else if ((unsigned long)sfs.f_type == BTRFS_SUPER_MAGIC &&
+		   btrfs_detect(path)) {
+		type = bdev_query_type("btrfs", 5);
+	} else if ((unsigned long)sfs.f_type == ZFS_SUPER_MAGIC &&
+		   (zfs_is_mountpoint(path) || zfs_detect(path))) {
+		type = bdev_query_type("zfs", 3);
+	} else {
+		type = bdev_query_type("dir", 3);
 	}
 
-	if (i == numbdevs)
+	bdev_cache_put(path, hash, &st, type);
+	return type;
+}
+
+struct bdev *bdev_init(const char *src, const char *dst, const char *mntopts)
+{
+	const struct bdev_type *type;
+	struct bdev *bdev;
+
+	if (!src)
+		return NULL;
+	type = bdev_detect(src);
+	if (!type)
 		return NULL;
 	bdev = malloc(sizeof(struct bdev));
 	if (!bdev)
 		return NULL;
 	memset(bdev, 0, sizeof(struct bdev));
-	bdev->ops = bdevs[i].ops;
-	bdev->type = bdevs[i].name;
+	bdev->ops = type->ops;
+	bdev->type = type->name;
 	if (mntopts)
 		bdev->mntopts = strdup(mntopts);
 	if (src)
@@ -2482,7 +3859,7 @@ static int rsync_rootfs(struct rsync_data *data)
 	}
 
 	// If not a snapshot, copy the fs.
-	if (orig->ops->mount(orig) < 0) {
+	if (!orig->mounted && orig->ops->mount(orig) < 0) {
 		ERROR("failed mounting %s onto %s", orig->src, orig->dest);
 		return -1;
 	}
@@ -2526,6 +3903,22 @@ bool bdev_is_dir(const char *path)
 	return ret;
 }
 
+const char *bdev_destroy_path(struct bdev *bdev)
+{
+	const char *upper;
+
+	if (strcmp(bdev->type, "dir") == 0)
+		return bdev->src;
+	if (strcmp(bdev->type, "loop") == 0)
+		return bdev->src + 5;
+	if (strcmp(bdev->type, "overlayfs") == 0 ||
+	    strcmp(bdev->type, "aufs") == 0) {
+		upper = index(bdev->src + strlen(bdev->type) + 1, ':');
+		return upper ? upper + 1 : NULL;
+	}
+	return NULL;
+}
+
 /*
  * is an unprivileged user allowed to make this kind of snapshot
  */
@@ -2552,24 +3945,15 @@ static bool unpriv_snap_allowed(struct bdev *b, const char *t, bool snap,
 }
 
 /*
- * If we're not snaphotting, then bdev_copy becomes a simple case of mount
- * the original, mount the new, and rsync the contents.
+ * bdev_copy_source: detect the backing store of a container's rootfs so
+ * that it can be cloned, possibly many times, with bdev_copy_from()
  */
-struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
-			const char *lxcpath, const char *bdevtype,
-			int flags, const char *bdevdata, uint64_t newsize,
-			int *needs_rdep)
+struct bdev *bdev_copy_source(struct lxc_container *c0)
 {
-	struct bdev *orig, *new;
-	pid_t pid;
-	int ret;
-	bool snap = flags & LXC_CLONE_SNAPSHOT;
-	bool maybe_snap = flags & LXC_CLONE_MAYBE_SNAPSHOT;
-	bool keepbdevtype = flags & LXC_CLONE_KEEPBDEVTYPE;
+	struct bdev *orig;
 	const char *src = c0->lxc_conf->rootfs.path;
 	const char *oldname = c0->name;
 	const char *oldpath = c0->config_path;
-	struct rsync_data data;
 
 	/* if the container name doesn't show up in the rootfs path, then
 	 * we don't know how to come up with a new name
@@ -2602,6 +3986,31 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 		}
 	}
 
+	return orig;
+}
+
+/*
+ * bdev_copy_from: clone the backing store @orig of container @c0 for a new
+ * container @cname. @orig comes from bdev_copy_source() and is left alone,
+ * so it can be reused for further clones. If @orig->mounted is set, it is
+ * expected to already be mounted on @orig->dest in our mount namespace.
+ */
+struct bdev *bdev_copy_from(struct bdev *orig, struct lxc_container *c0,
+			const char *cname, const char *lxcpath,
+			const char *bdevtype, int flags, const char *bdevdata,
+			uint64_t newsize, int *needs_rdep)
+{
+	struct bdev *new;
+	pid_t pid;
+	int ret;
+	bool snap = flags & LXC_CLONE_SNAPSHOT;
+	bool maybe_snap = flags & LXC_CLONE_MAYBE_SNAPSHOT;
+	bool keepbdevtype = flags & LXC_CLONE_KEEPBDEVTYPE;
+	const char *src = c0->lxc_conf->rootfs.path;
+	const char *oldname = c0->name;
+	const char *oldpath = c0->config_path;
+	struct rsync_data data;
+
 	/*
 	 * special case for snapshot - if caller requested maybe_snapshot and
 	 * keepbdevtype and backing store is directory, then proceed with a copy
@@ -2618,7 +4027,6 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 
 	if (am_unpriv() && !unpriv_snap_allowed(orig, bdevtype, snap, maybe_snap)) {
 		ERROR("Unsupported snapshot type for unprivileged users");
-		bdev_put(orig);
 		return NULL;
 	}
 
@@ -2631,9 +4039,9 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 	new = bdev_get(bdevtype ? bdevtype : orig->type);
 	if (!new) {
 		ERROR("no such block device type: %s", bdevtype ? bdevtype : orig->type);
-		bdev_put(orig);
 		return NULL;
 	}
+	new->flatten = flags & LXC_CLONE_FLATTEN;
 
 	if (new->ops->clone_paths(orig, new, oldname, cname, oldpath, lxcpath,
 				snap, newsize, c0->lxc_conf) < 0) {
@@ -2647,6 +4055,15 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 	if (snap)
 		return new;
 
+	if (strcmp(orig->type, "loop") == 0 && strcmp(new->type, "loop") == 0 &&
+			!newsize) {
+		if (loop_copy_image(orig->src + 5, new->src + 5) < 0) {
+			ERROR("Error copying %s to %s", orig->src, new->src);
+			goto err;
+		}
+		return new;
+	}
+
 	/*
 	 * https://github.com/lxc/lxc/issues/131
 	 * Use btrfs snapshot feature instead of rsync to restore if both orig and new are btrfs
@@ -2666,7 +4083,6 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 			ERROR("Error restoring %s to %s", orig->dest, new->dest);
 			goto err;
 		}
-		bdev_put(orig);
 		return new;
 	}
 
@@ -2678,7 +4094,6 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 
 	if (pid > 0) {
 		int ret = wait_for_pid(pid);
-		bdev_put(orig);
 		if (ret < 0) {
 			bdev_put(new);
 			return NULL;
@@ -2696,11 +4111,161 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 	exit(ret == 0 ? 0 : 1);
 
 err:
-	bdev_put(orig);
 	bdev_put(new);
 	return NULL;
 }
 
+/* the LVs of snapshot clones of @c0, as lvm_clonepaths() names them */
+static char **lvm_many_paths(struct bdev *orig, struct lxc_container *c0,
+			     const char **newnames, int count,
+			     const char *lxcpath)
+{
+	char **paths;
+	int i;
+
+	paths = calloc(count, sizeof(char *));
+	if (!paths)
+		return NULL;
+	for (i = 0; i < count; i++) {
+		paths[i] = dir_new_path(orig->src, c0->name, newnames[i],
+					c0->config_path, lxcpath);
+		if (!paths[i]) {
+			while (i--)
+				free(paths[i]);
+			free(paths);
+			return NULL;
+		}
+	}
+	return paths;
+}
+
+int bdev_snapshot_many(struct bdev *orig, struct lxc_container *c0,
+			const char **newnames, int count, const char *lxcpath,
+			uint64_t newsize)
+{
+	uint64_t size = newsize;
+	char **paths;
+	int i, ret = -1;
+
+	if (strcmp(orig->type, "zfs") == 0) {
+		ret = zfs_snapshot_many(orig, c0->name, newnames, count);
+	} else if (strcmp(orig->type, "lvm") == 0) {
+		if (!size && blk_getsize(orig, &size) < 0) {
+			ERROR("Error getting size of %s", orig->src);
+			return -1;
+		}
+		paths = lvm_many_paths(orig, c0, newnames, count, lxcpath);
+		if (!paths)
+			return -1;
+		ret = lvm_snapshot_many(orig->src, paths, count, size);
+		for (i = 0; i < count; i++)
+			free(paths[i]);
+		free(paths);
+	} else {
+		return 0;
+	}
+
+	if (ret == 0)
+		orig->snapshots_taken = true;
+	else
+		WARN("Failed to snapshot %s at once, snapshotting for each clone",
+		     orig->src);
+	return ret;
+}
+
+void bdev_snapshot_many_cleanup(struct bdev *orig, struct lxc_container *c0,
+			const char **newnames, const bool *results, int count,
+			const char *lxcpath)
+{
+	char vg[MAXPATHLEN], lv[MAXPATHLEN], *zfsroot, *cmds, *p, **paths;
+	char nvg[MAXPATHLEN], nlv[MAXPATHLEN];
+	int i, len, n = 0;
+	pid_t pid;
+
+	if (!orig->snapshots_taken)
+		return;
+
+	if (strcmp(orig->type, "zfs") == 0) {
+		zfsroot = zfs_root(orig->src);
+		if (!zfsroot)
+			return;
+		for (i = 0; i < count; i++) {
+			char snap[MAXPATHLEN];
+
+			if (results[i])
+				continue;
+			len = snprintf(snap, MAXPATHLEN, "%s/%s@%s", zfsroot,
+				       c0->name, newnames[i]);
+			if (len < 0 || len >= MAXPATHLEN)
+				continue;
+			// fails, as it should, if the clone was left behind
+			if ((pid = fork()) < 0)
+				break;
+			if (!pid) {
+				execlp("zfs", "zfs", "destroy", snap, NULL);
+				exit(1);
+			}
+			if (wait_for_pid(pid) < 0)
+				WARN("Failed to destroy snapshot %s", snap);
+		}
+		free(zfsroot);
+	} else if (strcmp(orig->type, "lvm") == 0) {
+		if (lvm_split_path(orig->src, vg, lv, MAXPATHLEN) < 0)
+			return;
+		paths = lvm_many_paths(orig, c0, newnames, count, lxcpath);
+		if (!paths)
+			return;
+		len = strlen("lvremove -f\n") + 1;
+		for (i = 0; i < count; i++)
+			len += strlen(paths[i]) + 1;
+		cmds = malloc(len);
+
+		// a failed clone may or may not have destroyed its LV already
+		if (cmds && lvm_load_vg(vg) == 0) {
+			p = cmds + sprintf(cmds, "lvremove -f");
+			process_lock();
+			for (i = 0; i < count; i++) {
+				if (results[i] || !lvm_lv_lookup(paths[i]) ||
+				    lvm_split_path(paths[i], nvg, nlv, MAXPATHLEN) < 0)
+					continue;
+				p += sprintf(p, " %s", paths[i]);
+				n++;
+			}
+			process_unlock();
+			sprintf(p, "\n");
+			if (n && lvm_shell(cmds) < 0)
+				ERROR("Failed to remove the snapshots of %s left by failed clones",
+				      orig->src);
+			lvm_load_vg(vg);
+		}
+		free(cmds);
+		for (i = 0; i < count; i++)
+			free(paths[i]);
+		free(paths);
+	}
+}
+
+/*
+ * If we're not snaphotting, then bdev_copy becomes a simple case of mount
+ * the original, mount the new, and rsync the contents.
+ */
+struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
+			const char *lxcpath, const char *bdevtype,
+			int flags, const char *bdevdata, uint64_t newsize,
+			int *needs_rdep)
+{
+	struct bdev *orig, *new;
+
+	orig = bdev_copy_source(c0);
+	if (!orig)
+		return NULL;
+
+	new = bdev_copy_from(orig, c0, cname, lxcpath, bdevtype, flags,
+			bdevdata, newsize, needs_rdep);
+	bdev_put(orig);
+	return new;
+}
+
 static struct bdev * do_bdev_create(const char *dest, const char *type,
 			const char *cname, struct bdev_specs *specs)
 {
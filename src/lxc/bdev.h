@@ -30,6 +30,7 @@
 
 #include "config.h"
 #include <stdint.h>
+#include <stdbool.h>
 #include <lxc/lxccontainer.h>
 
 struct bdev;
@@ -83,12 +84,25 @@ struct bdev {
 	// turn the following into a union if need be
 	// lofd is the open fd for the mounted loopback file
 	int lofd;
+	// set if src is already mounted on dest in the current mount namespace
+	bool mounted;
+	// set if bdev_snapshot_many() took the snapshots to clone this from
+	bool snapshots_taken;
+	// set to merge the layers of an overlayfs snapshot into one for its clone
+	bool flatten;
 };
 
 char *overlay_getlower(char *p);
 
 bool bdev_is_dir(const char *path);
 
+/*
+ * The file or directory which destroying @bdev removes, for the backing
+ * stores whose destroy does nothing else: dir, loop, and the upper layer
+ * of overlayfs and aufs.  NULL for the others.
+ */
+const char *bdev_destroy_path(struct bdev *bdev);
+
 /*
  * Instantiate a bdev object.  The src is used to determine which blockdev
  * type this should be.  The dst and data are optional, and will be used
@@ -106,6 +120,38 @@ struct bdev *bdev_copy(struct lxc_container *c0, const char *cname,
 			const char *lxcpath, const char *bdevtype,
 			int flags, const char *bdevdata, uint64_t newsize,
 			int *needs_rdep);
+/*
+ * Same as bdev_copy(), split so that the source backing store of a
+ * container cloned many times is only detected (and mounted) once.
+ */
+struct bdev *bdev_copy_source(struct lxc_container *c0);
+struct bdev *bdev_copy_from(struct bdev *orig, struct lxc_container *c0,
+			const char *cname, const char *lxcpath,
+			const char *bdevtype, int flags, const char *bdevdata,
+			uint64_t newsize, int *needs_rdep);
+/*
+ * Take the snapshots for snapshot clones of container @c0 named @newnames
+ * in @lxcpath from its backing store @orig (from bdev_copy_source()) all at
+ * once, rather than one for each clone.  zfs takes all its snapshots in one
+ * go, lvm creates all the snapshot LVs in one lvm shell.  For the other
+ * types this does nothing.
+ */
+int bdev_snapshot_many(struct bdev *orig, struct lxc_container *c0,
+			const char **newnames, int count, const char *lxcpath,
+			uint64_t newsize);
+/*
+ * Destroy the snapshots bdev_snapshot_many() took for the clones which then
+ * failed, those whose entry in @results is false.
+ */
+void bdev_snapshot_many_cleanup(struct bdev *orig, struct lxc_container *c0,
+			const char **newnames, const bool *results, int count,
+			const char *lxcpath);
+/*
+ * Give the space freed inside the sparse loop image of a container which
+ * just stopped back to the host, by briefly mounting it in a private mount
+ * namespace to trim it.  Does nothing for other backing stores.
+ */
+void bdev_trim_rootfs(struct lxc_conf *conf);
 struct bdev *bdev_create(const char *dest, const char *type,
 			const char *cname, struct bdev_specs *specs);
 void bdev_put(struct bdev *bdev);
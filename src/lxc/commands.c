@@ -32,6 +32,9 @@
 #include <sys/param.h>
 #include <malloc.h>
 #include <stdlib.h>
+#include <limits.h>
+
+#include <lxc/lxccontainer.h>
 
 #include "log.h"
 #include "lxc.h"
@@ -45,6 +48,7 @@
 #include "mainloop.h"
 #include "af_unix.h"
 #include "config.h"
+#include "trace.h"
 
 /*
  * This file provides the different functions for clients to
@@ -105,6 +109,8 @@ static const char *lxc_cmd_str(lxc_cmd_t cmd)
 		[LXC_CMD_GET_CLONE_FLAGS] = "get_clone_flags",
 		[LXC_CMD_GET_CGROUP]      = "get_cgroup",
 		[LXC_CMD_GET_CONFIG_ITEM] = "get_config_item",
+		[LXC_CMD_CONSOLE_LOG]     = "console_log",
+		[LXC_CMD_GET_START_TRACE] = "get_start_trace",
 	};
 
 	if (cmd >= LXC_CMD_MAX)
@@ -163,7 +169,9 @@ static int lxc_cmd_rsp_recv(int sock, struct lxc_cmd_rr *cmd)
 
 	if (rsp->datalen == 0)
 		return ret;
-	if (rsp->datalen > LXC_CMD_DATA_MAX) {
+	/* the console log is bounded by lxc.console.buffer_size instead */
+	if (rsp->datalen > LXC_CMD_DATA_MAX &&
+	    cmd->req.cmd != LXC_CMD_CONSOLE_LOG) {
 		ERROR("command %s response data %d too long",
 		      lxc_cmd_str(cmd->req.cmd), rsp->datalen);
 		errno = EFBIG;
@@ -176,7 +184,7 @@ static int lxc_cmd_rsp_recv(int sock, struct lxc_cmd_rr *cmd)
 		      lxc_cmd_str(cmd->req.cmd));
 		return -1;
 	}
-	ret = recv(sock, rsp->data, rsp->datalen, 0);
+	ret = recv(sock, rsp->data, rsp->datalen, MSG_WAITALL);
 	if (ret != rsp->datalen) {
 		ERROR("command %s failed to receive response data",
 		      lxc_cmd_str(cmd->req.cmd));
@@ -502,6 +510,55 @@ out:
 	return lxc_cmd_rsp_send(fd, &rsp);
 }
 
+/*
+ * lxc_cmd_get_start_trace: Get the start trace of the running container
+ *
+ * @name     : name of container to connect to
+ * @lxcpath  : the lxcpath in which the container is running
+ *
+ * Returns the trace as a JSON object on success, NULL on failure or if
+ * the container wasn't started with lxc.start.trace set. The caller must
+ * free() the returned trace.
+ */
+char *lxc_cmd_get_start_trace(const char *name, const char *lxcpath)
+{
+	int ret, stopped;
+	struct lxc_cmd_rr cmd = {
+		.req = { .cmd = LXC_CMD_GET_START_TRACE },
+	};
+
+	ret = lxc_cmd(name, &cmd, &stopped, lxcpath);
+	if (ret < 0)
+		return NULL;
+
+	if (cmd.rsp.ret == 0 && cmd.rsp.datalen > 0)
+		return cmd.rsp.data;
+	return NULL;
+}
+
+static int lxc_cmd_get_start_trace_callback(int fd, struct lxc_cmd_req *req,
+					    struct lxc_handler *handler)
+{
+	struct lxc_cmd_rsp rsp = { .ret = -ENODATA };
+	char *json = NULL;
+	int ret;
+
+	if (handler->trace) {
+		json = lxc_trace_json(handler->trace, handler->name);
+		if (json) {
+			rsp.data = json;
+			rsp.datalen = strlen(json) + 1;
+			rsp.ret = 0;
+		} else {
+			rsp.ret = -ENOMEM;
+		}
+	}
+
+	ret = lxc_cmd_rsp_send(fd, &rsp);
+	free(json);
+	return ret;
+}
+
 /*
  * lxc_cmd_get_state: Get current state of the container
  *
@@ -713,7 +770,110 @@ out_close:
 	return 1;
 }
 
+/*
+ * lxc_cmd_console_log: Retrieve and/or clear the in-memory console buffer
+ *
+ * @name     : name of container to connect to
+ * @lxcpath  : the lxcpath in which the container is running
+ * @log      : in: what to do and how much to read
+ *             out: the data read (malloc()ed) and its length
+ *
+ * Returns 0 on success, < 0 on failure, -ENODATA if the container has no
+ * console buffer configured
+ */
+int lxc_cmd_console_log(const char *name, const char *lxcpath,
+			struct lxc_console_log *log)
+{
+	int ret, stopped;
+	struct lxc_cmd_console_log data = {
+		.clear = log->clear,
+		.read = log->read,
+		.read_max = log->read_max,
+	};
+	struct lxc_cmd_rr cmd = {
+		.req = { .cmd = LXC_CMD_CONSOLE_LOG,
+			 .data = &data,
+			 .datalen = sizeof(data),
+		       },
+	};
+
+	log->data = NULL;
+	log->read_max = 0;
+
+	ret = lxc_cmd(name, &cmd, &stopped, lxcpath);
+	if (ret < 0)
+		return ret;
+
+	if (!ret) {
+		WARN("'%s' has stopped before sending its console log", name);
+		return -1;
+	}
+
+	if (cmd.rsp.ret < 0) {
+		if (cmd.rsp.datalen > 0)
+			free(cmd.rsp.data);
+		return cmd.rsp.ret;
+	}
+
+	if (cmd.rsp.datalen > 0) {
+		log->data = cmd.rsp.data;
+		log->read_max = cmd.rsp.datalen;
+	}
+	return 0;
+}
+
+static int lxc_cmd_console_log_callback(int fd, struct lxc_cmd_req *req,
+					struct lxc_handler *handler)
+{
+	const struct lxc_cmd_console_log *log = req->data;
+	struct lxc_ringbuf *buf = &handler->conf->console.ringbuf;
+	struct lxc_cmd_rsp rsp;
+	uint64_t len = 0;
+	char *data = NULL;
+	int ret;
+
+	memset(&rsp, 0, sizeof(rsp));
+	if (req->datalen != sizeof(*log)) {
+		rsp.ret = -EINVAL;
+		goto out;
+	}
+
+	if (!buf->addr) {
+		rsp.ret = -ENODATA;
+		goto out;
+	}
+
+	if (log->read) {
+		len = lxc_ringbuf_used(buf);
+		if (log->read_max && log->read_max < len)
+			len = log->read_max;
+		if (len > INT_MAX)
+			len = INT_MAX;
+	}
+
+	if (len) {
+		data = malloc(len);
+		if (!data) {
+			rsp.ret = -ENOMEM;
+			goto out;
+		}
+		lxc_ringbuf_read(buf, data, len);
+	}
 
+	/* only what was handed out is dropped when reading */
+	if (log->clear && log->read)
+		lxc_ringbuf_consume(buf, len);
+	else if (log->clear)
+		lxc_ringbuf_clear(buf);
+
+	rsp.data = data;
+	rsp.datalen = len;
+
+out:
+	ret = lxc_cmd_rsp_send(fd, &rsp);
+	free(data);
+	return ret;
+}
 
 static int lxc_cmd_process(int fd, struct lxc_cmd_req *req,
 			   struct lxc_handler *handler)
@@ -729,6 +889,8 @@ static int lxc_cmd_process(int fd, struct lxc_cmd_req *req,
 		[LXC_CMD_GET_CLONE_FLAGS] = lxc_cmd_get_clone_flags_callback,
 		[LXC_CMD_GET_CGROUP]      = lxc_cmd_get_cgroup_callback,
 		[LXC_CMD_GET_CONFIG_ITEM] = lxc_cmd_get_config_item_callback,
+		[LXC_CMD_CONSOLE_LOG]     = lxc_cmd_console_log_callback,
+		[LXC_CMD_GET_START_TRACE] = lxc_cmd_get_start_trace_callback,
 	};
 
 	if (req->cmd >= LXC_CMD_MAX) {
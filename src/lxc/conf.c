@@ -55,6 +55,7 @@
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <net/if.h>
+#include <net/ethernet.h>
 #include <libgen.h>
 
 #include "network.h"
@@ -68,6 +69,10 @@
 #include "cgroup.h"
 #include "lxclock.h"
 #include "namespace.h"
+#include "ptypool.h"
+#include "trace.h"
+#include "mainloop.h"
+#include "af_unix.h"
 #include "lsm/lsm.h"
 
 #if HAVE_SYS_CAPABILITY_H
@@ -276,49 +281,346 @@ static struct caps_opt caps_opt[] = {
 static struct caps_opt caps_opt[] = {};
 #endif
 
-static int run_buffer(char *buffer)
+/*
+ * A script being run: its output is read from a pipe in a mainloop and
+ * logged line by line, so that several of them can run at the same time.
+ * It is done when its shell exits, which is watched through a pidfd where
+ * the kernel has them and by polling waitpid() otherwise.  The shell leads
+ * its own process group, which is what gets killed on a timeout.
+ */
+struct script_run {
+	const char *script;
+	char *cmd;
+	pid_t pid;
+	int outfd;
+	int pidfd;
+	bool exited;
+	int status;
+	bool timed_out;
+	uint64_t start;
+	uint64_t end;
+	size_t used;
+	char line[LXC_LOG_BUFFER_SIZE];
+};
+
+/* how often scripts are polled for when there are no pidfds */
+#define SCRIPT_POLL_MS 50
+
+static uint64_t monotonic_ms(void)
 {
-	struct lxc_popen_FILE *f;
-	char *output;
-	int ret;
+	struct timespec ts;
 
-	f = lxc_popen(buffer);
-	if (!f) {
-		SYSERROR("popen failed");
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int pidfd_open(pid_t pid, unsigned int flags)
+{
+#ifdef __NR_pidfd_open
+	return syscall(__NR_pidfd_open, pid, flags);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/* log the complete lines of output, or everything left when @flush */
+static void script_log_output(struct script_run *run, bool flush)
+{
+	char *p = run->line, *nl;
+
+	while ((nl = memchr(p, '\n', run->line + run->used - p))) {
+		*nl = '\0';
+		DEBUG("script output (%s): %s", run->script, p);
+		p = nl + 1;
+	}
+
+	run->used -= p - run->line;
+	memmove(run->line, p, run->used);
+
+	/* a line longer than the buffer is logged in pieces */
+	if (run->used && (flush || run->used == sizeof(run->line) - 1)) {
+		run->line[run->used] = '\0';
+		DEBUG("script output (%s): %s", run->script, run->line);
+		run->used = 0;
+	}
+}
+
+/*
+ * Read what the script wrote so far.  Returns 1 once it closed its output,
+ * 0 if there may be more.
+ */
+static int script_read_output(struct script_run *run)
+{
+	ssize_t ret;
+
+	for (;;) {
+		ret = read(run->outfd, run->line + run->used,
+			   sizeof(run->line) - 1 - run->used);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		run->used += ret;
+		script_log_output(run, false);
+	}
+
+	return ret < 0 && errno == EAGAIN ? 0 : 1;
+}
+
+/* stop reading the output of @run, logging what is left of it */
+static void script_close_output(struct script_run *run,
+				struct lxc_epoll_descr *descr)
+{
+	if (run->outfd < 0)
+		return;
+	script_log_output(run, true);
+	if (descr)
+		lxc_mainloop_del_handler(descr, run->outfd);
+	close(run->outfd);
+	run->outfd = -1;
+}
+
+static int script_output_handler(int fd, uint32_t events, void *data,
+				 struct lxc_epoll_descr *descr)
+{
+	struct script_run *run = data;
+
+	if (script_read_output(run))
+		script_close_output(run, descr);
+	return 0;
+}
+
+static void script_exited(struct script_run *run, int status,
+			  struct lxc_epoll_descr *descr)
+{
+	run->exited = true;
+	run->status = status;
+	run->end = monotonic_ms();
+	if (run->pidfd >= 0) {
+		if (descr)
+			lxc_mainloop_del_handler(descr, run->pidfd);
+		close(run->pidfd);
+		run->pidfd = -1;
+	}
+}
+
+/* without a pidfd, or if it fails, check whether the script has exited */
+static void script_poll(struct script_run *run, struct lxc_epoll_descr *descr)
+{
+	int status;
+	pid_t ret;
+
+	if (run->exited)
+		return;
+	ret = waitpid(run->pid, &status, WNOHANG);
+	if (ret == run->pid)
+		script_exited(run, status, descr);
+	else if (ret < 0 && errno != EINTR)
+		script_exited(run, -1, descr);
+}
+
+static int script_exit_handler(int fd, uint32_t events, void *data,
+			       struct lxc_epoll_descr *descr)
+{
+	script_poll(data, descr);
+
+	/* back to run_scripts() so that it can see whether all are done */
+	return 1;
+}
+
+static int script_spawn(struct script_run *run)
+{
+	int pipefd[2];
+	sigset_t mask;
+
+	run->pid = -1;
+	run->outfd = -1;
+	run->pidfd = -1;
+	run->start = monotonic_ms();
+
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		SYSERROR("failed to create a pipe for '%s'", run->script);
 		return -1;
 	}
 
-	output = malloc(LXC_LOG_BUFFER_SIZE);
-	if (!output) {
-		ERROR("failed to allocate memory for script output");
-		lxc_pclose(f);
+	run->pid = fork();
+	if (run->pid < 0) {
+		SYSERROR("failed to fork '%s'", run->script);
+		close(pipefd[0]);
+		close(pipefd[1]);
 		return -1;
 	}
 
-	while(fgets(output, LXC_LOG_BUFFER_SIZE, f->f))
-		DEBUG("script output: %s", output);
+	if (run->pid == 0) {
+		/* its own process group, so that a timeout kills all of it */
+		setpgid(0, 0);
+		if (dup2(pipefd[1], STDOUT_FILENO) < 0)
+			_exit(127);
+		sigfillset(&mask);
+		sigprocmask(SIG_UNBLOCK, &mask, NULL);
+		execl("/bin/sh", "sh", "-c", run->cmd, (char *) NULL);
+		_exit(127);
+	}
 
-	free(output);
+	/* on both sides, so that the group exists before it can be killed */
+	setpgid(run->pid, run->pid);
+	close(pipefd[1]);
+	run->outfd = pipefd[0];
+	if (fcntl(run->outfd, F_SETFL, O_NONBLOCK) < 0)
+		SYSERROR("failed to make the output of '%s' non-blocking",
+			 run->script);
+	run->pidfd = pidfd_open(run->pid, 0);
+	if (run->pidfd >= 0)
+		fcntl(run->pidfd, F_SETFD, FD_CLOEXEC);
+	return 0;
+}
+
+static int script_result(struct script_run *run)
+{
+	int ret = run->status;
 
-	ret = lxc_pclose(f);
-	if (ret == -1) {
-		SYSERROR("Script exited on error");
+	INFO("Script '%s' finished in %" PRIu64 " ms", run->script,
+	     run->end - run->start);
+
+	if (run->timed_out) {
+		ERROR("Script '%s' timed out", run->script);
+		return -1;
+	} else if (ret == -1) {
+		SYSERROR("Script '%s' exited on error", run->script);
 		return -1;
 	} else if (WIFEXITED(ret) && WEXITSTATUS(ret) != 0) {
-		ERROR("Script exited with status %d", WEXITSTATUS(ret));
+		ERROR("Script '%s' exited with status %d", run->script,
+		      WEXITSTATUS(ret));
 		return -1;
 	} else if (WIFSIGNALED(ret)) {
-		ERROR("Script terminated by signal %d (%s)", WTERMSIG(ret),
-		      strsignal(WTERMSIG(ret)));
+		ERROR("Script '%s' terminated by signal %d (%s)", run->script,
+		      WTERMSIG(ret), strsignal(WTERMSIG(ret)));
 		return -1;
 	}
 
 	return 0;
 }
 
-static int run_script_argv(const char *name, const char *section,
-		      const char *script, const char *hook, const char *lxcpath,
-		      char **argsin)
+/*
+ * run_scripts: run scripts concurrently and wait for all of them
+ *
+ * @runs    : the scripts, with their script and cmd set
+ * @n       : number of scripts in @runs
+ * @timeout : seconds after which the scripts still running are killed,
+ *            0 to wait for as long as they take
+ *
+ * A script is done when its shell exits, whether or not something it
+ * left in the background still holds its output.  On a timeout, its
+ * whole process group is killed.
+ *
+ * Returns 0 if all the scripts succeeded, -1 otherwise.
+ */
+static int run_scripts(struct script_run *runs, int n, unsigned int timeout)
+{
+	struct lxc_epoll_descr descr;
+	uint64_t now, deadline = 0;
+	int i, running, ret = 0;
+	bool polling;
+
+	if (lxc_mainloop_open(&descr)) {
+		SYSERROR("failed to create the mainloop for scripts");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (script_spawn(&runs[i]) < 0) {
+			ret = -1;
+			break;
+		}
+		if (lxc_mainloop_add_handler(&descr, runs[i].outfd,
+				script_output_handler, &runs[i])) {
+			ERROR("failed to watch the output of '%s'",
+			      runs[i].script);
+			close(runs[i].outfd);
+			runs[i].outfd = -1;
+		}
+		if (runs[i].pidfd >= 0 &&
+		    lxc_mainloop_add_handler(&descr, runs[i].pidfd,
+				script_exit_handler, &runs[i])) {
+			close(runs[i].pidfd);
+			runs[i].pidfd = -1;
+		}
+	}
+	n = i;
+
+	if (timeout)
+		deadline = monotonic_ms() + timeout * 1000ULL;
+
+	for (;;) {
+		int timeout_ms = -1;
+
+		running = 0;
+		polling = false;
+		for (i = 0; i < n; i++) {
+			script_poll(&runs[i], &descr);
+			if (!runs[i].exited) {
+				running++;
+				polling |= runs[i].pidfd < 0;
+			}
+		}
+		if (!running || ret)
+			break;
+
+		if (deadline) {
+			now = monotonic_ms();
+			if (now >= deadline)
+				break;
+			timeout_ms = deadline - now;
+		}
+		if (polling && (timeout_ms < 0 || timeout_ms > SCRIPT_POLL_MS))
+			timeout_ms = SCRIPT_POLL_MS;
+
+		if (lxc_mainloop(&descr, timeout_ms)) {
+			SYSERROR("failed to wait for the scripts");
+			ret = -1;
+		}
+	}
+
+	/* whatever is still running overran the deadline, unless we gave up */
+	for (i = 0; i < n; i++) {
+		if (!runs[i].exited) {
+			int status = -1;
+
+			runs[i].timed_out = ret == 0;
+			kill(-runs[i].pid, SIGKILL);
+			while (waitpid(runs[i].pid, &status, 0) < 0 &&
+			       errno == EINTR)
+				;
+			script_exited(&runs[i], status, &descr);
+		}
+		/* what the script left in its pipe, not what comes after */
+		if (runs[i].outfd >= 0) {
+			script_read_output(&runs[i]);
+			script_close_output(&runs[i], &descr);
+		}
+		if (script_result(&runs[i]))
+			ret = -1;
+	}
+
+	lxc_mainloop_close(&descr);
+	return ret;
+}
+
+static int run_buffer(char *buffer)
+{
+	struct script_run run;
+
+	memset(&run, 0, sizeof(run));
+	run.script = buffer;
+	run.cmd = buffer;
+	return run_scripts(&run, 1, 0);
+}
+
+/* build the command line of a hook, to be freed by the caller */
+static char *script_argv_cmd(const char *name, const char *section,
+			     const char *script, const char *hook,
+			     char **argsin)
 {
 	int ret, i;
 	char *buffer;
@@ -338,18 +640,18 @@ static int run_script_argv(const char *name, const char *section,
 	size += 3;
 
 	if (size > INT_MAX)
-		return -1;
+		return NULL;
 
-	buffer = alloca(size);
+	buffer = malloc(size);
 	if (!buffer) {
 		ERROR("failed to allocate memory");
-		return -1;
+		return NULL;
 	}
 
 	ret = snprintf(buffer, size, "%s %s %s %s", script, name, section, hook);
 	if (ret < 0 || ret >= size) {
 		ERROR("Script name too long");
-		return -1;
+		goto err;
 	}
 
 	for (i=0; argsin && argsin[i]; i++) {
@@ -358,12 +660,16 @@ static int run_script_argv(const char *name, const char *section,
 		rc = snprintf(buffer + ret, len, " %s", argsin[i]);
 		if (rc < 0 || rc >= len) {
 			ERROR("Script args too long");
-			return -1;
+			goto err;
 		}
 		ret += rc;
 	}
 
-	return run_buffer(buffer);
+	return buffer;
+
+err:
+	free(buffer);
+	return NULL;
 }
 
 static int run_script(const char *name, const char *section,
@@ -2355,11 +2661,51 @@ static int setup_ipv6_addr(struct lxc_list *ip, int ifindex)
 	return 0;
 }
 
+static int setup_netdev_addr_up(struct lxc_netdev *netdev, const char *ifname,
+				const char *current_ifname)
+{
+	int err;
+
+	/* setup ipv4 addresses on the interface */
+	if (setup_ipv4_addr(&netdev->ipv4, netdev->ifindex)) {
+		ERROR("failed to setup ip addresses for '%s'",
+			      ifname);
+		return -1;
+	}
+
+	/* setup ipv6 addresses on the interface */
+	if (setup_ipv6_addr(&netdev->ipv6, netdev->ifindex)) {
+		ERROR("failed to setup ipv6 addresses for '%s'",
+			      ifname);
+		return -1;
+	}
+
+	/* set the network device up */
+	if (netdev->flags & IFF_UP) {
+		err = lxc_netdev_up(current_ifname);
+		if (err) {
+			ERROR("failed to set '%s' up : %s", current_ifname,
+			      strerror(-err));
+			return -1;
+		}
+
+		/* the network is up, make the loopback up too */
+		err = lxc_netdev_up("lo");
+		if (err) {
+			ERROR("failed to set the loopback up : %s",
+			      strerror(-err));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 static int setup_netdev(struct lxc_netdev *netdev)
 {
 	char ifname[IFNAMSIZ];
 	char *current_ifname = ifname;
-	int err;
+	int err, batched;
 
 	/* empty network namespace */
 	if (!netdev->ifindex) {
@@ -2425,39 +2771,20 @@ static int setup_netdev(struct lxc_netdev *netdev)
 		}
 	}
 
-	/* setup ipv4 addresses on the interface */
-	if (setup_ipv4_addr(&netdev->ipv4, netdev->ifindex)) {
-		ERROR("failed to setup ip addresses for '%s'",
-			      ifname);
-		return -1;
-	}
-
-	/* setup ipv6 addresses on the interface */
-	if (setup_ipv6_addr(&netdev->ipv6, netdev->ifindex)) {
-		ERROR("failed to setup ipv6 addresses for '%s'",
-			      ifname);
-		return -1;
-	}
-
-	/* set the network device up */
-	if (netdev->flags & IFF_UP) {
-		int err;
-
-		err = lxc_netdev_up(current_ifname);
-		if (err) {
-			ERROR("failed to set '%s' up : %s", current_ifname,
-			      strerror(-err));
-			return -1;
-		}
-
-		/* the network is up, make the loopback up too */
-		err = lxc_netdev_up("lo");
-		if (err) {
-			ERROR("failed to set the loopback up : %s",
-			      strerror(-err));
-			return -1;
+	/* the addresses and the link state don't need anything back from
+	 * the kernel, so send them in one batch, which it applies in order */
+	batched = lxc_netlink_batch_begin() == 0;
+	err = setup_netdev_addr_up(netdev, ifname, current_ifname);
+	if (batched) {
+		int batch_err = lxc_netlink_batch_end();
+		if (!err && batch_err) {
+			ERROR("failed to setup the addresses and state of '%s' : %s",
+			      current_ifname, strerror(-batch_err));
+			err = -1;
 		}
 	}
+	if (err)
+		return -1;
 
 	/* We can only set up the default routes after bringing
 	 * up the interface, sine bringing up the interface adds
@@ -2542,18 +2869,25 @@ static int setup_network(struct lxc_list *network)
 	struct lxc_list *iterator;
 	struct lxc_netdev *netdev;
 
+	if (lxc_list_empty(network))
+		return 0;
+
+	if (lxc_netlink_session_begin())
+		WARN("failed to open a netlink session");
+
 	lxc_list_for_each(iterator, network) {
 
 		netdev = iterator->elem;
 
 		if (setup_netdev(netdev)) {
 			ERROR("failed to setup netdev");
+			lxc_netlink_session_end();
 			return -1;
 		}
 	}
 
-	if (!lxc_list_empty(network))
-		INFO("network has been setup");
+	lxc_netlink_session_end();
+	INFO("network has been setup");
 
 	return 0;
 }
@@ -2626,106 +2960,213 @@ struct lxc_conf *lxc_conf_init(void)
 	return new;
 }
 
-static int instanciate_veth(struct lxc_handler *handler, struct lxc_netdev *netdev)
+#define LXC_IFNAME_ATTEMPTS 16
+
+/*
+ * Name one end of a veth pair. With lxc.network.veth.naming = hash, the name
+ * is derived from the container and the position of @netdev in its
+ * configuration, so that it is the same at every start.
+ */
+static char *veth_mkifname(struct lxc_handler *handler,
+			   struct lxc_netdev *netdev, const char *end,
+			   unsigned int attempt)
+{
+	char key[MAXPATHLEN];
+	struct lxc_list *it;
+	int idx = 0, ret;
+
+	if (!netdev->priv.veth_attr.hashname)
+		return lxc_mkifname("vethXXXXXX");
+
+	lxc_list_for_each(it, &handler->conf->network) {
+		if (it->elem == netdev)
+			break;
+		idx++;
+	}
+
+	ret = snprintf(key, sizeof(key), "%s/%s/%d/%s", handler->lxcpath,
+		       handler->name, idx, end);
+	if (ret < 0 || ret >= sizeof(key))
+		return NULL;
+
+	return lxc_mkifname_hash("vethXXXXXX", key, attempt);
+}
+
+/*
+ * A veth pair being created. instanciate_veth() creates one in a go, while
+ * lxc_create_network() queues the creation requests of all of them in one
+ * netlink batch, and then finishes them one by one.
+ */
+struct veth_create {
+	struct lxc_netdev *netdev;
+	char *veth1;
+	char *veth2;
+	unsigned int attempt;
+	unsigned char hwaddr[ETH_ALEN];
+	struct lxc_veth_args args;
+};
+
+static void veth_create_free(struct veth_create *vc)
+{
+	if (!vc->netdev->priv.veth_attr.pair)
+		free(vc->veth1);
+	free(vc->veth2);
+	vc->veth1 = vc->veth2 = NULL;
+}
+
+/*
+ * Pick the names of the pair and send, or queue, its creation request. The
+ * result of the request ends up in @vc->args.err.
+ */
+static int veth_create_begin(struct lxc_handler *handler,
+			     struct veth_create *vc)
 {
-	char veth1buf[IFNAMSIZ], *veth1;
-	char veth2buf[IFNAMSIZ], *veth2;
+	struct lxc_netdev *netdev = vc->netdev;
 	int err;
 
-	if (netdev->priv.veth_attr.pair)
-		veth1 = netdev->priv.veth_attr.pair;
-	else {
-		err = snprintf(veth1buf, sizeof(veth1buf), "vethXXXXXX");
-		if (err >= sizeof(veth1buf)) { /* can't *really* happen, but... */
-			ERROR("veth1 name too long");
+	if (!vc->attempt) {
+		/* changing the high byte of the mac address to 0xfe, the bridge
+		 * interface will always keep the host's mac address and not
+		 * take the mac address of a container */
+		err = lxc_private_host_hw_addr(vc->hwaddr);
+		if (err) {
+			ERROR("failed to generate a mac address : %s",
+			      strerror(-err));
 			return -1;
 		}
-		veth1 = lxc_mkifname(veth1buf);
-		if (!veth1) {
+		vc->args.hwaddr = vc->hwaddr;
+
+		if (netdev->mtu)
+			vc->args.mtu = atoi(netdev->mtu);
+
+		if (netdev->link) {
+			vc->args.master = if_nametoindex(netdev->link);
+			if (!vc->args.master) {
+				ERROR("failed to retrieve the index for the bridge '%s'",
+				      netdev->link);
+				return -1;
+			}
+		}
+
+		/* the mtu, mac address, bridge and link state all come with
+		 * the creation request. The kernel sets the mtu as it
+		 * creates the pair, before it sets the link up and enslaves
+		 * it to the bridge, so the bridge sees the mtu asked for,
+		 * as when it was set ahead of lxc_bridge_attach() */
+		vc->args.up = 1;
+	}
+
+	if (netdev->priv.veth_attr.pair)
+		vc->veth1 = netdev->priv.veth_attr.pair;
+	else {
+		vc->veth1 = veth_mkifname(handler, netdev, "host", vc->attempt);
+		if (!vc->veth1) {
 			ERROR("failed to allocate a temporary name");
 			return -1;
 		}
-		/* store away for deconf */
-		memcpy(netdev->priv.veth_attr.veth1, veth1, IFNAMSIZ);
 	}
 
-	snprintf(veth2buf, sizeof(veth2buf), "vethXXXXXX");
-	veth2 = lxc_mkifname(veth2buf);
-	if (!veth2) {
+	vc->veth2 = veth_mkifname(handler, netdev, "peer", vc->attempt);
+	if (!vc->veth2) {
 		ERROR("failed to allocate a temporary name");
-		goto out_delete;
+		veth_create_free(vc);
+		return -1;
 	}
 
-	err = lxc_veth_create(veth1, veth2);
-	if (err) {
-		ERROR("failed to create %s-%s : %s", veth1, veth2,
-		      strerror(-err));
-		goto out_delete;
-	}
+	lxc_veth_create(vc->veth1, vc->veth2, &vc->args);
+	return 0;
+}
 
-	/* changing the high byte of the mac address to 0xfe, the bridge interface
-	 * will always keep the host's mac address and not take the mac address
-	 * of a container */
-	err = setup_private_host_hw_addr(veth1);
-	if (err) {
-		ERROR("failed to change mac address of host interface '%s' : %s",
-			veth1, strerror(-err));
-		goto out_delete;
-	}
+/*
+ * Check the outcome of veth_create_begin(), retrying with other names if
+ * they were taken, and finish the setup of the pair.
+ */
+static int veth_create_end(struct lxc_handler *handler,
+			   struct veth_create *vc)
+{
+	struct lxc_netdev *netdev = vc->netdev;
+	int err;
 
-	if (netdev->mtu) {
-		err = lxc_netdev_set_mtu(veth1, atoi(netdev->mtu));
-		if (!err)
-			err = lxc_netdev_set_mtu(veth2, atoi(netdev->mtu));
-		if (err) {
-			ERROR("failed to set mtu '%s' for %s-%s : %s",
-			      netdev->mtu, veth1, veth2, strerror(-err));
-			goto out_delete;
-		}
-	}
+	for (;;) {
+		err = vc->args.err;
 
-	if (netdev->link) {
-		err = lxc_bridge_attach(netdev->link, veth1);
-		if (err) {
-			ERROR("failed to attach '%s' to the bridge '%s' : %s",
-				      veth1, netdev->link, strerror(-err));
-			goto out_delete;
-		}
-	}
+		/* the generated names may have been taken since they were
+		 * picked, or be another container's hashed names */
+		if (err != -EEXIST || vc->attempt + 1 == LXC_IFNAME_ATTEMPTS)
+			break;
+		if (netdev->priv.veth_attr.pair && if_nametoindex(vc->veth1))
+			break;
 
-	netdev->ifindex = if_nametoindex(veth2);
-	if (!netdev->ifindex) {
-		ERROR("failed to retrieve the index for %s", veth2);
-		goto out_delete;
+		veth_create_free(vc);
+		vc->attempt++;
+		if (veth_create_begin(handler, vc))
+			return -1;
 	}
 
-	err = lxc_netdev_up(veth1);
 	if (err) {
-		ERROR("failed to set %s up : %s", veth1, strerror(-err));
+		ERROR("failed to create %s-%s : %s", vc->veth1, vc->veth2,
+		      strerror(-err));
+		goto out_free;
+	}
+
+	/* store away for deconf */
+	if (!netdev->priv.veth_attr.pair)
+		snprintf(netdev->priv.veth_attr.veth1, IFNAMSIZ, "%s",
+			 vc->veth1);
+
+	netdev->ifindex = vc->args.peer_ifindex;
+	if (!netdev->ifindex)
+		netdev->ifindex = if_nametoindex(vc->veth2);
+	if (!netdev->ifindex) {
+		ERROR("failed to retrieve the index for %s", vc->veth2);
 		goto out_delete;
 	}
 
 	if (netdev->upscript) {
 		err = run_script(handler->name, "net", netdev->upscript, "up",
-				 "veth", veth1, (char*) NULL);
+				 "veth", vc->veth1, (char*) NULL);
 		if (err)
 			goto out_delete;
 	}
 
 	DEBUG("instanciated veth '%s/%s', index is '%d'",
-	      veth1, veth2, netdev->ifindex);
+	      vc->veth1, vc->veth2, netdev->ifindex);
 
+	veth_create_free(vc);
 	return 0;
 
 out_delete:
-	lxc_netdev_delete_by_name(veth1);
-	if (!netdev->priv.veth_attr.pair && veth1)
-		free(veth1);
-	if(veth2)
-		free(veth2);
+	lxc_netdev_delete_by_name(vc->veth1);
+	netdev->ifindex = 0;
+out_free:
+	veth_create_free(vc);
 	return -1;
 }
 
+/*
+ * Forget a pair whose creation was queued, deleting it unless its names
+ * were someone else's. The reply may have been lost, so don't trust an
+ * error other than that.
+ */
+static void veth_create_abort(struct veth_create *vc)
+{
+	if (vc->args.ifindex)
+		lxc_netdev_delete_by_index(vc->args.ifindex);
+	else if (vc->args.err != -EEXIST)
+		lxc_netdev_delete_by_name(vc->veth1);
+	veth_create_free(vc);
+}
+
+static int instanciate_veth(struct lxc_handler *handler, struct lxc_netdev *netdev)
+{
+	struct veth_create vc = { .netdev = netdev };
+
+	if (veth_create_begin(handler, &vc))
+		return -1;
+
+	return veth_create_end(handler, &vc);
+}
+
 static int shutdown_veth(struct lxc_handler *handler, struct lxc_netdev *netdev)
 {
 	char *veth1;
@@ -2950,34 +3391,131 @@ int lxc_requests_empty_network(struct lxc_handler *handler)
 	return 0;
 }
 
+/*
+ * Delete the network devices created so far by lxc_create_network(), last
+ * first. Physical devices were not touched yet.
+ */
+static void rollback_network(struct lxc_handler *handler)
+{
+	struct lxc_list *network = &handler->conf->network;
+	struct lxc_list *iterator;
+	struct lxc_netdev *netdev;
+
+	for (iterator = network->prev; iterator != network;
+	     iterator = iterator->prev) {
+		netdev = iterator->elem;
+
+		if (!netdev->ifindex || netdev->type == LXC_NET_PHYS)
+			continue;
+
+		if (lxc_netdev_delete_by_index(netdev->ifindex))
+			WARN("failed to remove interface '%s'", netdev->name);
+		netdev->ifindex = 0;
+	}
+}
+
 int lxc_create_network(struct lxc_handler *handler)
 {
 	struct lxc_list *network = &handler->conf->network;
 	struct lxc_list *iterator;
 	struct lxc_netdev *netdev;
+	struct veth_create *vcs = NULL;
 	int am_root = (getuid() == 0);
+	int i = 0, nveth = 0, queued = 0, batched;
+
+	int ret = -1;
 
 	if (!am_root)
 		return 0;
 
-	lxc_list_for_each(iterator, network) {
+	if (lxc_netlink_session_begin())
+		WARN("failed to open a netlink session");
 
+	lxc_list_for_each(iterator, network) {
 		netdev = iterator->elem;
 
 		if (netdev->type < 0 || netdev->type > LXC_NET_MAXCONFTYPE) {
 			ERROR("invalid network configuration type '%d'",
 			      netdev->type);
-			return -1;
+			goto out;
 		}
 
+		/* left over from a previous run, not ours to roll back */
+		netdev->ifindex = 0;
+		if (netdev->type == LXC_NET_VETH)
+			nveth++;
+	}
+
+	/* the veth pairs are created all at once below */
+	lxc_list_for_each(iterator, network) {
+
+		netdev = iterator->elem;
+
+		if (netdev->type == LXC_NET_VETH)
+			continue;
+
 		if (netdev_conf[netdev->type](handler, netdev)) {
 			ERROR("failed to create netdev");
-			return -1;
+			goto out;
 		}
 
 	}
 
-	return 0;
+	if (!nveth)
+		goto done;
+
+	vcs = calloc(nveth, sizeof(*vcs));
+	if (!vcs) {
+		ERROR("failed to allocate memory");
+		goto out;
+	}
+
+	/* queue the creation of every pair, so that the kernel gets them in
+	 * a single message and answers them in a single pass */
+	batched = lxc_netlink_batch_begin() == 0;
+
+	lxc_list_for_each(iterator, network) {
+		netdev = iterator->elem;
+
+		if (netdev->type != LXC_NET_VETH)
+			continue;
+
+		vcs[queued].netdev = netdev;
+		if (veth_create_begin(handler, &vcs[queued]))
+			break;
+		queued++;
+	}
+
+	if (batched)
+		lxc_netlink_batch_end();
+
+	if (queued < nveth) {
+		i = -1;
+		goto out;
+	}
+
+	for (i = 0; i < queued; i++) {
+		if (veth_create_end(handler, &vcs[i])) {
+			ERROR("failed to create netdev");
+			goto out;
+		}
+	}
+
+done:
+	ret = 0;
+out:
+	if (ret) {
+		batched = lxc_netlink_batch_begin() == 0;
+		/* the pairs after the failed one were not finished */
+		for (i++; i < queued; i++)
+			veth_create_abort(&vcs[i]);
+		rollback_network(handler);
+		if (batched)
+			lxc_netlink_batch_end();
+	}
+	free(vcs);
+	lxc_netlink_session_end();
+	return ret;
 }
 
 void lxc_delete_network(struct lxc_handler *handler)
@@ -2986,6 +3524,9 @@ void lxc_delete_network(struct lxc_handler *handler)
 	struct lxc_list *iterator;
 	struct lxc_netdev *netdev;
 
+	if (lxc_netlink_session_begin())
+		WARN("failed to open a netlink session");
+
 	lxc_list_for_each(iterator, network) {
 		netdev = iterator->elem;
 
@@ -3008,25 +3549,84 @@ void lxc_delete_network(struct lxc_handler *handler)
 		    lxc_netdev_delete_by_index(netdev->ifindex))
 			WARN("failed to remove interface '%s'", netdev->name);
 	}
+
+	lxc_netlink_session_end();
 }
 
 #define LXC_USERNIC_PATH LIBEXECDIR "/lxc/lxc-user-nic"
 
-/* lxc-user-nic returns "interface_name:interface_name\n" */
-#define MAX_BUFFER_SIZE IFNAMSIZ*2 + 2
-static int unpriv_assign_nic(struct lxc_netdev *netdev, pid_t pid)
+/*
+ * lxc-user-nic returns "interface_name:interface_name\n", its daemon mode
+ * can also answer "error <message>\n"
+ */
+#define MAX_BUFFER_SIZE 256
+
+/*
+ * usernic_daemon_request: ask a running lxc-user-nic --daemon for a nic
+ *
+ * @netdev : the nic to create
+ * @pid    : the pid whose network namespace gets the nic
+ * @buffer : where to store the answer, '\0' terminated
+ * @size   : size of @buffer
+ *
+ * Returns the length of the answer, or -1 with errno set to ECONNREFUSED
+ * when no daemon is listening.
+ */
+static int usernic_daemon_request(struct lxc_netdev *netdev, pid_t pid,
+				  char *buffer, size_t size)
 {
-	pid_t child;
-	int bytes, pipefd[2];
-	char *token, *saveptr = NULL;
-	char buffer[MAX_BUFFER_SIZE];
+	struct ucred cred;
+	socklen_t credsz = sizeof(cred);
+	char req[MAX_BUFFER_SIZE];
+	int fd, ret, bytes = 0;
 
-	if (netdev->type != LXC_NET_VETH) {
-		ERROR("nic type %d not support for unprivileged use",
-			netdev->type);
+	fd = lxc_abstract_unix_connect(LXC_USERNIC_SOCKET);
+	if (fd < 0) {
+		errno = ECONNREFUSED;
 		return -1;
 	}
 
+	/* anybody can bind an abstract socket, only trust root */
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credsz) ||
+	    cred.uid != 0) {
+		WARN("ignoring lxc-user-nic daemon not running as root");
+		close(fd);
+		errno = ECONNREFUSED;
+		return -1;
+	}
+
+	ret = snprintf(req, sizeof(req), "%lu veth %s %s\n", (unsigned long)pid,
+		       netdev->link, netdev->name ? netdev->name : "eth0");
+	if (ret < 0 || ret >= sizeof(req)) {
+		ERROR("nic link or name too long");
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if (lxc_write_nointr(fd, req, ret) != ret) {
+		SYSERROR("failed to send request to lxc-user-nic daemon");
+		close(fd);
+		return -1;
+	}
+
+	while (bytes < size - 1) {
+		ret = lxc_read_nointr(fd, buffer + bytes, size - 1 - bytes);
+		if (ret <= 0)
+			break;
+		bytes += ret;
+	}
+	close(fd);
+	buffer[bytes] = '\0';
+	return bytes;
+}
+
+/* run the setuid lxc-user-nic and read its answer into @buffer */
+static int usernic_exec(struct lxc_netdev *netdev, pid_t pid, char *buffer,
+			size_t size)
+{
+	pid_t child;
+	int bytes, pipefd[2];
+
 	if(pipe(pipefd) < 0) {
 		SYSERROR("pipe failed");
 		return -1;
@@ -3060,19 +3660,46 @@ static int unpriv_assign_nic(struct lxc_netdev *netdev, pid_t pid)
 	/* close the write-end of the pipe */
 	close(pipefd[1]);
 
-	bytes = read(pipefd[0], &buffer, MAX_BUFFER_SIZE);
+	bytes = lxc_read_nointr(pipefd[0], buffer, size - 1);
 	if (bytes < 0) {
 		SYSERROR("read failed");
+		bytes = 0;
 	}
-	buffer[bytes - 1] = '\0';
+	buffer[bytes] = '\0';
 
-	if (wait_for_pid(child) != 0) {
-		close(pipefd[0]);
+	/* close the read-end of the pipe */
+	close(pipefd[0]);
+
+	if (wait_for_pid(child) != 0)
+		return -1;
+
+	return bytes;
+}
+
+static int unpriv_assign_nic(struct lxc_netdev *netdev, pid_t pid)
+{
+	int bytes;
+	char *token, *saveptr = NULL;
+	char buffer[MAX_BUFFER_SIZE];
+
+	if (netdev->type != LXC_NET_VETH) {
+		ERROR("nic type %d not support for unprivileged use",
+			netdev->type);
 		return -1;
 	}
 
-	/* close the read-end of the pipe */
-	close(pipefd[0]);
+	bytes = usernic_daemon_request(netdev, pid, buffer, sizeof(buffer));
+	if (bytes < 0 && errno == ECONNREFUSED)
+		bytes = usernic_exec(netdev, pid, buffer, sizeof(buffer));
+	if (bytes <= 0)
+		return -1;
+
+	if (buffer[bytes - 1] == '\n')
+		buffer[bytes - 1] = '\0';
+	if (strncmp(buffer, "error ", 6) == 0) {
+		ERROR("lxc-user-nic: %s", buffer + 6);
+		return -1;
+	}
 
 	/* fill netdev->name field */
 	token = strtok_r(buffer, ":", &saveptr);
@@ -3104,7 +3731,11 @@ int lxc_assign_network(struct lxc_list *network, pid_t pid)
 	struct lxc_list *iterator;
 	struct lxc_netdev *netdev;
 	int am_root = (getuid() == 0);
-	int err;
+	int err, batched = 0;
+
+	/* the moves don't depend on each other, send them all at once */
+	if (am_root)
+		batched = lxc_netlink_batch_begin() == 0;
 
 	lxc_list_for_each(iterator, network) {
 
@@ -3127,12 +3758,23 @@ int lxc_assign_network(struct lxc_list *network, pid_t pid)
 		if (err) {
 			ERROR("failed to move '%s' to the container : %s",
 			      netdev->link, strerror(-err));
+			if (batched)
+				lxc_netlink_batch_end();
 			return -1;
 		}
 
 		DEBUG("move '%s' to '%d'", netdev->name, pid);
 	}
 
+	if (batched) {
+		err = lxc_netlink_batch_end();
+		if (err) {
+			ERROR("failed to move the network devices to the container : %s",
+			      strerror(-err));
+			return -1;
+		}
+	}
+
 	return 0;
 }
 
@@ -3351,10 +3993,8 @@ int lxc_create_tty(const char *name, struct lxc_conf *conf)
 
 		struct lxc_pty_info *pty_info = &tty_info->pty_info[i];
 
-		process_lock();
-		ret = openpty(&pty_info->master, &pty_info->slave,
-			    pty_info->name, NULL, NULL);
-		process_unlock();
+		ret = lxc_pty_get(&pty_info->master, &pty_info->slave,
+				  pty_info->name, sizeof(pty_info->name));
 		if (ret) {
 			SYSERROR("failed to create pty #%d", i);
 			tty_info->nbtty = i;
@@ -3365,10 +4005,6 @@ int lxc_create_tty(const char *name, struct lxc_conf *conf)
 		DEBUG("allocated pty '%s' (%d/%d)",
 		      pty_info->name, pty_info->master, pty_info->slave);
 
-		/* Prevent leaking the file descriptors to the container */
-		fcntl(pty_info->master, F_SETFD, FD_CLOEXEC);
-		fcntl(pty_info->slave, F_SETFD, FD_CLOEXEC);
-
 		pty_info->busy = 0;
 	}
 
@@ -3680,16 +4316,19 @@ int lxc_setup(struct lxc_handler *handler)
 		ERROR("failed to setup the network for '%s'", name);
 		return -1;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_NETWORK);
 
 	if (run_lxc_hooks(name, "pre-mount", lxc_conf, lxcpath, NULL)) {
 		ERROR("failed to run pre-mount hooks for container '%s'.", name);
 		return -1;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_PRE_MOUNT_HOOKS);
 
 	if (setup_rootfs(lxc_conf)) {
 		ERROR("failed to setup rootfs for '%s'", name);
 		return -1;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_ROOTFS);
 
 	if (lxc_conf->autodev < 0) {
 		lxc_conf->autodev = check_autodev(lxc_conf->rootfs.mount, data);
@@ -3700,6 +4339,7 @@ int lxc_setup(struct lxc_handler *handler)
 			ERROR("failed to mount /dev in the container");
 			return -1;
 		}
+		lxc_trace(handler->trace, LXC_TRACE_CHILD_AUTODEV_MOUNT);
 	}
 
 	/* do automatic mounts (mainly /proc and /sys), but exclude
@@ -3728,11 +4368,13 @@ int lxc_setup(struct lxc_handler *handler)
 		ERROR("failed to setup the automatic mounts for '%s'", name);
 		return -1;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_MOUNT_ENTRIES);
 
 	if (run_lxc_hooks(name, "mount", lxc_conf, lxcpath, NULL)) {
 		ERROR("failed to run mount hooks for container '%s'.", name);
 		return -1;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_MOUNT_HOOKS);
 
 	if (lxc_conf->autodev > 0) {
 		if (run_lxc_hooks(name, "autodev", lxc_conf, lxcpath, NULL)) {
@@ -3743,6 +4385,7 @@ int lxc_setup(struct lxc_handler *handler)
 			ERROR("failed to populate /dev in the container");
 			return -1;
 		}
+		lxc_trace(handler->trace, LXC_TRACE_CHILD_AUTODEV);
 	}
 
 	if (!lxc_conf->is_execute && setup_console(&lxc_conf->rootfs, &lxc_conf->console, lxc_conf->ttydir)) {
@@ -3770,11 +4413,13 @@ int lxc_setup(struct lxc_handler *handler)
 		ERROR("failed to LSM mount proc for '%s'", name);
 		return -1;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_DEV);
 
 	if (setup_pivot_root(&lxc_conf->rootfs)) {
 		ERROR("failed to set rootfs for '%s'", name);
 		return -1;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_PIVOT_ROOT);
 
 	if (setup_pts(lxc_conf->pts)) {
 		ERROR("failed to setup the new pts instance");
@@ -3802,6 +4447,7 @@ int lxc_setup(struct lxc_handler *handler)
 		}
 	}
 
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_SETUP);
 	NOTICE("'%s' is setup.", name);
 
 	return 0;
@@ -3810,8 +4456,9 @@ int lxc_setup(struct lxc_handler *handler)
 int run_lxc_hooks(const char *name, char *hook, struct lxc_conf *conf,
 		  const char *lxcpath, char *argv[])
 {
-	int which = -1;
+	int which = -1, i, n, ret = -1;
 	struct lxc_list *it;
+	struct script_run *runs;
 
 	if (strcmp(hook, "pre-start") == 0)
 		which = LXCHOOK_PRESTART;
@@ -3829,14 +4476,39 @@ int run_lxc_hooks(const char *name, char *hook, struct lxc_conf *conf,
 		which = LXCHOOK_CLONE;
 	else
 		return -1;
+	n = lxc_list_len(&conf->hooks[which]);
+	if (!n)
+		return 0;
+
+	runs = calloc(n, sizeof(*runs));
+	if (!runs)
+		return -1;
+
+	i = 0;
 	lxc_list_for_each(it, &conf->hooks[which]) {
-		int ret;
-		char *hookname = it->elem;
-		ret = run_script_argv(name, "lxc", hookname, hook, lxcpath, argv);
-		if (ret)
-			return ret;
+		runs[i].script = it->elem;
+		runs[i].cmd = script_argv_cmd(name, "lxc", it->elem, hook, argv);
+		if (!runs[i].cmd)
+			goto out;
+		i++;
 	}
-	return 0;
+
+	/* hooks of a same type are independent when asked to run in parallel */
+	if (conf->hooks_parallel) {
+		ret = run_scripts(runs, n, conf->hooks_timeout);
+	} else {
+		for (i = 0; i < n; i++) {
+			ret = run_scripts(&runs[i], 1, conf->hooks_timeout);
+			if (ret)
+				break;
+		}
+	}
+
+out:
+	for (i = 0; i < n; i++)
+		free(runs[i].cmd);
+	free(runs);
+	return ret;
 }
 
 static void lxc_remove_nic(struct lxc_list *it)
@@ -4104,6 +4776,7 @@ void lxc_conf_free(struct lxc_conf *conf)
 		return;
 	if (conf->console.path)
 		free(conf->console.path);
+	free(conf->console.log_path);
 	if (conf->rootfs.mount)
 		free(conf->rootfs.mount);
 	if (conf->rootfs.options)
@@ -32,6 +32,7 @@
 #include <stdbool.h>
 
 #include "list.h"
+#include "ringbuf.h"
 #include "start.h" /* for lxc_handler */
 
 #if HAVE_SCMP_FILTER_CTX
@@ -85,6 +86,7 @@ struct lxc_route6 {
 struct ifla_veth {
 	char *pair; /* pair name */
 	char veth1[IFNAMSIZ]; /* needed for deconf */
+	int hashname; /* derive the names from the container's */
 };
 
 struct ifla_vlan {
@@ -194,6 +196,15 @@ struct lxc_tty_state;
  * Defines the structure to store the console information
  * @peer   : the file descriptor put/get console traffic
  * @name   : the file name of the slave pty
+ * @buffer_size : size of the in-memory ring buffer of console output,
+ *                0 if disabled
+ * @ringbuf     : the most recent console output, see lxc.console.buffer_size
+ * @log_size    : rotate the console log once it would grow past this many
+ *                bytes, 0 for no limit
+ * @log_rotate  : number of rotated console logs to keep
+ * @log_compress: gzip the console log
+ * @log_written : bytes written to the current console log
+ * @log_gz      : the zlib stream writing to log_fd if log_compress is set
  */
 struct lxc_console {
 	int slave;
@@ -207,6 +218,13 @@ struct lxc_console {
 	char name[MAXPATHLEN];
 	struct termios *tios;
 	struct lxc_tty_state *tty_state;
+	uint64_t buffer_size;
+	struct lxc_ringbuf ringbuf;
+	uint64_t log_size;
+	unsigned int log_rotate;
+	int log_compress;
+	uint64_t log_written;
+	void *log_gz;
 };
 
 /*
@@ -298,6 +316,8 @@ struct lxc_conf {
 	char *ttydir;
 	int close_all_fds;
 	struct lxc_list hooks[NUM_LXC_HOOKS];
+	int hooks_parallel;  // if 1, the hooks of a same type run concurrently
+	unsigned int hooks_timeout;  // seconds a hook may run, 0 for no limit
 
 	char *lsm_aa_profile;
 	char *lsm_se_context;
@@ -306,6 +326,8 @@ struct lxc_conf {
 #if HAVE_SCMP_FILTER_CTX
 	scmp_filter_ctx *seccomp_ctx;
 #endif
+	void *seccomp_bpf;  // compiled policy (struct sock_filter[]) from the cache
+	unsigned short seccomp_bpf_len;  // number of instructions in seccomp_bpf
 	int maincmd_fd;
 	int autodev;  // if 1, mount and fill a /dev at start
 	int haltsignal; // signal used to halt container
@@ -326,6 +348,7 @@ struct lxc_conf {
 	int start_auto;
 	int start_delay;
 	int start_order;
+	int start_trace;
 	struct lxc_list groups;
 };
 
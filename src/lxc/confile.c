@@ -70,11 +70,14 @@ static int config_rootfs_options(const char *, const char *, struct lxc_conf *);
 static int config_pivotdir(const char *, const char *, struct lxc_conf *);
 static int config_utsname(const char *, const char *, struct lxc_conf *);
 static int config_hook(const char *, const char *, struct lxc_conf *lxc_conf);
+static int config_hook_parallel(const char *, const char *, struct lxc_conf *);
+static int config_hook_timeout(const char *, const char *, struct lxc_conf *);
 static int config_network_type(const char *, const char *, struct lxc_conf *);
 static int config_network_flags(const char *, const char *, struct lxc_conf *);
 static int config_network_link(const char *, const char *, struct lxc_conf *);
 static int config_network_name(const char *, const char *, struct lxc_conf *);
 static int config_network_veth_pair(const char *, const char *, struct lxc_conf *);
+static int config_network_veth_naming(const char *, const char *, struct lxc_conf *);
 static int config_network_macvlan_mode(const char *, const char *, struct lxc_conf *);
 static int config_network_hwaddr(const char *, const char *, struct lxc_conf *);
 static int config_network_vlan_id(const char *, const char *, struct lxc_conf *);
@@ -87,6 +90,11 @@ static int config_network_ipv6(const char *, const char *, struct lxc_conf *);
 static int config_network_ipv6_gateway(const char *, const char *, struct lxc_conf *);
 static int config_cap_drop(const char *, const char *, struct lxc_conf *);
 static int config_cap_keep(const char *, const char *, struct lxc_conf *);
+static int config_console_buffer_size(const char *, const char *, struct lxc_conf *);
+static int config_console_logfile(const char *, const char *, struct lxc_conf *);
+static int config_console_size(const char *, const char *, struct lxc_conf *);
+static int config_console_rotate(const char *, const char *, struct lxc_conf *);
+static int config_console_compress(const char *, const char *, struct lxc_conf *);
 static int config_console(const char *, const char *, struct lxc_conf *);
 static int config_seccomp(const char *, const char *, struct lxc_conf *);
 static int config_includefile(const char *, const char *, struct lxc_conf *);
@@ -123,12 +131,15 @@ static struct lxc_config_t config[] = {
 	{ "lxc.hook.start",           config_hook                 },
 	{ "lxc.hook.post-stop",       config_hook                 },
 	{ "lxc.hook.clone",           config_hook                 },
+	{ "lxc.hook.parallel",        config_hook_parallel        },
+	{ "lxc.hook.timeout",         config_hook_timeout         },
 	{ "lxc.network.type",         config_network_type         },
 	{ "lxc.network.flags",        config_network_flags        },
 	{ "lxc.network.link",         config_network_link         },
 	{ "lxc.network.name",         config_network_name         },
 	{ "lxc.network.macvlan.mode", config_network_macvlan_mode },
 	{ "lxc.network.veth.pair",    config_network_veth_pair    },
+	{ "lxc.network.veth.naming",  config_network_veth_naming  },
 	{ "lxc.network.script.up",    config_network_script_up    },
 	{ "lxc.network.script.down",  config_network_script_down  },
 	{ "lxc.network.hwaddr",       config_network_hwaddr       },
@@ -142,6 +153,11 @@ static struct lxc_config_t config[] = {
 	{ "lxc.network.",             config_network_nic          },
 	{ "lxc.cap.drop",             config_cap_drop             },
 	{ "lxc.cap.keep",             config_cap_keep             },
+	{ "lxc.console.buffer_size",  config_console_buffer_size  },
+	{ "lxc.console.logfile",      config_console_logfile      },
+	{ "lxc.console.size",         config_console_size         },
+	{ "lxc.console.rotate",       config_console_rotate       },
+	{ "lxc.console.compress",     config_console_compress     },
 	{ "lxc.console",              config_console              },
 	{ "lxc.seccomp",              config_seccomp              },
 	{ "lxc.include",              config_includefile          },
@@ -151,6 +167,7 @@ static struct lxc_config_t config[] = {
 	{ "lxc.start.auto",           config_start                },
 	{ "lxc.start.delay",          config_start                },
 	{ "lxc.start.order",          config_start                },
+	{ "lxc.start.trace",          config_start                },
 	{ "lxc.group",                config_group                },
 };
 
@@ -434,6 +451,7 @@ extern int lxc_list_nicconfigs(struct lxc_conf *c, const char *key,
 	switch(netdev->type) {
 	case LXC_NET_VETH:
 		strprint(retv, inlen, "veth.pair\n");
+		strprint(retv, inlen, "veth.naming\n");
 		break;
 	case LXC_NET_MACVLAN:
 		strprint(retv, inlen, "macvlan.mode\n");
@@ -594,6 +612,27 @@ static int config_network_veth_pair(const char *key, const char *value,
 	return network_ifname(&netdev->priv.veth_attr.pair, value);
 }
 
+static int config_network_veth_naming(const char *key, const char *value,
+				      struct lxc_conf *lxc_conf)
+{
+	struct lxc_netdev *netdev;
+
+	netdev = network_netdev(key, value, &lxc_conf->network);
+	if (!netdev)
+		return -1;
+
+	if (!strcmp(value, "random"))
+		netdev->priv.veth_attr.hashname = 0;
+	else if (!strcmp(value, "hash"))
+		netdev->priv.veth_attr.hashname = 1;
+	else {
+		ERROR("invalid veth naming '%s', expected random or hash", value);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int config_network_macvlan_mode(const char *key, const char *value,
 				       struct lxc_conf *lxc_conf)
 {
@@ -998,6 +1037,10 @@ static int config_start(const char *key, const char *value,
 		lxc_conf->start_order = atoi(value);
 		return 0;
 	}
+	else if (strcmp(key, "lxc.start.trace") == 0) {
+		lxc_conf->start_trace = atoi(value);
+		return 0;
+	}
 	SYSERROR("Unknown key: %s", key);
 	return -1;
 }
@@ -1548,6 +1591,104 @@ static int config_console(const char *key, const char *value,
 	return config_path_item(&lxc_conf->console.path, value);
 }
 
+static int config_uint64(const char *value, uint64_t *ret)
+{
+	unsigned long long v;
+	char *end;
+
+	errno = 0;
+	v = strtoull(value, &end, 10);
+	if (errno || end == value || *end != '\0' || *value == '-')
+		return -1;
+
+	*ret = v;
+	return 0;
+}
+
+static int config_console_buffer_size(const char *key, const char *value,
+				      struct lxc_conf *lxc_conf)
+{
+	uint64_t size;
+	long pgsz;
+
+	if (config_uint64(value, &size)) {
+		ERROR("invalid console buffer size '%s'", value);
+		return -1;
+	}
+
+	/* round up to a full page, the buffer is allocated in one go */
+	pgsz = sysconf(_SC_PAGESIZE);
+	if (pgsz > 0 && size % pgsz)
+		size += pgsz - size % pgsz;
+
+	lxc_conf->console.buffer_size = size;
+	return 0;
+}
+
+static int config_console_logfile(const char *key, const char *value,
+				  struct lxc_conf *lxc_conf)
+{
+	return config_path_item(&lxc_conf->console.log_path, value);
+}
+
+static int config_console_size(const char *key, const char *value,
+			       struct lxc_conf *lxc_conf)
+{
+	if (config_uint64(value, &lxc_conf->console.log_size)) {
+		ERROR("invalid console log size '%s'", value);
+		return -1;
+	}
+	return 0;
+}
+
+static int config_console_rotate(const char *key, const char *value,
+				 struct lxc_conf *lxc_conf)
+{
+	uint64_t rotate;
+
+	if (config_uint64(value, &rotate) || rotate > 1000) {
+		ERROR("invalid console log rotate count '%s'", value);
+		return -1;
+	}
+	lxc_conf->console.log_rotate = rotate;
+	return 0;
+}
+
+static int config_hook_parallel(const char *key, const char *value,
+				struct lxc_conf *lxc_conf)
+{
+	lxc_conf->hooks_parallel = value ? atoi(value) : 0;
+	return 0;
+}
+
+static int config_hook_timeout(const char *key, const char *value,
+			       struct lxc_conf *lxc_conf)
+{
+	uint64_t timeout;
+
+	if (config_uint64(value, &timeout) || timeout > UINT_MAX) {
+		ERROR("invalid hook timeout '%s'", value);
+		return -1;
+	}
+	lxc_conf->hooks_timeout = timeout;
+	return 0;
+}
+
+static int config_console_compress(const char *key, const char *value,
+				   struct lxc_conf *lxc_conf)
+{
+	int v = atoi(value);
+
+#if !HAVE_LIBZ
+	if (v) {
+		ERROR("lxc was built without zlib, cannot compress the console log");
+		return -1;
+	}
+#endif
+	lxc_conf->console.log_compress = v ? 1 : 0;
+	return 0;
+}
+
 static int config_includefile(const char *key, const char *value,
 			  struct lxc_conf *lxc_conf)
 {
@@ -1784,6 +1925,16 @@ static int lxc_get_conf_int(struct lxc_conf *c, char *retv, int inlen, int v)
 	return snprintf(retv, inlen, "%d", v);
 }
 
+static int lxc_get_conf_uint64(struct lxc_conf *c, char *retv, int inlen,
+			       uint64_t v)
+{
+	if (!retv)
+		inlen = 0;
+	else
+		memset(retv, 0, inlen);
+	return snprintf(retv, inlen, "%llu", (unsigned long long)v);
+}
+
 static int lxc_get_arch_entry(struct lxc_conf *c, char *retv, int inlen)
 {
 	int fulllen = 0;
@@ -1943,8 +2094,8 @@ static int lxc_get_mount_entries(struct lxc_conf *c, char *retv, int inlen)
 
 /*
  * lxc.network.0.XXX, where XXX can be: name, type, link, flags, type,
- * macvlan.mode, veth.pair, vlan, ipv4, ipv6, script.up, hwaddr, mtu,
- * ipv4_gateway, ipv6_gateway.  ipvX_gateway can return 'auto' instead
+ * macvlan.mode, veth.pair, veth.naming, vlan, ipv4, ipv6, script.up,
+ * hwaddr, mtu, ipv4_gateway, ipv6_gateway.  ipvX_gateway can return 'auto' instead
  * of an address.  ipv4 and ipv6 return lists (newline-separated).
  * things like veth.pair return '' if invalid (i.e. if called for vlan
  * type).
@@ -2009,6 +2160,12 @@ static int lxc_get_item_nic(struct lxc_conf *c, char *retv, int inlen,
 				  netdev->priv.veth_attr.pair :
 				  netdev->priv.veth_attr.veth1);
 		}
+	} else if (strcmp(p1, "veth.naming") == 0) {
+		if (netdev->type == LXC_NET_VETH) {
+			strprint(retv, inlen, "%s",
+				 netdev->priv.veth_attr.hashname ?
+				  "hash" : "random");
+		}
 	} else if (strcmp(p1, "vlan") == 0) {
 		if (netdev->type == LXC_NET_VLAN) {
 			strprint(retv, inlen, "%d", netdev->priv.vlan_attr.vid);
@@ -2098,6 +2255,16 @@ int lxc_get_config_item(struct lxc_conf *c, const char *key, char *retv,
 		return lxc_get_cgroup_entry(c, retv, inlen, key + 11);
 	else if (strcmp(key, "lxc.utsname") == 0)
 		v = c->utsname ? c->utsname->nodename : NULL;
+	else if (strcmp(key, "lxc.console.buffer_size") == 0)
+		return lxc_get_conf_uint64(c, retv, inlen, c->console.buffer_size);
+	else if (strcmp(key, "lxc.console.logfile") == 0)
+		v = c->console.log_path;
+	else if (strcmp(key, "lxc.console.size") == 0)
+		return lxc_get_conf_uint64(c, retv, inlen, c->console.log_size);
+	else if (strcmp(key, "lxc.console.rotate") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->console.log_rotate);
+	else if (strcmp(key, "lxc.console.compress") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->console.log_compress);
 	else if (strcmp(key, "lxc.console") == 0)
 		v = c->console.path;
 	else if (strcmp(key, "lxc.rootfs.mount") == 0)
@@ -2112,6 +2279,10 @@ int lxc_get_config_item(struct lxc_conf *c, const char *key, char *retv,
 		return lxc_get_item_cap_drop(c, retv, inlen);
 	else if (strcmp(key, "lxc.cap.keep") == 0)
 		return lxc_get_item_cap_keep(c, retv, inlen);
+	else if (strcmp(key, "lxc.hook.parallel") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->hooks_parallel);
+	else if (strcmp(key, "lxc.hook.timeout") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->hooks_timeout);
 	else if (strncmp(key, "lxc.hook", 8) == 0)
 		return lxc_get_item_hooks(c, retv, inlen, key);
 	else if (strcmp(key, "lxc.network") == 0)
@@ -2124,6 +2295,8 @@ int lxc_get_config_item(struct lxc_conf *c, const char *key, char *retv,
 		return lxc_get_conf_int(c, retv, inlen, c->start_delay);
 	else if (strcmp(key, "lxc.start.order") == 0)
 		return lxc_get_conf_int(c, retv, inlen, c->start_order);
+	else if (strcmp(key, "lxc.start.trace") == 0)
+		return lxc_get_conf_int(c, retv, inlen, c->start_trace);
 	else if (strcmp(key, "lxc.group") == 0)
 		return lxc_get_item_groups(c, retv, inlen);
 	else if (strcmp(key, "lxc.seccomp") == 0)
@@ -2260,6 +2433,8 @@ void write_config(FILE *fout, struct lxc_conf *c)
 			if (n->priv.veth_attr.pair)
 				fprintf(fout, "lxc.network.veth.pair = %s\n",
 					n->priv.veth_attr.pair);
+			if (n->priv.veth_attr.hashname)
+				fprintf(fout, "lxc.network.veth.naming = hash\n");
 		} else if (n->type == LXC_NET_VLAN) {
 			fprintf(fout, "lxc.network.vlan.id = %d\n", n->priv.vlan_attr.vid);
 		}
@@ -2329,8 +2504,24 @@ void write_config(FILE *fout, struct lxc_conf *c)
 			fprintf(fout, "lxc.hook.%s = %s\n",
 				lxchook_names[i], (char *)it->elem);
 	}
+	if (c->hooks_parallel)
+		fprintf(fout, "lxc.hook.parallel = %d\n", c->hooks_parallel);
+	if (c->hooks_timeout)
+		fprintf(fout, "lxc.hook.timeout = %u\n", c->hooks_timeout);
 	if (c->console.path)
 		fprintf(fout, "lxc.console = %s\n", c->console.path);
+	if (c->console.buffer_size)
+		fprintf(fout, "lxc.console.buffer_size = %llu\n",
+			(unsigned long long)c->console.buffer_size);
+	if (c->console.log_path)
+		fprintf(fout, "lxc.console.logfile = %s\n", c->console.log_path);
+	if (c->console.log_size)
+		fprintf(fout, "lxc.console.size = %llu\n",
+			(unsigned long long)c->console.log_size);
+	if (c->console.log_rotate)
+		fprintf(fout, "lxc.console.rotate = %u\n", c->console.log_rotate);
+	if (c->console.log_compress)
+		fprintf(fout, "lxc.console.compress = 1\n");
 	if (c->rootfs.path)
 		fprintf(fout, "lxc.rootfs = %s\n", c->rootfs.path);
 	if (c->rootfs.mount && strcmp(c->rootfs.mount, LXCROOTFSMOUNT) != 0)
@@ -2345,6 +2536,8 @@ void write_config(FILE *fout, struct lxc_conf *c)
 		fprintf(fout, "lxc.start.delay = %d\n", c->start_delay);
 	if (c->start_order)
 		fprintf(fout, "lxc.start.order = %d\n", c->start_order);
+	if (c->start_trace)
+		fprintf(fout, "lxc.start.trace = %d\n", c->start_trace);
 	lxc_list_for_each(it, &c->groups)
 		fprintf(fout, "lxc.group = %s\n", (char *)it->elem);
 }
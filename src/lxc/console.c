@@ -25,10 +25,12 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <termios.h>
 
 #include <lxc/lxccontainer.h>
@@ -43,6 +45,7 @@
 #include "af_unix.h"
 #include "lxclock.h"
 #include "utils.h"
+#include "ptypool.h"
 
 #if HAVE_PTY_H
 #include <pty.h>
@@ -50,8 +53,17 @@
 #include <../include/openpty.h>
 #endif
 
+#if HAVE_LIBZ
+#include <zlib.h>
+#endif
+
 lxc_log_define(lxc_console, lxc);
 
+/* size of the buffer used to proxy data between the pty and its peers, big
+ * enough to drain a busy pty in a single read most of the time
+ */
+#define LXC_CONSOLE_BUFFER_SIZE 16384
+
 static struct lxc_list lxc_ttys;
 
 typedef void (*sighandler_t)(int);
@@ -210,14 +222,141 @@ static void lxc_console_sigwinch_fini(struct lxc_tty_state *ts)
 	free(ts);
 }
 
+/*
+ * lxc_console_log_open: open the console log file
+ *
+ * @console : the console whose log_path is opened
+ * @trunc   : start over with an empty file
+ *
+ * Returns 0 on success, -1 on failure
+ */
+static int lxc_console_log_open(struct lxc_console *console, bool trunc)
+{
+	struct stat st;
+	int flags = O_CLOEXEC | O_RDWR | O_CREAT | O_APPEND;
+
+	if (trunc)
+		flags |= O_TRUNC;
+
+	console->log_fd = lxc_unpriv(open(console->log_path, flags, 0600));
+	if (console->log_fd < 0) {
+		SYSERROR("failed to open '%s'", console->log_path);
+		return -1;
+	}
+
+	console->log_written = 0;
+	if (!fstat(console->log_fd, &st))
+		console->log_written = st.st_size;
+
+#if HAVE_LIBZ
+	if (console->log_compress) {
+		/* appending to an existing log adds a new gzip member, which
+		 * zcat and friends handle transparently
+		 */
+		console->log_gz = gzdopen(console->log_fd, "ab1");
+		if (!console->log_gz) {
+			ERROR("failed to set up compression for '%s'",
+			      console->log_path);
+			close(console->log_fd);
+			console->log_fd = -1;
+			return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+static void lxc_console_log_close(struct lxc_console *console)
+{
+	if (console->log_fd < 0)
+		return;
+
+#if HAVE_LIBZ
+	/* the gzip stream owns log_fd */
+	if (console->log_gz) {
+		gzclose(console->log_gz);
+		console->log_gz = NULL;
+		console->log_fd = -1;
+		return;
+	}
+#endif
+
+	close(console->log_fd);
+	console->log_fd = -1;
+}
+
+/*
+ * lxc_console_log_rotate: shift log_path to log_path.1, log_path.1 to
+ * log_path.2 and so on, dropping the oldest, and start a new log. Without
+ * lxc.console.rotate the log is simply truncated.
+ *
+ * This is only a couple of renames so it is done right from the mainloop.
+ */
+static int lxc_console_log_rotate(struct lxc_console *console)
+{
+	size_t len = strlen(console->log_path) + 12;
+	char *from = alloca(len), *to = alloca(len);
+	unsigned int i;
+
+	lxc_console_log_close(console);
+
+	if (console->log_rotate) {
+		for (i = console->log_rotate; i > 1; i--) {
+			snprintf(from, len, "%s.%u", console->log_path, i - 1);
+			snprintf(to, len, "%s.%u", console->log_path, i);
+			if (lxc_unpriv(rename(from, to)) && errno != ENOENT)
+				WARN("failed to rotate '%s': %s", from,
+				     strerror(errno));
+		}
+
+		snprintf(to, len, "%s.1", console->log_path);
+		if (lxc_unpriv(rename(console->log_path, to)))
+			WARN("failed to rotate '%s': %s", console->log_path,
+			     strerror(errno));
+	}
+
+	INFO("rotated console log '%s'", console->log_path);
+	return lxc_console_log_open(console, true);
+}
+
+static int lxc_console_log_write(struct lxc_console *console, const char *buf,
+				 int len)
+{
+	int ret;
+
+	if (console->log_size && console->log_written &&
+	    console->log_written + len > console->log_size) {
+		if (lxc_console_log_rotate(console) < 0)
+			return -1;
+	}
+
+#if HAVE_LIBZ
+	if (console->log_gz) {
+		ret = gzwrite(console->log_gz, buf, len);
+		/* keep what was written so far readable with zcat */
+		if (ret == len && gzflush(console->log_gz, Z_SYNC_FLUSH) != Z_OK)
+			ret = -1;
+		if (ret > 0)
+			console->log_written = lseek(console->log_fd, 0, SEEK_CUR);
+		return ret;
+	}
+#endif
+
+	ret = lxc_write_nointr(console->log_fd, buf, len);
+	if (ret > 0)
+		console->log_written += ret;
+	return ret;
+}
+
 static int lxc_console_cb_con(int fd, uint32_t events, void *data,
 			      struct lxc_epoll_descr *descr)
 {
 	struct lxc_console *console = (struct lxc_console *)data;
-	char buf[1024];
+	char buf[LXC_CONSOLE_BUFFER_SIZE];
 	int r,w;
 
-	w = r = read(fd, buf, sizeof(buf));
+	w = r = lxc_read_nointr(fd, buf, sizeof(buf));
 	if (r < 0) {
 		SYSERROR("failed to read");
 		return 1;
@@ -231,14 +370,16 @@ static int lxc_console_cb_con(int fd, uint32_t events, void *data,
 	}
 
 	if (fd == console->peer)
-		w = write(console->master, buf, r);
+		w = lxc_write_nointr(console->master, buf, r);
 
 	if (fd == console->master) {
+		lxc_ringbuf_write(&console->ringbuf, buf, r);
+
 		if (console->log_fd >= 0)
-			w = write(console->log_fd, buf, r);
+			w = lxc_console_log_write(console, buf, r);
 
 		if (console->peer >= 0)
-			w = write(console->peer, buf, r);
+			w = lxc_write_nointr(console->peer, buf, r);
 	}
 
 	if (w != r)
@@ -373,10 +514,8 @@ static int lxc_console_peer_proxy_alloc(struct lxc_console *console, int sockfd)
 	/* this is the proxy pty that will be given to the client, and that
 	 * the real pty master will send to / recv from
 	 */
-	process_lock();
-	ret = openpty(&console->peerpty.master, &console->peerpty.slave,
-		    console->peerpty.name, NULL, NULL);
-	process_unlock();
+	ret = lxc_pty_get(&console->peerpty.master, &console->peerpty.slave,
+			  console->peerpty.name, sizeof(console->peerpty.name));
 	if (ret) {
 		SYSERROR("failed to create proxy pty");
 		return -1;
@@ -543,12 +682,12 @@ void lxc_console_delete(struct lxc_console *console)
 		WARN("failed to set old terminal settings");
 	free(console->tios);
 	console->tios = NULL;
+	lxc_ringbuf_release(&console->ringbuf);
 
 	close(console->peer);
 	close(console->master);
 	close(console->slave);
-	if (console->log_fd >= 0)
-		close(console->log_fd);
+	lxc_console_log_close(console);
 
 	console->peer = -1;
 	console->master = -1;
@@ -572,38 +711,33 @@ int lxc_console_create(struct lxc_conf *conf)
 	if (console->path && !strcmp(console->path, "none"))
 		return 0;
 
-	process_lock();
-	ret = openpty(&console->master, &console->slave,
-		    console->name, NULL, NULL);
-	process_unlock();
+	ret = lxc_pty_get(&console->master, &console->slave, console->name,
+			  sizeof(console->name));
 	if (ret) {
 		SYSERROR("failed to allocate a pty");
 		return -1;
 	}
 
-	if (fcntl(console->master, F_SETFD, FD_CLOEXEC)) {
-		SYSERROR("failed to set console master to close-on-exec");
-		goto err;
-	}
-
-	if (fcntl(console->slave, F_SETFD, FD_CLOEXEC)) {
-		SYSERROR("failed to set console slave to close-on-exec");
-		goto err;
-	}
-
 	lxc_console_peer_default(console);
 
 	if (console->log_path) {
-		console->log_fd = lxc_unpriv(open(console->log_path,
-						  O_CLOEXEC | O_RDWR |
-						  O_CREAT | O_APPEND, 0600));
-		if (console->log_fd < 0) {
-			SYSERROR("failed to open '%s'", console->log_path);
+		if (lxc_console_log_open(console, false) < 0)
 			goto err;
-		}
 		DEBUG("using '%s' as console log", console->log_path);
 	}
 
+	if (console->buffer_size) {
+		ret = lxc_ringbuf_create(&console->ringbuf, console->buffer_size);
+		if (ret < 0) {
+			ERROR("failed to allocate %llu bytes console buffer: %s",
+			      (unsigned long long)console->buffer_size,
+			      strerror(-ret));
+			goto err;
+		}
+		DEBUG("using %llu bytes console buffer",
+		      (unsigned long long)console->buffer_size);
+	}
+
 	return 0;
 
 err:
@@ -617,47 +751,61 @@ static int lxc_console_cb_tty_stdin(int fd, uint32_t events, void *cbdata,
 				    struct lxc_epoll_descr *descr)
 {
 	struct lxc_tty_state *ts = cbdata;
-	char c;
+	char buf[LXC_CONSOLE_BUFFER_SIZE];
+	int r, i, len, quit = 0;
 
 	assert(fd == ts->stdinfd);
-	if (read(ts->stdinfd, &c, 1) < 0) {
+	r = lxc_read_nointr(ts->stdinfd, buf, sizeof(buf));
+	if (r < 0) {
 		SYSERROR("failed to read");
 		return 1;
 	}
 
-	/* we want to exit the console with Ctrl+a q */
-	if (c == ts->escape && !ts->saw_escape) {
-		ts->saw_escape = 1;
-		return 0;
-	}
-
-	if (c == 'q' && ts->saw_escape)
+	if (!r)
 		return 1;
 
-	ts->saw_escape = 0;
-	if (write(ts->masterfd, &c, 1) < 0) {
+	/* strip the escape sequences in place so that whatever was typed
+	 * or pasted is forwarded with a single write
+	 */
+	for (i = 0, len = 0; i < r; i++) {
+		/* we want to exit the console with Ctrl+a q */
+		if (buf[i] == ts->escape && !ts->saw_escape) {
+			ts->saw_escape = 1;
+			continue;
+		}
+
+		if (buf[i] == 'q' && ts->saw_escape) {
+			quit = 1;
+			break;
+		}
+
+		ts->saw_escape = 0;
+		buf[len++] = buf[i];
+	}
+
+	if (len && lxc_write_nointr(ts->masterfd, buf, len) != len) {
 		SYSERROR("failed to write");
 		return 1;
 	}
 
-	return 0;
+	return quit;
 }
 
 static int lxc_console_cb_tty_master(int fd, uint32_t events, void *cbdata,
 				     struct lxc_epoll_descr *descr)
 {
 	struct lxc_tty_state *ts = cbdata;
-	char buf[1024];
+	char buf[LXC_CONSOLE_BUFFER_SIZE];
 	int r,w;
 
 	assert(fd == ts->masterfd);
-	r = read(fd, buf, sizeof(buf));
+	r = lxc_read_nointr(fd, buf, sizeof(buf));
 	if (r < 0) {
 		SYSERROR("failed to read");
 		return 1;
 	}
 
-	w = write(ts->stdoutfd, buf, r);
+	w = lxc_write_nointr(ts->stdoutfd, buf, r);
 	if (w < 0 || w != r) {
 		SYSERROR("failed to write");
 		return 1;
@@ -0,0 +1,701 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "deltacopy.h"
+#include "log.h"
+#include "utils.h"
+
+lxc_log_define(lxc_deltacopy, lxc);
+
+#define COPY_MAX_THREADS 32
+
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+/* overlayfs keeps its own xattrs under these, user.* for unprivileged mounts */
+#define OVL_XATTR_TRUSTED	"trusted.overlay."
+#define OVL_XATTR_USER		"user.overlay."
+
+/*
+ * A directory to copy. Its times are set once all of its subdirectories
+ * are done, as copying into it changes them.
+ * @path    : relative to the root of the tree, "" for the root itself
+ * @pending : itself and its subdirectories not done yet
+ */
+struct copy_dir {
+	char *path;
+	struct timespec times[2];
+	int pending;
+	struct copy_dir *parent;
+	struct copy_dir *next;
+};
+
+struct copy_ctx {
+	const char *src;
+	const char *dest;
+	int srcfd;
+	int destfd;
+	/* apply @src as an overlayfs upper layer onto @dest */
+	bool merge;
+
+	/* protected by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct copy_dir *queue;
+	int busy;
+	bool error;
+	uint64_t ncopied;
+	uint64_t nreflinked;
+};
+
+/* copy @len bytes at @off, with copy_file_range() while the kernel can */
+static int copy_range(int srcfd, int destfd, off_t off, off_t len,
+		      bool *use_cfr)
+{
+	char buf[65536];
+	ssize_t n, w, done;
+	loff_t in, out;
+
+#ifdef __NR_copy_file_range
+	while (*use_cfr && len > 0) {
+		in = out = off;
+		n = syscall(__NR_copy_file_range, srcfd, &in, destfd, &out,
+			    len > (1L << 30) ? (1L << 30) : len, 0);
+		if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+			      errno == EINVAL || errno == EOPNOTSUPP)) {
+			*use_cfr = false;
+			break;
+		}
+		if (n < 0)
+			return -1;
+		if (n == 0)
+			return 0;
+		off += n;
+		len -= n;
+	}
+#endif
+
+	while (len > 0) {
+		n = pread(srcfd, buf, len > sizeof(buf) ? sizeof(buf) : len, off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return 0;
+		for (done = 0; done < n; done += w) {
+			w = pwrite(destfd, buf + done, n - done, off + done);
+			if (w < 0) {
+				if (errno == EINTR) {
+					w = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int lxc_reflink_file(int srcfd, int destfd)
+{
+	bool use_cfr = true;
+	off_t data, hole, size;
+	struct stat st;
+
+	if (ioctl(destfd, FICLONE, srcfd) == 0)
+		return 1;
+
+	if (fstat(srcfd, &st) < 0)
+		return -1;
+	size = st.st_size;
+	if (ftruncate(destfd, size) < 0)
+		return -1;
+
+	/* only the data is copied, the holes stay holes */
+	for (data = 0; data < size; data = hole) {
+		data = lseek(srcfd, data, SEEK_DATA);
+		if (data < 0) {
+			if (errno == ENXIO)
+				break;
+			if (errno != EINVAL)
+				return -1;
+			/* no SEEK_DATA here, copy it all */
+			return copy_range(srcfd, destfd, 0, size, &use_cfr);
+		}
+		hole = lseek(srcfd, data, SEEK_HOLE);
+		if (hole < 0)
+			return -1;
+		if (copy_range(srcfd, destfd, data, hole - data, &use_cfr) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static bool is_whiteout(struct stat *st)
+{
+	return S_ISCHR(st->st_mode) && st->st_rdev == makedev(0, 0);
+}
+
+static bool is_ovl_xattr(const char *name)
+{
+	return strncmp(name, OVL_XATTR_TRUSTED, strlen(OVL_XATTR_TRUSTED)) == 0 ||
+	       strncmp(name, OVL_XATTR_USER, strlen(OVL_XATTR_USER)) == 0;
+}
+
+/*
+ * A renamed directory (redirect) or a file whose data was not copied up
+ * (metacopy) is found in the lower layer under another name, or only there.
+ * Merging them as they are would lose data.
+ */
+static bool is_ovl_indirect(const char *name)
+{
+	const char *attr;
+
+	if (strncmp(name, OVL_XATTR_TRUSTED, strlen(OVL_XATTR_TRUSTED)) == 0)
+		attr = name + strlen(OVL_XATTR_TRUSTED);
+	else if (strncmp(name, OVL_XATTR_USER, strlen(OVL_XATTR_USER)) == 0)
+		attr = name + strlen(OVL_XATTR_USER);
+	else
+		return false;
+	return strcmp(attr, "redirect") == 0 || strcmp(attr, "metacopy") == 0;
+}
+
+static bool is_opaque(struct copy_ctx *ctx, const char *path)
+{
+	char v, srcpath[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(srcpath, sizeof(srcpath), "%s/%s", ctx->src, path);
+	if (ret < 0 || ret >= sizeof(srcpath))
+		return false;
+
+	if (lgetxattr(srcpath, OVL_XATTR_TRUSTED "opaque", &v, 1) == 1 && v == 'y')
+		return true;
+	return lgetxattr(srcpath, OVL_XATTR_USER "opaque", &v, 1) == 1 && v == 'y';
+}
+
+/* remove @name in @dfd, and everything in it if it is a directory */
+static int remove_at(int dfd, const char *name)
+{
+	struct dirent *de;
+	DIR *d;
+	int fd;
+
+	if (unlinkat(dfd, name, 0) == 0 || errno == ENOENT)
+		return 0;
+	if (errno != EISDIR)
+		return -1;
+
+	fd = openat(dfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	d = fdopendir(fd);
+	if (!d) {
+		close(fd);
+		return -1;
+	}
+	while ((errno = 0, de = readdir(d))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (remove_at(fd, de->d_name) < 0) {
+			closedir(d);
+			return -1;
+		}
+	}
+	closedir(d);
+	return unlinkat(dfd, name, AT_REMOVEDIR);
+}
+
+static int copy_xattrs(struct copy_ctx *ctx, const char *src,
+		       const char *dest)
+{
+	char *names = NULL, *name, *value = NULL;
+	ssize_t len, vlen;
+	int ret = -1;
+
+	len = llistxattr(src, NULL, 0);
+	if (len <= 0)
+		return len < 0 && errno != ENOTSUP ? -1 : 0;
+	names = malloc(len);
+	if (!names)
+		return -1;
+	len = llistxattr(src, names, len);
+	if (len < 0)
+		goto out;
+
+	for (name = names; name < names + len; name += strlen(name) + 1) {
+		if (ctx->merge && is_ovl_indirect(name)) {
+			ERROR("%s has %s, which can't be flattened", src, name);
+			errno = EOPNOTSUPP;
+			goto out;
+		}
+		if (ctx->merge && is_ovl_xattr(name))
+			continue;
+
+		vlen = lgetxattr(src, name, NULL, 0);
+		if (vlen < 0)
+			goto out;
+		free(value);
+		value = malloc(vlen + 1);
+		if (!value)
+			goto out;
+		vlen = lgetxattr(src, name, value, vlen);
+		if (vlen < 0)
+			goto out;
+		if (lsetxattr(dest, name, value, vlen, 0) < 0) {
+			/* the destination can't hold it, or we may not set it */
+			if (errno != ENOTSUP && errno != EPERM)
+				goto out;
+			WARN("failed to copy xattr %s to %s", name, dest);
+		}
+	}
+	ret = 0;
+
+out:
+	if (ret < 0)
+		SYSERROR("failed to copy the xattrs of %s", src);
+	free(value);
+	free(names);
+	return ret;
+}
+
+/*
+ * copy_inode: create @name in @destdfd as a copy of the one in @srcdfd,
+ * or, for a directory, just give the existing one its owner, mode and xattrs
+ */
+static int copy_inode(struct copy_ctx *ctx, int srcdfd, int destdfd,
+		      const char *name, struct stat *st, const char *path)
+{
+	char srcpath[MAXPATHLEN], destpath[MAXPATHLEN], target[MAXPATHLEN];
+	struct timespec times[2] = { st->st_atim, st->st_mtim };
+	int srcfd = -1, destfd = -1, ret;
+	ssize_t len;
+
+	ret = snprintf(srcpath, sizeof(srcpath), "%s/%s", ctx->src, path);
+	if (ret < 0 || ret >= sizeof(srcpath))
+		return -1;
+	ret = snprintf(destpath, sizeof(destpath), "%s/%s", ctx->dest, path);
+	if (ret < 0 || ret >= sizeof(destpath))
+		return -1;
+
+	switch (st->st_mode & S_IFMT) {
+	case S_IFDIR:
+		break;
+	case S_IFREG:
+		srcfd = openat(srcdfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (srcfd < 0) {
+			SYSERROR("failed to open %s", srcpath);
+			return -1;
+		}
+		destfd = openat(destdfd, name, O_WRONLY | O_CREAT | O_EXCL |
+				O_NOFOLLOW | O_CLOEXEC, 0600);
+		if (destfd < 0) {
+			SYSERROR("failed to create %s", destpath);
+			goto err;
+		}
+		ret = lxc_reflink_file(srcfd, destfd);
+		if (ret < 0) {
+			SYSERROR("failed to copy %s to %s", srcpath, destpath);
+			goto err;
+		}
+		if (ret)
+			__sync_fetch_and_add(&ctx->nreflinked, 1);
+		break;
+	case S_IFLNK:
+		len = readlinkat(srcdfd, name, target, sizeof(target) - 1);
+		if (len < 0) {
+			SYSERROR("failed to read %s", srcpath);
+			return -1;
+		}
+		target[len] = '\0';
+		if (symlinkat(target, destdfd, name) < 0) {
+			SYSERROR("failed to create %s", destpath);
+			return -1;
+		}
+		break;
+	default:
+		if (mknodat(destdfd, name, st->st_mode, st->st_rdev) < 0) {
+			SYSERROR("failed to create %s", destpath);
+			return -1;
+		}
+		break;
+	}
+
+	/* the owner first, changing it drops setuid bits and capabilities */
+	if (fchownat(destdfd, name, st->st_uid, st->st_gid,
+		     AT_SYMLINK_NOFOLLOW) < 0) {
+		SYSERROR("failed to chown %s", destpath);
+		goto err;
+	}
+	if (!S_ISLNK(st->st_mode) &&
+	    fchmodat(destdfd, name, st->st_mode & 07777, 0) < 0) {
+		SYSERROR("failed to chmod %s", destpath);
+		goto err;
+	}
+	if (copy_xattrs(ctx, srcpath, destpath) < 0)
+		goto err;
+	if (!S_ISDIR(st->st_mode) &&
+	    utimensat(destdfd, name, times, AT_SYMLINK_NOFOLLOW) < 0) {
+		SYSERROR("failed to set the times of %s", destpath);
+		goto err;
+	}
+
+	if (srcfd >= 0)
+		close(srcfd);
+	if (destfd >= 0)
+		close(destfd);
+	__sync_fetch_and_add(&ctx->ncopied, 1);
+	return 0;
+
+err:
+	if (srcfd >= 0)
+		close(srcfd);
+	if (destfd >= 0)
+		close(destfd);
+	return -1;
+}
+
+static struct copy_dir *copy_dir_new(struct copy_dir *parent,
+				     const char *name, struct stat *st)
+{
+	struct copy_dir *dir;
+	size_t len;
+
+	dir = malloc(sizeof(*dir));
+	if (!dir)
+		return NULL;
+
+	if (parent) {
+		len = strlen(parent->path) + strlen(name) + 2;
+		dir->path = malloc(len);
+		if (dir->path)
+			snprintf(dir->path, len, "%s%s%s", parent->path,
+				 *parent->path ? "/" : "", name);
+	} else {
+		dir->path = strdup("");
+	}
+	if (!dir->path) {
+		free(dir);
+		return NULL;
+	}
+
+	dir->times[0] = st->st_atim;
+	dir->times[1] = st->st_mtim;
+	dir->pending = 1;
+	dir->parent = parent;
+	dir->next = NULL;
+	return dir;
+}
+
+/* one of @dir's subtree is done, or @dir itself. Called with ctx->lock held */
+static void copy_dir_put(struct copy_ctx *ctx, struct copy_dir *dir)
+{
+	struct copy_dir *parent;
+
+	while (dir && --dir->pending == 0) {
+		if (!ctx->error &&
+		    utimensat(ctx->destfd, *dir->path ? dir->path : ".",
+			      dir->times, AT_SYMLINK_NOFOLLOW) < 0)
+			WARN("failed to set the times of %s/%s: %s", ctx->dest,
+			     dir->path, strerror(errno));
+		parent = dir->parent;
+		free(dir->path);
+		free(dir);
+		dir = parent;
+	}
+}
+
+/*
+ * copy_dir: copy the entries of a directory, except for the contents of the
+ * subdirectories which are returned in @children to be copied later
+ */
+static int copy_dir(struct copy_ctx *ctx, struct copy_dir *dir,
+		    struct copy_dir **children)
+{
+	const char *rel = *dir->path ? dir->path : ".";
+	char path[MAXPATHLEN];
+	struct stat st, dst;
+	struct dirent *de;
+	bool exists;
+	int srcfd, destfd, ret;
+	DIR *d;
+
+	srcfd = openat(ctx->srcfd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+		       O_CLOEXEC);
+	if (srcfd < 0) {
+		SYSERROR("failed to open %s/%s", ctx->src, dir->path);
+		return -1;
+	}
+	destfd = openat(ctx->destfd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			O_CLOEXEC);
+	if (destfd < 0) {
+		SYSERROR("failed to open %s/%s", ctx->dest, dir->path);
+		close(srcfd);
+		return -1;
+	}
+	d = fdopendir(srcfd);
+	if (!d) {
+		SYSERROR("failed to read %s/%s", ctx->src, dir->path);
+		close(srcfd);
+		close(destfd);
+		return -1;
+	}
+
+	while ((errno = 0, de = readdir(d))) {
+		struct copy_dir *child;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		ret = snprintf(path, sizeof(path), "%s%s%s", dir->path,
+			       *dir->path ? "/" : "", de->d_name);
+		if (ret < 0 || ret >= sizeof(path)) {
+			ERROR("path too long in %s/%s", ctx->src, dir->path);
+			goto err;
+		}
+
+		if (fstatat(srcfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			SYSERROR("failed to stat %s/%s", ctx->src, path);
+			goto err;
+		}
+
+		exists = false;
+		if (ctx->merge) {
+			exists = fstatat(destfd, de->d_name, &dst,
+					 AT_SYMLINK_NOFOLLOW) == 0;
+			/*
+			 * whiteouts, non-directories and opaque directories
+			 * hide whatever the lower layer has under that name
+			 */
+			if (exists && (!S_ISDIR(st.st_mode) ||
+				       !S_ISDIR(dst.st_mode) ||
+				       is_opaque(ctx, path))) {
+				if (remove_at(destfd, de->d_name) < 0) {
+					SYSERROR("failed to remove %s/%s",
+						 ctx->dest, path);
+					goto err;
+				}
+				exists = false;
+			}
+			if (is_whiteout(&st))
+				continue;
+		}
+
+		if (!S_ISDIR(st.st_mode)) {
+			if (copy_inode(ctx, srcfd, destfd, de->d_name, &st,
+				       path) < 0)
+				goto err;
+			continue;
+		}
+
+		if (!exists && mkdirat(destfd, de->d_name, 0700) < 0) {
+			SYSERROR("failed to create %s/%s", ctx->dest, path);
+			goto err;
+		}
+		if (copy_inode(ctx, srcfd, destfd, de->d_name, &st, path) < 0)
+			goto err;
+
+		child = copy_dir_new(dir, de->d_name, &st);
+		if (!child)
+			goto err;
+		child->next = *children;
+		*children = child;
+	}
+	if (errno) {
+		SYSERROR("failed to read %s/%s", ctx->src, dir->path);
+		goto err;
+	}
+
+	closedir(d);
+	close(destfd);
+	return 0;
+
+err:
+	closedir(d);
+	close(destfd);
+	return -1;
+}
+
+static void *copy_worker(void *data)
+{
+	struct copy_ctx *ctx = data;
+	struct copy_dir *dir, *children, *next;
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		while (!ctx->queue && ctx->busy && !ctx->error)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		if (!ctx->queue || ctx->error)
+			break;
+
+		dir = ctx->queue;
+		ctx->queue = dir->next;
+		ctx->busy++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		children = NULL;
+		ret = copy_dir(ctx, dir, &children);
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->busy--;
+		if (ret < 0)
+			ctx->error = true;
+		for (; children; children = next) {
+			next = children->next;
+			if (ctx->error) {
+				free(children->path);
+				free(children);
+				continue;
+			}
+			dir->pending++;
+			children->next = ctx->queue;
+			ctx->queue = children;
+		}
+		copy_dir_put(ctx, dir);
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+static int copy_tree(const char *src, const char *dest, bool merge,
+		     int threads)
+{
+	struct copy_ctx ctx;
+	struct copy_dir *root, *dir;
+	struct timespec start, end;
+	pthread_t *tids = NULL;
+	struct stat st;
+	int i, started = 0, ret = -1;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.src = src;
+	ctx.dest = dest;
+	ctx.merge = merge;
+	ctx.destfd = -1;
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+
+	ctx.srcfd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx.srcfd < 0 || fstat(ctx.srcfd, &st) < 0) {
+		SYSERROR("failed to open %s", src);
+		goto out;
+	}
+	if (mkdir(dest, 0700) < 0 && errno != EEXIST) {
+		SYSERROR("failed to create %s", dest);
+		goto out;
+	}
+	ctx.destfd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx.destfd < 0) {
+		SYSERROR("failed to open %s", dest);
+		goto out;
+	}
+	if (copy_inode(&ctx, ctx.srcfd, ctx.destfd, ".", &st, "") < 0)
+		goto out;
+
+	root = copy_dir_new(NULL, NULL, &st);
+	if (!root)
+		goto out;
+	ctx.queue = root;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > COPY_MAX_THREADS)
+		threads = COPY_MAX_THREADS;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* the calling thread is one of the workers */
+	tids = malloc((threads - 1) * sizeof(*tids) + 1);
+	for (i = 0; tids && i < threads - 1; i++) {
+		if (pthread_create(&tids[i], NULL, copy_worker, &ctx))
+			break;
+		started++;
+	}
+	copy_worker(&ctx);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	/* whatever is left was given up on after an error */
+	while ((dir = ctx.queue)) {
+		ctx.queue = dir->next;
+		copy_dir_put(&ctx, dir);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	INFO("%s %s to %s: %" PRIu64 " inodes, %" PRIu64 " files reflinked, "
+	     "%d workers, %ld ms", merge ? "merged" : "copied", src, dest,
+	     ctx.ncopied, ctx.nreflinked, started + 1,
+	     (end.tv_sec - start.tv_sec) * 1000 +
+	     (end.tv_nsec - start.tv_nsec) / 1000000);
+
+	if (!ctx.error)
+		ret = 0;
+
+out:
+	free(tids);
+	if (ctx.destfd >= 0)
+		close(ctx.destfd);
+	if (ctx.srcfd >= 0)
+		close(ctx.srcfd);
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+	return ret;
+}
+
+int lxc_copy_delta(const char *src, const char *dest, int threads)
+{
+	return copy_tree(src, dest, false, threads);
+}
+
+int lxc_flatten_overlay(const char *lower, const char *upper,
+			const char *dest, int threads)
+{
+	if (copy_tree(lower, dest, false, threads) < 0)
+		return -1;
+	return copy_tree(upper, dest, true, threads);
+}
@@ -0,0 +1,73 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_DELTACOPY_H
+#define __LXC_DELTACOPY_H
+
+/*
+ * lxc_copy_delta: copy the upper layer of an overlayfs or aufs snapshot
+ *
+ * @src     : the layer to copy
+ * @dest    : where to copy it to, created if it does not exist
+ * @threads : number of workers, 0 for one per online cpu
+ *
+ * Like 'rsync -a', owners, modes, times, xattrs and device nodes are
+ * copied, so overlayfs whiteouts (0:0 character devices) and opaque
+ * directories (the trusted.overlay.opaque xattr) are kept as they are.
+ * Regular files are reflinked where the filesystem supports it. The
+ * subtrees are copied in parallel.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+extern int lxc_copy_delta(const char *src, const char *dest, int threads);
+
+/*
+ * lxc_flatten_overlay: merge an overlayfs upper layer into its lower one
+ *
+ * @lower   : the lower layer
+ * @upper   : the upper layer on top of it
+ * @dest    : where to put the result, created if it does not exist
+ * @threads : number of workers, 0 for one per online cpu
+ *
+ * @dest ends up with what a mount of @upper over @lower shows: whiteouts
+ * remove what they hide, opaque directories replace the lower ones and
+ * neither is left in @dest.  Renamed directories and metadata-only copies
+ * (the redirect and metacopy xattrs) are not supported: they fail the
+ * merge, which leaves @dest half done.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+extern int lxc_flatten_overlay(const char *lower, const char *upper,
+			       const char *dest, int threads);
+
+/*
+ * lxc_reflink_file: copy the data of a regular file
+ *
+ * @srcfd  : the file to copy from
+ * @destfd : an empty file to copy into
+ *
+ * Shares the extents of @srcfd with FICLONE where the filesystem can,
+ * falls back to copy_file_range() and then to pread() and pwrite(). Only
+ * the data found with SEEK_DATA is copied, so holes stay holes.
+ *
+ * Returns 1 if the extents are shared, 0 if the data was copied, -1 on
+ * failure with errno set.
+ */
+extern int lxc_reflink_file(int srcfd, int destfd);
+
+#endif /* __LXC_DELTACOPY_H */
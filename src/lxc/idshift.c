@@ -0,0 +1,643 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "conf.h"
+#include "idshift.h"
+#include "log.h"
+#include "utils.h"
+
+lxc_log_define(lxc_idshift, lxc);
+
+#define SHIFT_MAX_THREADS 32
+
+/* only the subtrees down to this depth are recorded in the progress file */
+#define SHIFT_PROGRESS_DEPTH 2
+
+/* the on-disk formats of the xattrs holding ids, from the kernel's uapi */
+#define XATTR_ACL_ACCESS	"system.posix_acl_access"
+#define XATTR_ACL_DEFAULT	"system.posix_acl_default"
+#define XATTR_CAPS		"security.capability"
+
+#define SHIFT_ACL_VERSION	0x0002
+#define SHIFT_ACL_USER		0x02
+#define SHIFT_ACL_GROUP		0x08
+
+struct shift_acl_entry {
+	uint16_t e_tag;
+	uint16_t e_perm;
+	uint32_t e_id;
+};
+
+#define SHIFT_CAP_REVISION_MASK	0xFF000000
+#define SHIFT_CAP_REVISION_3	0x03000000
+#define SHIFT_CAP_V3_SIZE	24	/* the root id is the last __le32 */
+
+/*
+ * A directory to walk. It stays around until all of its subdirectories are
+ * done too, which is when its subtree can be recorded as done.
+ * @path    : relative to the root of the tree, "" for the root itself
+ * @dev,ino : what it was when found, checked again when it is opened
+ * @pending : itself and its subdirectories not done yet
+ */
+struct shift_dir {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	int depth;
+	int pending;
+	struct shift_dir *parent;
+	struct shift_dir *next;
+};
+
+struct shift_ctx {
+	int rootfd;
+	dev_t dev;
+	struct lxc_list *from;
+	struct lxc_list *to;
+	int progress_fd;
+	char *done_buf;
+	char **done;
+	size_t ndone;
+
+	/* protected by lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct shift_dir *queue;
+	int busy;
+	bool error;
+	uint64_t nshifted;
+	uint64_t nskipped;
+};
+
+/* map @id from @map's host ids to its namespace ids or, if @to_host, back */
+static bool map_id(struct lxc_list *map, enum idtype type, unsigned long id,
+		   bool to_host, unsigned long *ret)
+{
+	struct lxc_list *it;
+
+	lxc_list_for_each(it, map) {
+		struct id_map *m = it->elem;
+		unsigned long base = to_host ? m->nsid : m->hostid;
+
+		if (m->idtype != type)
+			continue;
+		if (id >= base && id - base < m->range) {
+			*ret = (to_host ? m->hostid : m->nsid) + (id - base);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* returns true and the new id in @ret if @id needs shifting */
+static bool shift_id(struct shift_ctx *ctx, enum idtype type,
+		     unsigned long id, unsigned long *ret)
+{
+	unsigned long nsid = id;
+
+	/* already shifted */
+	if (map_id(ctx->to, type, id, false, &nsid))
+		return false;
+	nsid = id;
+	if (ctx->from && !map_id(ctx->from, type, id, false, &nsid))
+		return false;
+	if (!map_id(ctx->to, type, nsid, true, ret))
+		return false;
+	return *ret != id;
+}
+
+static bool shift_acl(struct shift_ctx *ctx, char *buf, ssize_t len)
+{
+	struct shift_acl_entry *e;
+	unsigned long id;
+	uint32_t version;
+	bool changed = false;
+
+	if (len < sizeof(version))
+		return false;
+	memcpy(&version, buf, sizeof(version));
+	if (le32toh(version) != SHIFT_ACL_VERSION)
+		return false;
+
+	for (e = (void *)(buf + sizeof(version));
+	     (char *)(e + 1) <= buf + len; e++) {
+		enum idtype type;
+
+		if (le16toh(e->e_tag) == SHIFT_ACL_USER)
+			type = ID_TYPE_UID;
+		else if (le16toh(e->e_tag) == SHIFT_ACL_GROUP)
+			type = ID_TYPE_GID;
+		else
+			continue;
+
+		if (shift_id(ctx, type, le32toh(e->e_id), &id)) {
+			e->e_id = htole32(id);
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+static int shift_acl_xattr(struct shift_ctx *ctx, int fd, const char *name)
+{
+	char *buf;
+	ssize_t len;
+	int ret = -1;
+
+	len = fgetxattr(fd, name, NULL, 0);
+	if (len <= 0)
+		return len < 0 && errno != ENODATA ? -1 : 0;
+
+	buf = malloc(len);
+	if (!buf)
+		return -1;
+	len = fgetxattr(fd, name, buf, len);
+	if (len < 0)
+		goto out;
+	if (shift_acl(ctx, buf, len) && fsetxattr(fd, name, buf, len, 0) < 0)
+		goto out;
+	ret = 0;
+out:
+	free(buf);
+	return ret;
+}
+
+/*
+ * shift_inode: shift the owner of an inode and the ids in its xattrs
+ *
+ * @ctx  : the walk
+ * @dfd  : directory holding the inode, used with @name when @fd is -1
+ * @name : name of the inode in @dfd
+ * @fd   : the inode opened, or -1
+ * @st   : what fstatat() returned for it
+ * @path : name to use in error messages
+ *
+ * Returns 1 if the inode was shifted, 0 if there was nothing to do, -1 on
+ * error.
+ */
+static int shift_inode(struct shift_ctx *ctx, int dfd, const char *name,
+		       int fd, struct stat *st, const char *path)
+{
+	unsigned long uid = st->st_uid, gid = st->st_gid;
+	char caps[SHIFT_CAP_V3_SIZE], list[1024], *biglist = NULL, *p;
+	ssize_t caps_len = -1, len;
+	bool shift_uid, shift_gid;
+	int ownfd = -1, ret = -1;
+
+	shift_uid = shift_id(ctx, ID_TYPE_UID, st->st_uid, &uid);
+	shift_gid = shift_id(ctx, ID_TYPE_GID, st->st_gid, &gid);
+	if (!shift_uid && !shift_gid)
+		return 0;
+
+	/* only regular files and directories can carry ACLs and caps */
+	if (fd < 0 && S_ISREG(st->st_mode)) {
+		ownfd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC |
+			       O_NONBLOCK | O_NOCTTY);
+		if (ownfd < 0) {
+			SYSERROR("failed to open %s", path);
+			return -1;
+		}
+		fd = ownfd;
+	}
+
+	if (fd >= 0) {
+		len = flistxattr(fd, list, sizeof(list));
+		if (len < 0 && errno == ERANGE) {
+			len = flistxattr(fd, NULL, 0);
+			biglist = len > 0 ? malloc(len) : NULL;
+			len = biglist ? flistxattr(fd, biglist, len) : -1;
+		}
+		if (len < 0 && errno != ENOTSUP) {
+			SYSERROR("failed to list the xattrs of %s", path);
+			goto out;
+		}
+		for (p = biglist ? biglist : list; len > 0 &&
+		     p < (biglist ? biglist : list) + len; p += strlen(p) + 1) {
+			if (!strcmp(p, XATTR_ACL_ACCESS) ||
+			    !strcmp(p, XATTR_ACL_DEFAULT)) {
+				if (shift_acl_xattr(ctx, fd, p) < 0) {
+					SYSERROR("failed to shift the ACL of %s", path);
+					goto out;
+				}
+			} else if (!strcmp(p, XATTR_CAPS)) {
+				caps_len = fgetxattr(fd, p, caps, sizeof(caps));
+			}
+		}
+	}
+
+	if (fd >= 0)
+		ret = fchown(fd, uid, gid);
+	else
+		ret = fchownat(dfd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
+	if (ret < 0) {
+		SYSERROR("failed to chown %s to %lu:%lu", path, uid, gid);
+		goto out;
+	}
+	ret = -1;
+
+	/* chown() drops the setuid and setgid bits and the file caps */
+	if (fd >= 0 && (st->st_mode & (S_ISUID | S_ISGID)) &&
+	    fchmod(fd, st->st_mode & 07777) < 0) {
+		SYSERROR("failed to restore the mode of %s", path);
+		goto out;
+	}
+	if (caps_len > 0) {
+		uint32_t magic, rootid;
+		unsigned long id;
+
+		memcpy(&magic, caps, sizeof(magic));
+		if (caps_len == SHIFT_CAP_V3_SIZE &&
+		    (le32toh(magic) & SHIFT_CAP_REVISION_MASK) == SHIFT_CAP_REVISION_3) {
+			memcpy(&rootid, caps + caps_len - sizeof(rootid),
+			       sizeof(rootid));
+			if (shift_id(ctx, ID_TYPE_UID, le32toh(rootid), &id)) {
+				rootid = htole32(id);
+				memcpy(caps + caps_len - sizeof(rootid), &rootid,
+				       sizeof(rootid));
+			}
+		}
+		if (fsetxattr(fd, XATTR_CAPS, caps, caps_len, 0) < 0) {
+			SYSERROR("failed to restore the file caps of %s", path);
+			goto out;
+		}
+	}
+	ret = 1;
+
+out:
+	free(biglist);
+	if (ownfd >= 0)
+		close(ownfd);
+	return ret;
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static bool shift_subtree_done(struct shift_ctx *ctx, const char *path)
+{
+	return ctx->ndone && bsearch(&path, ctx->done, ctx->ndone,
+				     sizeof(*ctx->done), cmp_path);
+}
+
+/* load the subtrees an interrupted run already did, and open for appending */
+static int shift_progress_open(struct shift_ctx *ctx, const char *progress)
+{
+	char *buf = NULL, *line, *nl;
+	struct stat st;
+	size_t n = 0;
+
+	ctx->progress_fd = open(progress, O_RDWR | O_CREAT | O_APPEND |
+				O_CLOEXEC, 0600);
+	if (ctx->progress_fd < 0) {
+		SYSERROR("failed to open %s", progress);
+		return -1;
+	}
+	if (fstat(ctx->progress_fd, &st) < 0 || !st.st_size)
+		return 0;
+
+	buf = malloc(st.st_size + 1);
+	if (!buf)
+		return -1;
+	if (pread(ctx->progress_fd, buf, st.st_size, 0) != st.st_size) {
+		free(buf);
+		return -1;
+	}
+	buf[st.st_size] = '\0';
+	ctx->done_buf = buf;
+
+	/* an unterminated last line was cut short, it is ignored */
+	for (line = buf; (nl = strchr(line, '\n')); line = nl + 1)
+		n++;
+	ctx->done = malloc(n * sizeof(*ctx->done) + 1);
+	if (!ctx->done)
+		return -1;
+	for (line = buf; (nl = strchr(line, '\n')); line = nl + 1) {
+		*nl = '\0';
+		ctx->done[ctx->ndone++] = line;
+	}
+	qsort(ctx->done, ctx->ndone, sizeof(*ctx->done), cmp_path);
+	INFO("resuming, %zu subtrees were done already", ctx->ndone);
+	return 0;
+}
+
+static struct shift_dir *shift_dir_new(struct shift_dir *parent,
+				       const char *name, struct stat *st)
+{
+	struct shift_dir *dir;
+	size_t len;
+
+	dir = malloc(sizeof(*dir));
+	if (!dir)
+		return NULL;
+
+	if (parent) {
+		len = strlen(parent->path) + strlen(name) + 2;
+		dir->path = malloc(len);
+		if (dir->path)
+			snprintf(dir->path, len, "%s%s%s", parent->path,
+				 *parent->path ? "/" : "", name);
+	} else {
+		dir->path = strdup("");
+	}
+	if (!dir->path) {
+		free(dir);
+		return NULL;
+	}
+
+	dir->dev = st->st_dev;
+	dir->ino = st->st_ino;
+	dir->depth = parent ? parent->depth + 1 : 0;
+	dir->pending = 1;
+	dir->parent = parent;
+	dir->next = NULL;
+	return dir;
+}
+
+/* one of @dir's subtree is done, or @dir itself. Called with ctx->lock held */
+static void shift_dir_put(struct shift_ctx *ctx, struct shift_dir *dir)
+{
+	struct shift_dir *parent;
+
+	while (dir && --dir->pending == 0) {
+		if (!ctx->error && ctx->progress_fd >= 0 && dir->depth &&
+		    dir->depth <= SHIFT_PROGRESS_DEPTH &&
+		    !strchr(dir->path, '\n')) {
+			/* O_APPEND, lines are written in one go */
+			size_t len = strlen(dir->path);
+
+			dir->path[len] = '\n';
+			if (write(ctx->progress_fd, dir->path, len + 1) < 0)
+				WARN("failed to record the progress");
+			dir->path[len] = '\0';
+		}
+		parent = dir->parent;
+		free(dir->path);
+		free(dir);
+		dir = parent;
+	}
+}
+
+/*
+ * shift_dir: shift a directory and the entries in it, except for the
+ * subdirectories which are returned in @children to be walked later
+ */
+static int shift_dir(struct shift_ctx *ctx, struct shift_dir *dir,
+		     struct shift_dir **children, uint64_t *nshifted,
+		     uint64_t *nskipped)
+{
+	char path[MAXPATHLEN];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+	int fd, ret;
+
+	fd = openat(ctx->rootfd, *dir->path ? dir->path : ".",
+		    O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		SYSERROR("failed to open %s", dir->path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_dev != dir->dev ||
+	    st.st_ino != dir->ino) {
+		ERROR("%s changed during the walk", dir->path);
+		close(fd);
+		return -1;
+	}
+
+	ret = shift_inode(ctx, -1, NULL, fd, &st, *dir->path ? dir->path : ".");
+	if (ret < 0) {
+		close(fd);
+		return -1;
+	}
+	ret ? (*nshifted)++ : (*nskipped)++;
+
+	d = fdopendir(fd);
+	if (!d) {
+		SYSERROR("failed to read %s", dir->path);
+		close(fd);
+		return -1;
+	}
+
+	while ((errno = 0, de = readdir(d))) {
+		struct shift_dir *child;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		ret = snprintf(path, sizeof(path), "%s%s%s", dir->path,
+			       *dir->path ? "/" : "", de->d_name);
+		if (ret < 0 || ret >= sizeof(path)) {
+			ERROR("path too long in %s", dir->path);
+			goto err;
+		}
+
+		if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			if (errno == ENOENT)
+				continue;
+			SYSERROR("failed to stat %s", path);
+			goto err;
+		}
+
+		if (!S_ISDIR(st.st_mode)) {
+			ret = shift_inode(ctx, fd, de->d_name, -1, &st, path);
+			if (ret < 0)
+				goto err;
+			ret ? (*nshifted)++ : (*nskipped)++;
+			continue;
+		}
+
+		/* the walk does not cross mount points */
+		if (st.st_dev != ctx->dev)
+			continue;
+		if (dir->depth < SHIFT_PROGRESS_DEPTH &&
+		    shift_subtree_done(ctx, path))
+			continue;
+
+		child = shift_dir_new(dir, de->d_name, &st);
+		if (!child)
+			goto err;
+		child->next = *children;
+		*children = child;
+	}
+	if (errno) {
+		SYSERROR("failed to read %s", dir->path);
+		goto err;
+	}
+
+	closedir(d);
+	return 0;
+
+err:
+	closedir(d);
+	return -1;
+}
+
+static void *shift_worker(void *data)
+{
+	struct shift_ctx *ctx = data;
+	struct shift_dir *dir, *children, *next;
+	uint64_t nshifted, nskipped;
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+	for (;;) {
+		while (!ctx->queue && ctx->busy && !ctx->error)
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		if (!ctx->queue || ctx->error)
+			break;
+
+		dir = ctx->queue;
+		ctx->queue = dir->next;
+		ctx->busy++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		children = NULL;
+		nshifted = nskipped = 0;
+		ret = shift_dir(ctx, dir, &children, &nshifted, &nskipped);
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->busy--;
+		ctx->nshifted += nshifted;
+		ctx->nskipped += nskipped;
+		if (ret < 0)
+			ctx->error = true;
+		for (; children; children = next) {
+			next = children->next;
+			if (ctx->error) {
+				free(children->path);
+				free(children);
+				continue;
+			}
+			dir->pending++;
+			children->next = ctx->queue;
+			ctx->queue = children;
+		}
+		shift_dir_put(ctx, dir);
+		pthread_cond_broadcast(&ctx->cond);
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return NULL;
+}
+
+int lxc_shift_ids(const char *path, struct lxc_list *from,
+		  struct lxc_list *to, const char *progress, int threads)
+{
+	struct shift_ctx ctx;
+	struct shift_dir *root, *dir;
+	struct timespec start, end;
+	pthread_t *tids = NULL;
+	struct stat st;
+	int i, started = 0, ret = -1;
+
+	if (lxc_list_empty(to)) {
+		ERROR("no id map to shift %s into", path);
+		return -1;
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.from = from && !lxc_list_empty(from) ? from : NULL;
+	ctx.to = to;
+	ctx.progress_fd = -1;
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.cond, NULL);
+
+	ctx.rootfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ctx.rootfd < 0 || fstat(ctx.rootfd, &st) < 0) {
+		SYSERROR("failed to open %s", path);
+		goto out;
+	}
+	ctx.dev = st.st_dev;
+
+	if (progress && shift_progress_open(&ctx, progress) < 0)
+		goto out;
+
+	root = shift_dir_new(NULL, NULL, &st);
+	if (!root)
+		goto out;
+	ctx.queue = root;
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > SHIFT_MAX_THREADS)
+		threads = SHIFT_MAX_THREADS;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	/* the calling thread is one of the workers */
+	tids = malloc((threads - 1) * sizeof(*tids) + 1);
+	for (i = 0; tids && i < threads - 1; i++) {
+		if (pthread_create(&tids[i], NULL, shift_worker, &ctx))
+			break;
+		started++;
+	}
+	shift_worker(&ctx);
+	for (i = 0; i < started; i++)
+		pthread_join(tids[i], NULL);
+
+	/* whatever is left was given up on after an error */
+	while ((dir = ctx.queue)) {
+		ctx.queue = dir->next;
+		shift_dir_put(&ctx, dir);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	INFO("shifted %s: %" PRIu64 " inodes changed, %" PRIu64 " left alone, "
+	     "%d workers, %ld ms", path, ctx.nshifted, ctx.nskipped,
+	     started + 1, (end.tv_sec - start.tv_sec) * 1000 +
+	     (end.tv_nsec - start.tv_nsec) / 1000000);
+
+	if (ctx.error)
+		goto out;
+	if (progress && unlink(progress) < 0)
+		WARN("failed to remove %s", progress);
+	ret = 0;
+
+out:
+	free(tids);
+	if (ctx.progress_fd >= 0)
+		close(ctx.progress_fd);
+	if (ctx.rootfd >= 0)
+		close(ctx.rootfd);
+	free(ctx.done_buf);
+	free(ctx.done);
+	pthread_cond_destroy(&ctx.cond);
+	pthread_mutex_destroy(&ctx.lock);
+	return ret;
+}
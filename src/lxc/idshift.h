@@ -0,0 +1,46 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_IDSHIFT_H
+#define __LXC_IDSHIFT_H
+
+#include "list.h"
+
+/*
+ * lxc_shift_ids: shift the ownership of a tree from one id map to another
+ *
+ * @path     : root of the tree, the walk does not leave its filesystem
+ * @from     : the id map (of struct id_map) the tree is owned through,
+ *             NULL or empty if it is owned by host ids (a privileged rootfs)
+ * @to       : the id map to shift the tree into
+ * @progress : file recording the subtrees already done, so that an
+ *             interrupted run can resume, NULL for none. It is removed
+ *             once the whole tree is done.
+ * @threads  : number of workers, 0 for one per online cpu
+ *
+ * Owners, ACL entries and the root id of namespaced file capabilities are
+ * shifted, inodes whose owner already is in @to's host ranges are skipped.
+ * Ids not covered by the maps are left alone. Needs to run as root.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+extern int lxc_shift_ids(const char *path, struct lxc_list *from,
+			 struct lxc_list *to, const char *progress,
+			 int threads);
+
+#endif /* __LXC_IDSHIFT_H */
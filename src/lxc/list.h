@@ -24,6 +24,8 @@
 #ifndef _list_h
 #define _list_h
 
+#include <stddef.h>
+
 struct lxc_list {
 	void *elem;
 	struct lxc_list *next;
@@ -99,4 +101,14 @@ static inline void lxc_list_del(struct lxc_list *list)
 	prev->next = next;
 }
 
+static inline size_t lxc_list_len(struct lxc_list *list)
+{
+	struct lxc_list *iter;
+	size_t len = 0;
+
+	lxc_list_for_each(iter, list)
+		len++;
+	return len;
+}
+
 #endif
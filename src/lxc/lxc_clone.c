@@ -74,7 +74,7 @@ static uint64_t get_fssize(char *s)
 
 static void usage(const char *me)
 {
-	printf("Usage: %s [-s] [-B backingstore] [-L size[unit]] [-K] [-M] [-H]\n", me);
+	printf("Usage: %s [-s] [-B backingstore] [-L size[unit]] [-K] [-M] [-H] [-S] [-F]\n", me);
 	printf("          [-p lxcpath] [-P newlxcpath] orig new\n");
 	printf("\n");
 	printf("  -s: snapshot rather than copy\n");
@@ -86,6 +86,10 @@ static void usage(const char *me)
 	printf("      unit is MB\n");
 	printf("  -K: Keep name - do not change the container name\n");
 	printf("  -M: Keep macaddr - do not choose a random new mac address\n");
+	printf("  -S: Shift ids - give the new container the id map of the default\n");
+	printf("      configuration and shift its rootfs into it (root only)\n");
+	printf("  -F: Flatten - give an overlayfs snapshot of an overlayfs container\n");
+	printf("      its own lower layer with the original's delta merged in\n");
 	printf("  -p: use container orig from custom lxcpath\n");
 	printf("  -P: create container new in custom lxcpath\n");
 	exit(1);
@@ -100,6 +104,8 @@ static struct option options[] = {
 	{ "vgname", required_argument, 0, 'v'},
 	{ "keepname", no_argument, 0, 'K'},
 	{ "keepmac", no_argument, 0, 'M'},
+	{ "shift-ids", no_argument, 0, 'S'},
+	{ "flatten", no_argument, 0, 'F'},
 	{ "lxcpath", required_argument, 0, 'p'},
 	{ "newpath", required_argument, 0, 'P'},
 	{ "fstype", required_argument, 0, 't'},
@@ -110,7 +116,7 @@ static struct option options[] = {
 int main(int argc, char *argv[])
 {
 	struct lxc_container *c1 = NULL, *c2 = NULL;
-	int snapshot = 0, keepname = 0, keepmac = 0;
+	int snapshot = 0, keepname = 0, keepmac = 0, shiftids = 0, flatten = 0;
 	int flags = 0, option_index;
 	uint64_t newsize = 0;
 	char *bdevtype = NULL, *lxcpath = NULL, *newpath = NULL, *fstype = NULL;
@@ -122,7 +128,7 @@ int main(int argc, char *argv[])
 		usage(argv[0]);
 
 	while (1) {
-		c = getopt_long(argc, argv, "sB:L:o:n:v:KMHp:P:t:h", options, &option_index);
+		c = getopt_long(argc, argv, "sB:L:o:n:v:KMSFHp:P:t:h", options, &option_index);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -134,6 +140,8 @@ int main(int argc, char *argv[])
 		case 'v': vgname = optarg; break;
 		case 'K': keepname = 1; break;
 		case 'M': keepmac = 1; break;
+		case 'S': shiftids = 1; break;
+		case 'F': flatten = 1; break;
 		case 'p': lxcpath = optarg; break;
 		case 'P': newpath = optarg; break;
 		case 't': fstype = optarg; break;
@@ -156,6 +164,8 @@ int main(int argc, char *argv[])
 	if (snapshot)  flags |= LXC_CLONE_SNAPSHOT;
 	if (keepname)  flags |= LXC_CLONE_KEEPNAME;
 	if (keepmac)   flags |= LXC_CLONE_KEEPMACADDR;
+	if (shiftids)  flags |= LXC_CLONE_SHIFTIDS;
+	if (flatten)   flags |= LXC_CLONE_FLATTEN;
 
 	// vgname and fstype could be supported by sending them through the
 	// bdevdata.  However, they currently are not yet.  I'm not convinced
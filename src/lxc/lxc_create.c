@@ -81,6 +81,7 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 	case '4': args->fssize = get_fssize(arg); break;
 	case '5': args->zfsroot = arg; break;
 	case '6': args->dir = arg; break;
+	case '7': args->shiftids = 1; break;
 	}
 	return 0;
 }
@@ -96,6 +97,7 @@ static const struct option my_longopts[] = {
 	{"fssize", required_argument, 0, '4'},
 	{"zfsroot", required_argument, 0, '5'},
 	{"dir", required_argument, 0, '6'},
+	{"shift-ids", no_argument, 0, '7'},
 	LXC_COMMON_OPTIONS
 };
 
@@ -154,7 +156,9 @@ Options :\n\
                      (Default: 1G, default unit: M)\n\
   --dir=DIR          Place rootfs directory under DIR\n\
   --zfsroot=PATH     Create zfs under given zfsroot\n\
-                     (Default: tank/lxc)\n",
+                     (Default: tank/lxc)\n\
+  --shift-ids        Run the template as root and shift the rootfs into\n\
+                     the container's id map afterwards\n",
 	.options  = my_longopts,
 	.parser   = my_parser,
 	.checker  = NULL,
@@ -263,6 +267,8 @@ int main(int argc, char *argv[])
 		my_args.bdevtype = NULL;
 	if (my_args.quiet)
 		flags = LXC_CREATE_QUIET;
+	if (my_args.shiftids)
+		flags |= LXC_CREATE_SHIFTIDS;
 	if (!c->create(c, my_args.template, my_args.bdevtype, &spec, flags, &argv[optind])) {
 		ERROR("Error creating container %s", c->name);
 		lxc_container_put(c);
@@ -43,6 +43,7 @@ static bool ips;
 static bool state;
 static bool pid;
 static bool stats;
+static bool trace;
 static bool humanize = true;
 static char **key = NULL;
 static int keys = 0;
@@ -60,6 +61,7 @@ static int my_parser(struct lxc_arguments* args, int c, char* arg)
 	case 's': state = true; filter_count += 1; break;
 	case 'p': pid = true; filter_count += 1; break;
 	case 'S': stats = true; filter_count += 5; break;
+	case 'T': trace = true; filter_count += 1; break;
 	case 'H': humanize = false; break;
 	}
 	return 0;
@@ -71,6 +73,7 @@ static const struct option my_longopts[] = {
 	{"state", no_argument, 0, 's'},
 	{"pid", no_argument, 0, 'p'},
 	{"stats", no_argument, 0, 'S'},
+	{"start-trace", no_argument, 0, 'T'},
 	{"no-humanize", no_argument, 0, 'H'},
 	LXC_COMMON_OPTIONS,
 };
@@ -88,6 +91,7 @@ Options :\n\
   -i, --ips             shows the IP addresses\n\
   -p, --pid             shows the process id of the init container\n\
   -S, --stats           shows usage stats\n\
+  -T, --start-trace     shows how long each phase of the start took\n\
   -H, --no-humanize     shows stats as raw numbers, not humanized\n\
   -s, --state           shows the state of the container\n",
 	.name     = NULL,
@@ -294,7 +298,7 @@ static int print_info(const char *name, const char *lxcpath)
 		return -1;
 	}
 
-	if (!state && !pid && !ips && !stats && keys <= 0) {
+	if (!state && !pid && !ips && !stats && !trace && keys <= 0) {
 		state = pid = ips = stats = true;
 		print_info_msg_str("Name:", c->name);
 	}
@@ -331,6 +335,18 @@ static int print_info(const char *name, const char *lxcpath)
 		print_net_stats(c);
 	}
 
+	if (trace) {
+		char *json = c->get_start_trace(c);
+
+		if (json) {
+			printf("%s\n", json);
+			free(json);
+		} else {
+			fprintf(stderr, "%s has no start trace, see lxc.start.trace\n",
+				c->name);
+		}
+	}
+
 	for(i = 0; i < keys; i++) {
 		int len = c->get_config_item(c, key[i], NULL, 0);
 
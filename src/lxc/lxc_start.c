@@ -81,11 +81,10 @@ static int ensure_path(char **confpath, const char *path)
 			goto err;
 		}
 
-		*confpath = strdup(fullpath);
-		if (!*confpath) {
-			ERROR("failed to dup string '%s'", fullpath);
-			goto err;
-		}
+		/* the path may be set by the configuration already */
+		free(*confpath);
+		*confpath = fullpath;
+		fullpath = NULL;
 	}
 	err = 0;
 
@@ -39,21 +39,29 @@
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <net/if_arp.h>
+#include <net/ethernet.h>
 #include <netinet/in.h>
 #include <linux/if_bridge.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
 #include <linux/sockios.h>
 #include <sys/param.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include "config.h"
 #include "utils.h"
 #include "network.h"
+#include "mainloop.h"
+#include "af_unix.h"
 
 static void usage(char *me, bool fail)
 {
 	fprintf(stderr, "Usage: %s pid type bridge nicname\n", me);
 	fprintf(stderr, " nicname is the name to use inside the container\n");
+	fprintf(stderr, "       %s --daemon\n", me);
+	fprintf(stderr, " serve the requests of liblxc over a unix socket\n");
 	exit(fail ? 1 : 0);
 }
 
@@ -197,35 +205,6 @@ static bool nic_exists(char *nic)
 	return true;
 }
 
-static int instanciate_veth(char *n1, char **n2)
-{
-	int err;
-
-	err = snprintf(*n2, IFNAMSIZ, "%sp", n1);
-	if (err < 0 || err >= IFNAMSIZ) {
-		fprintf(stderr, "nic name too long\n");
-		return -1;
-	}
-
-	err = lxc_veth_create(n1, *n2);
-	if (err) {
-		fprintf(stderr, "failed to create %s-%s : %s\n", n1, *n2,
-		      strerror(-err));
-		return -1;
-	}
-
-	/* changing the high byte of the mac address to 0xfe, the bridge interface
-	 * will always keep the host's mac address and not take the mac address
-	 * of a container */
-	err = setup_private_host_hw_addr(n1);
-	if (err) {
-		fprintf(stderr, "failed to change mac address of host interface '%s' : %s\n",
-			n1, strerror(-err));
-	}
-
-	return netdev_set_flag(n1, IFF_UP);
-}
-
 static int get_mtu(char *name)
 {
 	int idx = if_nametoindex(name);
@@ -237,6 +216,8 @@ static bool create_nic(char *nic, char *br, int pid, char **cnic)
 	char *veth1buf, *veth2buf;
 	veth1buf = alloca(IFNAMSIZ);
 	veth2buf = alloca(IFNAMSIZ);
+	unsigned char hwaddr[ETH_ALEN];
+	struct lxc_veth_args args = { 0 };
 	int ret, mtu;
 
 	ret = snprintf(veth1buf, IFNAMSIZ, "%s", nic);
@@ -245,40 +226,46 @@ static bool create_nic(char *nic, char *br, int pid, char **cnic)
 		return false;
 	}
 
-	/* create the nics */
-	if (instanciate_veth(veth1buf, &veth2buf) < 0) {
-		fprintf(stderr, "Error creating veth tunnel\n");
+	ret = snprintf(veth2buf, IFNAMSIZ, "%sp", veth1buf);
+	if (ret < 0 || ret >= IFNAMSIZ) {
+		fprintf(stderr, "nic name too long\n");
 		return false;
 	}
 
-	/* copy the bridge's mtu to both ends */
-	mtu = get_mtu(br);
-	if (mtu != -1) {
-		if (lxc_netdev_set_mtu(veth1buf, mtu) < 0 ||
-				lxc_netdev_set_mtu(veth2buf, mtu) < 0) {
-			fprintf(stderr, "Failed setting mtu\n");
-			goto out_del;
-		}
-	}
+	/* changing the high byte of the mac address to 0xfe, the bridge interface
+	 * will always keep the host's mac address and not take the mac address
+	 * of a container */
+	ret = lxc_private_host_hw_addr(hwaddr);
+	if (ret)
+		fprintf(stderr, "failed to generate a mac address for '%s' : %s\n",
+			veth1buf, strerror(-ret));
+	else
+		args.hwaddr = hwaddr;
 
-	/* attach veth1 to bridge */
-	if (lxc_bridge_attach(br, veth1buf) < 0) {
-		fprintf(stderr, "Error attaching %s to %s\n", veth1buf, br);
-		goto out_del;
+	args.master = if_nametoindex(br);
+	if (!args.master) {
+		fprintf(stderr, "Error retrieving the index of %s\n", br);
+		return false;
 	}
 
-	/* pass veth2 to target netns */
-	ret = lxc_netdev_move_by_name(veth2buf, pid);
-	if (ret < 0) {
-		fprintf(stderr, "Error moving %s to netns %d\n", veth2buf, pid);
-		goto out_del;
+	/* copy the bridge's mtu to both ends */
+	mtu = get_mtu(br);
+	if (mtu != -1)
+		args.mtu = mtu;
+
+	/* create the nics, attached to the bridge, with veth2 already in the
+	 * target netns */
+	args.up = 1;
+	args.netns_pid = pid;
+	ret = lxc_veth_create(veth1buf, veth2buf, &args);
+	if (ret) {
+		fprintf(stderr, "failed to create %s-%s : %s\n", veth1buf,
+			veth2buf, strerror(-ret));
+		return false;
 	}
+
 	*cnic = strdup(veth2buf);
 	return true;
-
-out_del:
-	lxc_netdev_delete_by_name(veth1buf);
-	return false;
 }
 
 /*
@@ -286,13 +273,20 @@ out_del:
  * *dest will container the name (vethXXXXXX) which is attached
  * on the host to the lxc bridge
  */
-static void get_new_nicname(char **dest, char *br, int pid, char **cnic)
+static bool get_new_nicname(char **dest, char *br, int pid, char **cnic)
 {
 	char template[IFNAMSIZ];
 	snprintf(template, sizeof(template), "vethXXXXXX");
 	*dest = lxc_mkifname(template);
+	if (!*dest)
+		return false;
 
-	create_nic(*dest, br, pid, cnic);
+	if (!create_nic(*dest, br, pid, cnic)) {
+		free(*dest);
+		*dest = NULL;
+		return false;
+	}
+	return true;
 }
 
 static bool get_nic_from_line(char *p, char **nic)
@@ -419,7 +413,8 @@ static bool get_nic_if_avail(int fd, char *me, int pid, char *intype, char *br,
 			return false;
 	}
 
-	get_new_nicname(nicname, br, pid, cnic);
+	if (!get_new_nicname(nicname, br, pid, cnic))
+		return false;
 	/* me  ' ' intype ' ' br ' ' *nicname + '\n' + '\0' */
 	slen = strlen(me) + strlen(intype) + strlen(br) + strlen(*nicname) + 5;
 	newline = alloca(slen);
@@ -505,10 +500,10 @@ static int rename_in_ns(int pid, char *oldname, char *newname)
 	return 0;
 
 out_err:
-	if (ofd >= 0)
-		close(ofd);
 	if (setns(ofd, 0) < 0)
 		fprintf(stderr, "Error returning to original network namespace\n");
+	if (ofd >= 0)
+		close(ofd);
 	if (fd >= 0)
 		close(fd);
 	return -1;
@@ -555,6 +550,651 @@ static bool may_access_netns(int pid)
 	return may_access;
 }
 
+/*
+ * Daemon mode.
+ *
+ * Run as root, lxc-user-nic --daemon serves the requests liblxc would
+ * otherwise make by executing the setuid binary once per nic. The
+ * allocation db is loaded once and kept indexed by user, type and bridge,
+ * so a request only looks at (and culls) the entries of its own owner.
+ * The file keeps its format and its lock, so the daemon and the setuid
+ * binary can be used side by side: the daemon reloads the db whenever it
+ * was changed behind its back.
+ *
+ * The protocol is one request per connection:
+ *   client: "pid type bridge nicname\n"
+ *   daemon: "nicname:vethname\n" or "error <message>\n"
+ * The user is taken from the credentials of the connection.  Clients are
+ * read without blocking, and a request is only served once its whole line
+ * has arrived, so a client which sends nothing doesn't hold up the others.
+ */
+#define USERNIC_HASH_SIZE 64
+#define USERNIC_COMPACT_INTERVAL 60 /* seconds */
+#define USERNIC_REQUEST_MAX 256
+#define USERNIC_REQUEST_TIMEOUT 2 /* seconds */
+#define USERNIC_CLIENTS_MAX 64
+
+struct usernic_owner {
+	char *user;
+	char *type;
+	char *br;
+	char **nics;
+	int count;
+	int size;
+	struct usernic_owner *next;
+};
+
+/*
+ * @fd        : the db file, locked for the duration of each request
+ * @st        : the stat of @fd when the index was last in sync with it
+ * @sum       : the FNV-1a hash of the file's content at that point
+ * @hash      : the owners, hashed on user, type and bridge
+ * @dirty     : entries were culled from the index but not from the file
+ * @compacted : last time the file was rewritten from the index
+ */
+struct usernic_db {
+	int fd;
+	struct stat st;
+	uint64_t sum;
+	struct usernic_owner *hash[USERNIC_HASH_SIZE];
+	bool dirty;
+	time_t compacted;
+};
+
+/* a connection whose request line hasn't fully arrived yet */
+struct usernic_client {
+	int fd;
+	time_t deadline;
+	size_t len;
+	char req[USERNIC_REQUEST_MAX];
+	struct usernic_server *server;
+	struct usernic_client *next;
+};
+
+struct usernic_server {
+	struct usernic_db db;
+	struct usernic_client *clients;
+	int nclients;
+};
+
+static unsigned int usernic_hash(char *user, char *type, char *br)
+{
+	uint64_t h = FNV1A_64_INIT;
+
+	h = fnv_64a_buf(user, strlen(user) + 1, h);
+	h = fnv_64a_buf(type, strlen(type) + 1, h);
+	h = fnv_64a_buf(br, strlen(br) + 1, h);
+	return h % USERNIC_HASH_SIZE;
+}
+
+static struct usernic_owner *db_owner(struct usernic_db *db, char *user,
+				      char *type, char *br, bool create)
+{
+	unsigned int h = usernic_hash(user, type, br);
+	struct usernic_owner *o;
+
+	for (o = db->hash[h]; o; o = o->next) {
+		if (strcmp(o->user, user) == 0 && strcmp(o->type, type) == 0 &&
+		    strcmp(o->br, br) == 0)
+			return o;
+	}
+	if (!create)
+		return NULL;
+
+	o = calloc(1, sizeof(*o));
+	if (!o)
+		return NULL;
+	o->user = strdup(user);
+	o->type = strdup(type);
+	o->br = strdup(br);
+	if (!o->user || !o->type || !o->br) {
+		free(o->user);
+		free(o->type);
+		free(o->br);
+		free(o);
+		return NULL;
+	}
+	o->next = db->hash[h];
+	db->hash[h] = o;
+	return o;
+}
+
+static bool db_owner_add(struct usernic_owner *o, char *nic)
+{
+	char **nics;
+
+	if (o->count == o->size) {
+		nics = realloc(o->nics, sizeof(*nics) * (o->size ? o->size * 2 : 4));
+		if (!nics)
+			return false;
+		o->nics = nics;
+		o->size = o->size ? o->size * 2 : 4;
+	}
+	o->nics[o->count] = strdup(nic);
+	if (!o->nics[o->count])
+		return false;
+	o->count++;
+	return true;
+}
+
+static void db_clear(struct usernic_db *db)
+{
+	struct usernic_owner *o, *next;
+	int i, j;
+
+	for (i = 0; i < USERNIC_HASH_SIZE; i++) {
+		for (o = db->hash[i]; o; o = next) {
+			next = o->next;
+			for (j = 0; j < o->count; j++)
+				free(o->nics[j]);
+			free(o->nics);
+			free(o->user);
+			free(o->type);
+			free(o->br);
+			free(o);
+		}
+		db->hash[i] = NULL;
+	}
+	db->dirty = false;
+}
+
+/* (re)build the index from the db file, which must be locked */
+static bool db_load(struct usernic_db *db)
+{
+	FILE *f;
+	char *line = NULL;
+	size_t len = 0;
+	char user[100], type[100], br[100], nic[100];
+	struct usernic_owner *o;
+	ssize_t n;
+	int fd;
+	bool ret = true;
+
+	db_clear(db);
+	db->sum = FNV1A_64_INIT;
+
+	fd = dup(db->fd);
+	if (fd < 0 || lseek(fd, 0, SEEK_SET) < 0 || !(f = fdopen(fd, "r"))) {
+		fprintf(stderr, "Failed to read %s: %s\n", LXC_USERNIC_DB,
+			strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	while ((n = getline(&line, &len, f)) != -1) {
+		db->sum = fnv_64a_buf(line, n, db->sum);
+		if (sscanf(line, "%99[^ \t\n] %99[^ \t\n] %99[^ \t\n] %99[^ \t\n]",
+			   user, type, br, nic) != 4)
+			continue;
+		o = db_owner(db, user, type, br, true);
+		if (!o || !db_owner_add(o, nic)) {
+			fprintf(stderr, "Out of memory\n");
+			ret = false;
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+
+	if (fstat(db->fd, &db->st) < 0)
+		ret = false;
+	return ret;
+}
+
+/* reload the index if the setuid lxc-user-nic changed the db file */
+static bool db_sync(struct usernic_db *db)
+{
+	struct stat st;
+
+	if (stat(LXC_USERNIC_DB, &st) == 0 && st.st_ino != db->st.st_ino) {
+		int fd = open(LXC_USERNIC_DB, O_RDWR | O_CLOEXEC);
+		struct flock lk = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+
+		if (fd < 0 || fcntl(fd, F_SETLKW, &lk) < 0) {
+			fprintf(stderr, "Failed to reopen %s: %s\n",
+				LXC_USERNIC_DB, strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			return false;
+		}
+		close(db->fd);
+		db->fd = fd;
+		return db_load(db);
+	}
+
+	if (fstat(db->fd, &st) < 0)
+		return false;
+	if (st.st_size == db->st.st_size &&
+	    st.st_mtim.tv_sec == db->st.st_mtim.tv_sec &&
+	    st.st_mtim.tv_nsec == db->st.st_mtim.tv_nsec)
+		return true;
+	return db_load(db);
+}
+
+static bool db_lock(struct usernic_db *db, bool lock)
+{
+	struct flock lk = { .l_whence = SEEK_SET };
+
+	lk.l_type = lock ? F_WRLCK : F_UNLCK;
+	if (fcntl(db->fd, F_SETLKW, &lk) < 0) {
+		fprintf(stderr, "Failed to %s %s: %s\n", lock ? "lock" : "unlock",
+			LXC_USERNIC_DB, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/* forget the nics of @o which don't exist anymore */
+static void db_cull(struct usernic_db *db, struct usernic_owner *o)
+{
+	int i = 0;
+
+	while (i < o->count) {
+		if (nic_exists(o->nics[i])) {
+			i++;
+			continue;
+		}
+		free(o->nics[i]);
+		o->nics[i] = o->nics[--o->count];
+		db->dirty = true;
+	}
+}
+
+static bool db_append(struct usernic_db *db, struct usernic_owner *o, char *nic)
+{
+	char line[4 * 100 + 5];
+	int ret;
+
+	ret = snprintf(line, sizeof(line), "%s %s %s %s\n", o->user, o->type,
+		       o->br, nic);
+	if (ret < 0 || ret >= sizeof(line))
+		return false;
+	if (!db_owner_add(o, nic))
+		return false;
+	if (pwrite(db->fd, line, ret, db->st.st_size) != ret) {
+		fprintf(stderr, "Failed to write to %s: %s\n", LXC_USERNIC_DB,
+			strerror(errno));
+		free(o->nics[--o->count]);
+		if (ftruncate(db->fd, db->st.st_size))
+			fprintf(stderr, "Failed to set new file size\n");
+		return false;
+	}
+	/* our own write must not look like a foreign one */
+	db->sum = fnv_64a_buf(line, ret, db->sum);
+	return fstat(db->fd, &db->st) == 0;
+}
+
+/*
+ * A rewrite of the file by the setuid lxc-user-nic which kept its size
+ * within the granularity of its mtime goes unnoticed by db_sync(), so
+ * the content is checked before the file is rewritten from the index.
+ */
+static bool db_verify(struct usernic_db *db)
+{
+	char buf[4096];
+	uint64_t sum = FNV1A_64_INIT;
+	off_t off = 0;
+	ssize_t n;
+
+	while ((n = pread(db->fd, buf, sizeof(buf), off)) > 0) {
+		sum = fnv_64a_buf(buf, n, sum);
+		off += n;
+	}
+	if (n < 0) {
+		fprintf(stderr, "Failed to read %s: %s\n", LXC_USERNIC_DB,
+			strerror(errno));
+		return false;
+	}
+	if (sum == db->sum && off == db->st.st_size)
+		return true;
+	return db_load(db);
+}
+
+/* cull every owner and rewrite the db file if anything went away */
+static void db_compact(struct usernic_db *db)
+{
+	struct usernic_owner *o;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+	int i, j;
+
+	if (!db_lock(db, true))
+		return;
+	if (!db_sync(db) || !db_verify(db))
+		goto out;
+
+	for (i = 0; i < USERNIC_HASH_SIZE; i++)
+		for (o = db->hash[i]; o; o = o->next)
+			db_cull(db, o);
+	if (!db->dirty)
+		goto out;
+
+	f = open_memstream(&buf, &len);
+	if (!f)
+		goto out;
+	for (i = 0; i < USERNIC_HASH_SIZE; i++)
+		for (o = db->hash[i]; o; o = o->next)
+			for (j = 0; j < o->count; j++)
+				fprintf(f, "%s %s %s %s\n", o->user, o->type,
+					o->br, o->nics[j]);
+	fclose(f);
+
+	if (pwrite(db->fd, buf, len, 0) != len || ftruncate(db->fd, len)) {
+		fprintf(stderr, "Failed to rewrite %s: %s\n", LXC_USERNIC_DB,
+			strerror(errno));
+		/* the file can't be trusted to match the index anymore */
+		db->st.st_size = -1;
+		goto out;
+	}
+	fstat(db->fd, &db->st);
+	db->sum = fnv_64a_buf(buf, len, FNV1A_64_INIT);
+	db->dirty = false;
+
+out:
+	free(buf);
+	db->compacted = time(NULL);
+	db_lock(db, false);
+}
+
+/*
+ * Like may_access_netns(), for a root daemon acting on behalf of @uid:@gid.
+ */
+static bool may_access_netns_as(int pid, uid_t uid, gid_t gid)
+{
+	char s[200];
+	bool may_access;
+	int ret;
+
+	ret = snprintf(s, 200, "/proc/%d/ns/net", pid);
+	if (ret < 0 || ret >= 200)
+		return false;
+
+	if (setresgid(gid, gid, 0) < 0 || setresuid(uid, uid, 0) < 0) {
+		fprintf(stderr, "Failed to switch to %d:%d: %s\n", (int)uid,
+			(int)gid, strerror(errno));
+		may_access = false;
+		goto restore;
+	}
+	may_access = access(s, R_OK) == 0;
+	if (!may_access)
+		fprintf(stderr, "Uid %d may not access %s: %s\n", (int)uid, s,
+			strerror(errno));
+
+restore:
+	if (setresuid(0, 0, 0) < 0 || setresgid(0, 0, 0) < 0) {
+		fprintf(stderr, "Failed to restore root ids: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+	return may_access;
+}
+
+/* answer the request @req of the client on @fd into @reply */
+static int usernic_serve(struct usernic_db *db, int fd, char *req,
+			 char *reply, size_t size)
+{
+	char type[100], br[100], name[IFNAMSIZ];
+	char *me, *nicname = NULL, *cnic = NULL;
+	struct usernic_owner *o;
+	struct ucred cred;
+	socklen_t credsz = sizeof(cred);
+	struct passwd *pwd;
+	const char *err = NULL;
+	int pid, allowed, ret;
+
+	if (sscanf(req, "%d %99s %99s %15s", &pid, type, br, name) != 4 ||
+	    pid <= 0)
+		return snprintf(reply, size, "error bad request\n");
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credsz) < 0)
+		return snprintf(reply, size, "error no credentials\n");
+	pwd = getpwuid(cred.uid);
+	if (!pwd)
+		return snprintf(reply, size, "error unknown uid %d\n",
+				(int)cred.uid);
+	me = alloca(strlen(pwd->pw_name) + 1);
+	strcpy(me, pwd->pw_name);
+
+	if (!may_access_netns_as(pid, cred.uid, cred.gid))
+		return snprintf(reply, size,
+				"error user %s may not modify netns for pid %d\n",
+				me, pid);
+
+	allowed = get_alloted(me, type, br);
+	if (allowed <= 0)
+		return snprintf(reply, size,
+				"error user %s may not create %s nics on %s\n",
+				me, type, br);
+
+	if (!db_lock(db, true))
+		return snprintf(reply, size, "error failed to lock the db\n");
+	if (!db_sync(db)) {
+		err = "failed to read the db";
+		goto unlock;
+	}
+	o = db_owner(db, me, type, br, true);
+	if (!o) {
+		err = "out of memory";
+		goto unlock;
+	}
+	if (o->count >= allowed)
+		db_cull(db, o);
+	if (o->count >= allowed) {
+		err = "quota reached";
+		goto unlock;
+	}
+	if (!get_new_nicname(&nicname, br, pid, &cnic)) {
+		err = "failed to create the nic";
+		goto unlock;
+	}
+	if (!db_append(db, o, nicname)) {
+		err = "failed to record the nic in the db";
+		if (lxc_netdev_delete_by_name(nicname) != 0)
+			fprintf(stderr, "Error unlinking %s!\n", nicname);
+	}
+unlock:
+	db_lock(db, false);
+	if (err) {
+		ret = snprintf(reply, size, "error %s\n", err);
+		goto out;
+	}
+
+	if (rename_in_ns(pid, cnic, name) < 0) {
+		ret = snprintf(reply, size, "error failed to rename the link\n");
+		goto out;
+	}
+	ret = snprintf(reply, size, "%s:%s\n", name, nicname);
+
+out:
+	free(nicname);
+	free(cnic);
+	return ret;
+}
+
+static void usernic_client_free(struct usernic_client *client,
+				struct lxc_epoll_descr *descr)
+{
+	struct usernic_server *server = client->server;
+	struct usernic_client **p;
+
+	for (p = &server->clients; *p; p = &(*p)->next) {
+		if (*p == client) {
+			*p = client->next;
+			break;
+		}
+	}
+	server->nclients--;
+	lxc_mainloop_del_handler(descr, client->fd);
+	close(client->fd);
+	free(client);
+}
+
+static int usernic_client_handler(int fd, uint32_t events, void *data,
+				  struct lxc_epoll_descr *descr)
+{
+	struct usernic_client *client = data;
+	struct usernic_db *db = &client->server->db;
+	char reply[USERNIC_REQUEST_MAX];
+	ssize_t ret;
+	int len;
+
+	ret = recv(fd, client->req + client->len,
+		   sizeof(client->req) - 1 - client->len, MSG_DONTWAIT);
+	if (ret < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (ret <= 0) {
+		usernic_client_free(client, descr);
+		return 0;
+	}
+	client->len += ret;
+	client->req[client->len] = '\0';
+
+	/* wait for the rest of the line, unless it can't fit */
+	if (!memchr(client->req, '\n', client->len) &&
+	    client->len < sizeof(client->req) - 1)
+		return 0;
+
+	len = usernic_serve(db, fd, client->req, reply, sizeof(reply));
+	if (len > 0 && len < sizeof(reply) &&
+	    send(fd, reply, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len)
+		fprintf(stderr, "Failed to answer a request: %s\n",
+			strerror(errno));
+	usernic_client_free(client, descr);
+
+	/* leave the mainloop when the db is due for compaction */
+	return time(NULL) - db->compacted >= USERNIC_COMPACT_INTERVAL;
+}
+
+static int usernic_accept_handler(int fd, uint32_t events, void *data,
+				  struct lxc_epoll_descr *descr)
+{
+	struct usernic_server *server = data;
+	struct usernic_client *client;
+	int clientfd;
+
+	clientfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (clientfd < 0) {
+		fprintf(stderr, "Failed to accept a connection: %s\n",
+			strerror(errno));
+		return 0;
+	}
+
+	if (server->nclients >= USERNIC_CLIENTS_MAX) {
+		fprintf(stderr, "Too many pending requests, dropping one\n");
+		send(clientfd, "error busy\n", 11, MSG_NOSIGNAL | MSG_DONTWAIT);
+		close(clientfd);
+		return 0;
+	}
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(clientfd);
+		return 0;
+	}
+	client->fd = clientfd;
+	client->deadline = time(NULL) + USERNIC_REQUEST_TIMEOUT;
+	client->server = server;
+	if (lxc_mainloop_add_handler(descr, clientfd, usernic_client_handler,
+				     client)) {
+		fprintf(stderr, "Failed to add a client to the mainloop\n");
+		close(clientfd);
+		free(client);
+		return 0;
+	}
+	client->next = server->clients;
+	server->clients = client;
+	server->nclients++;
+
+	/* leave the mainloop so that its timeout covers the new deadline */
+	return 1;
+}
+
+/* drop the clients which didn't send their request in time */
+static void usernic_expire_clients(struct usernic_server *server,
+				   struct lxc_epoll_descr *descr)
+{
+	struct usernic_client *client, *next;
+	time_t now = time(NULL);
+
+	for (client = server->clients; client; client = next) {
+		next = client->next;
+		if (now >= client->deadline)
+			usernic_client_free(client, descr);
+	}
+}
+
+static int usernic_daemon(void)
+{
+	struct usernic_server server = { .db = { .fd = -1 } };
+	struct usernic_db *db = &server.db;
+	struct lxc_epoll_descr descr;
+	int fd, timeout;
+	time_t now;
+
+	if (geteuid() != 0 || getuid() != 0) {
+		fprintf(stderr, "The daemon mode must be run as root\n");
+		return 1;
+	}
+
+	if (!create_db_dir(LXC_USERNIC_DB)) {
+		fprintf(stderr, "Failed to create directory for db file\n");
+		return 1;
+	}
+	if ((db->fd = open_and_lock(LXC_USERNIC_DB)) < 0)
+		return 1;
+	if (fcntl(db->fd, F_SETFD, FD_CLOEXEC) < 0 || !db_load(db)) {
+		close(db->fd);
+		return 1;
+	}
+	db_lock(db, false);
+	db->compacted = time(NULL);
+
+	fd = lxc_abstract_unix_open(LXC_USERNIC_SOCKET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to listen on @%s: %s\n",
+			&LXC_USERNIC_SOCKET[1], strerror(errno));
+		close(db->fd);
+		return 1;
+	}
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || lxc_mainloop_open(&descr)) {
+		close(fd);
+		close(db->fd);
+		return 1;
+	}
+	if (lxc_mainloop_add_handler(&descr, fd, usernic_accept_handler,
+				     &server)) {
+		fprintf(stderr, "Failed to add the socket to the mainloop\n");
+		goto out;
+	}
+
+	for (;;) {
+		/* wake up for the next compaction, or to drop silent clients */
+		timeout = USERNIC_COMPACT_INTERVAL;
+		if (server.clients)
+			timeout = 1;
+		if (lxc_mainloop(&descr, timeout * 1000) < 0) {
+			fprintf(stderr, "The mainloop failed: %s\n",
+				strerror(errno));
+			break;
+		}
+		usernic_expire_clients(&server, &descr);
+		now = time(NULL);
+		if (now - db->compacted >= USERNIC_COMPACT_INTERVAL)
+			db_compact(db);
+	}
+
+out:
+	while (server.clients)
+		usernic_client_free(server.clients, &descr);
+	lxc_mainloop_close(&descr);
+	close(fd);
+	close(db->fd);
+	db_clear(db);
+	return 1;
+}
+
 int main(int argc, char *argv[])
 {
 	int n, fd;
@@ -565,6 +1205,9 @@ int main(int argc, char *argv[])
 	char *vethname;
 	int pid;
 
+	if (argc == 2 && strcmp(argv[1], "--daemon") == 0)
+		exit(usernic_daemon());
+
 	if ((me = get_username()) == NULL) {
 		fprintf(stderr, "Failed to get username\n");
 		exit(1);
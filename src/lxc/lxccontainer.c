@@ -26,6 +26,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sched.h>
@@ -36,6 +37,8 @@
 #include <stdint.h>
 #include <grp.h>
 #include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 #include <lxc/lxccontainer.h>
 #include <lxc/version.h>
@@ -55,12 +58,12 @@
 #include "monitor.h"
 #include "namespace.h"
 #include "lxclock.h"
-
-#if HAVE_IFADDRS_H
-#include <ifaddrs.h>
-#else
-#include <../include/ifaddrs.h>
-#endif
+#include "nl.h"
+#include "network.h"
+#include "af_unix.h"
+#include "idshift.h"
+#include "ptypool.h"
+#include "trash.h"
 
 #define MAX_BUFFER 4096
 
@@ -249,6 +252,10 @@ static void lxc_container_free(struct lxc_container *c)
 		free(c->config_path);
 		c->config_path = NULL;
 	}
+	if (c->attach_ctx) {
+		lxc_attach_ctx_free(c->attach_ctx);
+		c->attach_ctx = NULL;
+	}
 
 	free(c);
 }
@@ -405,6 +412,27 @@ static int lxcapi_console(struct lxc_container *c, int ttynum, int stdinfd,
 	return lxc_console(c, ttynum, stdinfd, stdoutfd, stderrfd, escape);
 }
 
+static int lxcapi_console_log(struct lxc_container *c, struct lxc_console_log *log)
+{
+	int ret;
+
+	if (!c || !log)
+		return -EINVAL;
+
+	ret = lxc_cmd_console_log(c->name, c->config_path, log);
+	if (ret == -ENODATA)
+		NOTICE("container %s has no console buffer", c->name);
+	return ret;
+}
+
+static char *lxcapi_get_start_trace(struct lxc_container *c)
+{
+	if (!c)
+		return NULL;
+
+	return lxc_cmd_get_start_trace(c->name, c->config_path);
+}
+
 static pid_t lxcapi_init_pid(struct lxc_container *c)
 {
 	if (!c)
@@ -603,19 +631,35 @@ static bool lxcapi_start(struct lxc_container *c, int useinit, char * const argv
 	* while container is running...
 	*/
 	if (daemonize) {
+		struct lxc_pty_info *ptys;
+		int nptys;
+
 		lxc_monitord_spawn(c->config_path);
 
+		/* hand pre-opened ptys for the ttys and the console over */
+		ptys = malloc(sizeof(*ptys) * (conf->tty + 1));
+		nptys = ptys ? lxc_pty_pool_take(ptys, conf->tty + 1) : 0;
+
 		pid_t pid = fork();
-		if (pid < 0)
+		if (pid < 0) {
+			lxc_pty_close(ptys, nptys);
+			free(ptys);
 			return false;
+		}
 
 		if (pid != 0) {
+			lxc_pty_close(ptys, nptys);
+			free(ptys);
+			/* get ready for the next container, in the background */
+			lxc_pty_pool_fill();
 			/* Set to NULL because we don't want father unlink
 			 * the PID file, child will do the free and unlink.
 			 */
 			c->pidfile = NULL;
 			return wait_on_daemonized_start(c, pid);
 		}
+		lxc_pty_pool_adopt(ptys, nptys);
+		free(ptys);
 
 		/* second fork to be reparented by init */
 		pid = fork();
@@ -682,10 +726,12 @@ reboot:
 		c->pidfile = NULL;
 	}
 
-	if (daemonize)
+	if (daemonize) {
+		/* whatever was left of the ptys adopted from the parent */
+		lxc_pty_pool_release();
 		exit (ret == 0 ? true : false);
-	else
-		return (ret == 0 ? true : false);
+	}
+	return (ret == 0 ? true : false);
 }
 
 /*
@@ -858,7 +904,64 @@ static char *lxcbasename(char *path)
 	return p;
 }
 
-static bool create_run_template(struct lxc_container *c, char *tpath, bool quiet,
+/*
+ * Mount the rootfs of a container being created in a private mount
+ * namespace, for its template to fill it in. Meant to be called by a child
+ * task, which exits when done with it.
+ */
+static struct bdev *create_mount_rootfs(struct lxc_container *c)
+{
+	struct bdev *bdev;
+	char *src;
+
+	src = c->lxc_conf->rootfs.path;
+	/*
+	 * for an overlay create, what the user wants is the template to fill
+	 * in what will become the readonly lower layer.  So don't mount for
+	 * the template
+	 */
+	if (strncmp(src, "overlayfs:", 10) == 0)
+		src = overlay_getlower(src+10);
+	if (strncmp(src, "aufs:", 5) == 0)
+		src = overlay_getlower(src+5);
+
+	bdev = bdev_init(src, c->lxc_conf->rootfs.mount, NULL);
+	if (!bdev) {
+		ERROR("Error opening rootfs");
+		return NULL;
+	}
+
+	if (geteuid() == 0) {
+		if (unshare(CLONE_NEWNS) < 0) {
+			ERROR("error unsharing mounts");
+			return NULL;
+		}
+		if (detect_shared_rootfs()) {
+			if (mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL)) {
+				SYSERROR("Failed to make / rslave to run template");
+				ERROR("Continuing...");
+			}
+		}
+	}
+	if (strcmp(bdev->type, "dir") != 0) {
+		if (geteuid() != 0) {
+			ERROR("non-root users can only create directory-backed containers");
+			return NULL;
+		}
+		if (bdev->ops->mount(bdev) < 0) {
+			ERROR("Error mounting rootfs");
+			return NULL;
+		}
+	} else { // TODO come up with a better way here!
+		if (bdev->dest)
+			free(bdev->dest);
+		bdev->dest = strdup(bdev->src);
+	}
+
+	return bdev;
+}
+
+static bool create_run_template(struct lxc_container *c, char *tpath, int flags,
 				char *const argv[])
 {
 	pid_t pid;
@@ -873,14 +976,14 @@ static bool create_run_template(struct lxc_container *c, char *tpath, bool quiet
 	}
 
 	if (pid == 0) { // child
-		char *patharg, *namearg, *rootfsarg, *src;
+		char *patharg, *namearg, *rootfsarg;
 		struct bdev *bdev = NULL;
 		int i;
 		int ret, len, nargs = 0;
 		char **newargv;
 		struct lxc_conf *conf = c->lxc_conf;
 
-		if (quiet) {
+		if (flags & LXC_CREATE_QUIET) {
 			close(0);
 			close(1);
 			close(2);
@@ -889,49 +992,9 @@ static bool create_run_template(struct lxc_container *c, char *tpath, bool quiet
 			open("/dev/null", O_RDWR);
 		}
 
-		src = c->lxc_conf->rootfs.path;
-		/*
-		 * for an overlay create, what the user wants is the template to fill
-		 * in what will become the readonly lower layer.  So don't mount for
-		 * the template
-		 */
-		if (strncmp(src, "overlayfs:", 10) == 0)
-			src = overlay_getlower(src+10);
-		if (strncmp(src, "aufs:", 5) == 0)
-			src = overlay_getlower(src+5);
-
-		bdev = bdev_init(src, c->lxc_conf->rootfs.mount, NULL);
-		if (!bdev) {
-			ERROR("Error opening rootfs");
+		bdev = create_mount_rootfs(c);
+		if (!bdev)
 			exit(1);
-		}
-
-		if (geteuid() == 0) {
-			if (unshare(CLONE_NEWNS) < 0) {
-				ERROR("error unsharing mounts");
-				exit(1);
-			}
-			if (detect_shared_rootfs()) {
-				if (mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL)) {
-					SYSERROR("Failed to make / rslave to run template");
-					ERROR("Continuing...");
-				}
-			}
-		}
-		if (strcmp(bdev->type, "dir") != 0) {
-			if (geteuid() != 0) {
-				ERROR("non-root users can only create directory-backed containers");
-				exit(1);
-			}
-			if (bdev->ops->mount(bdev) < 0) {
-				ERROR("Error mounting rootfs");
-				exit(1);
-			}
-		} else { // TODO come up with a better way here!
-			if (bdev->dest)
-				free(bdev->dest);
-			bdev->dest = strdup(bdev->src);
-		}
 
 		/*
 		 * create our new array, pre-pend the template name and
@@ -990,8 +1053,11 @@ static bool create_run_template(struct lxc_container *c, char *tpath, bool quiet
 		 * lxc-usernsexec <-m map1> ... <-m mapn> --
 		 * and we append "--mapped-uid x", where x is the mapped uid
 		 * for our geteuid()
+		 * The ids are shifted afterwards instead with
+		 * LXC_CREATE_SHIFTIDS.
 		 */
-		if (!lxc_list_empty(&conf->id_map)) {
+		if (!lxc_list_empty(&conf->id_map) &&
+		    !(flags & LXC_CREATE_SHIFTIDS)) {
 			int n2args = 1;
 			char txtuid[20];
 			char txtgid[20];
@@ -1209,6 +1275,44 @@ static void lxcapi_clear_config(struct lxc_container *c)
 	}
 }
 
+/*
+ * Shift the rootfs filled in by a template run as root into the container's
+ * id map, for LXC_CREATE_SHIFTIDS.
+ */
+static bool create_shift_ids(struct lxc_container *c)
+{
+	char progress[MAXPATHLEN];
+	struct bdev *bdev;
+	pid_t pid;
+	int ret;
+
+	ret = snprintf(progress, MAXPATHLEN, "%s/%s/idshift", c->config_path,
+		       c->name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return false;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("failed to fork task to shift the ids of the rootfs");
+		return false;
+	}
+
+	if (pid == 0) {
+		bdev = create_mount_rootfs(c);
+		if (!bdev)
+			exit(1);
+		ret = lxc_shift_ids(bdev->dest, NULL, &c->lxc_conf->id_map,
+				    progress, 0);
+		exit(ret < 0 ? 1 : 0);
+	}
+
+	if (wait_for_pid(pid) != 0) {
+		ERROR("Error shifting the rootfs into the container's id map");
+		return false;
+	}
+	return true;
+}
+
 static bool lxcapi_destroy(struct lxc_container *c);
 /*
  * lxcapi_create:
@@ -1263,6 +1367,13 @@ static bool lxcapi_create(struct lxc_container *c, const char *t,
 		}
 	}
 
+	if (flags & LXC_CREATE_SHIFTIDS) {
+		if (geteuid() != 0 || lxc_list_empty(&c->lxc_conf->id_map)) {
+			ERROR("Shifting ids needs root and a container with an id map");
+			goto free_tpath;
+		}
+	}
+
 	if (!create_container_dir(c))
 		goto free_tpath;
 
@@ -1331,7 +1442,10 @@ static bool lxcapi_create(struct lxc_container *c, const char *t,
 	if (!load_config_locked(c, c->configfile))
 		goto out_unlock;
 
-	if (!create_run_template(c, tpath, !!(flags & LXC_CREATE_QUIET), argv))
+	if (!create_run_template(c, tpath, flags, argv))
+		goto out_unlock;
+
+	if ((flags & LXC_CREATE_SHIFTIDS) && !create_shift_ids(c))
 		goto out_unlock;
 
 	// now clear out the lxc_conf we have, reload from the created
@@ -1561,208 +1675,216 @@ static bool remove_from_array(char ***names, char *cname, int size)
 	return false;
 }
 
-static char** lxcapi_get_interfaces(struct lxc_container *c)
+/*
+ * Open a netlink socket in the network namespace of the running container
+ * @c. As root, the calling thread can setns() into the container's netns
+ * and back. Otherwise the container's user namespace has to be entered
+ * first, which can't be undone, so a child does that and hands the socket
+ * back to us.
+ */
+static int container_netlink_open(struct lxc_container *c, struct nl_handler *nlh)
 {
+	char path[MAXPATHLEN];
+	int netns, ret, fd = -1, sv[2];
 	pid_t pid;
-	int i, count = 0, pipefd[2];
-	char **interfaces = NULL;
-	char interface[IFNAMSIZ];
 
-	if(pipe(pipefd) < 0) {
-		SYSERROR("pipe failed");
-		return NULL;
+	if (geteuid() == 0) {
+		pid = c->init_pid(c);
+		if (pid < 0) {
+			ERROR("%s is not running", c->name);
+			return -1;
+		}
+
+		ret = snprintf(path, MAXPATHLEN, "/proc/%d/ns/net", pid);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			return -1;
+
+		netns = open(path, O_RDONLY | O_CLOEXEC);
+		if (netns < 0) {
+			SYSERROR("failed to open %s", path);
+			return -1;
+		}
+
+		ret = lxc_netns_netlink_open(nlh, netns);
+		close(netns);
+		if (ret < 0) {
+			ERROR("failed to open a netlink socket in %s: %s", path,
+			      strerror(-ret));
+			return -1;
+		}
+		return 0;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		SYSERROR("socketpair failed");
+		return -1;
 	}
 
 	pid = fork();
 	if (pid < 0) {
-		SYSERROR("failed to fork task to get interfaces information");
-		close(pipefd[0]);
-		close(pipefd[1]);
-		return NULL;
+		SYSERROR("failed to fork task to open a netlink socket");
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
 	}
 
-	if (pid == 0) { // child
-		int ret = 1, nbytes;
-		struct ifaddrs *interfaceArray = NULL, *tempIfAddr = NULL;
-
-		/* close the read-end of the pipe */
-		close(pipefd[0]);
+	if (pid == 0) {
+		close(sv[0]);
 
 		if (!enter_to_ns(c)) {
 			SYSERROR("failed to enter namespace");
-			goto out;
+			exit(1);
 		}
 
-		/* Grab the list of interfaces */
-		if (getifaddrs(&interfaceArray)) {
-			SYSERROR("failed to get interfaces list");
-			goto out;
+		if (netlink_open(nlh, NETLINK_ROUTE) < 0) {
+			ERROR("failed to open a netlink socket");
+			exit(1);
 		}
 
-		/* Iterate through the interfaces */
-		for (tempIfAddr = interfaceArray; tempIfAddr != NULL; tempIfAddr = tempIfAddr->ifa_next) {
-			nbytes = write(pipefd[1], tempIfAddr->ifa_name, IFNAMSIZ);
-			if (nbytes < 0) {
-				ERROR("write failed");
-				goto out;
-			}
-			count++;
+		if (lxc_abstract_unix_send_fd(sv[1], nlh->fd, NULL, 0) <= 0) {
+			SYSERROR("failed to send the netlink socket");
+			exit(1);
 		}
-		ret = 0;
+		exit(0);
+	}
 
-	out:
-		if (interfaceArray)
-			freeifaddrs(interfaceArray);
+	close(sv[1]);
+	ret = lxc_abstract_unix_recv_fd(sv[0], &fd, NULL, 0);
+	close(sv[0]);
 
-		/* close the write-end of the pipe, thus sending EOF to the reader */
-		close(pipefd[1]);
-		exit(ret);
+	if (wait_for_pid(pid) != 0 || ret <= 0 || fd < 0) {
+		if (ret > 0 && fd >= 0)
+			close(fd);
+		return -1;
 	}
 
-	/* close the write-end of the pipe */
-	close(pipefd[1]);
+	if (netlink_open_fd(nlh, fd) < 0) {
+		netlink_close(nlh);
+		return -1;
+	}
 
-	while (read(pipefd[0], &interface, IFNAMSIZ) == IFNAMSIZ) {
-		if (array_contains(&interfaces, interface, count))
-				continue;
+	return 0;
+}
 
-		if(!add_to_array(&interfaces, interface, count))
-			ERROR("PARENT: add_to_array failed");
-		count++;
-	}
+static int lxcapi_get_net_info(struct lxc_container *c, struct lxc_interface **ifs)
+{
+	struct nl_handler nlh;
+	int count;
 
-	if (wait_for_pid(pid) != 0) {
-		for(i=0;i<count;i++)
-			free(interfaces[i]);
-		free(interfaces);
-		interfaces = NULL;
-	}
+	if (!c || !ifs)
+		return -1;
 
-	/* close the read-end of the pipe */
-	close(pipefd[0]);
+	if (container_netlink_open(c, &nlh) < 0)
+		return -1;
 
-	/* Append NULL to the array */
-	if(interfaces)
-		interfaces = (char **)lxc_append_null_to_array((void **)interfaces, count);
+	count = lxc_netdev_list(&nlh, ifs);
+	netlink_close(&nlh);
+	if (count < 0) {
+		ERROR("failed to get interfaces information: %s", strerror(-count));
+		return -1;
+	}
 
-	return interfaces;
+	return count;
 }
 
-static char** lxcapi_get_ips(struct lxc_container *c, const char* interface, const char* family, int scope)
+void lxc_interfaces_free(struct lxc_interface *ifs, int count)
 {
-	pid_t pid;
-	int i, count = 0, pipefd[2];
-	char **addresses = NULL;
-	char address[INET6_ADDRSTRLEN];
+	int i, j;
 
-	if(pipe(pipefd) < 0) {
-		SYSERROR("pipe failed");
-		return NULL;
+	if (!ifs)
+		return;
+
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < ifs[i].naddrs; j++)
+			free(ifs[i].addrs[j].address);
+		free(ifs[i].addrs);
+		free(ifs[i].hwaddr);
+		free(ifs[i].name);
 	}
+	free(ifs);
+}
 
-	pid = fork();
-	if (pid < 0) {
-		SYSERROR("failed to fork task to get container ips");
-		close(pipefd[0]);
-		close(pipefd[1]);
+static char** lxcapi_get_interfaces(struct lxc_container *c)
+{
+	struct lxc_interface *ifs;
+	char **interfaces;
+	int i, count;
+
+	count = lxcapi_get_net_info(c, &ifs);
+	if (count < 0)
 		return NULL;
+
+	interfaces = calloc(count + 1, sizeof(char *));
+	if (!interfaces)
+		goto out;
+
+	/* ifs is already sorted by name */
+	for (i = 0; i < count; i++) {
+		interfaces[i] = strdup(ifs[i].name);
+		if (!interfaces[i]) {
+			lxc_free_array((void **)interfaces, free);
+			interfaces = NULL;
+			break;
+		}
 	}
 
-	if (pid == 0) { // child
-		int ret = 1, nbytes;
-		struct ifaddrs *interfaceArray = NULL, *tempIfAddr = NULL;
-		char addressOutputBuffer[INET6_ADDRSTRLEN];
-		void *tempAddrPtr = NULL;
-		char *address = NULL;
+out:
+	lxc_interfaces_free(ifs, count);
+	return interfaces;
+}
 
-		/* close the read-end of the pipe */
-		close(pipefd[0]);
+static char** lxcapi_get_ips(struct lxc_container *c, const char* interface, const char* family, int scope)
+{
+	struct lxc_interface *ifs;
+	struct lxc_ifaddr *addr;
+	char **addresses = NULL, **tmp;
+	int i, j, count, naddrs = 0;
 
-		if (!enter_to_ns(c)) {
-			SYSERROR("failed to enter namespace");
-			goto out;
-		}
+	count = lxcapi_get_net_info(c, &ifs);
+	if (count < 0)
+		return NULL;
 
-		/* Grab the list of interfaces */
-		if (getifaddrs(&interfaceArray)) {
-			SYSERROR("failed to get interfaces list");
-			goto out;
-		}
+	for (i = 0; i < count; i++) {
+		if (interface && strcmp(interface, ifs[i].name))
+			continue;
+		else if (!interface && strcmp("lo", ifs[i].name) == 0)
+			continue;
 
-		/* Iterate through the interfaces */
-		for (tempIfAddr = interfaceArray; tempIfAddr != NULL; tempIfAddr = tempIfAddr->ifa_next) {
-			if (tempIfAddr->ifa_addr == NULL)
-				continue;
+		for (j = 0; j < ifs[i].naddrs; j++) {
+			addr = &ifs[i].addrs[j];
 
-			if(tempIfAddr->ifa_addr->sa_family == AF_INET) {
+			if (addr->family == AF_INET) {
 				if (family && strcmp(family, "inet"))
 					continue;
-				tempAddrPtr = &((struct sockaddr_in *)tempIfAddr->ifa_addr)->sin_addr;
-			}
-			else {
+			} else {
 				if (family && strcmp(family, "inet6"))
 					continue;
-
-				if (((struct sockaddr_in6 *)tempIfAddr->ifa_addr)->sin6_scope_id != scope)
+				if (addr->scope != scope)
 					continue;
-
-				tempAddrPtr = &((struct sockaddr_in6 *)tempIfAddr->ifa_addr)->sin6_addr;
 			}
 
-			if (interface && strcmp(interface, tempIfAddr->ifa_name))
-				continue;
-			else if (!interface && strcmp("lo", tempIfAddr->ifa_name) == 0)
-				continue;
-
-			address = (char *)inet_ntop(tempIfAddr->ifa_addr->sa_family,
-						tempAddrPtr,
-						addressOutputBuffer,
-						sizeof(addressOutputBuffer));
-			if (!address)
-					continue;
-
-			nbytes = write(pipefd[1], address, INET6_ADDRSTRLEN);
-			if (nbytes < 0) {
-				ERROR("write failed");
-				goto out;
-			}
-			count++;
+			tmp = realloc(addresses, (naddrs + 2) * sizeof(char *));
+			if (!tmp)
+				goto out_error;
+			addresses = tmp;
+			addresses[naddrs] = strdup(addr->address);
+			if (!addresses[naddrs])
+				goto out_error;
+			addresses[++naddrs] = NULL;
 		}
-		ret = 0;
-
-	out:
-		if(interfaceArray)
-			freeifaddrs(interfaceArray);
-
-		/* close the write-end of the pipe, thus sending EOF to the reader */
-		close(pipefd[1]);
-		exit(ret);
-	}
-
-	/* close the write-end of the pipe */
-	close(pipefd[1]);
-
-	while (read(pipefd[0], &address, INET6_ADDRSTRLEN) == INET6_ADDRSTRLEN) {
-		if(!add_to_array(&addresses, address, count))
-			ERROR("PARENT: add_to_array failed");
-		count++;
 	}
 
-	if (wait_for_pid(pid) != 0) {
-		for(i=0;i<count;i++)
-			free(addresses[i]);
-		free(addresses);
-		addresses = NULL;
-	}
-
-	/* close the read-end of the pipe */
-	close(pipefd[0]);
-
-	/* Append NULL to the array */
-	if(addresses)
-		addresses = (char **)lxc_append_null_to_array((void **)addresses, count);
+	if (addresses)
+		qsort(addresses, naddrs, sizeof(char *), (int (*)(const void *,const void *))string_cmp);
 
+	lxc_interfaces_free(ifs, count);
 	return addresses;
+
+out_error:
+	ERROR("Out of memory");
+	lxc_free_array((void **)addresses, free);
+	lxc_interfaces_free(ifs, count);
+	return NULL;
 }
 
 static int lxcapi_get_config_item(struct lxc_container *c, const char *key, char *retv, int inlen)
@@ -1987,11 +2109,15 @@ static int lxc_rmdir_onedev_wrapper(void *data)
 	return lxc_rmdir_onedev(arg);
 }
 
-// do we want the api to support --force, or leave that to the caller?
-static bool lxcapi_destroy(struct lxc_container *c)
+/*
+ * Destroy container @c.  With lxc.destroy.deferred, its directory goes to
+ * the trash of @trashpath.
+ */
+static bool do_destroy(struct lxc_container *c, const char *trashpath)
 {
 	struct bdev *r = NULL;
-	bool bret = false;
+	const char *rootfs;
+	bool bret = false, deferred;
 	int ret;
 
 	if (!c || !lxcapi_is_defined(c))
@@ -2011,8 +2137,23 @@ static bool lxcapi_destroy(struct lxc_container *c)
 		goto out;
 	}
 
+	const char *p1 = lxcapi_get_config_path(c);
+	char *path = alloca(strlen(p1) + strlen(c->name) + 2);
+	sprintf(path, "%s/%s", p1, c->name);
+	deferred = lxc_trash_enabled();
+
 	if (!am_unpriv() && c->lxc_conf && c->lxc_conf->rootfs.path && c->lxc_conf->rootfs.mount) {
 		r = bdev_init(c->lxc_conf->rootfs.path, c->lxc_conf->rootfs.mount, NULL);
+		/*
+		 * A rootfs which is just files in the container directory goes
+		 * to the trash with it
+		 */
+		if (r && deferred && (rootfs = bdev_destroy_path(r)) &&
+		    strncmp(rootfs, path, strlen(path)) == 0 &&
+		    rootfs[strlen(path)] == '/') {
+			bdev_put(r);
+			r = NULL;
+		}
 		if (r) {
 			if (r->ops->destroy(r) < 0) {
 				bdev_put(r);
@@ -2025,9 +2166,11 @@ static bool lxcapi_destroy(struct lxc_container *c)
 
 	mod_all_rdeps(c, false);
 
-	const char *p1 = lxcapi_get_config_path(c);
-	char *path = alloca(strlen(p1) + strlen(c->name) + 2);
-	sprintf(path, "%s/%s", p1, c->name);
+	if (deferred && lxc_trash_container(trashpath, path, c->name) == 0) {
+		lxc_trash_spawn_reaper(trashpath);
+		bret = true;
+		goto out;
+	}
 	if (am_unpriv())
 		ret = userns_exec_1(c->lxc_conf, lxc_rmdir_onedev_wrapper, path);
 	else
@@ -2043,6 +2186,14 @@ out:
 	return bret;
 }
 
+// do we want the api to support --force, or leave that to the caller?
+static bool lxcapi_destroy(struct lxc_container *c)
+{
+	if (!c)
+		return false;
+	return do_destroy(c, lxcapi_get_config_path(c));
+}
+
 static bool set_config_item_locked(struct lxc_container *c, const char *key, const char *v)
 {
 	struct lxc_config_t *config;
@@ -2426,13 +2577,18 @@ static bool add_rdepends(struct lxc_container *c, struct lxc_container *c0)
 }
 
 static int copy_storage(struct lxc_container *c0, struct lxc_container *c,
-		const char *newtype, int flags, const char *bdevdata, uint64_t newsize)
+		struct bdev *orig, const char *newtype, int flags,
+		const char *bdevdata, uint64_t newsize)
 {
 	struct bdev *bdev;
 	int need_rdep;
 
-	bdev = bdev_copy(c0, c->name, c->config_path, newtype, flags,
-			bdevdata, newsize, &need_rdep);
+	if (orig)
+		bdev = bdev_copy_from(orig, c0, c->name, c->config_path, newtype,
+				flags, bdevdata, newsize, &need_rdep);
+	else
+		bdev = bdev_copy(c0, c->name, c->config_path, newtype, flags,
+				bdevdata, newsize, &need_rdep);
 	if (!bdev) {
 		ERROR("Error copying storage");
 		return -1;
@@ -2542,6 +2698,18 @@ static int clone_update_rootfs(struct clone_update_data *data)
 		}
 	}
 
+	if (flags & LXC_CLONE_SHIFTIDS) {
+		ret = snprintf(path, MAXPATHLEN, "%s/%s/idshift",
+			       c->config_path, c->name);
+		if (ret < 0 || ret >= MAXPATHLEN ||
+		    lxc_shift_ids(bdev->dest, &c0->lxc_conf->id_map,
+				  &conf->id_map, path, 0) < 0) {
+			ERROR("Error shifting the ids of %s", c->name);
+			bdev_put(bdev);
+			return -1;
+		}
+	}
+
 	if (!(flags & LXC_CLONE_KEEPNAME)) {
 		ret = snprintf(path, MAXPATHLEN, "%s/etc/hostname", bdev->dest);
 		bdev_put(bdev);
@@ -2600,32 +2768,67 @@ static int create_file_dirname(char *path)
 	return ret;
 }
 
-static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *newname,
-		const char *lxcpath, int flags,
-		const char *bdevtype, const char *bdevdata, uint64_t newsize,
-		char **hookargs)
+/*
+ * For LXC_CLONE_SHIFTIDS: give the clone the id map of the default
+ * configuration, which its rootfs will be shifted into.
+ */
+static bool clone_default_idmap(struct lxc_container *c)
 {
-	struct lxc_container *c2 = NULL;
-	char newpath[MAXPATHLEN];
-	int ret, storage_copied = 0;
-	const char *n, *l;
-	char *origroot = NULL;
-	struct clone_update_data data;
-	FILE *fout;
-	pid_t pid;
+	const char *path = lxc_global_config_value("lxc.default_config");
+	struct lxc_list *it, *next;
+	struct lxc_conf *conf;
+	bool ret = false;
 
-	if (!c || !c->is_defined(c))
-		return NULL;
+	conf = lxc_conf_init();
+	if (!conf)
+		return false;
+	if (lxc_config_read(path, conf) < 0) {
+		ERROR("Error reading %s", path);
+		goto out;
+	}
+	if (lxc_list_empty(&conf->id_map)) {
+		ERROR("No lxc.id_map in %s to shift the clone into", path);
+		goto out;
+	}
 
-	if (container_mem_lock(c))
-		return NULL;
+	lxc_clear_idmaps(c->lxc_conf);
+	lxc_list_for_each_safe(it, &conf->id_map, next) {
+		lxc_list_del(it);
+		lxc_list_add_tail(&c->lxc_conf->id_map, it);
+	}
+	ret = true;
+out:
+	lxc_conf_free(conf);
+	return ret;
+}
 
-	if (!is_stopped(c)) {
-		ERROR("error: Original container (%s) is running", c->name);
+/*
+ * do_clone: the body of lxcapi_clone. The caller must hold c's mem lock and
+ * have checked that c is stopped. @orig, if not NULL, is c's rootfs as
+ * returned by bdev_copy_source(), shared between the clones of c.
+ */
+static struct lxc_container *do_clone(struct lxc_container *c,
+		struct bdev *orig, const char *newname, const char *lxcpath,
+		int flags, const char *bdevtype, const char *bdevdata,
+		uint64_t newsize, char **hookargs)
+{
+	struct lxc_container *c2 = NULL;
+	char newpath[MAXPATHLEN];
+	int ret, storage_copied = 0;
+	const char *n, *l;
+	char *origroot = NULL;
+	struct clone_update_data data;
+	FILE *fout;
+	pid_t pid;
+
+	if ((flags & LXC_CLONE_SHIFTIDS) && am_unpriv()) {
+		ERROR("clone: only root can shift the ids of a clone");
 		goto out;
 	}
 
-	// Make sure the container doesn't yet exist.
+	// Make sure the container doesn't yet exist: another clone_many()
+	// child may be creating it right now, so only the one which creates
+	// its directory goes on.
 	n = newname ? newname : c->name;
 	l = lxcpath ? lxcpath : c->get_config_path(c);
 	ret = snprintf(newpath, MAXPATHLEN, "%s/%s/config", l, n);
@@ -2633,14 +2836,13 @@ static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *n
 		SYSERROR("clone: failed making config pathname");
 		goto out;
 	}
-	if (file_exists(newpath)) {
-		ERROR("error: clone: %s exists", newpath);
-		goto out;
-	}
 
 	ret = create_file_dirname(newpath);
-	if (ret < 0 && errno != EEXIST) {
-		ERROR("Error creating container dir for %s", newpath);
+	if (ret < 0) {
+		if (errno == EEXIST)
+			ERROR("error: clone: %s/%s exists", l, n);
+		else
+			ERROR("Error creating container dir for %s", newpath);
 		goto out;
 	}
 
@@ -2678,7 +2880,7 @@ static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *n
 	}
 
 	// copy/snapshot rootfs's
-	ret = copy_storage(c, c2, bdevtype, flags, bdevdata, newsize);
+	ret = copy_storage(c, c2, orig, bdevtype, flags, bdevdata, newsize);
 	if (ret < 0)
 		goto out;
 
@@ -2708,6 +2910,17 @@ static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *n
 	// fail after this
 	storage_copied = 1;
 
+	if (flags & LXC_CLONE_SHIFTIDS) {
+		/* an overlay's lower layer is shared with the original */
+		if (strncmp(c2->lxc_conf->rootfs.path, "overlayfs:", 10) == 0 ||
+		    strncmp(c2->lxc_conf->rootfs.path, "aufs:", 5) == 0) {
+			ERROR("clone: cannot shift the ids of an overlay snapshot");
+			goto out;
+		}
+		if (!clone_default_idmap(c2))
+			goto out;
+	}
+
 	if (!c2->save_config(c2, NULL))
 		goto out;
 
@@ -2719,7 +2932,6 @@ static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *n
 		ret = wait_for_pid(pid);
 		if (ret)
 			goto out;
-		container_mem_unlock(c);
 		return c2;
 	}
 	data.c0 = c;
@@ -2734,11 +2946,9 @@ static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *n
 	if (ret < 0)
 		exit(1);
 
-	container_mem_unlock(c);
 	exit(0);
 
 out:
-	container_mem_unlock(c);
 	if (c2) {
 		if (!storage_copied)
 			c2->lxc_conf->rootfs.path = NULL;
@@ -2749,6 +2959,229 @@ out:
 	return NULL;
 }
 
+static struct lxc_container *lxcapi_clone(struct lxc_container *c, const char *newname,
+		const char *lxcpath, int flags,
+		const char *bdevtype, const char *bdevdata, uint64_t newsize,
+		char **hookargs)
+{
+	struct lxc_container *c2 = NULL;
+
+	if (!c || !c->is_defined(c))
+		return NULL;
+
+	if (container_mem_lock(c))
+		return NULL;
+
+	if (!is_stopped(c)) {
+		ERROR("error: Original container (%s) is running", c->name);
+		goto out;
+	}
+
+	c2 = do_clone(c, NULL, newname, lxcpath, flags, bdevtype, bdevdata,
+			newsize, hookargs);
+
+out:
+	container_mem_unlock(c);
+	return c2;
+}
+
+/*
+ * Wait for any clone of clone_many_run() to be done, and record its result
+ * in the slot of its pid in @pids.  Returns -1 if there is none left.
+ */
+static int clone_many_reap(pid_t *pids, int count, bool *results)
+{
+	int i, status;
+	pid_t pid;
+
+	for (;;) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (i = 0; i < count; i++) {
+			if (pids[i] != pid)
+				continue;
+			results[i] = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+			pids[i] = 0;
+			return 0;
+		}
+	}
+}
+
+/*
+ * Run the clones of a clone_many request, at most max_parallel at a time.
+ * Each clone runs in its own process, so that neither a failure nor the
+ * process-wide state touched while cloning affects the others.  This
+ * runs in a child of its own, so any child reaped is one of the clones,
+ * and a new clone starts as soon as any one of them is done.
+ */
+static void clone_many_run(struct lxc_container *c, struct bdev *orig,
+		const char **newnames, int count, const char *lxcpath,
+		int flags, const char *bdevtype, const char *bdevdata,
+		uint64_t newsize, char **hookargs, int max_parallel,
+		bool *results)
+{
+	pid_t *pids;
+	int i, running = 0;
+
+	pids = calloc(count, sizeof(*pids));
+	if (!pids) {
+		ERROR("out of memory");
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		pid_t pid;
+
+		if (running >= max_parallel) {
+			if (clone_many_reap(pids, count, results) < 0)
+				break;
+			running--;
+		}
+
+		pid = fork();
+		if (pid < 0) {
+			SYSERROR("fork");
+			break;
+		}
+		if (pid == 0) {
+			struct lxc_container *c2;
+
+			c2 = do_clone(c, orig, newnames[i], lxcpath, flags,
+					bdevtype, bdevdata, newsize, hookargs);
+			if (!c2)
+				exit(1);
+			lxc_container_put(c2);
+			exit(0);
+		}
+		pids[i] = pid;
+		running++;
+	}
+
+	while (running-- > 0)
+		if (clone_many_reap(pids, count, results) < 0)
+			break;
+	free(pids);
+}
+
+static int lxcapi_clone_many(struct lxc_container *c, const char **newnames,
+		int count, const char *lxcpath, int flags,
+		const char *bdevtype, const char *bdevdata, uint64_t newsize,
+		char **hookargs, int max_parallel, bool *results)
+{
+	struct bdev *orig = NULL;
+	bool *shared;
+	pid_t pid;
+	int i, j, ret = -1;
+
+	if (!c || !c->is_defined(c) || !newnames || count <= 0 || !results)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		results[i] = false;
+		if (!newnames[i]) {
+			ERROR("clone_many: missing name for clone %d", i);
+			errno = EINVAL;
+			return -1;
+		}
+		// two clones of the same name would race for one directory
+		for (j = 0; j < i; j++) {
+			if (strcmp(newnames[i], newnames[j]) == 0) {
+				ERROR("clone_many: %s is given more than once",
+				      newnames[i]);
+				errno = EINVAL;
+				return -1;
+			}
+		}
+	}
+
+	if (max_parallel <= 0) {
+		max_parallel = sysconf(_SC_NPROCESSORS_ONLN);
+		if (max_parallel <= 0)
+			max_parallel = 1;
+	}
+
+	/* the results are filled in by a child, see below */
+	shared = mmap(NULL, count * sizeof(*shared), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED) {
+		SYSERROR("mmap");
+		return -1;
+	}
+	memset(shared, 0, count * sizeof(*shared));
+
+	if (container_mem_lock(c))
+		goto out_unmap;
+
+	if (!is_stopped(c)) {
+		ERROR("error: Original container (%s) is running", c->name);
+		goto out;
+	}
+
+	orig = bdev_copy_source(c);
+	if (!orig)
+		goto out;
+
+	/* zfs and lvm can take the snapshots of all clones in one go */
+	if ((flags & LXC_CLONE_SNAPSHOT) && (!bdevtype || strcmp(bdevtype, orig->type) == 0))
+		(void) bdev_snapshot_many(orig, c, newnames, count,
+				lxcpath ? lxcpath : c->config_path, newsize);
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("fork");
+		goto out;
+	}
+
+	if (pid == 0) {
+		/*
+		 * For a privileged copy clone, mount the source only once in a
+		 * private mount namespace instead of once per clone.
+		 */
+		if (!am_unpriv() && !(flags & (LXC_CLONE_SNAPSHOT |
+					LXC_CLONE_MAYBE_SNAPSHOT))) {
+			if (unshare(CLONE_NEWNS) < 0)
+				SYSERROR("unshare CLONE_NEWNS");
+			else if (detect_shared_rootfs() &&
+					mount(NULL, "/", NULL, MS_SLAVE|MS_REC, NULL))
+				SYSERROR("Failed to make / rslave");
+			else if (orig->ops->mount(orig) < 0)
+				WARN("failed mounting %s onto %s, mounting it for each clone",
+					orig->src, orig->dest);
+			else
+				orig->mounted = true;
+		}
+
+		clone_many_run(c, orig, newnames, count, lxcpath, flags,
+				bdevtype, bdevdata, newsize, hookargs,
+				max_parallel, shared);
+		exit(0);
+	}
+
+	if (wait_for_pid(pid) < 0)
+		WARN("clone_many: not all clones of %s may have completed", c->name);
+
+	ret = 0;
+	for (i = 0; i < count; i++) {
+		results[i] = shared[i];
+		if (results[i])
+			ret++;
+	}
+	bdev_snapshot_many_cleanup(orig, c, newnames, results, count,
+			lxcpath ? lxcpath : c->config_path);
+
+out:
+	if (orig)
+		bdev_put(orig);
+	container_mem_unlock(c);
+out_unmap:
+	munmap(shared, count * sizeof(*shared));
+	return ret;
+}
+
 static bool lxcapi_rename(struct lxc_container *c, const char *newname)
 {
 	struct bdev *bdev;
@@ -2782,10 +3215,48 @@ static bool lxcapi_rename(struct lxc_container *c, const char *newname)
 
 static int lxcapi_attach(struct lxc_container *c, lxc_attach_exec_t exec_function, void *exec_payload, lxc_attach_options_t *options, pid_t *attached_process)
 {
+	int ret;
+
 	if (!c)
 		return -1;
 
-	return lxc_attach(c->name, c->config_path, exec_function, exec_payload, options, attached_process);
+	if (!c->attach_ctx)
+		return lxc_attach(c->name, c->config_path, exec_function,
+				exec_payload, options, attached_process);
+
+	if (container_mem_lock(c))
+		return -1;
+	if (c->attach_ctx)
+		ret = lxc_attach_ctx_run(c->attach_ctx, exec_function, exec_payload,
+				options, attached_process);
+	else
+		ret = lxc_attach(c->name, c->config_path, exec_function,
+				exec_payload, options, attached_process);
+	container_mem_unlock(c);
+	return ret;
+}
+
+static bool lxcapi_attach_cache(struct lxc_container *c, bool enable)
+{
+	bool ret = true;
+
+	if (!c)
+		return false;
+
+	if (container_mem_lock(c))
+		return false;
+
+	if (!enable) {
+		lxc_attach_ctx_free(c->attach_ctx);
+		c->attach_ctx = NULL;
+	} else if (!c->attach_ctx) {
+		c->attach_ctx = lxc_attach_ctx_new(c->name, c->config_path);
+		if (!c->attach_ctx)
+			ret = false;
+	}
+
+	container_mem_unlock(c);
+	return ret;
 }
 
 static int lxcapi_attach_run_wait(struct lxc_container *c, lxc_attach_options_t *options, const char *program, const char * const argv[])
@@ -2799,7 +3270,7 @@ static int lxcapi_attach_run_wait(struct lxc_container *c, lxc_attach_options_t
 
 	command.program = (char*)program;
 	command.argv = (char**)argv;
-	r = lxc_attach(c->name, c->config_path, lxc_attach_run_command, &command, options, &pid);
+	r = lxcapi_attach(c, lxc_attach_run_command, &command, options, &pid);
 	if (r < 0) {
 		ERROR("ups");
 		return r;
@@ -2807,42 +3278,351 @@ static int lxcapi_attach_run_wait(struct lxc_container *c, lxc_attach_options_t
 	return lxc_wait_for_pid_status(pid);
 }
 
-static int get_next_index(const char *lxcpath, char *cname)
+/*
+ * Each container's snapshot directory, ${lxcpath}snaps/${lxcname}, has an
+ * index of its snapshots in .index, so that listing them or picking the
+ * name of the next one doesn't have to look at every snapshot.  The first
+ * line is "next <n>", the index of the next snapshot, followed by one line
+ * per snapshot in the order they were taken:
+ *	<name> TAB <timestamp> TAB <has a comment, 0 or 1> TAB <bdev type>
+ * The index is rebuilt from the snapshot directories when it is missing,
+ * can't be parsed, or doesn't have as many snapshots as the directory has
+ * subdirectories.
+ */
+#define SNAP_INDEX ".index"
+
+struct snap_entry {
+	char name[20];
+	char timestamp[25];
+	bool comment;
+	char type[16];
+};
+
+struct snap_index {
+	int fd;
+	bool readonly;
+	int next;
+	int count;
+	struct snap_entry *entries;
+};
+
+static char *get_timestamp(char* snappath, char *name);
+
+static void snap_index_close(struct snap_index *idx)
 {
-	char *fname;
-	struct stat sb;
-	int i = 0, ret;
+	// closing the file drops the lock
+	if (idx->fd >= 0)
+		close(idx->fd);
+	free(idx->entries);
+	idx->fd = -1;
+	idx->entries = NULL;
+	idx->count = 0;
+}
 
-	fname = alloca(strlen(lxcpath) + 20);
-	while (1) {
-		sprintf(fname, "%s/snap%d", lxcpath, i);
-		ret = stat(fname, &sb);
-		if (ret != 0)
-			return i;
-		i++;
+static struct snap_entry *snap_index_add(struct snap_index *idx)
+{
+	struct snap_entry *n;
+
+	n = realloc(idx->entries, (idx->count + 1) * sizeof(*n));
+	if (!n)
+		return NULL;
+	idx->entries = n;
+	n = &idx->entries[idx->count++];
+	memset(n, 0, sizeof(*n));
+	return n;
+}
+
+static int snap_index_parse(struct snap_index *idx, char *buf)
+{
+	char *line, *nl, *f[4];
+	struct snap_entry *e;
+	int i;
+
+	if (sscanf(buf, "next %d\n", &idx->next) != 1 || idx->next < 0)
+		return -1;
+	line = strchr(buf, '\n');
+	if (!line)
+		return -1;
+	for (line++; (nl = strchr(line, '\n')); line = nl + 1) {
+		*nl = '\0';
+		f[0] = line;
+		for (i = 1; i < 4; i++) {
+			f[i] = strchr(f[i-1], '\t');
+			if (!f[i])
+				return -1;
+			*f[i]++ = '\0';
+		}
+		if (strlen(f[0]) >= sizeof(e->name) ||
+		    strlen(f[1]) >= sizeof(e->timestamp) ||
+		    strlen(f[3]) >= sizeof(e->type))
+			return -1;
+		e = snap_index_add(idx);
+		if (!e)
+			return -1;
+		strcpy(e->name, f[0]);
+		strcpy(e->timestamp, f[1]);
+		e->comment = strcmp(f[2], "1") == 0;
+		strcpy(e->type, f[3]);
 	}
+	// a last line without newline was cut short
+	return *line ? -1 : 0;
+}
+
+static int snap_index_write(struct snap_index *idx)
+{
+	char *buf, *p;
+	size_t len;
+	int i, ret = -1;
+
+	// an index we can't write is just rebuilt each time
+	if (idx->readonly)
+		return 0;
+
+	len = 32 + idx->count * (sizeof(struct snap_entry) + 4);
+	buf = malloc(len);
+	if (!buf)
+		return -1;
+	p = buf + sprintf(buf, "next %d\n", idx->next);
+	for (i = 0; i < idx->count; i++) {
+		struct snap_entry *e = &idx->entries[i];
+
+		p += sprintf(p, "%s\t%s\t%d\t%s\n", e->name, e->timestamp,
+			     e->comment ? 1 : 0, e->type);
+	}
+
+	if (ftruncate(idx->fd, 0) == 0 &&
+	    pwrite(idx->fd, buf, p - buf, 0) == p - buf)
+		ret = 0;
+	else
+		SYSERROR("Error writing the snapshot index");
+	free(buf);
+	return ret;
+}
+
+static int snap_entry_cmp(const void *a, const void *b)
+{
+	const struct snap_entry *ea = a, *eb = b;
+
+	return atoi(ea->name + 4) - atoi(eb->name + 4);
+}
+
+/* the bdev type of snapshot @name, from the lxc.rootfs in its config */
+static void snap_rootfs_type(const char *snappath, const char *name,
+			     char *type, size_t len)
+{
+	char path[MAXPATHLEN], *line = NULL, *p;
+	size_t sz = 0;
+	struct bdev *bdev;
+	FILE *f;
+	int ret;
+
+	snprintf(type, len, "-");
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/config", snappath, name);
+	if (ret < 0 || ret >= MAXPATHLEN || !(f = fopen(path, "r")))
+		return;
+	while (getline(&line, &sz, f) != -1) {
+		p = line + strspn(line, " \t");
+		if (strncmp(p, "lxc.rootfs", 10) != 0)
+			continue;
+		p += 10 + strspn(p + 10, " \t");
+		if (*p != '=')
+			continue;
+		p++;
+		p += strspn(p, " \t");
+		p[strcspn(p, "\n")] = '\0';
+		bdev = bdev_init(p, NULL, NULL);
+		if (bdev) {
+			snprintf(type, len, "%s", bdev->type);
+			bdev_put(bdev);
+		}
+		break;
+	}
+	free(line);
+	fclose(f);
+}
+
+static int snap_index_rebuild(struct snap_index *idx, char *snappath)
+{
+	char path[MAXPATHLEN], *ts, *end;
+	struct dirent dirent, *direntp;
+	struct snap_entry *e;
+	DIR *dir;
+	long n;
+	int ret;
+
+	free(idx->entries);
+	idx->entries = NULL;
+	idx->count = 0;
+	idx->next = 0;
+
+	dir = opendir(snappath);
+	if (!dir)
+		return -1;
+	while (!readdir_r(dir, &dirent, &direntp) && direntp) {
+		if (strncmp(direntp->d_name, "snap", 4) != 0 ||
+		    strlen(direntp->d_name) >= sizeof(e->name))
+			continue;
+		ret = snprintf(path, MAXPATHLEN, "%s/%s/config", snappath,
+			       direntp->d_name);
+		if (ret < 0 || ret >= MAXPATHLEN || !file_exists(path))
+			continue;
+
+		e = snap_index_add(idx);
+		if (!e) {
+			closedir(dir);
+			return -1;
+		}
+		strcpy(e->name, direntp->d_name);
+		ts = get_timestamp(snappath, direntp->d_name);
+		if (ts) {
+			snprintf(e->timestamp, sizeof(e->timestamp), "%s", ts);
+			free(ts);
+		}
+		ret = snprintf(path, MAXPATHLEN, "%s/%s/comment", snappath,
+			       direntp->d_name);
+		e->comment = ret > 0 && ret < MAXPATHLEN && file_exists(path);
+		snap_rootfs_type(snappath, e->name, e->type, sizeof(e->type));
+
+		n = strtol(direntp->d_name + 4, &end, 10);
+		if (!*end && n >= idx->next)
+			idx->next = n + 1;
+	}
+	closedir(dir);
+	// snapN were taken in the order of N
+	if (idx->count)
+		qsort(idx->entries, idx->count, sizeof(*idx->entries),
+		      snap_entry_cmp);
+
+	INFO("Rebuilt the snapshot index of %s, %d snapshots", snappath,
+	     idx->count);
+	return snap_index_write(idx);
+}
+
+/*
+ * snap_index_open: lock and load the snapshot index of the snapshot
+ * directory @snappath, rebuilding it if need be
+ *
+ * @idx      : filled in, to be released with snap_index_close()
+ * @snappath : the container's snapshot directory, which must exist
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int snap_index_open(struct snap_index *idx, char *snappath)
+{
+	char path[MAXPATHLEN], *buf = NULL;
+	struct stat st;
+	struct flock lk;
+	int ret;
+
+	memset(idx, 0, sizeof(*idx));
+	ret = snprintf(path, MAXPATHLEN, "%s/" SNAP_INDEX, snappath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	idx->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (idx->fd < 0 && (errno == EACCES || errno == EROFS)) {
+		// listing the snapshots of someone else's container
+		idx->readonly = true;
+		idx->fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (idx->fd < 0 && errno == ENOENT)
+			goto rebuild;
+	}
+	if (idx->fd < 0) {
+		SYSERROR("Error opening the snapshot index %s", path);
+		return -1;
+	}
+	lk.l_type = idx->readonly ? F_RDLCK : F_WRLCK;
+	lk.l_whence = SEEK_SET;
+	lk.l_start = 0;
+	lk.l_len = 0;
+	if (fcntl(idx->fd, F_SETLKW, &lk) < 0) {
+		SYSERROR("Error locking the snapshot index %s", path);
+		goto err;
+	}
+
+	if (fstat(idx->fd, &st) < 0)
+		goto err;
+	buf = malloc(st.st_size + 1);
+	if (!buf)
+		goto err;
+	if (pread(idx->fd, buf, st.st_size, 0) != st.st_size)
+		goto rebuild;
+	buf[st.st_size] = '\0';
+	if (snap_index_parse(idx, buf) < 0)
+		goto rebuild;
+
+	// where the link count of a directory counts its subdirectories, it
+	// tells whether snapshots were added or removed behind our back
+	if (stat(snappath, &st) == 0 && st.st_nlink > 1 &&
+	    st.st_nlink - 2 != idx->count)
+		goto rebuild;
+
+	free(buf);
+	return 0;
+
+rebuild:
+	free(buf);
+	if (snap_index_rebuild(idx, snappath) == 0)
+		return 0;
+err:
+	snap_index_close(idx);
+	return -1;
+}
+
+static int snap_index_find(struct snap_index *idx, const char *name)
+{
+	int i;
+
+	for (i = 0; i < idx->count; i++)
+		if (strcmp(idx->entries[i].name, name) == 0)
+			return i;
+	return -1;
 }
 
 static int lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
 {
 	int i, flags, ret;
 	struct lxc_container *c2;
-	char snappath[MAXPATHLEN], newname[20];
+	struct snap_index idx;
+	struct snap_entry *e;
+	struct bdev *bdev;
+	char snappath[MAXPATHLEN], newname[20], path[MAXPATHLEN];
 
 	// /var/lib/lxc -> /var/lib/lxcsnaps \0
 	ret = snprintf(snappath, MAXPATHLEN, "%ssnaps/%s", c->config_path, c->name);
 	if (ret < 0 || ret >= MAXPATHLEN)
 		return -1;
-	i = get_next_index(snappath, c->name);
 
 	if (mkdir_p(snappath, 0755) < 0) {
 		ERROR("Failed to create snapshot directory %s", snappath);
 		return -1;
 	}
 
+	/*
+	 * the index stays locked until the new snapshot is in it.  The fcntl
+	 * lock only keeps other processes out, so hold the mem lock as well
+	 * against other threads sharing this container.
+	 */
+	if (container_mem_lock(c))
+		return -1;
+	if (!is_stopped(c)) {
+		ERROR("error: Original container (%s) is running", c->name);
+		container_mem_unlock(c);
+		return -1;
+	}
+	if (snap_index_open(&idx, snappath) < 0) {
+		container_mem_unlock(c);
+		return -1;
+	}
+	for (i = idx.next; ; i++) {
+		ret = snprintf(path, MAXPATHLEN, "%s/snap%d", snappath, i);
+		if (ret < 0 || ret >= MAXPATHLEN)
+			goto err;
+		if (!dir_exists(path))
+			break;
+	}
 	ret = snprintf(newname, 20, "snap%d", i);
 	if (ret < 0 || ret >= 20)
-		return -1;
+		goto err;
 
 	/*
 	 * We pass LXC_CLONE_SNAPSHOT to make sure that a rdepends file entry is
@@ -2857,12 +3637,25 @@ static int lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
 		ERROR("and keep the original container pristine.");
 		flags &= ~LXC_CLONE_SNAPSHOT | LXC_CLONE_MAYBE_SNAPSHOT;
 	}
-	c2 = c->clone(c, newname, snappath, flags, NULL, NULL, 0, NULL);
+	// c->clone would take the mem lock we already hold
+	c2 = do_clone(c, NULL, newname, snappath, flags, NULL, NULL, 0, NULL);
 	if (!c2) {
 		ERROR("clone of %s:%s failed", c->config_path, c->name);
-		return -1;
+		goto err;
 	}
 
+	e = snap_index_add(&idx);
+	if (!e) {
+		lxc_container_put(c2);
+		goto err;
+	}
+	strcpy(e->name, newname);
+	snprintf(e->type, sizeof(e->type), "-");
+	bdev = bdev_init(c2->lxc_conf->rootfs.path, NULL, NULL);
+	if (bdev) {
+		snprintf(e->type, sizeof(e->type), "%s", bdev->type);
+		bdev_put(bdev);
+	}
 	lxc_container_put(c2);
 
 	// Now write down the creation time
@@ -2881,28 +3674,42 @@ static int lxcapi_snapshot(struct lxc_container *c, const char *commentfile)
 	f = fopen(dfnam, "w");
 	if (!f) {
 		ERROR("Failed to open %s", dfnam);
-		return -1;
+		goto err;
 	}
 	if (fprintf(f, "%s", buffer) < 0) {
 		SYSERROR("Writing timestamp");
 		fclose(f);
-		return -1;
+		goto err;
 	}
 	ret = fclose(f);
 	if (ret != 0) {
 		SYSERROR("Writing timestamp");
-		return -1;
+		goto err;
 	}
+	strcpy(e->timestamp, buffer);
 
 	if (commentfile) {
 		// $p / $name / comment \0
 		int len = strlen(snappath) + strlen(newname) + 10;
 		char *path = alloca(len);
 		sprintf(path, "%s/%s/comment", snappath, newname);
-		return copy_file(commentfile, path) < 0 ? -1 : i;
+		if (copy_file(commentfile, path) < 0)
+			goto err;
+		e->comment = true;
 	}
 
+	idx.next = i + 1;
+	if (snap_index_write(&idx) < 0)
+		goto err;
+	snap_index_close(&idx);
+	container_mem_unlock(c);
 	return i;
+
+err:
+	// a snapshot left out of the index gets it rebuilt on the next open
+	snap_index_close(&idx);
+	container_mem_unlock(c);
+	return -1;
 }
 
 static void lxcsnap_free(struct lxc_snapshot *s)
@@ -2965,11 +3772,11 @@ static char *get_timestamp(char* snappath, char *name)
 
 static int lxcapi_snapshot_list(struct lxc_container *c, struct lxc_snapshot **ret_snaps)
 {
-	char snappath[MAXPATHLEN], path2[MAXPATHLEN];
-	int dirlen, count = 0, ret;
-	struct dirent dirent, *direntp;
-	struct lxc_snapshot *snaps =NULL, *nsnaps;
-	DIR *dir;
+	char snappath[MAXPATHLEN];
+	int dirlen, count = 0, i;
+	struct lxc_snapshot *snaps = NULL;
+	struct snap_index idx;
+	struct snap_entry *e;
 
 	if (!c || !lxcapi_is_defined(c))
 		return -1;
@@ -2980,64 +3787,58 @@ static int lxcapi_snapshot_list(struct lxc_container *c, struct lxc_snapshot **r
 		ERROR("path name too long");
 		return -1;
 	}
-	dir = opendir(snappath);
-	if (!dir) {
+	if (!dir_exists(snappath)) {
 		INFO("failed to open %s - assuming no snapshots", snappath);
 		return 0;
 	}
+	if (container_mem_lock(c))
+		return -1;
+	if (snap_index_open(&idx, snappath) < 0) {
+		container_mem_unlock(c);
+		return -1;
+	}
+	if (!idx.count)
+		goto out;
 
-	while (!readdir_r(dir, &dirent, &direntp)) {
-		if (!direntp)
-			break;
-
-		if (!strcmp(direntp->d_name, "."))
-			continue;
-
-		if (!strcmp(direntp->d_name, ".."))
-			continue;
-
-		ret = snprintf(path2, MAXPATHLEN, "%s/%s/config", snappath, direntp->d_name);
-		if (ret < 0 || ret >= MAXPATHLEN) {
-			ERROR("pathname too long");
-			goto out_free;
-		}
-		if (!file_exists(path2))
-			continue;
-		nsnaps = realloc(snaps, (count + 1)*sizeof(*snaps));
-		if (!nsnaps) {
-			SYSERROR("Out of memory");
-			goto out_free;
-		}
-		snaps = nsnaps;
+	snaps = calloc(idx.count, sizeof(*snaps));
+	if (!snaps) {
+		SYSERROR("Out of memory");
+		goto out_free;
+	}
+	for (count = 0; count < idx.count; count++) {
+		e = &idx.entries[count];
 		snaps[count].free = lxcsnap_free;
-		snaps[count].name = strdup(direntp->d_name);
-		if (!snaps[count].name)
-			goto out_free;
+		snaps[count].name = strdup(e->name);
 		snaps[count].lxcpath = strdup(snappath);
-		if (!snaps[count].lxcpath) {
-			free(snaps[count].name);
+		snaps[count].comment_pathname = get_snapcomment_path(snappath, e->name);
+		if (!snaps[count].name || !snaps[count].lxcpath ||
+		    !snaps[count].comment_pathname) {
+			lxcsnap_free(&snaps[count]);
 			goto out_free;
 		}
-		snaps[count].comment_pathname = get_snapcomment_path(snappath, direntp->d_name);
-		snaps[count].timestamp = get_timestamp(snappath, direntp->d_name);
-		count++;
+		if (*e->timestamp) {
+			snaps[count].timestamp = strdup(e->timestamp);
+			if (!snaps[count].timestamp) {
+				lxcsnap_free(&snaps[count]);
+				goto out_free;
+			}
+		}
 	}
 
-	if (closedir(dir))
-		WARN("failed to close directory");
-
+out:
+	snap_index_close(&idx);
+	container_mem_unlock(c);
 	*ret_snaps = snaps;
 	return count;
 
 out_free:
+	snap_index_close(&idx);
+	container_mem_unlock(c);
 	if (snaps) {
-		int i;
 		for (i=0; i<count; i++)
 			lxcsnap_free(&snaps[i]);
 		free(snaps);
 	}
-	if (closedir(dir))
-		WARN("failed to close directory");
 	return -1;
 }
 
@@ -3097,9 +3898,10 @@ static bool lxcapi_snapshot_restore(struct lxc_container *c, const char *snapnam
 
 static bool lxcapi_snapshot_destroy(struct lxc_container *c, const char *snapname)
 {
-	int ret;
+	int ret, i;
 	char clonelxcpath[MAXPATHLEN];
 	struct lxc_container *snap = NULL;
+	struct snap_index idx;
 
 	if (!c || !c->name || !c->config_path)
 		return false;
@@ -3114,12 +3916,31 @@ static bool lxcapi_snapshot_destroy(struct lxc_container *c, const char *snapnam
 		goto err;
 	}
 
-	if (!lxcapi_destroy(snap)) {
+	if (container_mem_lock(c))
+		goto err;
+	if (snap_index_open(&idx, clonelxcpath) < 0) {
+		container_mem_unlock(c);
+		goto err;
+	}
+	// a trash in the snapshot directory would throw the index off
+	if (!do_destroy(snap, c->config_path)) {
 		ERROR("Could not destroy snapshot %s", snapname);
+		snap_index_close(&idx);
+		container_mem_unlock(c);
 		goto err;
 	}
 	lxc_container_put(snap);
 
+	i = snap_index_find(&idx, snapname);
+	if (i >= 0) {
+		memmove(&idx.entries[i], &idx.entries[i + 1],
+			(idx.count - i - 1) * sizeof(*idx.entries));
+		idx.count--;
+		snap_index_write(&idx);
+	}
+	snap_index_close(&idx);
+	container_mem_unlock(c);
+
 	return true;
 err:
 	if (snap)
@@ -3344,6 +4165,7 @@ struct lxc_container *lxc_container_new(const char *name, const char *configpath
 	c->unfreeze = lxcapi_unfreeze;
 	c->console = lxcapi_console;
 	c->console_getfd = lxcapi_console_getfd;
+	c->console_log = lxcapi_console_log;
 	c->init_pid = lxcapi_init_pid;
 	c->load_config = lxcapi_load_config;
 	c->want_daemonize = lxcapi_want_daemonize;
@@ -3371,11 +4193,15 @@ struct lxc_container *lxc_container_new(const char *name, const char *configpath
 	c->get_config_path = lxcapi_get_config_path;
 	c->set_config_path = lxcapi_set_config_path;
 	c->clone = lxcapi_clone;
+	c->clone_many = lxcapi_clone_many;
 	c->get_interfaces = lxcapi_get_interfaces;
 	c->get_ips = lxcapi_get_ips;
+	c->get_net_info = lxcapi_get_net_info;
+	c->get_start_trace = lxcapi_get_start_trace;
 	c->attach = lxcapi_attach;
 	c->attach_run_wait = lxcapi_attach_run_wait;
 	c->attach_run_waitl = lxcapi_attach_run_waitl;
+	c->attach_cache = lxcapi_attach_cache;
 	c->snapshot = lxcapi_snapshot;
 	c->snapshot_list = lxcapi_snapshot_list;
 	c->snapshot_restore = lxcapi_snapshot_restore;
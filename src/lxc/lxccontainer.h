@@ -39,9 +39,12 @@ extern "C" {
 #define LXC_CLONE_SNAPSHOT        (1 << 2) /*!< Snapshot the original filesystem(s) */
 #define LXC_CLONE_KEEPBDEVTYPE    (1 << 3) /*!< Use the same bdev type */
 #define LXC_CLONE_MAYBE_SNAPSHOT  (1 << 4) /*!< Snapshot only if bdev supports it, else copy */
-#define LXC_CLONE_MAXFLAGS        (1 << 5) /*!< Number of \c LXC_CLONE_* flags */
+#define LXC_CLONE_SHIFTIDS        (1 << 5) /*!< Shift the rootfs into the id map of the default configuration */
+#define LXC_CLONE_FLATTEN         (1 << 6) /*!< Merge the layers of an overlayfs snapshot into one for the clone */
+#define LXC_CLONE_MAXFLAGS        (1 << 7) /*!< Number of \c LXC_CLONE_* flags */
 #define LXC_CREATE_QUIET          (1 << 0) /*!< Redirect \c stdin to \c /dev/zero and \c stdout and \c stderr to \c /dev/null */
-#define LXC_CREATE_MAXFLAGS       (1 << 1) /*!< Number of \c LXC_CREATE* flags */
+#define LXC_CREATE_SHIFTIDS       (1 << 1) /*!< Run the template as root, then shift the rootfs into the id map */
+#define LXC_CREATE_MAXFLAGS       (1 << 2) /*!< Number of \c LXC_CREATE* flags */
 
 struct bdev_specs;
 
@@ -49,6 +52,12 @@ struct lxc_snapshot;
 
 struct lxc_lock;
 
+struct lxc_console_log;
+
+struct lxc_attach_ctx;
+
+struct lxc_interface;
+
 /*!
  * An LXC container.
  */
@@ -305,8 +314,8 @@ struct lxc_container {
 	 * \param bdevtype Backing store type to use (if \c NULL, \c dir will be used).
 	 * \param specs Additional parameters for the backing store (for
 	 *  example LVM volume group to use).
-	 * \param flags \c LXC_CREATE_* options (currently only \ref
-	 *  LXC_CREATE_QUIET is supported).
+	 * \param flags \c LXC_CREATE_* options (\ref LXC_CREATE_QUIET
+	 *  and \ref LXC_CREATE_SHIFTIDS).
 	 * \param argv Arguments to pass to the template, terminated by \c NULL (if no
 	 *  arguments are required, just pass \c NULL).
 	 *
@@ -325,8 +334,8 @@ struct lxc_container {
 	 * \param bdevtype Backing store type to use (if \c NULL, \c dir will be used).
 	 * \param specs Additional parameters for the backing store (for
 	 *  example LVM volume group to use).
-	 * \param flags \c LXC_CREATE_* options (currently only \ref
-	 *  LXC_CREATE_QUIET is supported).
+	 * \param flags \c LXC_CREATE_* options (\ref LXC_CREATE_QUIET
+	 *  and \ref LXC_CREATE_SHIFTIDS).
 	 * \param ... Command-line to pass to init (must end in \c NULL).
 	 *
 	 * \return \c true on success, else \c false.
@@ -542,6 +551,8 @@ struct lxc_container {
 	 *  - \ref LXC_CLONE_KEEPNAME
 	 *  - \ref LXC_CLONE_KEEPMACADDR
 	 *  - \ref LXC_CLONE_SNAPSHOT
+	 *  - \ref LXC_CLONE_SHIFTIDS
+	 *  - \ref LXC_CLONE_FLATTEN
 	 * \param bdevtype Optionally force the cloned bdevtype to a specified plugin.
 	 *  By default the original is used (subject to snapshot requirements).
 	 * \param bdevdata Information about how to create the new storage
@@ -740,6 +751,118 @@ struct lxc_container {
 	 * \return \c true on success, else \c false.
 	 */
 	bool (*remove_device_node)(struct lxc_container *c, const char *src_path, const char *dest_path);
+
+	/*!
+	 * \brief Query or clear the in-memory console buffer of a running
+	 *  container (see \c lxc.console.buffer_size).
+	 *
+	 * \param c Container.
+	 * \param[in,out] log \ref lxc_console_log describing the request.
+	 *
+	 * \return \c 0 on success, \c -ENODATA if the container has no
+	 *  console buffer, else a negative value.
+	 */
+	int (*console_log)(struct lxc_container *c, struct lxc_console_log *log);
+
+	/*!
+	 * \brief Copy a stopped container several times.
+	 *
+	 * Behaves like calling \ref clone once for each name in \p newnames,
+	 *  except that the original container is locked, checked and its
+	 *  backing store detected (and for a copy clone, mounted) only once,
+	 *  and that up to \p max_parallel clones are made concurrently.
+	 *
+	 * \param c Original container.
+	 * \param newnames Array of \p count new container names.
+	 * \param count Number of entries in \p newnames and \p results.
+	 * \param lxcpath lxcpath in which to create the new containers.
+	 * \param flags Additional \c LXC_CLONE* flags to change the cloning behaviour.
+	 * \param bdevtype Optionally force the cloned bdevtype to a specified plugin.
+	 * \param bdevdata Information about how to create the new storage.
+	 * \param newsize In case of a block device backing store, an
+	 *  optional size. If \c 0, the original backing store's size will
+	 *  be used if possible.
+	 * \param hookargs Additional arguments to pass to the clone hook script.
+	 * \param max_parallel Maximum number of concurrent clones, \c 0
+	 *  for the number of online CPUs.
+	 * \param[out] results Set to \c true for each clone that succeeded.
+	 *
+	 * \return Number of successful clones, or \c -1 if no clone could
+	 *  be attempted, as when a name is given more than once.
+	 *
+	 * \note As with \ref clone, the new containers have to be loaded
+	 *  with \ref lxc_container_new to be used.
+	 */
+	int (*clone_many)(struct lxc_container *c, const char **newnames,
+		int count, const char *lxcpath, int flags, const char *bdevtype,
+		const char *bdevdata, uint64_t newsize, char **hookargs,
+		int max_parallel, bool *results);
+
+	/*!
+	 * \brief Cache what is needed to attach to the running container.
+	 *
+	 * While enabled, \ref attach, \ref attach_run_wait and
+	 *  \ref attach_run_waitl reuse the container's namespace file
+	 *  descriptors, init process context and seccomp policy instead of
+	 *  looking them up for every call. The cache is refreshed
+	 *  automatically when the container is restarted.
+	 *
+	 * \note While the cache is enabled, \c exec_function passed to
+	 *  \ref attach must not use \p c, as it runs in a copy of the
+	 *  caller in which the container's lock is held.
+	 *
+	 * \param c Container.
+	 * \param enable Whether to enable or drop the cache.
+	 *
+	 * \return \c true on success, else \c false (for instance if the
+	 *  container is not running).
+	 */
+	bool (*attach_cache)(struct lxc_container *c, bool enable);
+
+	/*!
+	 * \brief Obtain the network interfaces of a running container,
+	 *  along with their addresses.
+	 *
+	 * \param c Container.
+	 * \param[out] ifs Newly-allocated array of \ref lxc_interface,
+	 *  sorted by name.
+	 *
+	 * \return Number of interfaces in \p ifs, or \c -1 on error.
+	 *
+	 * \note \p ifs must be freed with \ref lxc_interfaces_free.
+	 */
+	int (*get_net_info)(struct lxc_container *c, struct lxc_interface **ifs);
+
+	/*!
+	 * \brief Obtain how long each phase of the start of a running
+	 *  container took (see \c lxc.start.trace).
+	 *
+	 * \param c Container.
+	 *
+	 * \return Newly-allocated JSON object, or \c NULL if the container
+	 *  isn't running or wasn't started with \c lxc.start.trace set.
+	 *
+	 * \note The returned string must be freed by the caller.
+	 */
+	char *(*get_start_trace)(struct lxc_container *c);
+
+	/*!
+	 * \private
+	 * Cached attach context, see \ref attach_cache.
+	 * \note protected by privlock.  Kept last so that the offsets of
+	 *  the members above don't change.
+	 */
+	struct lxc_attach_ctx *attach_ctx;
+};
+
+/*!
+ * \brief Console buffer request for \ref lxc_container::console_log.
+ */
+struct lxc_console_log {
+	bool clear; /*!< Drop the returned data (or everything when not reading) from the buffer */
+	bool read; /*!< Return the oldest buffered data */
+	uint64_t read_max; /*!< In: maximum number of bytes to read, \c 0 for all; out: number of bytes in \c data */
+	char *data; /*!< Out: the data read, must be freed by the caller (may be \c NULL) */
 };
 
 /*!
@@ -758,6 +881,29 @@ struct lxc_snapshot {
 	void (*free)(struct lxc_snapshot *s);
 };
 
+/*!
+ * An address of a container network interface, see \ref get_net_info.
+ */
+struct lxc_ifaddr {
+	int family; /*!< \c AF_INET or \c AF_INET6 */
+	char *address; /*!< The address in text form */
+	unsigned int prefixlen; /*!< Prefix length */
+	int scope; /*!< IPv6 scope id, as understood by \ref get_ips */
+};
+
+/*!
+ * A container network interface, see \ref get_net_info.
+ */
+struct lxc_interface {
+	char *name; /*!< Interface name */
+	int index; /*!< Interface index */
+	unsigned int flags; /*!< \c IFF_* flags */
+	unsigned int mtu; /*!< MTU */
+	char *hwaddr; /*!< Link layer address, or \c NULL */
+	int naddrs; /*!< Number of entries in \p addrs */
+	struct lxc_ifaddr *addrs; /*!< Addresses of the interface */
+};
+
 /*!
  * \brief Create a new container.
  *
@@ -789,6 +935,14 @@ int lxc_container_get(struct lxc_container *c);
  */
 int lxc_container_put(struct lxc_container *c);
 
+/*!
+ * \brief Free a list of interfaces returned by \ref get_net_info.
+ *
+ * \param ifs List of interfaces.
+ * \param count Number of interfaces in \p ifs.
+ */
+void lxc_interfaces_free(struct lxc_interface *ifs, int count);
+
 /*!
  * \brief Obtain a list of all container states.
  * \param[out] states Caller-allocated array to hold all states (may be \c NULL).
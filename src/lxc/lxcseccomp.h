@@ -43,6 +43,8 @@ static inline void lxc_seccomp_free(struct lxc_conf *conf) {
 		free(conf->seccomp);
 		conf->seccomp = NULL;
 	}
+	free(conf->seccomp_bpf);
+	conf->seccomp_bpf = NULL;
 }
 #endif
 
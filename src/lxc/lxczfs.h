@@ -0,0 +1,77 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_ZFS_H
+#define __LXC_ZFS_H
+
+#include <errno.h>
+#include <stdbool.h>
+
+/*
+ * In-process versions of the zfs commands the zfs backing store runs,
+ * through libzfs_core.  Each returns 0 on success, -1 on failure, or
+ * -ENOSYS if libzfs_core is not available, in which case the caller is
+ * expected to fall back to the zfs command.
+ */
+
+#ifdef HAVE_LIBZFS_CORE
+/*
+ * lxc_zfs_create: like 'zfs create -omountpoint=@mountpoint @dataset'
+ */
+extern int lxc_zfs_create(const char *dataset, const char *mountpoint);
+
+/*
+ * lxc_zfs_clone: like 'zfs clone -omountpoint=@mountpoint @snapshot @dataset'
+ *
+ * @take : first (re-)take @snapshot, as 'zfs destroy' and 'zfs snapshot'
+ *         would, otherwise it has to exist already
+ */
+extern int lxc_zfs_clone(const char *snapshot, const char *dataset,
+			 const char *mountpoint, bool take);
+
+/*
+ * lxc_zfs_snapshot: like 'zfs snapshot @snapshots...', all of them are
+ * taken at once or none is
+ */
+extern int lxc_zfs_snapshot(const char **snapshots, int count);
+
+/*
+ * lxc_zfs_destroy: like 'zfs destroy @dataset', which is mounted on
+ * @mountpoint
+ */
+extern int lxc_zfs_destroy(const char *dataset, const char *mountpoint);
+#else
+static inline int lxc_zfs_create(const char *dataset, const char *mountpoint) {
+	return -ENOSYS;
+}
+
+static inline int lxc_zfs_clone(const char *snapshot, const char *dataset,
+				const char *mountpoint, bool take) {
+	return -ENOSYS;
+}
+
+static inline int lxc_zfs_snapshot(const char **snapshots, int count) {
+	return -ENOSYS;
+}
+
+static inline int lxc_zfs_destroy(const char *dataset, const char *mountpoint) {
+	return -ENOSYS;
+}
+#endif
+
+#endif /* __LXC_ZFS_H */
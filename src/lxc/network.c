@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sched.h>
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -36,6 +37,7 @@
 #include <sys/socket.h>
 #include <sys/param.h>
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <net/if_arp.h>
@@ -48,12 +50,8 @@
 #include "nl.h"
 #include "network.h"
 #include "conf.h"
-
-#if HAVE_IFADDRS_H
-#include <ifaddrs.h>
-#else
-#include <../include/ifaddrs.h>
-#endif
+#include "utils.h"
+#include <lxc/lxccontainer.h>
 
 #ifndef IFLA_LINKMODE
 #  define IFLA_LINKMODE 17
@@ -102,6 +100,315 @@ struct rt_req {
 	struct rtmsg rt;
 };
 
+/*
+ * The NETLINK_ROUTE session of the calling thread, see
+ * lxc_netlink_session_begin(). While it is open, the primitives below share
+ * its socket and recycle their message buffers. While a batch is open,
+ * requests which only wait for an ACK are queued in @batch and sent in one
+ * go by rtnl_batch_flush(). Queued requests which want their replies
+ * register in @pending a callback, called with each of them.
+ */
+#define RTNL_MSG_CACHE 4
+#define RTNL_BATCH_SIZE (4 * NLMSG_GOOD_SIZE)
+/* the replies pile up in the socket's receive buffer until the kernel is
+ * done with the whole batch, a full link message takes a few kB there */
+#define RTNL_BATCH_MAX 32
+#define RTNL_BATCH_REPLIES 8
+
+struct rtnl_pending {
+	__u32 seq;
+	void (*cb)(struct nlmsghdr *msg, void *data);
+	void *data;
+};
+
+static __thread struct {
+	int refcount;
+	struct nl_handler nlh;
+	struct nlmsg *msgs[RTNL_MSG_CACHE];
+	int nmsgs;
+	int batching;
+	char *batch;
+	size_t batch_len;
+	int batch_count;
+	int batch_err;
+	struct rtnl_pending pending[RTNL_BATCH_REPLIES];
+	int npending;
+} rtnl_session;
+
+int lxc_netlink_session_begin(void)
+{
+	int err;
+
+	if (rtnl_session.refcount++)
+		return 0;
+
+	err = netlink_open(&rtnl_session.nlh, NETLINK_ROUTE);
+	if (err) {
+		rtnl_session.refcount = 0;
+		return err;
+	}
+
+	return 0;
+}
+
+void lxc_netlink_session_end(void)
+{
+	if (!rtnl_session.refcount || --rtnl_session.refcount)
+		return;
+
+	netlink_close(&rtnl_session.nlh);
+	while (rtnl_session.nmsgs)
+		nlmsg_free(rtnl_session.msgs[--rtnl_session.nmsgs]);
+	free(rtnl_session.batch);
+	memset(&rtnl_session, 0, sizeof(rtnl_session));
+}
+
+static int rtnl_open(struct nl_handler *nlh)
+{
+	if (rtnl_session.refcount) {
+		*nlh = rtnl_session.nlh;
+		return 0;
+	}
+
+	return netlink_open(nlh, NETLINK_ROUTE);
+}
+
+static void rtnl_close(struct nl_handler *nlh)
+{
+	if (rtnl_session.refcount) {
+		rtnl_session.nlh.seq = nlh->seq;
+		return;
+	}
+
+	netlink_close(nlh);
+}
+
+static struct nlmsg *rtnl_msg_alloc(void)
+{
+	struct nlmsg *nlmsg;
+
+	if (!rtnl_session.nmsgs)
+		return nlmsg_alloc(NLMSG_GOOD_SIZE);
+
+	nlmsg = rtnl_session.msgs[--rtnl_session.nmsgs];
+	memset(nlmsg, 0, NLMSG_GOOD_SIZE);
+	nlmsg->nlmsghdr.nlmsg_len = NLMSG_ALIGN(NLMSG_GOOD_SIZE);
+	return nlmsg;
+}
+
+static void rtnl_msg_free(struct nlmsg *nlmsg)
+{
+	if (nlmsg && rtnl_session.refcount &&
+	    rtnl_session.nmsgs < RTNL_MSG_CACHE) {
+		rtnl_session.msgs[rtnl_session.nmsgs++] = nlmsg;
+		return;
+	}
+
+	nlmsg_free(nlmsg);
+}
+
+static void rtnl_batch_reply(struct nlmsghdr *msg)
+{
+	int i;
+
+	for (i = 0; i < rtnl_session.npending; i++) {
+		if (rtnl_session.pending[i].seq == msg->nlmsg_seq) {
+			rtnl_session.pending[i].cb(msg, rtnl_session.pending[i].data);
+			return;
+		}
+	}
+}
+
+/*
+ * Send the queued requests in a single datagram and collect their ACKs.
+ * Returns the first error reported by the kernel.
+ */
+static int rtnl_batch_flush(void)
+{
+	struct nl_handler *nlh = &rtnl_session.nlh;
+	struct nlmsg *answer;
+	struct nlmsghdr *msg;
+	int err = 0, ret, len, acks = 0;
+
+	if (!rtnl_session.batch_count)
+		return 0;
+
+	answer = rtnl_msg_alloc();
+	if (!answer) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	ret = netlink_send_buf(nlh, rtnl_session.batch, rtnl_session.batch_len);
+	if (ret < 0) {
+		err = ret;
+		goto out;
+	}
+
+	while (acks < rtnl_session.batch_count) {
+		answer->nlmsghdr.nlmsg_len = NLMSG_ALIGN(NLMSG_GOOD_SIZE);
+		ret = netlink_rcv(nlh, answer);
+		if (ret <= 0) {
+			err = ret ? ret : -ECONNRESET;
+			/* don't leave stale ACKs behind for the next request */
+			netlink_close(nlh);
+			if (netlink_open(nlh, NETLINK_ROUTE) < 0)
+				nlh->fd = -1;
+			break;
+		}
+
+		len = ret;
+		for (msg = &answer->nlmsghdr; NLMSG_OK(msg, len);
+		     msg = NLMSG_NEXT(msg, len)) {
+			struct nlmsgerr *errmsg;
+
+			if (rtnl_session.npending)
+				rtnl_batch_reply(msg);
+
+			if (msg->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			acks++;
+			errmsg = (struct nlmsgerr *)NLMSG_DATA(msg);
+			if (errmsg->error && !err)
+				err = errmsg->error;
+		}
+	}
+
+out:
+	rtnl_msg_free(answer);
+	rtnl_session.batch_len = 0;
+	rtnl_session.batch_count = 0;
+	rtnl_session.npending = 0;
+	if (err && !rtnl_session.batch_err)
+		rtnl_session.batch_err = err;
+	return err;
+}
+
+static int rtnl_batch_add(struct nlmsg *request)
+{
+	size_t len = NLMSG_ALIGN(request->nlmsghdr.nlmsg_len);
+
+	if (len > RTNL_BATCH_SIZE)
+		return -EMSGSIZE;
+
+	if (!rtnl_session.batch) {
+		rtnl_session.batch = malloc(RTNL_BATCH_SIZE);
+		if (!rtnl_session.batch)
+			return -ENOMEM;
+	}
+
+	if (rtnl_session.batch_len + len > RTNL_BATCH_SIZE ||
+	    rtnl_session.batch_count == RTNL_BATCH_MAX)
+		rtnl_batch_flush();
+
+	memset(rtnl_session.batch + rtnl_session.batch_len, 0, len);
+	memcpy(rtnl_session.batch + rtnl_session.batch_len, request,
+	       request->nlmsghdr.nlmsg_len);
+	rtnl_session.batch_len += len;
+	rtnl_session.batch_count++;
+	return 0;
+}
+
+/*
+ * Queue a request like rtnl_batch_add(), and have @cb called with every
+ * reply to it, the ACK included, once the batch is flushed.
+ */
+static int rtnl_batch_add_reply(struct nlmsg *request,
+				void (*cb)(struct nlmsghdr *, void *),
+				void *data)
+{
+	struct rtnl_pending *pending;
+	int err;
+
+	if (rtnl_session.npending == RTNL_BATCH_REPLIES)
+		rtnl_batch_flush();
+
+	err = rtnl_batch_add(request);
+	if (err)
+		return err;
+
+	pending = &rtnl_session.pending[rtnl_session.npending++];
+	pending->seq = request->nlmsghdr.nlmsg_seq;
+	pending->cb = cb;
+	pending->data = data;
+	return 0;
+}
+
+int lxc_netlink_batch_begin(void)
+{
+	int err;
+
+	err = lxc_netlink_session_begin();
+	if (err)
+		return err;
+
+	rtnl_session.batching++;
+	return 0;
+}
+
+int lxc_netlink_batch_end(void)
+{
+	int err;
+
+	if (!rtnl_session.batching)
+		return -EINVAL;
+
+	rtnl_batch_flush();
+	err = rtnl_session.batch_err;
+	if (!--rtnl_session.batching)
+		rtnl_session.batch_err = 0;
+	lxc_netlink_session_end();
+	return err;
+}
+
+/*
+ * Same as netlink_transaction(), going through the session if there is
+ * one. Replies which don't match the request's sequence number, such as
+ * the rest of an interrupted dump, are skipped.
+ */
+static int rtnl_transaction(struct nl_handler *nlh, struct nlmsg *request,
+			    struct nlmsg *answer)
+{
+	int err, answer_len = answer->nlmsghdr.nlmsg_len;
+	__u32 seq;
+
+	if (nlh->fd < 0)
+		return -EBADF;
+
+	seq = ++nlh->seq;
+	request->nlmsghdr.nlmsg_seq = seq;
+
+	if (rtnl_session.batching) {
+		if ((request->nlmsghdr.nlmsg_flags & (NLM_F_ACK|NLM_F_ECHO)) ==
+		    NLM_F_ACK)
+			return rtnl_batch_add(request);
+		/* keep the requests in order */
+		rtnl_batch_flush();
+		nlh->fd = rtnl_session.nlh.fd;
+	}
+
+	err = netlink_send(nlh, request);
+	if (err < 0)
+		return err;
+
+	do {
+		answer->nlmsghdr.nlmsg_len = answer_len;
+		err = netlink_rcv(nlh, answer);
+		if (err < 0)
+			return err;
+		if (!err)
+			return -ECONNRESET;
+	} while (answer->nlmsghdr.nlmsg_seq != seq);
+
+	if (answer->nlmsghdr.nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *errmsg = (struct nlmsgerr*)NLMSG_DATA(answer);
+		return errmsg->error;
+	}
+
+	return 0;
+}
+
 int lxc_netdev_move_by_index(int ifindex, pid_t pid)
 {
 	struct nl_handler nlh;
@@ -109,12 +416,12 @@ int lxc_netdev_move_by_index(int ifindex, pid_t pid)
 	struct link_req *link_req;
 	int err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 
@@ -128,10 +435,10 @@ int lxc_netdev_move_by_index(int ifindex, pid_t pid)
 	if (nla_put_u32(nlmsg, IFLA_NET_NS_PID, pid))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, nlmsg);
+	err = rtnl_transaction(&nlh, nlmsg, nlmsg);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(nlmsg);
+	rtnl_close(&nlh);
+	rtnl_msg_free(nlmsg);
 	return err;
 }
 
@@ -154,16 +461,16 @@ int lxc_netdev_delete_by_index(int ifindex)
 	struct link_req *link_req;
 	int err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto out;
 
@@ -174,11 +481,11 @@ int lxc_netdev_delete_by_index(int ifindex)
 	nlmsg->nlmsghdr.nlmsg_flags = NLM_F_ACK|NLM_F_REQUEST;
 	nlmsg->nlmsghdr.nlmsg_type = RTM_DELLINK;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_transaction(&nlh, nlmsg, answer);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(answer);
-	nlmsg_free(nlmsg);
+	rtnl_close(&nlh);
+	rtnl_msg_free(answer);
+	rtnl_msg_free(nlmsg);
 	return err;
 }
 
@@ -200,7 +507,7 @@ int lxc_netdev_rename_by_index(int ifindex, const char *newname)
 	struct link_req *link_req;
 	int len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
@@ -209,11 +516,11 @@ int lxc_netdev_rename_by_index(int ifindex, const char *newname)
 		goto out;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto out;
 
@@ -227,11 +534,11 @@ int lxc_netdev_rename_by_index(int ifindex, const char *newname)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, newname))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_transaction(&nlh, nlmsg, answer);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(answer);
-	nlmsg_free(nlmsg);
+	rtnl_close(&nlh);
+	rtnl_msg_free(answer);
+	rtnl_msg_free(nlmsg);
 	return err;
 }
 
@@ -257,7 +564,7 @@ int netdev_set_flag(const char *name, int flag)
 	struct link_req *link_req;
 	int index, len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
@@ -267,11 +574,11 @@ int netdev_set_flag(const char *name, int flag)
 		goto out;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto out;
 
@@ -289,11 +596,11 @@ int netdev_set_flag(const char *name, int flag)
 	nlmsg->nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK;
 	nlmsg->nlmsghdr.nlmsg_type = RTM_NEWLINK;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_transaction(&nlh, nlmsg, answer);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(nlmsg);
-	nlmsg_free(answer);
+	rtnl_close(&nlh);
+	rtnl_msg_free(nlmsg);
+	rtnl_msg_free(answer);
 	return err;
 }
 
@@ -414,7 +721,7 @@ int lxc_netdev_set_mtu(const char *name, int mtu)
 	struct link_req *link_req;
 	int index, len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
@@ -424,11 +731,11 @@ int lxc_netdev_set_mtu(const char *name, int mtu)
 		goto out;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto out;
 
@@ -447,11 +754,11 @@ int lxc_netdev_set_mtu(const char *name, int mtu)
 	if (nla_put_u32(nlmsg, IFLA_MTU, mtu))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_transaction(&nlh, nlmsg, answer);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(nlmsg);
-	nlmsg_free(answer);
+	rtnl_close(&nlh);
+	rtnl_msg_free(nlmsg);
+	rtnl_msg_free(answer);
 	return err;
 }
 
@@ -465,7 +772,54 @@ int lxc_netdev_down(const char *name)
 	return netdev_set_flag(name, 0);
 }
 
-int lxc_veth_create(const char *name1, const char *name2)
+/*
+ * Pick the ifindexes of a new veth pair out of the RTM_NEWLINK message the
+ * kernel echoes back: veth reports its peer as IFLA_LINK.
+ */
+static void veth_parse_echo(struct nlmsg *answer, struct lxc_veth_args *args)
+{
+	struct nlmsghdr *msg = &answer->nlmsghdr;
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	struct rtattr *rta = IFLA_RTA(ifi);
+	int attr_len = msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+
+	args->ifindex = ifi->ifi_index;
+	for (; RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+		if (rta->rta_type == IFLA_LINK)
+			args->peer_ifindex = *(int *)RTA_DATA(rta);
+	}
+}
+
+static void veth_batch_reply(struct nlmsghdr *msg, void *data)
+{
+	struct lxc_veth_args *args = data;
+
+	if (msg->nlmsg_type == RTM_NEWLINK)
+		veth_parse_echo((struct nlmsg *)msg, args);
+	else if (msg->nlmsg_type == NLMSG_ERROR)
+		args->err = ((struct nlmsgerr *)NLMSG_DATA(msg))->error;
+}
+
+/*
+ * lxc_veth_create: create a veth pair
+ *
+ * @name1 : name of the first end
+ * @name2 : name of the peer
+ * @args  : optional attributes of the pair, may be NULL
+ *
+ * Everything in @args is sent along with the creation request so that the
+ * kernel sets the pair up in one RTM_NEWLINK. On success the ifindexes of
+ * both ends are stored back into @args; they are 0 if the kernel does not
+ * echo the new link and the end is not in our network namespace.
+ *
+ * Inside a batch, the request is only queued: this returns 0, and the
+ * result and the ifindexes are stored into @args by lxc_netlink_batch_end(),
+ * without falling back to a lookup by name.
+ *
+ * Returns 0 on success, -errno on failure
+ */
+int lxc_veth_create(const char *name1, const char *name2,
+		    struct lxc_veth_args *args)
 {
 	struct nl_handler nlh;
 	struct nlmsg *nlmsg = NULL, *answer = NULL;
@@ -473,7 +827,7 @@ int lxc_veth_create(const char *name1, const char *name2)
 	struct rtattr *nest1, *nest2, *nest3;
 	int len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
@@ -487,11 +841,11 @@ int lxc_veth_create(const char *name1, const char *name2)
 		goto out;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto out;
 
@@ -502,6 +856,15 @@ int lxc_veth_create(const char *name1, const char *name2)
 		NLM_F_REQUEST|NLM_F_CREATE|NLM_F_EXCL|NLM_F_ACK;
 	nlmsg->nlmsghdr.nlmsg_type = RTM_NEWLINK;
 
+	if (args) {
+		/* ask for the new link, to learn the ifindexes */
+		nlmsg->nlmsghdr.nlmsg_flags |= NLM_F_ECHO;
+		if (args->up) {
+			link_req->ifinfomsg.ifi_flags = IFF_UP;
+			link_req->ifinfomsg.ifi_change = IFF_UP;
+		}
+	}
+
 	err = -EINVAL;
 	nest1 = nla_begin_nested(nlmsg, IFLA_LINKINFO);
 	if (!nest1)
@@ -523,6 +886,13 @@ int lxc_veth_create(const char *name1, const char *name2)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, name2))
 		goto out;
 
+	if (args && args->mtu && nla_put_u32(nlmsg, IFLA_MTU, args->mtu))
+		goto out;
+
+	if (args && args->netns_pid &&
+	    nla_put_u32(nlmsg, IFLA_NET_NS_PID, args->netns_pid))
+		goto out;
+
 	nla_end_nested(nlmsg, nest3);
 
 	nla_end_nested(nlmsg, nest2);
@@ -532,11 +902,57 @@ int lxc_veth_create(const char *name1, const char *name2)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, name1))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	if (args && args->mtu && nla_put_u32(nlmsg, IFLA_MTU, args->mtu))
+		goto out;
+
+	if (args && args->hwaddr &&
+	    nla_put_buffer(nlmsg, IFLA_ADDRESS, args->hwaddr, ETH_ALEN))
+		goto out;
+
+	if (args && args->master &&
+	    nla_put_u32(nlmsg, IFLA_MASTER, args->master))
+		goto out;
+
+	if (args) {
+		args->ifindex = 0;
+		args->peer_ifindex = 0;
+		args->err = -ECONNRESET;
+	}
+
+	if (args && rtnl_session.batching) {
+		nlmsg->nlmsghdr.nlmsg_seq = ++nlh.seq;
+		err = rtnl_batch_add_reply(nlmsg, veth_batch_reply, args);
+		goto out;
+	}
+
+	err = rtnl_transaction(&nlh, nlmsg, answer);
+	if (args)
+		args->err = err;
+	if (err || !args)
+		goto out;
+
+	if (answer->nlmsghdr.nlmsg_type == RTM_NEWLINK) {
+		__u32 seq = answer->nlmsghdr.nlmsg_seq;
+
+		veth_parse_echo(answer, args);
+		/* the ACK follows the echo, don't leave it in the socket */
+		do {
+			answer->nlmsghdr.nlmsg_len = NLMSG_ALIGN(NLMSG_GOOD_SIZE);
+			if (netlink_rcv(&nlh, answer) <= 0)
+				break;
+		} while (answer->nlmsghdr.nlmsg_seq != seq ||
+			 answer->nlmsghdr.nlmsg_type != NLMSG_ERROR);
+	}
+
+	/* older kernels only acknowledge, ask by name instead */
+	if (!args->ifindex)
+		args->ifindex = if_nametoindex(name1);
+	if (!args->peer_ifindex && !args->netns_pid)
+		args->peer_ifindex = if_nametoindex(name2);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(answer);
-	nlmsg_free(nlmsg);
+	rtnl_close(&nlh);
+	rtnl_msg_free(answer);
+	rtnl_msg_free(nlmsg);
 	return err;
 }
 
@@ -549,7 +965,7 @@ int lxc_vlan_create(const char *master, const char *name, unsigned short vlanid)
 	struct rtattr *nest, *nest2;
 	int lindex, len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
@@ -563,11 +979,11 @@ int lxc_vlan_create(const char *master, const char *name, unsigned short vlanid)
 		goto err3;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto err3;
 
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto err2;
 
@@ -607,13 +1023,13 @@ int lxc_vlan_create(const char *master, const char *name, unsigned short vlanid)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, name))
 		goto err1;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_transaction(&nlh, nlmsg, answer);
 err1:
-	nlmsg_free(answer);
+	rtnl_msg_free(answer);
 err2:
-	nlmsg_free(nlmsg);
+	rtnl_msg_free(nlmsg);
 err3:
-	netlink_close(&nlh);
+	rtnl_close(&nlh);
 	return err;
 }
 
@@ -625,7 +1041,7 @@ int lxc_macvlan_create(const char *master, const char *name, int mode)
 	struct rtattr *nest, *nest2;
 	int index, len, err;
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
@@ -639,11 +1055,11 @@ int lxc_macvlan_create(const char *master, const char *name, int mode)
 		goto out;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto out;
 
@@ -685,11 +1101,11 @@ int lxc_macvlan_create(const char *master, const char *name, int mode)
 	if (nla_put_string(nlmsg, IFLA_IFNAME, name))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_transaction(&nlh, nlmsg, answer);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(answer);
-	nlmsg_free(nlmsg);
+	rtnl_close(&nlh);
+	rtnl_msg_free(answer);
+	rtnl_msg_free(nlmsg);
 	return err;
 }
 
@@ -820,16 +1236,16 @@ static int ip_addr_add(int family, int ifindex,
 	addrlen = family == AF_INET ? sizeof(struct in_addr) :
 		sizeof(struct in6_addr);
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto out;
 
@@ -861,11 +1277,11 @@ static int ip_addr_add(int family, int ifindex,
 	     memcmp(acast, &in6addr_any, sizeof(in6addr_any))))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_transaction(&nlh, nlmsg, answer);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(answer);
-	nlmsg_free(nlmsg);
+	rtnl_close(&nlh);
+	rtnl_msg_free(answer);
+	rtnl_msg_free(nlmsg);
 	return err;
 }
 
@@ -1056,16 +1472,16 @@ static int ip_gateway_add(int family, int ifindex, void *gw)
 	addrlen = family == AF_INET ? sizeof(struct in_addr) :
 		sizeof(struct in6_addr);
 
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto out;
 
@@ -1092,11 +1508,11 @@ static int ip_gateway_add(int family, int ifindex, void *gw)
 	if (nla_put_u32(nlmsg, RTA_OIF, ifindex))
 		goto out;
 
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_transaction(&nlh, nlmsg, answer);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(answer);
-	nlmsg_free(nlmsg);
+	rtnl_close(&nlh);
+	rtnl_msg_free(answer);
+	rtnl_msg_free(nlmsg);
 	return err;
 }
 
@@ -1121,16 +1537,16 @@ static int ip_route_dest_add(int family, int ifindex, void *dest)
 	addrlen = family == AF_INET ? sizeof(struct in_addr) :
 		sizeof(struct in6_addr);
 	
-	err = netlink_open(&nlh, NETLINK_ROUTE);
+	err = rtnl_open(&nlh);
 	if (err)
 		return err;
 	
 	err = -ENOMEM;
-	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	nlmsg = rtnl_msg_alloc();
 	if (!nlmsg)
 		goto out;
 	
-	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	answer = rtnl_msg_alloc();
 	if (!answer)
 		goto out;
 	
@@ -1152,11 +1568,11 @@ static int ip_route_dest_add(int family, int ifindex, void *dest)
 		goto out;
 	if (nla_put_u32(nlmsg, RTA_OIF, ifindex))
 		goto out;
-	err = netlink_transaction(&nlh, nlmsg, answer);
+	err = rtnl_transaction(&nlh, nlmsg, answer);
 out:
-	netlink_close(&nlh);
-	nlmsg_free(answer);
-	nlmsg_free(nlmsg);
+	rtnl_close(&nlh);
+	rtnl_msg_free(answer);
+	rtnl_msg_free(nlmsg);
 	return err;
 }
 
@@ -1219,89 +1635,388 @@ const char *lxc_net_type_to_str(int type)
 static const char padchar[] =
 "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
-char *lxc_mkifname(char *template)
+/* per-thread state of the random name generator, seeded on first use */
+static __thread unsigned int ifname_seed;
+
+static unsigned int ifname_rand(void)
 {
-	char *name = NULL;
-	int i = 0;
-	FILE *urandom;
-	unsigned int seed;
-	struct ifaddrs *ifaddr, *ifa;
-	int ifexists = 0;
-
-	/* Get all the network interfaces */
-	getifaddrs(&ifaddr);
-
-	/* Initialize the random number generator */
-	urandom = fopen ("/dev/urandom", "r");
-	if (urandom != NULL) {
-		if (fread (&seed, sizeof(seed), 1, urandom) <= 0)
-			seed = time(0);
-		fclose(urandom);
+	int fd;
+
+	if (!ifname_seed) {
+		fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+		if (fd < 0 || lxc_read_nointr(fd, &ifname_seed,
+				sizeof(ifname_seed)) != sizeof(ifname_seed))
+			ifname_seed = time(NULL) ^ getpid();
+		if (fd >= 0)
+			close(fd);
+		if (!ifname_seed)
+			ifname_seed = 1;
+#ifndef HAVE_RAND_R
+		srand(ifname_seed);
+#endif
 	}
-	else
-		seed = time(0);
 
-#ifndef HAVE_RAND_R
-	srand(seed);
+#ifdef HAVE_RAND_R
+	return rand_r(&ifname_seed);
+#else
+	return rand();
 #endif
+}
+
+/*
+ * lxc_mkifname: generate a random network interface name
+ *
+ * @template : the name, each 'X' of it is replaced by a random character
+ *
+ * Only the candidate names are looked up, so this does not depend on the
+ * number of interfaces on the host. The name is free when this returns but
+ * may be taken by the time it is used, creating the interface will then
+ * fail with EEXIST and the caller should pick another name.
+ *
+ * Returns a newly allocated name, or NULL on failure
+ */
+char *lxc_mkifname(char *template)
+{
+	char *name, *p;
 
 	/* Generate random names until we find one that doesn't exist */
-	while(1) {
-		ifexists = 0;
+	for (;;) {
 		name = strdup(template);
-
-		if (name == NULL)
+		if (!name)
 			return NULL;
 
-		for (i = 0; i < strlen(name); i++) {
-			if (name[i] == 'X') {
-#ifdef HAVE_RAND_R
-				name[i] = padchar[rand_r(&seed) % (strlen(padchar) - 1)];
-#else
-				name[i] = padchar[rand() % (strlen(padchar) - 1)];
-#endif
+		for (p = name; *p; p++)
+			if (*p == 'X')
+				*p = padchar[ifname_rand() % (sizeof(padchar) - 1)];
+
+		if (!if_nametoindex(name))
+			return name;
+
+		free(name);
+	}
+}
+
+/*
+ * lxc_mkifname_hash: generate a network interface name from a key
+ *
+ * @template : the name, each 'X' of it is replaced by a character derived
+ *             from @key; at most 12 of them carry information
+ * @key      : the string which identifies the interface
+ * @attempt  : bump this to get another name for the same key, after the
+ *             previous one turned out to be taken
+ *
+ * The same arguments always give the same name, whether it exists or not.
+ *
+ * Returns a newly allocated name, or NULL on failure
+ */
+char *lxc_mkifname_hash(const char *template, const char *key,
+			unsigned int attempt)
+{
+	char *name, *p;
+	uint64_t hash;
+
+	name = strdup(template);
+	if (!name)
+		return NULL;
+
+	hash = fnv_64a_buf((void *)key, strlen(key), FNV1A_64_INIT);
+	hash = fnv_64a_buf(&attempt, sizeof(attempt), hash);
+
+	for (p = name; *p; p++) {
+		if (*p != 'X')
+			continue;
+		*p = padchar[hash % (sizeof(padchar) - 1)];
+		hash /= sizeof(padchar) - 1;
+	}
+
+	return name;
+}
+
+/*
+ * lxc_private_host_hw_addr: generate a random mac address for the host end
+ * of a veth pair
+ *
+ * The high byte is 0xfe, so a bridge will always keep the host's mac
+ * address rather than take over the one of a container.
+ *
+ * Returns 0 on success, -errno on failure
+ */
+int lxc_private_host_hw_addr(unsigned char *hwaddr)
+{
+	int fd, ret;
+
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	ret = lxc_read_nointr(fd, hwaddr, ETH_ALEN);
+	close(fd);
+	if (ret != ETH_ALEN)
+		return -EIO;
+
+	hwaddr[0] = 0xfe;
+	return 0;
+}
+
+/*
+ * Open a NETLINK_ROUTE socket in the network namespace @netns_fd. A netlink
+ * socket stays in the namespace it was created in, so only the calling
+ * thread has to switch namespaces, and only around socket().
+ */
+int lxc_netns_netlink_open(struct nl_handler *nlh, int netns_fd)
+{
+	char path[MAXPATHLEN];
+	int self, err;
+
+	/* setns() is per thread, so save this thread's netns */
+	snprintf(path, MAXPATHLEN, "/proc/self/task/%ld/ns/net",
+		 (long)syscall(SYS_gettid));
+	self = open(path, O_RDONLY | O_CLOEXEC);
+	if (self < 0)
+		return -errno;
+
+	if (setns(netns_fd, CLONE_NEWNET)) {
+		err = -errno;
+		close(self);
+		return err;
+	}
+
+	err = netlink_open(nlh, NETLINK_ROUTE);
+
+	if (setns(self, CLONE_NEWNET)) {
+		if (!err)
+			netlink_close(nlh);
+		err = -errno;
+	}
+	close(self);
+	return err;
+}
+
+/*
+ * Send a dump request of @type for @family and call @cb for each message
+ * of the reply. Stops early if @cb returns non-zero.
+ */
+static int netlink_dump(struct nl_handler *nlh, int type, int family,
+		int (*cb)(struct nlmsghdr *msg, void *data), void *data)
+{
+	struct nlmsg *nlmsg = NULL, *answer = NULL;
+	struct nlmsghdr *msg;
+	int err, recv_len, answer_len, readmore = 0;
+
+	err = -ENOMEM;
+	nlmsg = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	if (!nlmsg)
+		goto out;
+
+	answer = nlmsg_alloc(NLMSG_GOOD_SIZE);
+	if (!answer)
+		goto out;
+
+	answer_len = answer->nlmsghdr.nlmsg_len;
+
+	/* struct rtgenmsg is a prefix of both ifinfomsg and ifaddrmsg */
+	nlmsg->nlmsghdr.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+	nlmsg->nlmsghdr.nlmsg_flags = NLM_F_REQUEST|NLM_F_DUMP;
+	nlmsg->nlmsghdr.nlmsg_type = type;
+	nlmsg->nlmsghdr.nlmsg_seq = ++nlh->seq;
+	((struct rtgenmsg *)NLMSG_DATA(&nlmsg->nlmsghdr))->rtgen_family = family;
+
+	err = netlink_send(nlh, nlmsg);
+	if (err < 0)
+		goto out;
+
+	do {
+		answer->nlmsghdr.nlmsg_len = answer_len;
+
+		err = netlink_rcv(nlh, answer);
+		if (err < 0)
+			goto out;
+
+		recv_len = err;
+		err = 0;
+		msg = &answer->nlmsghdr;
+
+		while (NLMSG_OK(msg, recv_len)) {
+			if (msg->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *errmsg = (struct nlmsgerr*)NLMSG_DATA(msg);
+				err = errmsg->error;
+				goto out;
 			}
-		}
 
-		for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) {
-			if (strcmp(ifa->ifa_name, name) == 0) {
-				ifexists = 1;
+			if (msg->nlmsg_type == NLMSG_DONE) {
+				readmore = 0;
 				break;
 			}
+
+			err = cb(msg, data);
+			if (err)
+				goto out;
+
+			readmore = (msg->nlmsg_flags & NLM_F_MULTI);
+			msg = NLMSG_NEXT(msg, recv_len);
 		}
+	} while (readmore);
 
-		if (ifexists == 0)
+out:
+	nlmsg_free(answer);
+	nlmsg_free(nlmsg);
+	return err;
+}
+
+struct netdev_list {
+	struct lxc_interface *ifs;
+	int count;
+};
+
+static int netdev_list_link_cb(struct nlmsghdr *msg, void *data)
+{
+	struct netdev_list *list = data;
+	struct ifinfomsg *ifi = NLMSG_DATA(msg);
+	struct rtattr *rta = IFLA_RTA(ifi);
+	int attr_len = msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+	struct lxc_interface *ifs, *iface;
+
+	if (msg->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	ifs = realloc(list->ifs, (list->count + 1) * sizeof(*ifs));
+	if (!ifs)
+		return -ENOMEM;
+	list->ifs = ifs;
+	iface = &ifs[list->count++];
+	memset(iface, 0, sizeof(*iface));
+	iface->index = ifi->ifi_index;
+	iface->flags = ifi->ifi_flags;
+
+	for (; RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+		switch (rta->rta_type) {
+		case IFLA_IFNAME:
+			iface->name = strndup(RTA_DATA(rta), RTA_PAYLOAD(rta));
+			if (!iface->name)
+				return -ENOMEM;
 			break;
+		case IFLA_MTU:
+			if (RTA_PAYLOAD(rta) >= sizeof(unsigned int))
+				memcpy(&iface->mtu, RTA_DATA(rta), sizeof(unsigned int));
+			break;
+		case IFLA_ADDRESS: {
+			unsigned char *hw = RTA_DATA(rta);
+			int i, len = RTA_PAYLOAD(rta);
+			char *p;
 
-		free(name);
+			if (!len || iface->hwaddr)
+				break;
+			iface->hwaddr = malloc(len * 3);
+			if (!iface->hwaddr)
+				return -ENOMEM;
+			p = iface->hwaddr;
+			for (i = 0; i < len; i++)
+				p += sprintf(p, i ? ":%02x" : "%02x", hw[i]);
+			break;
+		}
+		}
 	}
 
-	freeifaddrs(ifaddr);
-	return name;
+	if (!iface->name)
+		return -EINVAL;
+	return 0;
 }
 
-int setup_private_host_hw_addr(char *veth1)
+static int netdev_list_addr_cb(struct nlmsghdr *msg, void *data)
 {
-	struct ifreq ifr;
-	int err;
-	int sockfd;
+	struct netdev_list *list = data;
+	struct ifaddrmsg *ifa = NLMSG_DATA(msg);
+	struct rtattr *rta = IFA_RTA(ifa);
+	int attr_len = msg->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa));
+	void *local = NULL, *address = NULL;
+	struct lxc_interface *iface = NULL;
+	struct lxc_ifaddr *addrs, *addr;
+	char buf[INET6_ADDRSTRLEN];
+	int i;
+
+	if (msg->nlmsg_type != RTM_NEWADDR)
+		return 0;
 
-	sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (sockfd < 0)
-		return -errno;
+	if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+		return 0;
 
-	snprintf((char *)ifr.ifr_name, IFNAMSIZ, "%s", veth1);
-	err = ioctl(sockfd, SIOCGIFHWADDR, &ifr);
-	if (err < 0) {
-		close(sockfd);
-		return -errno;
+	for (i = 0; i < list->count; i++) {
+		if (list->ifs[i].index == ifa->ifa_index) {
+			iface = &list->ifs[i];
+			break;
+		}
+	}
+	if (!iface)
+		return 0;
+
+	for (; RTA_OK(rta, attr_len); rta = RTA_NEXT(rta, attr_len)) {
+		if (rta->rta_type == IFA_LOCAL)
+			local = RTA_DATA(rta);
+		else if (rta->rta_type == IFA_ADDRESS)
+			address = RTA_DATA(rta);
 	}
 
-	ifr.ifr_hwaddr.sa_data[0] = 0xfe;
-	err = ioctl(sockfd, SIOCSIFHWADDR, &ifr);
-	close(sockfd);
-	if (err < 0)
-		return -errno;
+	/* same choice as getifaddrs(): for IPv4 point-to-point links,
+	 * IFA_ADDRESS is the peer */
+	if (ifa->ifa_family == AF_INET && local)
+		address = local;
+	if (!address)
+		return 0;
+
+	if (!inet_ntop(ifa->ifa_family, address, buf, sizeof(buf)))
+		return 0;
+
+	addrs = realloc(iface->addrs, (iface->naddrs + 1) * sizeof(*addrs));
+	if (!addrs)
+		return -ENOMEM;
+	iface->addrs = addrs;
+	addr = &addrs[iface->naddrs];
+	memset(addr, 0, sizeof(*addr));
+	addr->family = ifa->ifa_family;
+	addr->prefixlen = ifa->ifa_prefixlen;
+	addr->address = strdup(buf);
+	if (!addr->address)
+		return -ENOMEM;
+	iface->naddrs++;
+
+	/* getifaddrs() only sets sin6_scope_id for link-local addresses */
+	if (ifa->ifa_family == AF_INET6 &&
+	    (IN6_IS_ADDR_LINKLOCAL(address) || IN6_IS_ADDR_MC_LINKLOCAL(address)))
+		addr->scope = ifa->ifa_index;
 
 	return 0;
 }
+
+static int netdev_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct lxc_interface *)a)->name,
+		      ((const struct lxc_interface *)b)->name);
+}
+
+/*
+ * List the network interfaces and their addresses in the network namespace
+ * of @nlh, sorted by name. On success, @ifs has to be freed with
+ * lxc_interfaces_free() and the number of interfaces is returned.
+ */
+int lxc_netdev_list(struct nl_handler *nlh, struct lxc_interface **ifs)
+{
+	struct netdev_list list = { NULL, 0 };
+	int err;
+
+	err = netlink_dump(nlh, RTM_GETLINK, AF_UNSPEC, netdev_list_link_cb, &list);
+	if (err)
+		goto out_error;
+
+	err = netlink_dump(nlh, RTM_GETADDR, AF_UNSPEC, netdev_list_addr_cb, &list);
+	if (err)
+		goto out_error;
+
+	if (list.count)
+		qsort(list.ifs, list.count, sizeof(*list.ifs), netdev_cmp);
+
+	*ifs = list.ifs;
+	return list.count;
+
+out_error:
+	lxc_interfaces_free(list.ifs, list.count);
+	return err;
+}
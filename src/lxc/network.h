@@ -23,6 +23,12 @@
 #ifndef _network_h
 #define _network_h
 
+/*
+ * Abstract unix socket lxc-user-nic --daemon listens on, the leading
+ * '\0' is not part of the name
+ */
+#define LXC_USERNIC_SOCKET "\0lxc/user-nic"
+
 /*
  * Convert a string mac address to a socket structure
  */
@@ -59,10 +65,34 @@ extern int lxc_netdev_down(const char *name);
  */
 extern int lxc_netdev_set_mtu(const char *name, int mtu);
 
+/*
+ * Optional attributes of a new veth pair, applied by the kernel while it
+ * creates the pair, see lxc_veth_create().
+ * @mtu       : mtu of both ends, 0 to keep the default
+ * @hwaddr    : ETH_ALEN bytes mac address of the first end, or NULL
+ * @master    : ifindex of the bridge to enslave the first end to, or 0
+ * @up        : set the first end up
+ * @netns_pid : create the peer in the network namespace of this pid, or 0
+ * @ifindex   : returned ifindex of the first end
+ * @peer_ifindex : returned ifindex of the peer, in its own namespace
+ * @err       : returned result of the creation, also when it was batched
+ */
+struct lxc_veth_args {
+	int mtu;
+	const unsigned char *hwaddr;
+	int master;
+	int up;
+	pid_t netns_pid;
+	int ifindex;
+	int peer_ifindex;
+	int err;
+};
+
 /*
  * Create a virtual network devices
  */
-extern int lxc_veth_create(const char *name1, const char *name2);
+extern int lxc_veth_create(const char *name1, const char *name2,
+			   struct lxc_veth_args *args);
 extern int lxc_macvlan_create(const char *master, const char *name, int mode);
 extern int lxc_vlan_create(const char *master, const char *name, unsigned short vid);
 
@@ -136,7 +166,47 @@ extern int lxc_neigh_proxy_off(const char *name, int family);
  */
 extern char *lxc_mkifname(char *template);
 
+/*
+ * Generate a network interface name from a key, the same key and attempt
+ * always give the same name
+ */
+extern char *lxc_mkifname_hash(const char *template, const char *key,
+			       unsigned int attempt);
+
 extern const char *lxc_net_type_to_str(int type);
-extern int setup_private_host_hw_addr(char *veth1);
+extern int lxc_private_host_hw_addr(unsigned char *hwaddr);
 extern int netdev_get_mtu(int ifindex);
+
+/*
+ * Share one netlink socket and its buffers between the calls above until
+ * the matching lxc_netlink_session_end(). Sessions nest, and belong to the
+ * calling thread and its current network namespace.
+ */
+extern int lxc_netlink_session_begin(void);
+extern void lxc_netlink_session_end(void);
+
+/*
+ * Queue the requests which only need an acknowledgement until
+ * lxc_netlink_batch_end(), which sends them all at once. Those requests
+ * return 0 right away and lxc_netlink_batch_end() returns the first error.
+ * lxc_veth_create() is queued as well, and gets its own result back.
+ * The kernel applies the batch in order, but anything done by other means
+ * meanwhile, such as an ioctl(), reaches it first: a request which another
+ * step relies on must not be left in a batch.
+ */
+extern int lxc_netlink_batch_begin(void);
+extern int lxc_netlink_batch_end(void);
+
+struct nl_handler;
+struct lxc_interface;
+
+/*
+ * Open a netlink socket in another network namespace, without forking
+ */
+extern int lxc_netns_netlink_open(struct nl_handler *nlh, int netns_fd);
+
+/*
+ * List the interfaces and addresses of the namespace of a netlink socket
+ */
+extern int lxc_netdev_list(struct nl_handler *nlh, struct lxc_interface **ifs);
 #endif
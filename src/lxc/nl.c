@@ -190,6 +190,31 @@ extern int netlink_send(struct nl_handler *handler, struct nlmsg *nlmsg)
 	return ret;
 }
 
+extern int netlink_send_buf(struct nl_handler *handler, void *buf, size_t len)
+{
+	struct sockaddr_nl nladdr;
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+	struct msghdr msg = {
+		.msg_name = &nladdr,
+		.msg_namelen = sizeof(nladdr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	int ret;
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	ret = sendmsg(handler->fd, &msg, 0);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
 #ifndef NLMSG_ERROR
 #define NLMSG_ERROR                0x2
 #endif
@@ -258,6 +283,27 @@ extern int netlink_open(struct nl_handler *handler, int protocol)
         return 0;
 }
 
+extern int netlink_open_fd(struct nl_handler *handler, int fd)
+{
+	socklen_t socklen;
+
+	memset(handler, 0, sizeof(*handler));
+	handler->fd = fd;
+
+	socklen = sizeof(handler->local);
+	if (getsockname(handler->fd, (struct sockaddr*)&handler->local,
+			&socklen) < 0)
+		return -errno;
+
+	if (socklen != sizeof(handler->local) ||
+	    handler->local.nl_family != AF_NETLINK)
+		return -EINVAL;
+
+	handler->seq = time(NULL);
+
+	return 0;
+}
+
 extern int netlink_close(struct nl_handler *handler)
 {
 	close(handler->fd);
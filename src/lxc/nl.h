@@ -86,6 +86,18 @@ int netlink_open(struct nl_handler *handler, int protocol);
  */
 int netlink_close(struct nl_handler *handler);
 
+/*
+ * netlink_open_fd : fill the handler for an already opened and
+ *  bound netlink socket, for instance one received from another
+ *  process. The handler takes ownership of the fd.
+ *
+ * @handler: a netlink handler
+ * @fd: the netlink socket
+ *
+ * Return 0 on success, < 0 otherwise
+ */
+int netlink_open_fd(struct nl_handler *handler, int fd);
+
 /*
  * netlink_rcv : receive a netlink message from the kernel.
  *  It is up to the caller to manage the allocation of the
@@ -109,6 +121,17 @@ int netlink_rcv(struct nl_handler *handler, struct nlmsg *nlmsg);
  */
 int netlink_send(struct nl_handler *handler, struct nlmsg *nlmsg);
 
+/*
+ * netlink_send_buf : send several netlink messages at once
+ *
+ * @handler: a handler to the netlink socket
+ * @buf: the messages, each one aligned with NLMSG_ALIGN
+ * @len: the total length of @buf
+ *
+ * Returns 0 on success, < 0 otherwise
+ */
+int netlink_send_buf(struct nl_handler *handler, void *buf, size_t len);
+
 /*
  * netlink_transaction: send a request to the kernel and read the response.
  *  This is useful for transactional protocol. It is up to the caller
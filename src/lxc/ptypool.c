@@ -0,0 +1,298 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/param.h>
+
+#include "conf.h"
+#include "log.h"
+#include "lxclock.h"
+#include "ptypool.h"
+#include "utils.h"
+
+lxc_log_define(lxc_ptypool, lxc);
+
+/* don't let a typo in lxc.conf eat all the ptys of the host */
+#define LXC_PTY_POOL_MAX 1024
+
+/* protected by process_lock(), which is also held across fork() */
+static struct lxc_pty_info *pool;
+static int pool_count;
+static int pool_size;
+/* whether a thread is filling the pool */
+static bool filling;
+
+int lxc_pty_open(int *master, int *slave, char *name, size_t size)
+{
+	char path[MAXPATHLEN];
+	int m, s = -1, ret, saved_errno;
+
+	m = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (m < 0)
+		return -1;
+
+	if (grantpt(m) || unlockpt(m))
+		goto err;
+
+	if (ptsname_r(m, path, sizeof(path)))
+		goto err;
+
+#ifdef TIOCGPTPEER
+	/* no path lookup, and no race with the pty being reused */
+	s = ioctl(m, TIOCGPTPEER, O_RDWR | O_NOCTTY | O_CLOEXEC);
+#endif
+	if (s < 0)
+		s = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (s < 0)
+		goto err;
+
+	if (name) {
+		ret = snprintf(name, size, "%s", path);
+		if (ret < 0 || ret >= size) {
+			errno = ENAMETOOLONG;
+			goto err;
+		}
+	}
+
+	*master = m;
+	*slave = s;
+	return 0;
+
+err:
+	saved_errno = errno;
+	if (s >= 0)
+		close(s);
+	close(m);
+	errno = saved_errno;
+	return -1;
+}
+
+int lxc_pty_get(int *master, int *slave, char *name, size_t size)
+{
+	struct lxc_pty_info pty;
+	int ret;
+
+	process_lock();
+	if (!pool_count) {
+		process_unlock();
+		return lxc_pty_open(master, slave, name, size);
+	}
+	pty = pool[--pool_count];
+	process_unlock();
+
+	if (name) {
+		ret = snprintf(name, size, "%s", pty.name);
+		if (ret < 0 || ret >= size) {
+			lxc_pty_close(&pty, 1);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+	}
+	*master = pty.master;
+	*slave = pty.slave;
+	return 0;
+}
+
+static int pool_target(void)
+{
+	const char *value = lxc_global_config_value("lxc.pty.pool");
+	int n;
+
+	if (!value)
+		return 0;
+	n = atoi(value);
+	if (n < 0)
+		return 0;
+	return n > LXC_PTY_POOL_MAX ? LXC_PTY_POOL_MAX : n;
+}
+
+/* must be called with process_lock() held */
+static int pool_grow(int n)
+{
+	struct lxc_pty_info *p;
+
+	if (n <= pool_size)
+		return 0;
+	p = realloc(pool, sizeof(*pool) * n);
+	if (!p)
+		return -1;
+	pool = p;
+	pool_size = n;
+	return 0;
+}
+
+/*
+ * Open ptys until the pool holds @target of them.  Each pty is opened
+ * without holding process_lock(), so the other threads of the process
+ * aren't held back, and goes into the pool right away, so a fork only
+ * ever catches one of them in flight.
+ */
+static void pool_fill(int target)
+{
+	struct lxc_pty_info pty;
+	int n = 0;
+
+	for (;;) {
+		process_lock();
+		if (pool_count >= target) {
+			process_unlock();
+			break;
+		}
+		process_unlock();
+
+		if (lxc_pty_open(&pty.master, &pty.slave, pty.name,
+				 sizeof(pty.name))) {
+			SYSERROR("failed to pre-open a pty");
+			break;
+		}
+		pty.busy = 0;
+
+		process_lock();
+		/* somebody may have taken the pool over meanwhile */
+		if (pool_count >= target || pool_grow(target)) {
+			process_unlock();
+			lxc_pty_close(&pty, 1);
+			break;
+		}
+		pool[pool_count++] = pty;
+		process_unlock();
+		n++;
+	}
+
+	DEBUG("pre-opened %d ptys", n);
+}
+
+static void *pool_filler(void *arg)
+{
+	pool_fill((long)arg);
+
+	process_lock();
+	filling = false;
+	process_unlock();
+	return NULL;
+}
+
+/*
+ * lxc_pty_pool_fill: open ptys until the pool holds lxc.pty.pool of them
+ *
+ * The ptys are opened by a detached thread, so that the caller can go on
+ * starting its container.  There is at most one such thread at a time.
+ */
+void lxc_pty_pool_fill(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	long target = pool_target();
+	int ret;
+
+	if (!target)
+		return;
+
+	process_lock();
+	if (filling || pool_count >= target) {
+		process_unlock();
+		return;
+	}
+	filling = true;
+	process_unlock();
+
+	ret = pthread_attr_init(&attr);
+	if (!ret) {
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		ret = pthread_create(&tid, &attr, pool_filler, (void *)target);
+		pthread_attr_destroy(&attr);
+	}
+	if (ret) {
+		WARN("failed to start filling the pty pool: %s", strerror(ret));
+		process_lock();
+		filling = false;
+		process_unlock();
+	}
+}
+
+/*
+ * lxc_pty_pool_take: take ptys out of the pool
+ *
+ * @ptys : where to store the ptys
+ * @n    : number of ptys wanted
+ *
+ * Returns the number of ptys taken, which may be less than @n.
+ */
+int lxc_pty_pool_take(struct lxc_pty_info *ptys, int n)
+{
+	int i;
+
+	process_lock();
+	for (i = 0; i < n && pool_count; i++)
+		ptys[i] = pool[--pool_count];
+	process_unlock();
+
+	return i;
+}
+
+/*
+ * lxc_pty_pool_adopt: make @ptys the pool of a freshly forked child
+ *
+ * The rest of the pool inherited from the parent still belongs to the
+ * parent, and is closed.
+ */
+void lxc_pty_pool_adopt(struct lxc_pty_info *ptys, int n)
+{
+	process_lock();
+	lxc_pty_close(pool, pool_count);
+	pool_count = 0;
+	/* a thread filling the parent's pool didn't make it across fork() */
+	filling = false;
+	if (pool_grow(n)) {
+		process_unlock();
+		lxc_pty_close(ptys, n);
+		return;
+	}
+	memcpy(pool, ptys, sizeof(*ptys) * n);
+	pool_count = n;
+	process_unlock();
+}
+
+void lxc_pty_pool_release(void)
+{
+	process_lock();
+	lxc_pty_close(pool, pool_count);
+	free(pool);
+	pool = NULL;
+	pool_count = pool_size = 0;
+	process_unlock();
+}
+
+void lxc_pty_close(struct lxc_pty_info *ptys, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		close(ptys[i].master);
+		close(ptys[i].slave);
+	}
+}
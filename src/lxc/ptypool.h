@@ -0,0 +1,53 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_PTYPOOL_H
+#define __LXC_PTYPOOL_H
+
+#include <stddef.h>
+
+struct lxc_pty_info;
+
+/*
+ * Open a pty pair, both ends are close-on-exec from the start so no lock
+ * is needed against a concurrent fork and exec.
+ */
+extern int lxc_pty_open(int *master, int *slave, char *name, size_t size);
+
+/*
+ * Get a pty pair from the pool, or open a new one if the pool is empty.
+ */
+extern int lxc_pty_get(int *master, int *slave, char *name, size_t size);
+
+/*
+ * The pool of pre-opened ptys of a process, sized by lxc.pty.pool in
+ * lxc.conf (0, the default, disables it).
+ *
+ * A process about to fork the monitor of a container takes the ptys the
+ * container needs out of its pool, the child adopts them as its own pool
+ * and the parent closes its copies and has a thread refill the pool in the
+ * background.  The child releases what is left of its pool once the
+ * container has stopped.
+ */
+extern void lxc_pty_pool_fill(void);
+extern int lxc_pty_pool_take(struct lxc_pty_info *ptys, int n);
+extern void lxc_pty_pool_adopt(struct lxc_pty_info *ptys, int n);
+extern void lxc_pty_pool_release(void);
+extern void lxc_pty_close(struct lxc_pty_info *ptys, int n);
+
+#endif /* __LXC_PTYPOOL_H */
@@ -0,0 +1,121 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringbuf.h"
+
+/*
+ * lxc_ringbuf_create: allocate the backing memory of a ring buffer
+ *
+ * @buf  : the ring buffer to initialize
+ * @size : size in bytes, must be > 0
+ *
+ * Returns 0 on success, -errno on failure
+ */
+int lxc_ringbuf_create(struct lxc_ringbuf *buf, uint64_t size)
+{
+	memset(buf, 0, sizeof(*buf));
+	if (!size || size > SIZE_MAX)
+		return -EINVAL;
+
+	buf->addr = malloc(size);
+	if (!buf->addr)
+		return -ENOMEM;
+	buf->size = size;
+	return 0;
+}
+
+void lxc_ringbuf_release(struct lxc_ringbuf *buf)
+{
+	free(buf->addr);
+	memset(buf, 0, sizeof(*buf));
+}
+
+void lxc_ringbuf_clear(struct lxc_ringbuf *buf)
+{
+	buf->r_off = buf->w_off;
+}
+
+/* drop the @len oldest bytes, typically after they have been read */
+void lxc_ringbuf_consume(struct lxc_ringbuf *buf, uint64_t len)
+{
+	if (len > lxc_ringbuf_used(buf))
+		len = lxc_ringbuf_used(buf);
+	buf->r_off += len;
+}
+
+void lxc_ringbuf_write(struct lxc_ringbuf *buf, const char *msg, size_t len)
+{
+	uint64_t off, chunk;
+
+	if (!buf->addr || !len)
+		return;
+
+	/* only the tail of an oversized message can survive anyway */
+	if (len > buf->size) {
+		buf->w_off += len - buf->size;
+		msg += len - buf->size;
+		len = buf->size;
+	}
+
+	off = buf->w_off % buf->size;
+	chunk = buf->size - off;
+	if (chunk > len)
+		chunk = len;
+	memcpy(buf->addr + off, msg, chunk);
+	if (chunk < len)
+		memcpy(buf->addr, msg + chunk, len - chunk);
+
+	buf->w_off += len;
+	if (buf->w_off - buf->r_off > buf->size)
+		buf->r_off = buf->w_off - buf->size;
+}
+
+/*
+ * lxc_ringbuf_read: copy the oldest bytes out of a ring buffer
+ *
+ * @buf : the ring buffer to read from
+ * @dst : destination of at least @len bytes
+ * @len : maximum number of bytes to copy
+ *
+ * The data is not consumed, use lxc_ringbuf_clear() for that.
+ * Returns the number of bytes copied.
+ */
+uint64_t lxc_ringbuf_read(struct lxc_ringbuf *buf, char *dst, uint64_t len)
+{
+	uint64_t off, chunk;
+
+	if (!buf->addr)
+		return 0;
+
+	if (len > lxc_ringbuf_used(buf))
+		len = lxc_ringbuf_used(buf);
+
+	off = buf->r_off % buf->size;
+	chunk = buf->size - off;
+	if (chunk > len)
+		chunk = len;
+	memcpy(dst, buf->addr + off, chunk);
+	if (chunk < len)
+		memcpy(dst + chunk, buf->addr, len - chunk);
+
+	return len;
+}
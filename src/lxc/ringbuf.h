@@ -0,0 +1,54 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_RINGBUF_H
+#define __LXC_RINGBUF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A fixed size byte ring buffer. Writers never block: once the buffer is
+ * full the oldest bytes are overwritten.
+ * @addr  : the backing memory, NULL if the ring buffer is not in use
+ * @size  : the size of @addr in bytes
+ * @w_off : total number of bytes ever written
+ * @r_off : offset of the oldest byte still held in the buffer
+ */
+struct lxc_ringbuf {
+	char *addr;
+	uint64_t size;
+	uint64_t w_off;
+	uint64_t r_off;
+};
+
+extern int lxc_ringbuf_create(struct lxc_ringbuf *buf, uint64_t size);
+extern void lxc_ringbuf_release(struct lxc_ringbuf *buf);
+extern void lxc_ringbuf_clear(struct lxc_ringbuf *buf);
+extern void lxc_ringbuf_consume(struct lxc_ringbuf *buf, uint64_t len);
+extern void lxc_ringbuf_write(struct lxc_ringbuf *buf, const char *msg,
+			      size_t len);
+extern uint64_t lxc_ringbuf_read(struct lxc_ringbuf *buf, char *dst,
+				 uint64_t len);
+
+static inline uint64_t lxc_ringbuf_used(struct lxc_ringbuf *buf)
+{
+	return buf->w_off - buf->r_off;
+}
+
+#endif /* __LXC_RINGBUF_H */
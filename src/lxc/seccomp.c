@@ -24,16 +24,40 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <seccomp.h>
 #include <errno.h>
-#include <seccomp.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <linux/filter.h>
 
 #include "config.h"
 #include "lxcseccomp.h"
 #include "log.h"
+#include "utils.h"
+#include "version.h"
 
 lxc_log_define(lxc_seccomp, lxc);
 
+#ifndef SECCOMP_MODE_FILTER
+#define SECCOMP_MODE_FILTER 2
+#endif
+
+/*
+ * Compiling a policy through libseccomp costs far more than loading the
+ * resulting BPF program, and the same policy is compiled again for every
+ * start and every attach. The exported program is therefore cached in the
+ * runtime directory, keyed by a hash of the policy file's content, of the
+ * lxc and libseccomp versions and of the native architecture, and loaded
+ * directly with prctl() when it is found and holds that very policy.
+ */
+#if HAVE_SCMP_FILTER_CTX && HAVE_DECL_SECCOMP_SYSCALL_RESOLVE_NAME_ARCH
+#define LXC_SECCOMP_CACHE 1
+#endif
+
 static int parse_config_v1(FILE *f, struct lxc_conf *conf)
 {
 	char line[1024];
@@ -302,14 +326,289 @@ static int parse_config(FILE *f, struct lxc_conf *conf)
 	return parse_config_v2(f, line, conf);
 }
 
+/* read the whole policy file, which is small, into a nul terminated buffer */
+static char *read_policy(const char *path, size_t *len)
+{
+	struct stat st;
+	char *buf = NULL;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0)
+		goto out;
+	if (st.st_size <= 0 || st.st_size > 1024 * 1024) {
+		errno = EINVAL;
+		goto out;
+	}
+
+	buf = malloc(st.st_size + 1);
+	if (!buf)
+		goto out;
+	ret = lxc_read_nointr(fd, buf, st.st_size);
+	if (ret <= 0) {
+		free(buf);
+		buf = NULL;
+		goto out;
+	}
+	buf[ret] = '\0';
+	*len = ret;
+out:
+	close(fd);
+	return buf;
+}
+
+#if LXC_SECCOMP_CACHE
+#define SECCOMP_CACHE_MAGIC "lxcbpf2"
+
+/*
+ * A cache entry is the header, the identity of the policy it was compiled
+ * from, see seccomp_cache_ident(), and the program.
+ */
+struct seccomp_cache_header {
+	char magic[8];
+	uint64_t key;
+	uint32_t arch;
+	uint32_t len;	/* number of struct sock_filter following the identity */
+	uint32_t identlen;
+	uint32_t pad;
+};
+
+/*
+ * The identity of a compiled policy: the lxc version, the libseccomp
+ * version and the policy itself.  Another libseccomp may resolve syscalls
+ * or generate the program differently.  The version of the library loaded
+ * is used where libseccomp can tell it, as it can be upgraded without lxc
+ * being rebuilt.
+ *
+ * The key of the cache entry is only a hash of the identity, which the
+ * entry also holds in full: a filter is never taken from an entry whose
+ * key merely collides.
+ */
+static char *seccomp_cache_ident(const char *policy, size_t len,
+				 size_t *identlen)
+{
+	size_t vlen = strlen(LXC_VERSION) + 1;
+	char *ident;
+#if HAVE_DECL_SECCOMP_VERSION
+	const struct scmp_version *lib = seccomp_version();
+	unsigned int version[3] = { 0, 0, 0 };
+
+	if (lib) {
+		version[0] = lib->major;
+		version[1] = lib->minor;
+		version[2] = lib->micro;
+	}
+#elif defined(SCMP_VER_MAJOR)
+	const unsigned int version[3] = {
+		SCMP_VER_MAJOR, SCMP_VER_MINOR, SCMP_VER_MICRO
+	};
+#else
+	const unsigned int version[3] = { 0, 0, 0 };
+#endif
+
+	*identlen = vlen + sizeof(version) + len;
+	ident = malloc(*identlen);
+	if (!ident)
+		return NULL;
+	memcpy(ident, LXC_VERSION, vlen);
+	memcpy(ident + vlen, version, sizeof(version));
+	memcpy(ident + vlen + sizeof(version), policy, len);
+	return ident;
+}
+
+static char *seccomp_cache_path(uint64_t key, uint32_t arch)
+{
+	char *rundir, *path = NULL;
+	size_t len;
+	int ret;
+
+	rundir = get_rundir();
+	if (!rundir)
+		return NULL;
+
+	len = strlen(rundir) + strlen("/lxc/seccomp/") + 16 + 1 + 8 + 1;
+	path = malloc(len);
+	if (!path)
+		goto out;
+	ret = snprintf(path, len, "%s/lxc/seccomp/%016llx-%08x", rundir,
+		       (unsigned long long)key, arch);
+	if (ret < 0 || ret >= len) {
+		free(path);
+		path = NULL;
+	}
+out:
+	free(rundir);
+	return path;
+}
+
+/*
+ * seccomp_cache_load: load a compiled policy from the cache into @conf
+ *
+ * @conf : the configuration the policy is for
+ * @path : the cache entry
+ * @ident    : identity of the policy the entry must have been written for
+ * @identlen : its length
+ * @key      : its hash
+ * @arch     : architecture the entry must have been written for
+ *
+ * Only entries owned by us and not writable by anybody else are trusted,
+ * anything unexpected is treated as a miss.
+ * Returns 0 on success, -1 on a miss.
+ */
+static int seccomp_cache_load(struct lxc_conf *conf, const char *path,
+			      const char *ident, size_t identlen,
+			      uint64_t key, uint32_t arch)
+{
+	struct seccomp_cache_header hdr;
+	struct sock_filter *filter = NULL;
+	struct stat st;
+	char *buf = NULL;
+	size_t size;
+	int fd, ret = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+	    st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+		goto out;
+
+	if (lxc_read_nointr(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out;
+	if (memcmp(hdr.magic, SECCOMP_CACHE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.key != key || hdr.arch != arch || hdr.identlen != identlen ||
+	    !hdr.len || hdr.len > BPF_MAXINSNS)
+		goto out;
+
+	size = hdr.len * sizeof(*filter);
+	if (st.st_size != sizeof(hdr) + identlen + size)
+		goto out;
+
+	buf = malloc(identlen);
+	if (!buf)
+		goto out;
+	if (lxc_read_nointr(fd, buf, identlen) != identlen ||
+	    memcmp(buf, ident, identlen) != 0) {
+		DEBUG("%s is the cache entry of another seccomp policy", path);
+		goto out;
+	}
+
+	filter = malloc(size);
+	if (!filter)
+		goto out;
+	if (lxc_read_nointr(fd, filter, size) != size) {
+		free(filter);
+		goto out;
+	}
+
+	conf->seccomp_bpf = filter;
+	conf->seccomp_bpf_len = hdr.len;
+	ret = 0;
+out:
+	free(buf);
+	close(fd);
+	return ret;
+}
+
+/* export the policy compiled in @conf->seccomp_ctx to the cache at @path */
+static void seccomp_cache_store(struct lxc_conf *conf, const char *path,
+				const char *ident, size_t identlen,
+				uint64_t key, uint32_t arch)
+{
+	struct seccomp_cache_header hdr;
+	char *dir, *tmp;
+	off_t end;
+	int fd;
+
+	dir = alloca(strlen(path) + 1);
+	strcpy(dir, path);
+	*strrchr(dir, '/') = '\0';
+	if (mkdir_p(dir, 0700) < 0)
+		return;
+
+	tmp = alloca(strlen(path) + 8);
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SECCOMP_CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.key = key;
+	hdr.arch = arch;
+	hdr.identlen = identlen;
+	if (lxc_write_nointr(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto err;
+	if (lxc_write_nointr(fd, ident, identlen) != identlen)
+		goto err;
+	if (seccomp_export_bpf(conf->seccomp_ctx, fd) < 0)
+		goto err;
+
+	/* the header only gets its length once the program is written */
+	end = lseek(fd, 0, SEEK_END) - (off_t)(sizeof(hdr) + identlen);
+	if (end <= 0 || end % sizeof(struct sock_filter))
+		goto err;
+	hdr.len = end / sizeof(struct sock_filter);
+	if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		goto err;
+	if (close(fd) < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+		return;
+	}
+	DEBUG("cached seccomp policy %s as %s", conf->seccomp, path);
+	return;
+
+err:
+	close(fd);
+	unlink(tmp);
+}
+#endif
+
 int lxc_read_seccomp_config(struct lxc_conf *conf)
 {
 	FILE *f;
+	char *policy;
+	size_t len;
 	int ret;
+#if LXC_SECCOMP_CACHE
+	char *path = NULL, *ident = NULL;
+	size_t identlen;
+	uint64_t key;
+	uint32_t arch;
+#endif
 
 	if (!conf->seccomp)
 		return 0;
 
+	free(conf->seccomp_bpf);
+	conf->seccomp_bpf = NULL;
+
+	policy = read_policy(conf->seccomp, &len);
+	if (!policy) {
+		SYSERROR("failed to read seccomp policy file %s", conf->seccomp);
+		return -1;
+	}
+
+#if LXC_SECCOMP_CACHE
+	arch = seccomp_arch_native();
+	ident = seccomp_cache_ident(policy, len, &identlen);
+	if (ident) {
+		key = fnv_64a_buf(ident, identlen, FNV1A_64_INIT);
+		path = seccomp_cache_path(key, arch);
+	}
+	if (path && seccomp_cache_load(conf, path, ident, identlen, key,
+				       arch) == 0) {
+		DEBUG("using the cached seccomp policy %s", path);
+		free(ident);
+		free(path);
+		free(policy);
+		return 0;
+	}
+#endif
+
 #if HAVE_SCMP_FILTER_CTX
 	/* XXX for debug, pass in SCMP_ACT_TRAP */
 	conf->seccomp_ctx = seccomp_init(SCMP_ACT_KILL);
@@ -319,7 +618,8 @@ int lxc_read_seccomp_config(struct lxc_conf *conf)
 #endif
 	if (ret) {
 		ERROR("failed initializing seccomp");
-		return -1;
+		ret = -1;
+		goto out;
 	}
 
 	/* turn of no-new-privs.  We don't want it in lxc, and it breaks
@@ -330,16 +630,29 @@ int lxc_read_seccomp_config(struct lxc_conf *conf)
 #endif
 			SCMP_FLTATR_CTL_NNP, 0)) {
 		ERROR("failed to turn off n-new-privs");
-		return -1;
+		ret = -1;
+		goto out;
 	}
 
-	f = fopen(conf->seccomp, "r");
+	f = fmemopen(policy, len, "r");
 	if (!f) {
 		SYSERROR("failed to open seccomp policy file %s", conf->seccomp);
-		return -1;
+		ret = -1;
+		goto out;
 	}
 	ret = parse_config(f, conf);
 	fclose(f);
+
+#if LXC_SECCOMP_CACHE
+	if (ret == 0 && path)
+		seccomp_cache_store(conf, path, ident, identlen, key, arch);
+#endif
+out:
+#if LXC_SECCOMP_CACHE
+	free(ident);
+	free(path);
+#endif
+	free(policy);
 	return ret;
 }
 
@@ -348,6 +661,21 @@ int lxc_seccomp_load(struct lxc_conf *conf)
 	int ret;
 	if (!conf->seccomp)
 		return 0;
+
+	if (conf->seccomp_bpf) {
+		struct sock_fprog prog = {
+			.len = conf->seccomp_bpf_len,
+			.filter = conf->seccomp_bpf,
+		};
+
+		/* no-new-privs stays off, as it does through libseccomp */
+		if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) < 0) {
+			SYSERROR("Error loading the cached seccomp policy");
+			return -1;
+		}
+		return 0;
+	}
+
 	ret = seccomp_load(
 #if HAVE_SCMP_FILTER_CTX
 			conf->seccomp_ctx
@@ -371,4 +699,6 @@ void lxc_seccomp_free(struct lxc_conf *conf) {
 		conf->seccomp_ctx = NULL;
 	}
 #endif
+	free(conf->seccomp_bpf);
+	conf->seccomp_bpf = NULL;
 }
@@ -71,6 +71,8 @@
 #include "lxcseccomp.h"
 #include "caps.h"
 #include "lsm/lsm.h"
+#include "trace.h"
+#include "bdev.h"
 
 lxc_log_define(lxc_start, lxc);
 
@@ -367,6 +369,9 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 	handler->lxcpath = lxcpath;
 	handler->pinfd = -1;
 
+	if (conf->start_trace)
+		handler->trace = lxc_trace_create();
+
 	lsm_init();
 
 	handler->name = strdup(name);
@@ -388,6 +393,7 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 		ERROR("failed to set state '%s'", lxc_state2str(STARTING));
 		goto out_close_maincmd_fd;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_INIT);
 
 	/* Start of environment variable setup for hooks */
 	if (setenv("LXC_NAME", name, 1)) {
@@ -414,11 +420,13 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 		ERROR("failed to run pre-start hooks for container '%s'.", name);
 		goto out_aborting;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_PRE_START_HOOKS);
 
 	if (lxc_create_tty(name, conf)) {
 		ERROR("failed to create the ttys");
 		goto out_aborting;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_TTYS);
 
 	/* the signal fd has to be created before forking otherwise
 	 * if the child process exits before we setup the signal fd,
@@ -439,6 +447,7 @@ struct lxc_handler *lxc_init(const char *name, struct lxc_conf *conf, const char
 		ERROR("Failed to shift tty into container");
 		goto out_restore_sigmask;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CONSOLE);
 
 	INFO("'%s' is initialized", name);
 	return handler;
@@ -456,6 +465,7 @@ out_free_name:
 	free(handler->name);
 	handler->name = NULL;
 out_free:
+	lxc_trace_free(handler->trace);
 	free(handler);
 	return NULL;
 }
@@ -466,6 +476,7 @@ static void lxc_fini(const char *name, struct lxc_handler *handler)
 	 * which can take awhile
 	 */
 	lxc_set_state(name, handler, STOPPING);
+	bdev_trim_rootfs(handler->conf);
 	lxc_set_state(name, handler, STOPPED);
 
 	if (run_lxc_hooks(name, "post-stop", handler->conf, handler->lxcpath, NULL))
@@ -481,6 +492,7 @@ static void lxc_fini(const char *name, struct lxc_handler *handler)
 	handler->conf->maincmd_fd = -1;
 	free(handler->name);
 	cgroup_destroy(handler);
+	lxc_trace_free(handler->trace);
 	free(handler);
 }
 
@@ -607,6 +619,32 @@ static int read_unpriv_netifindex(struct lxc_list *network)
 	return 0;
 }
 
+/*
+ * With lxc.start.trace = 2, write the start trace to the log file as a
+ * line of its own, which the log priority doesn't filter and the size of
+ * a log event doesn't truncate.
+ */
+static void log_start_trace(struct lxc_handler *handler)
+{
+	char *json;
+	size_t len;
+
+	if (!handler->trace || handler->conf->start_trace < 2 ||
+	    lxc_log_fd == -1)
+		return;
+
+	json = lxc_trace_json(handler->trace, handler->name);
+	if (!json) {
+		WARN("failed to format the start trace");
+		return;
+	}
+	len = strlen(json);
+	json[len] = '\n';
+	if (lxc_write_nointr(lxc_log_fd, json, len + 1) != len + 1)
+		WARN("failed to log the start trace");
+	free(json);
+}
+
 static int do_start(void *data)
 {
 	struct lxc_handler *handler = data;
@@ -638,8 +676,10 @@ static int do_start(void *data)
 	/* Tell the parent task it can begin to configure the
 	 * container and wait for it to finish
 	 */
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_STARTED);
 	if (lxc_sync_barrier_parent(handler, LXC_SYNC_CONFIGURE))
 		return -1;
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_CONFIGURED);
 
 	if (read_unpriv_netifindex(&handler->conf->network) < 0)
 		goto out_warn_father;
@@ -710,6 +750,7 @@ static int do_start(void *data)
 		ERROR("failed to run start hooks for container '%s'.", handler->name);
 		goto out_warn_father;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_START_HOOKS);
 
 	/* The clearenv() and putenv() calls have been moved here
 	 * to allow us to use enviroment variables passed to the various
@@ -728,6 +769,7 @@ static int do_start(void *data)
 
 	close(handler->sigfd);
 
+	lxc_trace(handler->trace, LXC_TRACE_CHILD_EXEC);
 	/* after this call, we are in error because this
 	 * ops should not return as it execs */
 	handler->ops->start(handler, handler->data);
@@ -815,6 +857,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 				lxc_sync_fini(handler);
 				return -1;
 			}
+			lxc_trace(handler->trace, LXC_TRACE_NETWORK_CREATE);
 		}
 
 		if (save_phys_nics(handler->conf)) {
@@ -844,11 +887,13 @@ static int lxc_spawn(struct lxc_handler *handler)
 	}
 
 	cgroups_connected = true;
+	lxc_trace(handler->trace, LXC_TRACE_CGROUP_INIT);
 
 	if (!cgroup_create(handler)) {
 		ERROR("failed creating cgroups");
 		goto out_delete_net;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CGROUP_CREATE);
 
 	/*
 	 * if the rootfs is not a blockdev, prevent the container from
@@ -882,6 +927,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 		SYSERROR("failed to fork into a new namespace");
 		goto out_delete_net;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_SPAWN_CLONE);
 
 	if (attach_ns(saved_ns_fd))
 		WARN("failed to restore saved namespaces");
@@ -890,6 +936,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 
 	if (lxc_sync_wait_child(handler, LXC_SYNC_CONFIGURE))
 		failed_before_rename = 1;
+	lxc_trace(handler->trace, LXC_TRACE_SYNC_CONFIGURE);
 
 	if (!cgroup_create_legacy(handler)) {
 		ERROR("failed to setup the legacy cgroups for %s", name);
@@ -905,6 +952,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 
 	if (!cgroup_chown(handler))
 		goto out_delete_net;
+	lxc_trace(handler->trace, LXC_TRACE_CGROUP_SETUP);
 
 	if (failed_before_rename)
 		goto out_delete_net;
@@ -915,6 +963,7 @@ static int lxc_spawn(struct lxc_handler *handler)
 			ERROR("failed to create the configured network");
 			goto out_delete_net;
 		}
+		lxc_trace(handler->trace, LXC_TRACE_NETWORK_ASSIGN);
 	}
 
 	if (netpipe != -1) {
@@ -943,17 +992,20 @@ static int lxc_spawn(struct lxc_handler *handler)
 		ERROR("failed to set up id mapping");
 		goto out_delete_net;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_ID_MAP);
 
 	/* Tell the child to continue its initialization.  we'll get
 	 * LXC_SYNC_CGROUP when it is ready for us to setup cgroups
 	 */
 	if (lxc_sync_barrier_child(handler, LXC_SYNC_POST_CONFIGURE))
 		goto out_delete_net;
+	lxc_trace(handler->trace, LXC_TRACE_SYNC_POST_CONFIGURE);
 
 	if (!cgroup_setup_limits(handler, true)) {
 		ERROR("failed to setup the devices cgroup for '%s'", name);
 		goto out_delete_net;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_CGROUP_DEVICES);
 
 	cgroup_disconnect();
 	cgroups_connected = false;
@@ -967,18 +1019,21 @@ static int lxc_spawn(struct lxc_handler *handler)
 	 */
 	if (lxc_sync_barrier_child(handler, LXC_SYNC_POST_CGROUP))
 		return -1;
+	lxc_trace(handler->trace, LXC_TRACE_SYNC_POST_CGROUP);
 
 	if (detect_shared_rootfs())
 		umount2(handler->conf->rootfs.mount, MNT_DETACH);
 
 	if (handler->ops->post_start(handler, handler->data))
 		goto out_abort;
+	lxc_trace(handler->trace, LXC_TRACE_POST_START);
 
 	if (lxc_set_state(name, handler, RUNNING)) {
 		ERROR("failed to set state to %s",
 			      lxc_state2str(RUNNING));
 		goto out_abort;
 	}
+	lxc_trace(handler->trace, LXC_TRACE_RUNNING);
 
 	lxc_sync_fini(handler);
 
@@ -1027,6 +1082,7 @@ int __lxc_start(const char *name, struct lxc_conf *conf,
 	}
 
 	err = lxc_spawn(handler);
+	log_start_trace(handler);
 	if (err) {
 		ERROR("failed to spawn '%s'", name);
 		goto out_fini_nonet;
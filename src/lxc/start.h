@@ -72,6 +72,7 @@ struct lxc_handler {
 	int pinfd;
 	const char *lxcpath;
 	void *cgroup_data;
+	struct lxc_trace *trace;
 };
 
 extern struct lxc_handler *lxc_init(const char *name, struct lxc_conf *, const char *);
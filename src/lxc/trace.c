@@ -0,0 +1,203 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "log.h"
+#include "trace.h"
+
+lxc_log_define(lxc_trace, lxc);
+
+static const char * const phase_names[LXC_TRACE_PHASE_MAX] = {
+	[LXC_TRACE_INIT]                  = "init",
+	[LXC_TRACE_PRE_START_HOOKS]       = "pre-start-hooks",
+	[LXC_TRACE_TTYS]                  = "ttys",
+	[LXC_TRACE_CONSOLE]               = "console",
+	[LXC_TRACE_NETWORK_CREATE]        = "network-create",
+	[LXC_TRACE_CGROUP_INIT]           = "cgroup-init",
+	[LXC_TRACE_CGROUP_CREATE]         = "cgroup-create",
+	[LXC_TRACE_SPAWN_CLONE]           = "clone",
+	[LXC_TRACE_CHILD_STARTED]         = "child-started",
+	[LXC_TRACE_SYNC_CONFIGURE]        = "sync-configure",
+	[LXC_TRACE_CGROUP_SETUP]          = "cgroup-setup",
+	[LXC_TRACE_NETWORK_ASSIGN]        = "network-assign",
+	[LXC_TRACE_ID_MAP]                = "id-map",
+	[LXC_TRACE_CHILD_CONFIGURED]      = "child-configured",
+	[LXC_TRACE_CHILD_NETWORK]         = "child-network",
+	[LXC_TRACE_CHILD_PRE_MOUNT_HOOKS] = "child-pre-mount-hooks",
+	[LXC_TRACE_CHILD_ROOTFS]          = "child-rootfs",
+	[LXC_TRACE_CHILD_AUTODEV_MOUNT]   = "child-autodev-mount",
+	[LXC_TRACE_CHILD_MOUNT_ENTRIES]   = "child-mount-entries",
+	[LXC_TRACE_CHILD_MOUNT_HOOKS]     = "child-mount-hooks",
+	[LXC_TRACE_CHILD_AUTODEV]         = "child-autodev",
+	[LXC_TRACE_CHILD_DEV]             = "child-dev",
+	[LXC_TRACE_CHILD_PIVOT_ROOT]      = "child-pivot-root",
+	[LXC_TRACE_CHILD_SETUP]           = "child-setup",
+	[LXC_TRACE_SYNC_POST_CONFIGURE]   = "sync-post-configure",
+	[LXC_TRACE_CGROUP_DEVICES]        = "cgroup-devices",
+	[LXC_TRACE_CHILD_START_HOOKS]     = "child-start-hooks",
+	[LXC_TRACE_CHILD_EXEC]            = "child-exec",
+	[LXC_TRACE_SYNC_POST_CGROUP]      = "sync-post-cgroup",
+	[LXC_TRACE_POST_START]            = "post-start",
+	[LXC_TRACE_RUNNING]               = "running",
+};
+
+static uint64_t now(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * lxc_trace_create: start tracing a container start
+ *
+ * The trace is in shared memory, so that the container's init can record
+ * its own phases until it execs.
+ *
+ * Returns the trace, NULL on failure.
+ */
+struct lxc_trace *lxc_trace_create(void)
+{
+	struct lxc_trace *trace;
+
+	trace = mmap(NULL, sizeof(*trace), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (trace == MAP_FAILED) {
+		SYSERROR("failed to allocate the start trace");
+		return NULL;
+	}
+
+	trace->start = now(CLOCK_MONOTONIC);
+	trace->wall = now(CLOCK_REALTIME) / 1000;
+	return trace;
+}
+
+void lxc_trace_free(struct lxc_trace *trace)
+{
+	if (trace)
+		munmap(trace, sizeof(*trace));
+}
+
+void lxc_trace_record(struct lxc_trace *trace, enum lxc_trace_phase phase)
+{
+	uint64_t ns = now(CLOCK_MONOTONIC) - trace->start;
+	int i, tries;
+
+	/*
+	 * The monitor and the container's init may race here: take a slot,
+	 * fill it in, and only then count it, once the slots before it are
+	 * counted too. Should the other recorder die in between, the events
+	 * after its slot are given up on rather than waited for forever.
+	 */
+	i = __sync_fetch_and_add(&trace->reserved, 1);
+	if (i >= LXC_TRACE_PHASE_MAX)
+		return;
+	trace->events[i].phase = phase;
+	trace->events[i].ns = ns;
+	for (tries = 0; tries < 1000; tries++) {
+		if (__sync_bool_compare_and_swap(&trace->count, i, i + 1))
+			return;
+		sched_yield();
+	}
+	WARN("gave up recording the %s phase of the start trace",
+	     phase_names[phase]);
+}
+
+/* @s as a JSON string, quoted */
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/*
+ * lxc_trace_json: format a start trace
+ *
+ * @trace : the trace
+ * @name  : the name of the container
+ *
+ * Returns a single line JSON object, which the caller must free(), or
+ * NULL on failure. The phases are listed in the order they ended, each
+ * with the microseconds elapsed since the start began and since the
+ * previous phase ended.
+ */
+char *lxc_trace_json(struct lxc_trace *trace, const char *name)
+{
+	struct lxc_trace_event events[LXC_TRACE_PHASE_MAX], tmp;
+	uint64_t prev = 0;
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f;
+	int i, j, n;
+
+	n = trace->count;
+	if (n > LXC_TRACE_PHASE_MAX)
+		n = LXC_TRACE_PHASE_MAX;
+	/* the slots counted are filled in, don't read them any earlier */
+	__sync_synchronize();
+	memcpy(events, trace->events, sizeof(*events) * n);
+
+	/* both processes record, so the slots aren't quite in order */
+	for (i = 1; i < n; i++) {
+		tmp = events[i];
+		for (j = i; j > 0 && events[j - 1].ns > tmp.ns; j--)
+			events[j] = events[j - 1];
+		events[j] = tmp;
+	}
+
+	f = open_memstream(&buf, &len);
+	if (!f)
+		return NULL;
+
+	fprintf(f, "{\"name\":");
+	json_string(f, name);
+	fprintf(f, ",\"start\":%llu,\"phases\":[",
+		(unsigned long long)trace->wall);
+	for (i = 0; i < n; i++) {
+		if (events[i].phase < 0 || events[i].phase >= LXC_TRACE_PHASE_MAX)
+			continue;
+		fprintf(f, "%s{\"phase\":\"%s\",\"at\":%llu,\"took\":%llu}",
+			i ? "," : "", phase_names[events[i].phase],
+			(unsigned long long)events[i].ns / 1000,
+			(unsigned long long)(events[i].ns - prev) / 1000);
+		prev = events[i].ns;
+	}
+	fprintf(f, "]}");
+
+	if (fclose(f)) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
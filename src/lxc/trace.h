@@ -0,0 +1,100 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_TRACE_H
+#define __LXC_TRACE_H
+
+#include <stdint.h>
+
+/*
+ * The ends of the phases of a container start, in the order they happen.
+ * The CHILD ones are recorded by the container's init before it execs,
+ * the others by the monitor.
+ */
+enum lxc_trace_phase {
+	LXC_TRACE_INIT,
+	LXC_TRACE_PRE_START_HOOKS,
+	LXC_TRACE_TTYS,
+	LXC_TRACE_CONSOLE,
+	LXC_TRACE_NETWORK_CREATE,
+	LXC_TRACE_CGROUP_INIT,
+	LXC_TRACE_CGROUP_CREATE,
+	LXC_TRACE_SPAWN_CLONE,
+	LXC_TRACE_CHILD_STARTED,
+	LXC_TRACE_SYNC_CONFIGURE,
+	LXC_TRACE_CGROUP_SETUP,
+	LXC_TRACE_NETWORK_ASSIGN,
+	LXC_TRACE_ID_MAP,
+	LXC_TRACE_CHILD_CONFIGURED,
+	LXC_TRACE_CHILD_NETWORK,
+	LXC_TRACE_CHILD_PRE_MOUNT_HOOKS,
+	LXC_TRACE_CHILD_ROOTFS,
+	LXC_TRACE_CHILD_AUTODEV_MOUNT,
+	LXC_TRACE_CHILD_MOUNT_ENTRIES,
+	LXC_TRACE_CHILD_MOUNT_HOOKS,
+	LXC_TRACE_CHILD_AUTODEV,
+	LXC_TRACE_CHILD_DEV,
+	LXC_TRACE_CHILD_PIVOT_ROOT,
+	LXC_TRACE_CHILD_SETUP,
+	LXC_TRACE_SYNC_POST_CONFIGURE,
+	LXC_TRACE_CGROUP_DEVICES,
+	LXC_TRACE_CHILD_START_HOOKS,
+	LXC_TRACE_CHILD_EXEC,
+	LXC_TRACE_SYNC_POST_CGROUP,
+	LXC_TRACE_POST_START,
+	LXC_TRACE_RUNNING,
+	LXC_TRACE_PHASE_MAX,
+};
+
+struct lxc_trace_event {
+	int phase;
+	uint64_t ns;
+};
+
+/*
+ * The start trace of a container, shared between the monitor and the
+ * container's init until it execs.
+ * @start    : CLOCK_MONOTONIC when the start began
+ * @wall     : CLOCK_REALTIME at the same point, in microseconds
+ * @reserved : number of event slots taken by the recorders
+ * @count    : number of events recorded, whose slots are filled in
+ * @events   : the phase boundaries, in nanoseconds since @start
+ */
+struct lxc_trace {
+	uint64_t start;
+	uint64_t wall;
+	int reserved;
+	int count;
+	struct lxc_trace_event events[LXC_TRACE_PHASE_MAX];
+};
+
+extern struct lxc_trace *lxc_trace_create(void);
+extern void lxc_trace_free(struct lxc_trace *trace);
+extern void lxc_trace_record(struct lxc_trace *trace,
+			     enum lxc_trace_phase phase);
+extern char *lxc_trace_json(struct lxc_trace *trace, const char *name);
+
+/* costs a pointer test when tracing is disabled */
+static inline void lxc_trace(struct lxc_trace *trace,
+			     enum lxc_trace_phase phase)
+{
+	if (trace)
+		lxc_trace_record(trace, phase);
+}
+
+#endif /* __LXC_TRACE_H */
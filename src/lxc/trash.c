@@ -0,0 +1,443 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "conf.h"
+#include "confile.h"
+#include "log.h"
+#include "trash.h"
+#include "utils.h"
+
+lxc_log_define(lxc_trash, lxc);
+
+/*
+ * Destroyed containers are renamed to ${lxcpath}/.trash/${name}-XXXXXX.
+ * The reaper holds a lock on ${lxcpath}/.trash/.reaper while it removes
+ * them.
+ */
+#define TRASH_DIR	".trash"
+#define TRASH_LOCK	".reaper"
+
+#ifndef IOPRIO_WHO_PROCESS
+#define IOPRIO_WHO_PROCESS	1
+#endif
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE	3
+#endif
+#ifndef IOPRIO_CLASS_SHIFT
+#define IOPRIO_CLASS_SHIFT	13
+#endif
+
+/*
+ * Keeps the reaper below lxc.destroy.bwlimit bytes freed and
+ * lxc.destroy.oplimit files removed per second.
+ * @bps, @ops             : the limits, 0 for none
+ * @bytes_done, @ops_done : what was done since @start
+ */
+struct throttle {
+	struct timespec start;
+	uint64_t bps;
+	uint64_t ops;
+	uint64_t bytes_done;
+	uint64_t ops_done;
+};
+
+/* an entry of the trash that could not be removed, not to be retried */
+struct trash_failures {
+	char **names;
+	int count;
+};
+
+bool lxc_trash_enabled(void)
+{
+	const char *deferred = lxc_global_config_value("lxc.destroy.deferred");
+
+	return deferred && strcmp(deferred, "1") == 0;
+}
+
+static uint64_t config_limit(const char *key, uint64_t unit)
+{
+	const char *v = lxc_global_config_value(key);
+
+	return v ? strtoull(v, NULL, 10) * unit : 0;
+}
+
+static void throttle_init(struct throttle *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->bps = config_limit("lxc.destroy.bwlimit", 1024 * 1024);
+	t->ops = config_limit("lxc.destroy.oplimit", 1);
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+/* account for @bytes freed and @ops files removed, sleeping if ahead */
+static void throttle(struct throttle *t, uint64_t bytes, uint64_t ops)
+{
+	double due = 0, elapsed;
+	struct timespec now, ts;
+
+	t->bytes_done += bytes;
+	t->ops_done += ops;
+	if (t->bps)
+		due = (double)t->bytes_done / t->bps;
+	if (t->ops && (double)t->ops_done / t->ops > due)
+		due = (double)t->ops_done / t->ops;
+	if (!due)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - t->start.tv_sec) +
+		  (now.tv_nsec - t->start.tv_nsec) / 1e9;
+	if (due <= elapsed)
+		return;
+	ts.tv_sec = due - elapsed;
+	ts.tv_nsec = (due - elapsed - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Unlinking a large file frees all of its blocks at once, so with a
+ * bandwidth limit it is truncated a tenth of a second's worth at a time
+ * first.  Sparse files are cut in steps which free that much on average.
+ */
+static int trash_unlink(int dirfd, const char *name, struct stat *st,
+			struct throttle *t)
+{
+	uint64_t allocated = (uint64_t)st->st_blocks * 512, chunk, steps;
+	off_t size = st->st_size, step;
+	int fd;
+
+	chunk = t->bps / 10 > 1024 * 1024 ? t->bps / 10 : 1024 * 1024;
+	if (t->bps && S_ISREG(st->st_mode) && st->st_nlink == 1 &&
+	    allocated > chunk) {
+		fd = openat(dirfd, name, O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd >= 0) {
+			steps = allocated / chunk;
+			step = size / steps;
+			while (steps-- > 1 && step > 0) {
+				size -= step;
+				if (ftruncate(fd, size) < 0)
+					break;
+				throttle(t, chunk, 0);
+				allocated -= chunk;
+			}
+			close(fd);
+		}
+	}
+
+	if (unlinkat(dirfd, name, 0) < 0)
+		return -1;
+	throttle(t, st->st_nlink == 1 ? allocated : 0, 1);
+	return 0;
+}
+
+/*
+ * Remove directory @name in @parentfd and all it holds.  Like
+ * lxc_rmdir_onedev(), what is mounted below it, on another device than
+ * @dev, is left alone.
+ */
+static int trash_rmdir(int parentfd, const char *name, dev_t dev,
+		       struct throttle *t)
+{
+	struct dirent *direntp;
+	struct stat st;
+	int fd, failed = 0;
+	DIR *dir;
+
+	fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+		    O_CLOEXEC);
+	if (fd < 0) {
+		SYSERROR("Failed to open %s", name);
+		return -1;
+	}
+	dir = fdopendir(fd);
+	if (!dir) {
+		SYSERROR("Failed to open %s", name);
+		close(fd);
+		return -1;
+	}
+
+	while ((direntp = readdir(dir))) {
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, ".."))
+			continue;
+		if (fstatat(fd, direntp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			SYSERROR("Failed to stat %s", direntp->d_name);
+			failed = 1;
+			continue;
+		}
+		if (st.st_dev != dev)
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			if (trash_rmdir(fd, direntp->d_name, dev, t) < 0)
+				failed = 1;
+		} else if (trash_unlink(fd, direntp->d_name, &st, t) < 0) {
+			SYSERROR("Failed to delete %s", direntp->d_name);
+			failed = 1;
+		}
+	}
+	closedir(dir);
+
+	if (unlinkat(parentfd, name, AT_REMOVEDIR) < 0) {
+		SYSERROR("Failed to delete %s", name);
+		return -1;
+	}
+	throttle(t, 0, 1);
+	return failed ? -1 : 0;
+}
+
+struct reap_args {
+	const char *trash;
+	const char *name;
+};
+
+static int reap_entry(void *data)
+{
+	struct reap_args *args = data;
+	struct throttle t;
+	struct stat st;
+	int fd, ret;
+
+	fd = open(args->trash, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		SYSERROR("Failed to open %s", args->trash);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	throttle_init(&t);
+	ret = trash_rmdir(fd, args->name, st.st_dev, &t);
+	close(fd);
+	return ret;
+}
+
+static int reap_one(const char *trash, const char *name)
+{
+	struct reap_args args = { trash, name };
+	char path[MAXPATHLEN];
+	struct lxc_conf *conf;
+	int ret;
+
+	if (!am_unpriv())
+		return reap_entry(&args);
+
+	// the files belong to the ids the container was mapped to
+	ret = snprintf(path, MAXPATHLEN, "%s/%s/config", trash, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	conf = lxc_conf_init();
+	if (!conf)
+		return -1;
+	if (lxc_config_read(path, conf) == 0 && !lxc_list_empty(&conf->id_map))
+		ret = userns_exec_1(conf, reap_entry, &args);
+	else
+		ret = reap_entry(&args);
+	lxc_conf_free(conf);
+	return ret;
+}
+
+static bool trash_failed(struct trash_failures *f, const char *name)
+{
+	int i;
+
+	for (i = 0; i < f->count; i++)
+		if (strcmp(f->names[i], name) == 0)
+			return true;
+	return false;
+}
+
+static void trash_add_failure(struct trash_failures *f, const char *name)
+{
+	char **n;
+
+	n = realloc(f->names, (f->count + 1) * sizeof(char *));
+	if (!n)
+		return;
+	f->names = n;
+	f->names[f->count] = strdup(name);
+	if (f->names[f->count])
+		f->count++;
+}
+
+/*
+ * Reap what is in @trash, but the entries which failed before.  Returns
+ * the number of entries tried, -1 if the trash could not be read.
+ */
+static int trash_pass(const char *trash, struct trash_failures *f, bool dry)
+{
+	struct dirent *direntp;
+	int tried = 0;
+	DIR *dir;
+
+	dir = opendir(trash);
+	if (!dir)
+		return errno == ENOENT ? 0 : -1;
+	while ((direntp = readdir(dir))) {
+		if (!strcmp(direntp->d_name, ".") ||
+		    !strcmp(direntp->d_name, "..") ||
+		    !strcmp(direntp->d_name, TRASH_LOCK) ||
+		    trash_failed(f, direntp->d_name))
+			continue;
+		tried++;
+		if (dry)
+			break;
+		if (reap_one(trash, direntp->d_name) < 0) {
+			ERROR("Failed to reap %s/%s, leaving it", trash,
+			      direntp->d_name);
+			trash_add_failure(f, direntp->d_name);
+		} else {
+			INFO("Reaped %s/%s", trash, direntp->d_name);
+		}
+	}
+	closedir(dir);
+	return tried;
+}
+
+int lxc_trash_container(const char *lxcpath, const char *src,
+			const char *name)
+{
+	char trash[MAXPATHLEN], dest[MAXPATHLEN];
+	int ret;
+
+	ret = snprintf(trash, MAXPATHLEN, "%s/" TRASH_DIR, lxcpath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	ret = snprintf(dest, MAXPATHLEN, "%s/%s-XXXXXX", trash, name);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+	if (mkdir(trash, 0700) < 0 && errno != EEXIST) {
+		SYSERROR("Failed to create %s", trash);
+		return -1;
+	}
+	// a unique name, which the rename replaces as it is empty
+	if (!mkdtemp(dest)) {
+		SYSERROR("Failed to create %s", dest);
+		return -1;
+	}
+	if (rename(src, dest) < 0) {
+		SYSERROR("Failed to move %s to %s", src, dest);
+		rmdir(dest);
+		return -1;
+	}
+
+	INFO("Moved %s to %s", src, dest);
+	return 0;
+}
+
+int lxc_trash_reap(const char *lxcpath)
+{
+	struct flock lk = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	char trash[MAXPATHLEN], lock[MAXPATHLEN];
+	struct trash_failures f = { NULL, 0 };
+	int fd, i, ret;
+
+	ret = snprintf(trash, MAXPATHLEN, "%s/" TRASH_DIR, lxcpath);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+	ret = snprintf(lock, MAXPATHLEN, "%s/" TRASH_LOCK, trash);
+	if (ret < 0 || ret >= MAXPATHLEN)
+		return -1;
+
+#ifdef __NR_ioprio_set
+	if (syscall(__NR_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) < 0)
+		WARN("Failed to set the idle I/O priority: %s", strerror(errno));
+#endif
+
+	/*
+	 * Whatever is moved into the trash after a pass and before the lock
+	 * is dropped would be left for the next reaper, so look again after.
+	 */
+	ret = 0;
+	while (trash_pass(trash, &f, true) > 0) {
+		fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+		if (fd < 0) {
+			SYSERROR("Failed to open %s", lock);
+			ret = -1;
+			break;
+		}
+		if (fcntl(fd, F_SETLK, &lk) < 0) {
+			// another reaper has it
+			close(fd);
+			break;
+		}
+		while ((ret = trash_pass(trash, &f, false)) > 0)
+			;
+		close(fd);
+		if (ret < 0)
+			break;
+	}
+
+	if (f.count)
+		ret = -1;
+	for (i = 0; i < f.count; i++)
+		free(f.names[i]);
+	free(f.names);
+	return ret;
+}
+
+void lxc_trash_spawn_reaper(const char *lxcpath)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		SYSERROR("Failed to fork the trash reaper");
+		return;
+	}
+	if (pid) {
+		wait_for_pid(pid);
+		return;
+	}
+
+	/* second fork to be reparented by init */
+	if (setsid() < 0)
+		SYSERROR("Failed to setsid");
+	pid = fork();
+	if (pid < 0)
+		_exit(EXIT_FAILURE);
+	if (pid != 0)
+		_exit(EXIT_SUCCESS);
+	if (chdir("/"))
+		_exit(EXIT_FAILURE);
+	close(0);
+	close(1);
+	close(2);
+	open("/dev/null", O_RDONLY);
+	open("/dev/null", O_RDWR);
+	open("/dev/null", O_RDWR);
+
+	_exit(lxc_trash_reap(lxcpath) < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
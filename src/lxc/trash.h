@@ -0,0 +1,66 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __LXC_TRASH_H
+#define __LXC_TRASH_H
+
+#include <stdbool.h>
+
+/*
+ * lxc_trash_enabled: whether lxc.destroy.deferred asks for containers to be
+ * moved into the trash rather than removed when they are destroyed
+ */
+extern bool lxc_trash_enabled(void);
+
+/*
+ * lxc_trash_container: move the directory @src of container @name into the
+ * trash of @lxcpath, ${lxcpath}/.trash
+ *
+ * @src is normally ${lxcpath}/@name.  A snapshot is moved into the trash of
+ * the lxcpath of the container it was taken of, so that nothing but
+ * snapshots is left in the snapshot directory.
+ *
+ * The rename is atomic, so the container is gone as soon as this returns.
+ * Its files are removed later by lxc_trash_reap().
+ *
+ * Returns 0 on success, -1 if the directory could not be moved, for
+ * instance because the trash is on another filesystem, in which case the
+ * caller should remove it itself.
+ */
+extern int lxc_trash_container(const char *lxcpath, const char *src,
+			       const char *name);
+
+/*
+ * lxc_trash_reap: remove everything in the trash of @lxcpath
+ *
+ * Files are removed at idle I/O priority and no faster than
+ * lxc.destroy.bwlimit and lxc.destroy.oplimit allow.  Only one reaper
+ * runs for a trash at a time: if another one holds it, this returns
+ * right away and leaves it the work.
+ *
+ * Returns 0 on success, -1 if something could not be removed.
+ */
+extern int lxc_trash_reap(const char *lxcpath);
+
+/*
+ * lxc_trash_spawn_reaper: run lxc_trash_reap() for @lxcpath in a daemon
+ * process, so that the caller does not wait for it
+ */
+extern void lxc_trash_spawn_reaper(const char *lxcpath);
+
+#endif /* __LXC_TRASH_H */
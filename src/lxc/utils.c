@@ -238,10 +238,17 @@ const char *lxc_global_config_value(const char *option_name)
 		{ "lxc.bdev.lvm.vg",        DEFAULT_VG      },
 		{ "lxc.bdev.lvm.thin_pool", DEFAULT_THIN_POOL },
 		{ "lxc.bdev.zfs.root",      DEFAULT_ZFSROOT },
+		{ "lxc.bdev.loop.direct_io", "1"            },
+		{ "lxc.bdev.loop.sparse",   "1"             },
+		{ "lxc.bdev.btrfs.async_destroy", "1"       },
+		{ "lxc.destroy.deferred",   "0"             },
+		{ "lxc.destroy.bwlimit",    "0"             },
+		{ "lxc.destroy.oplimit",    "0"             },
 		{ "lxc.lxcpath",            NULL            },
 		{ "lxc.default_config",     NULL            },
 		{ "lxc.cgroup.pattern",     DEFAULT_CGROUP_PATTERN },
 		{ "lxc.cgroup.use",         NULL            },
+		{ "lxc.pty.pool",           "0"             },
 		{ NULL, NULL },
 	};
 
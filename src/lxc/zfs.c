@@ -0,0 +1,172 @@
+/*
+ * lxc: linux Container library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <libzfs_core.h>
+
+#include "log.h"
+#include "lxczfs.h"
+#include "utils.h"
+
+lxc_log_define(lxc_zfs, lxc);
+
+/*
+ * libzfs_core only opens /dev/zfs, so unlike the zfs command nothing here
+ * forks or loads the pool configuration.  It does not mount what it
+ * creates either, so that is done here the way 'zfs mount' would.
+ */
+static int zfs_mount_dataset(const char *dataset, const char *mountpoint)
+{
+	if (mkdir_p(mountpoint, 0755) < 0) {
+		SYSERROR("failed to create %s", mountpoint);
+		return -1;
+	}
+	if (mount(dataset, mountpoint, "zfs", 0, NULL) < 0) {
+		SYSERROR("failed to mount %s on %s", dataset, mountpoint);
+		return -1;
+	}
+	return 0;
+}
+
+static void zfs_log_errlist(nvlist_t *errlist, const char *what)
+{
+	nvpair_t *pair;
+
+	if (!errlist)
+		return;
+	for (pair = nvlist_next_nvpair(errlist, NULL); pair;
+	     pair = nvlist_next_nvpair(errlist, pair))
+		ERROR("failed to %s %s: %s", what, nvpair_name(pair),
+		      strerror(fnvpair_value_int32(pair)));
+	nvlist_free(errlist);
+}
+
+int lxc_zfs_create(const char *dataset, const char *mountpoint)
+{
+	nvlist_t *props;
+	int ret;
+
+	if (libzfs_core_init() != 0)
+		return -ENOSYS;
+
+	props = fnvlist_alloc();
+	fnvlist_add_string(props, "mountpoint", mountpoint);
+	ret = lzc_create(dataset, LZC_DATSET_TYPE_ZFS, props, NULL, 0);
+	fnvlist_free(props);
+	libzfs_core_fini();
+	if (ret != 0) {
+		ERROR("failed to create %s: %s", dataset, strerror(ret));
+		return -1;
+	}
+
+	return zfs_mount_dataset(dataset, mountpoint);
+}
+
+int lxc_zfs_clone(const char *snapshot, const char *dataset,
+		  const char *mountpoint, bool take)
+{
+	nvlist_t *snaps = NULL, *props, *errlist = NULL;
+	int ret = -1;
+
+	if (libzfs_core_init() != 0)
+		return -ENOSYS;
+
+	if (take) {
+		snaps = fnvlist_alloc();
+		fnvlist_add_boolean(snaps, snapshot);
+
+		// if the snapshot exists, delete it
+		if (lzc_exists(snapshot)) {
+			lzc_destroy_snaps(snaps, B_FALSE, &errlist);
+			zfs_log_errlist(errlist, "destroy");
+			errlist = NULL;
+		}
+
+		if (lzc_snapshot(snaps, NULL, &errlist) != 0) {
+			zfs_log_errlist(errlist, "snapshot");
+			goto out;
+		}
+	}
+
+	props = fnvlist_alloc();
+	fnvlist_add_string(props, "mountpoint", mountpoint);
+	ret = lzc_clone(dataset, snapshot, props);
+	fnvlist_free(props);
+	if (ret != 0) {
+		ERROR("failed to clone %s to %s: %s", snapshot, dataset,
+		      strerror(ret));
+		ret = -1;
+		goto out;
+	}
+
+	ret = zfs_mount_dataset(dataset, mountpoint);
+
+out:
+	if (snaps)
+		fnvlist_free(snaps);
+	libzfs_core_fini();
+	return ret;
+}
+
+int lxc_zfs_snapshot(const char **snapshots, int count)
+{
+	nvlist_t *snaps, *errlist = NULL;
+	int i, ret;
+
+	if (libzfs_core_init() != 0)
+		return -ENOSYS;
+
+	snaps = fnvlist_alloc();
+	for (i = 0; i < count; i++)
+		fnvlist_add_boolean(snaps, snapshots[i]);
+	ret = lzc_snapshot(snaps, NULL, &errlist);
+	fnvlist_free(snaps);
+	libzfs_core_fini();
+	if (ret != 0) {
+		zfs_log_errlist(errlist, "snapshot");
+		return -1;
+	}
+
+	return 0;
+}
+
+int lxc_zfs_destroy(const char *dataset, const char *mountpoint)
+{
+	int ret;
+
+	if (libzfs_core_init() != 0)
+		return -ENOSYS;
+
+	if (umount(mountpoint) < 0 && errno != EINVAL && errno != ENOENT) {
+		SYSERROR("failed to unmount %s", mountpoint);
+		libzfs_core_fini();
+		return -1;
+	}
+
+	ret = lzc_destroy(dataset);
+	libzfs_core_fini();
+	if (ret != 0) {
+		ERROR("failed to destroy %s: %s", dataset, strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
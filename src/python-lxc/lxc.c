@@ -1800,10 +1800,12 @@ PyInit__lxc(void)
     PYLXC_EXPORT_CONST(LXC_CLONE_KEEPMACADDR);
     PYLXC_EXPORT_CONST(LXC_CLONE_KEEPNAME);
     PYLXC_EXPORT_CONST(LXC_CLONE_MAYBE_SNAPSHOT);
+    PYLXC_EXPORT_CONST(LXC_CLONE_SHIFTIDS);
     PYLXC_EXPORT_CONST(LXC_CLONE_SNAPSHOT);
 
     /* create: create flags */
     PYLXC_EXPORT_CONST(LXC_CREATE_QUIET);
+    PYLXC_EXPORT_CONST(LXC_CREATE_SHIFTIDS);
 
     #undef PYLXC_EXPORT_CONST
 
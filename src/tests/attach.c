@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
 
 #define TSTNAME    "lxc-attach-test"
 #define TSTOUT(fmt, ...) do { \
@@ -270,6 +271,66 @@ static int test_attach_cmd(struct lxc_container *ct)
 	return 0;
 }
 
+#define BENCH_LOOPS 100
+
+static long bench_attach_usec(struct lxc_container *ct)
+{
+	struct timespec start, end;
+	const char *argv[] = {"true", NULL};
+	lxc_attach_options_t attach_options = LXC_ATTACH_OPTIONS_DEFAULT;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_LOOPS; i++) {
+		if (ct->attach_run_wait(ct, &attach_options, "true", argv) != 0) {
+			TSTERR("attach_run_wait failed");
+			return -1;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1000000 +
+		(end.tv_nsec - start.tv_nsec) / 1000) / BENCH_LOOPS;
+}
+
+/* test_attach_cache: run the attach tests with a cached attach context
+ * and report the attach latency with and without it
+ *
+ * @ct       : the container
+ */
+static int test_attach_cache(struct lxc_container *ct)
+{
+	long uncached, cached;
+	int ret;
+
+	uncached = bench_attach_usec(ct);
+	if (uncached < 0)
+		return -1;
+
+	TSTOUT("Testing attach with a cached context...\n");
+	if (!ct->attach_cache(ct, true)) {
+		TSTERR("attach_cache failed");
+		return -1;
+	}
+
+	ret = test_attach_cmd(ct);
+	if (ret < 0)
+		goto out;
+
+	cached = bench_attach_usec(ct);
+	if (cached < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	TSTOUT("attach_run_wait latency: %ld us uncached, %ld us cached\n",
+	       uncached, cached);
+	ret = 0;
+out:
+	ct->attach_cache(ct, false);
+	return ret;
+}
+
 /* test_ct_destroy: stop and destroy the test container
  *
  * @ct       : the container
@@ -357,6 +418,12 @@ static int test_attach(const char *lxcpath, const char *name, const char *templa
 		goto err2;
 	}
 
+	ret = test_attach_cache(ct);
+	if (ret < 0) {
+		TSTERR("attach cache test failed");
+		goto err2;
+	}
+
 	if (lsm_enabled()) {
 		ret = test_attach_lsm_cmd(ct);
 		if (ret < 0) {
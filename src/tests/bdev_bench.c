@@ -0,0 +1,423 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Times the life of one backing store type: create, mount, fill with a
+ * synthetic rootfs, umount, copy clone, snapshot clone, mount the snapshot
+ * and destroy them all.  Each phase is reported as one JSON object per
+ * line on stdout, so that runs can be compared by a script.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+
+#include "lxc/bdev.h"
+#include "lxc/utils.h"
+
+static const char *bdevtype = "dir";
+static const char *lxcpath = NULL;
+static int nfiles = 1000;
+static uint64_t fssize = 0;
+static uint64_t rootfs_size = 64 * 1024 * 1024;
+static int iterations = 1;
+static int nested = 0;
+static struct bdev_specs specs;
+static int failed;
+
+static const struct option options[] = {
+	{ "backingstore", required_argument, NULL, 'B' },
+	{ "lxcpath",      required_argument, NULL, 'P' },
+	{ "files",        required_argument, NULL, 'n' },
+	{ "size",         required_argument, NULL, 's' },
+	{ "fssize",       required_argument, NULL, 'L' },
+	{ "fstype",       required_argument, NULL, 't' },
+	{ "iterations",   required_argument, NULL, 'i' },
+	{ "vgname",       required_argument, NULL, 'v' },
+	{ "thinpool",     required_argument, NULL, 'T' },
+	{ "zfsroot",      required_argument, NULL, 'z' },
+	{ "nested",       required_argument, NULL, 'N' },
+	{ "help",         no_argument,       NULL, '?' },
+	{ 0, 0, 0, 0 },
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: lxc-test-bdev-bench [OPTION]...\n\n"
+		"Common options :\n"
+		"  -B, --backingstore=TYPE  Backing store type (default: dir)\n"
+		"  -P, --lxcpath=PATH       Where to create the containers (required)\n"
+		"  -n, --files=N            Files in the synthetic rootfs (default: 1000)\n"
+		"  -s, --size=MB            Size of the synthetic rootfs (default: 64)\n"
+		"  -L, --fssize=MB          Size of block device backed filesystems\n"
+		"                           (default: twice the rootfs)\n"
+		"  -t, --fstype=TYPE        Filesystem for block devices (default: ext4)\n"
+		"  -i, --iterations=N       Times to run the whole cycle (default: 1)\n"
+		"  -v, --vgname=VG          Volume group for lvm\n"
+		"  -T, --thinpool=POOL      Thin pool for lvm\n"
+		"  -z, --zfsroot=DATASET    Parent dataset for zfs\n"
+		"  -N, --nested=N           Subvolumes nested in one another in\n"
+		"                           the btrfs rootfs (default: 0)\n");
+}
+
+static double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * @bytes and @files are what the phase moved, 0 if that does not apply.
+ * They are left out of failed phases.
+ */
+static void report(const char *phase, int iteration, double start, bool ok,
+		   uint64_t bytes, int files)
+{
+	double ms = now_ms() - start;
+
+	printf("{\"type\": \"%s\", \"phase\": \"%s\", \"iteration\": %d, "
+	       "\"ok\": %s, \"ms\": %.3f", bdevtype, phase, iteration,
+	       ok ? "true" : "false", ms);
+	if (ok && files)
+		printf(", \"files\": %d, \"files_per_s\": %.1f", files,
+		       ms > 0 ? files * 1e3 / ms : 0);
+	if (ok && bytes)
+		printf(", \"bytes\": %llu, \"mb_per_s\": %.1f",
+		       (unsigned long long)bytes,
+		       ms > 0 ? bytes / 1048576.0 * 1e3 / ms : 0);
+	printf("}\n");
+	fflush(stdout);
+	if (!ok)
+		failed = 1;
+}
+
+/*
+ * Fill @root with @nfiles files of rootfs_size / nfiles bytes, a hundred to
+ * a directory.  Returns the number of bytes written, 0 on error.
+ */
+static uint64_t populate(const char *root)
+{
+	size_t filesize = rootfs_size / nfiles;
+	char path[PATH_MAX], *buf;
+	uint64_t written = 0;
+	int i, fd;
+
+	buf = malloc(filesize + 1);
+	if (!buf)
+		return 0;
+	for (i = 0; i < filesize; i++)
+		buf[i] = 'a' + i % 26;
+
+	for (i = 0; i < nfiles; i++) {
+		if (i % 100 == 0) {
+			snprintf(path, sizeof(path), "%s/d%04d", root, i / 100);
+			if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+				perror(path);
+				goto err;
+			}
+		}
+		snprintf(path, sizeof(path), "%s/d%04d/f%06d", root, i / 100, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(path);
+			goto err;
+		}
+		if (write(fd, buf, filesize) != filesize) {
+			perror(path);
+			close(fd);
+			goto err;
+		}
+		close(fd);
+		written += filesize;
+	}
+	free(buf);
+	return written ? written : 1;
+
+err:
+	free(buf);
+	return 0;
+}
+
+/* the path of the @depth-th nested subvolume below @root */
+static void nested_path(char *path, size_t size, const char *root, int depth)
+{
+	size_t len;
+	int i;
+
+	len = snprintf(path, size, "%s", root);
+	for (i = 0; i < depth && len < size; i++)
+		len += snprintf(path + len, size - len, "/nested%d", i);
+}
+
+/* nest subvolumes in one another below @root, each with a file in it */
+static bool make_nested(const char *root)
+{
+	char path[PATH_MAX], cmd[PATH_MAX + 64];
+	FILE *f;
+	int i;
+
+	for (i = 1; i <= nested; i++) {
+		nested_path(path, sizeof(path), root, i);
+		snprintf(cmd, sizeof(cmd), "btrfs -q subvolume create %s", path);
+		if (system(cmd) != 0)
+			return false;
+		strncat(path, "/file", sizeof(path) - strlen(path) - 1);
+		f = fopen(path, "w");
+		if (!f) {
+			perror(path);
+			return false;
+		}
+		fprintf(f, "%d\n", i);
+		fclose(f);
+	}
+	return true;
+}
+
+/* are the nested subvolumes below @root, with their files */
+static bool has_nested(const char *root)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int i;
+
+	for (i = 1; i <= nested; i++) {
+		nested_path(path, sizeof(path), root, i);
+		// the root directory of a btrfs subvolume is always inode 256
+		if (stat(path, &st) < 0 || st.st_ino != 256)
+			return false;
+		strncat(path, "/file", sizeof(path) - strlen(path) - 1);
+		if (access(path, F_OK) < 0)
+			return false;
+	}
+	return true;
+}
+
+/* create the container directory and its rootfs mount point, as clone does */
+static int mkdir_container(const char *name)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s/rootfs", lxcpath, name);
+	if (mkdir_p(path, 0755) < 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static void destroy(const char *phase, int iteration, struct bdev *bdev,
+		    const char *name)
+{
+	char path[PATH_MAX];
+	double start;
+	bool ok;
+
+	start = now_ms();
+	ok = bdev->ops->destroy(bdev) == 0;
+	snprintf(path, sizeof(path), "%s/%s", lxcpath, name);
+	if (lxc_rmdir_onedev(path) < 0)
+		ok = false;
+	report(phase, iteration, start, ok, 0, 0);
+}
+
+static void run(int iteration)
+{
+	// room for the name and the longest suffix
+	char name[NAME_MAX - 5], copyname[NAME_MAX], snapname[NAME_MAX];
+	char path[PATH_MAX];
+	struct lxc_container *c = NULL;
+	struct bdev *bdev, *copy = NULL, *snap = NULL;
+	uint64_t bytes;
+	double start;
+	int rdep, i;
+
+	snprintf(name, sizeof(name), "bench-%s-%d", bdevtype, iteration);
+	snprintf(copyname, sizeof(copyname), "%s-copy", name);
+	snprintf(snapname, sizeof(snapname), "%s-snap", name);
+	if (mkdir_container(name) < 0 || mkdir_container(copyname) < 0 ||
+	    mkdir_container(snapname) < 0) {
+		failed = 1;
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%s/rootfs", lxcpath, name);
+
+	start = now_ms();
+	bdev = bdev_create(path, bdevtype, name, &specs);
+	report("create", iteration, start, bdev != NULL, 0, 0);
+	if (!bdev)
+		goto out_dirs;
+
+	start = now_ms();
+	if (bdev->ops->mount(bdev) < 0) {
+		report("mount", iteration, start, false, 0, 0);
+		goto out;
+	}
+	report("mount", iteration, start, true, 0, 0);
+
+	start = now_ms();
+	bytes = populate(bdev->dest);
+	report("populate", iteration, start, bytes != 0, bytes, nfiles);
+	if (bytes && nested) {
+		start = now_ms();
+		if (!make_nested(bdev->dest))
+			bytes = 0;
+		report("nested", iteration, start, bytes != 0, 0, 0);
+	}
+
+	start = now_ms();
+	report("umount", iteration, start, bdev->ops->umount(bdev) == 0, 0, 0);
+	if (!bytes)
+		goto out;
+
+	c = lxc_container_new(name, lxcpath);
+	if (!c || !c->set_config_item(c, "lxc.rootfs", bdev->src)) {
+		fprintf(stderr, "failed to set up container %s\n", name);
+		failed = 1;
+		goto out;
+	}
+
+	// overlayfs and aufs can only be snapshotted
+	if (strcmp(bdevtype, "overlayfs") && strcmp(bdevtype, "aufs")) {
+		start = now_ms();
+		copy = bdev_copy(c, copyname, lxcpath, NULL,
+				 LXC_CLONE_KEEPBDEVTYPE, NULL, 0, &rdep);
+		report("copy", iteration, start, copy != NULL, bytes, nfiles);
+	}
+
+	// a dir is snapshotted into an overlayfs, a loop file can't be
+	if (bdev->ops->can_snapshot || strcmp(bdevtype, "dir") == 0) {
+		start = now_ms();
+		snap = bdev_copy(c, snapname, lxcpath, NULL,
+				 LXC_CLONE_SNAPSHOT, NULL, 0, &rdep);
+		report("snapshot", iteration, start, snap != NULL, 0, 0);
+	}
+
+	if (snap) {
+		start = now_ms();
+		if (snap->ops->mount(snap) < 0) {
+			report("snapshot-mount", iteration, start, false, 0, 0);
+		} else {
+			report("snapshot-mount", iteration, start, true, 0, 0);
+			if (nested) {
+				start = now_ms();
+				report("snapshot-nested", iteration, start,
+				       has_nested(snap->dest), 0, 0);
+			}
+			start = now_ms();
+			report("snapshot-umount", iteration, start,
+			       snap->ops->umount(snap) == 0, 0, 0);
+		}
+		destroy("snapshot-destroy", iteration, snap, snapname);
+	}
+	if (copy)
+		destroy("copy-destroy", iteration, copy, copyname);
+
+out:
+	destroy("destroy", iteration, bdev, name);
+	if (snap)
+		bdev_put(snap);
+	if (copy)
+		bdev_put(copy);
+	bdev_put(bdev);
+	if (c)
+		lxc_container_put(c);
+out_dirs:
+	// whatever a failed clone left behind
+	for (i = 0; i < 3; i++) {
+		snprintf(path, sizeof(path), "%s/%s", lxcpath,
+			 i == 0 ? name : i == 1 ? copyname : snapname);
+		if (access(path, F_OK) == 0)
+			lxc_rmdir_onedev(path);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, i;
+
+	while ((opt = getopt_long(argc, argv, "B:P:n:s:L:t:i:v:T:z:N:", options,
+				  NULL)) != -1) {
+		switch (opt) {
+		case 'B':
+			bdevtype = optarg;
+			break;
+		case 'P':
+			lxcpath = optarg;
+			break;
+		case 'n':
+			nfiles = atoi(optarg);
+			break;
+		case 's':
+			rootfs_size = strtoull(optarg, NULL, 0) * 1024 * 1024;
+			break;
+		case 'L':
+			fssize = strtoull(optarg, NULL, 0) * 1024 * 1024;
+			break;
+		case 't':
+			specs.fstype = optarg;
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'v':
+			specs.lvm.vg = optarg;
+			break;
+		case 'T':
+			specs.lvm.thinpool = optarg;
+			break;
+		case 'z':
+			specs.zfs.zfsroot = optarg;
+			break;
+		case 'N':
+			nested = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!lxcpath || nfiles <= 0 || iterations <= 0 || !rootfs_size ||
+	    nested < 0 || (nested && strcmp(bdevtype, "btrfs"))) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if (!specs.fstype)
+		specs.fstype = "ext4";
+	// leave room for the filesystem's own metadata
+	specs.fssize = fssize ? fssize : 2 * rootfs_size + 64 * 1024 * 1024;
+
+	if (mkdir(lxcpath, 0755) < 0 && errno != EEXIST) {
+		perror(lxcpath);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < iterations; i++)
+		run(i);
+
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
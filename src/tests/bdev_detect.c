@@ -0,0 +1,177 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Times bdev_init() over a few thousand directory rootfs paths, once with
+ * a cold cache and once with a warm one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#define _GNU_SOURCE
+#include <getopt.h>
+
+#include "lxc/bdev.h"
+
+static struct option options[] = {
+	{ "count", required_argument, NULL, 'n' },
+	{ "dir",   required_argument, NULL, 'd' },
+	{ "help",  no_argument,       NULL, '?' },
+	{ 0, 0, 0, 0 },
+};
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: lxc-test-bdev-detect [OPTION]...\n\n"
+		"Common options :\n"
+		"  -n, --count=N   Number of rootfs paths (default: 2000)\n"
+		"  -d, --dir=DIR   Directory to create them in (default: a new one in /tmp)\n");
+}
+
+static double elapsed_us(struct timespec *begin, struct timespec *end)
+{
+	return (end->tv_sec - begin->tv_sec) * 1e6 +
+		(end->tv_nsec - begin->tv_nsec) / 1e3;
+}
+
+static int detect_all(char **paths, int n, const char *pass)
+{
+	struct timespec begin, end;
+	struct bdev *bdev;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < n; i++) {
+		bdev = bdev_init(paths[i], NULL, NULL);
+		if (!bdev || strcmp(bdev->type, "dir") != 0) {
+			fprintf(stderr, "%s: detected as %s\n", paths[i],
+				bdev ? bdev->type : "nothing");
+			if (bdev)
+				bdev_put(bdev);
+			return -1;
+		}
+		bdev_put(bdev);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%-6s %d paths in %.0f us, %.2f us per bdev_init\n", pass, n,
+		elapsed_us(&begin, &end), elapsed_us(&begin, &end) / n);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	char tmpdir[] = "/tmp/lxc-bdev-XXXXXX", *dir = NULL, **paths;
+	int i, n = 2000, created = 0, ret = EXIT_FAILURE;
+	struct bdev *bdev;
+	char path[1024];
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "n:d:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (n <= 0) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	if (!dir) {
+		dir = mkdtemp(tmpdir);
+		if (!dir) {
+			perror("mkdtemp");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	paths = calloc(n, sizeof(char *));
+	if (!paths)
+		goto out;
+	for (created = 0; created < n; created++) {
+		snprintf(path, sizeof(path), "%s/c%d", dir, created);
+		if (mkdir(path, 0755) < 0) {
+			perror(path);
+			goto out;
+		}
+		snprintf(path, sizeof(path), "%s/c%d/rootfs", dir, created);
+		if (mkdir(path, 0755) < 0) {
+			perror(path);
+			goto out;
+		}
+		paths[created] = strdup(path);
+		if (!paths[created])
+			goto out;
+	}
+
+	if (detect_all(paths, n, "cold") < 0)
+		goto out;
+	if (detect_all(paths, n, "cached") < 0)
+		goto out;
+
+	/* a rootfs which is re-created must not be taken from the cache */
+	snprintf(path, sizeof(path), "%s/c0/rootfs", dir);
+	rmdir(path);
+	if ((bdev = bdev_init(path, NULL, NULL)) != NULL) {
+		fprintf(stderr, "%s: removed rootfs detected as %s\n", path,
+			bdev->type);
+		bdev_put(bdev);
+		goto out;
+	}
+	if (mkdir(path, 0755) < 0) {
+		perror(path);
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "loop:%s/c0/rootfs.img", dir);
+	bdev = bdev_init(path, NULL, NULL);
+	if (!bdev || strcmp(bdev->type, "loop") != 0) {
+		fprintf(stderr, "%s: not detected as loop\n", path);
+		if (bdev)
+			bdev_put(bdev);
+		goto out;
+	}
+	bdev_put(bdev);
+
+	ret = EXIT_SUCCESS;
+
+out:
+	for (i = 0; i < created; i++) {
+		snprintf(path, sizeof(path), "%s/c%d/rootfs", dir, i);
+		rmdir(path);
+		snprintf(path, sizeof(path), "%s/c%d", dir, i);
+		rmdir(path);
+		if (paths)
+			free(paths[i]);
+	}
+	free(paths);
+	if (dir == tmpdir)
+		rmdir(dir);
+	if (ret == EXIT_SUCCESS)
+		printf("All tests passed\n");
+	exit(ret);
+}
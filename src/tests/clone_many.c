@@ -0,0 +1,87 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Clones a container many times with one clone_many() call, for the
+ * backing store test scripts: prints "NAME ok" or "NAME failed" for each
+ * clone and exits with 0 only if they all made it.
+ */
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lxc/lxccontainer.h>
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: lxc-test-clone-many [-P LXCPATH] [-s] [-j N] "
+		"ORIG NEW...\n\n"
+		"  -P LXCPATH  Where the containers are\n"
+		"  -s          Snapshot clones\n"
+		"  -j N        Clones to run at once (default: one per cpu)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *lxcpath = NULL;
+	struct lxc_container *c;
+	int opt, i, count, flags = 0, parallel = 0, ret;
+	bool *results;
+
+	while ((opt = getopt(argc, argv, "P:sj:")) != -1) {
+		switch (opt) {
+		case 'P':
+			lxcpath = optarg;
+			break;
+		case 's':
+			flags |= LXC_CLONE_SNAPSHOT;
+			break;
+		case 'j':
+			parallel = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (argc - optind < 2) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	count = argc - optind - 1;
+
+	c = lxc_container_new(argv[optind], lxcpath);
+	if (!c || !c->is_defined(c)) {
+		fprintf(stderr, "%s is not defined\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	results = calloc(count, sizeof(*results));
+	if (!results)
+		exit(EXIT_FAILURE);
+
+	ret = c->clone_many(c, (const char **)argv + optind + 1, count,
+			    lxcpath, flags, NULL, NULL, 0, NULL, parallel,
+			    results);
+	for (i = 0; i < count; i++)
+		printf("%s %s\n", argv[optind + 1 + i],
+		       results[i] ? "ok" : "failed");
+
+	free(results);
+	lxc_container_put(c);
+	exit(ret == count ? EXIT_SUCCESS : EXIT_FAILURE);
+}
@@ -29,6 +29,58 @@
 #define MYNAME "clonetest1"
 #define MYNAME2 "clonetest2"
 
+static const char *bulknames[] = { "clonetest-b1", "clonetest-b2", "clonetest-b3" };
+#define NBULK (sizeof(bulknames) / sizeof(bulknames[0]))
+
+static void destroy_bulk(void)
+{
+	struct lxc_container *c;
+	int i;
+
+	for (i = 0; i < NBULK; i++) {
+		c = lxc_container_new(bulknames[i], NULL);
+		if (!c)
+			continue;
+		if (c->is_defined(c))
+			c->destroy(c);
+		lxc_container_put(c);
+	}
+}
+
+static int test_clone_many(struct lxc_container *c)
+{
+	bool results[NBULK];
+	struct lxc_container *c2;
+	int i, ret = -1;
+
+	destroy_bulk();
+
+	if (c->clone_many(c, bulknames, NBULK, NULL, 0, NULL, NULL, 0, NULL,
+				2, results) != NBULK) {
+		fprintf(stderr, "%d: clone_many did not clone all containers\n", __LINE__);
+		goto out;
+	}
+
+	for (i = 0; i < NBULK; i++) {
+		if (!results[i]) {
+			fprintf(stderr, "%d: clone_many failed for %s\n", __LINE__, bulknames[i]);
+			goto out;
+		}
+		c2 = lxc_container_new(bulknames[i], NULL);
+		if (!c2 || !c2->is_defined(c2)) {
+			fprintf(stderr, "%d: %s not defined after clone_many\n", __LINE__, bulknames[i]);
+			lxc_container_put(c2);
+			goto out;
+		}
+		lxc_container_put(c2);
+	}
+
+	ret = 0;
+out:
+	destroy_bulk();
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	struct lxc_container *c = NULL, *c2 = NULL, *c3 = NULL;
@@ -75,6 +127,9 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (test_clone_many(c) < 0)
+		goto out;
+
 	fprintf(stderr, "directory backing store tests passed\n");
 
 	// now test with lvm
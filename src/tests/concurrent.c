@@ -32,11 +32,13 @@ static int iterations = 1;
 static int quiet = 0;
 static int delay = 0;
 static const char *template = "busybox";
+static const char *bdevtype = NULL;
 
 static const struct option options[] = {
     { "threads",     required_argument, NULL, 'j' },
     { "iterations",  required_argument, NULL, 'i' },
     { "template",    required_argument, NULL, 't' },
+    { "backingstore", required_argument, NULL, 'B' },
     { "delay",       required_argument, NULL, 'd' },
     { "modes",       required_argument, NULL, 'm' },
     { "quiet",       no_argument,       NULL, 'q' },
@@ -51,6 +53,8 @@ static void usage(void) {
         "                               (default: 5, use 1 for no threading)\n"
         "  -i, --iterations=N           Number times to run the test (default: 1)\n"
         "  -t, --template=t             Template to use (default: busybox)\n"
+        "  -B, --backingstore=TYPE      Backing store type to create with\n"
+        "                               (default: dir)\n"
         "  -d, --delay=N                Delay in seconds between start and stop\n"
         "  -m, --modes=<mode,mode,...>  Modes to run (create, start, stop, destroy)\n"
         "  -q, --quiet                  Don't produce any output\n"
@@ -83,7 +87,7 @@ static void do_function(void *arguments)
 
     if (strcmp(args->mode, "create") == 0) {
         if (!c->is_defined(c)) {
-            if (!c->create(c, template, NULL, NULL, 1, NULL)) {
+            if (!c->create(c, template, bdevtype, NULL, 1, NULL)) {
                 fprintf(stderr, "Creating the container (%s) failed...\n", name);
                 goto out;
             }
@@ -144,7 +148,7 @@ int main(int argc, char *argv[]) {
 
     pthread_attr_init(&attr);
 
-    while ((opt = getopt_long(argc, argv, "j:i:t:d:m:q", options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "j:i:t:B:d:m:q", options, NULL)) != -1) {
         switch(opt) {
         case 'j':
             nthreads = atoi(optarg);
@@ -155,6 +159,9 @@ int main(int argc, char *argv[]) {
         case 't':
             template = optarg;
             break;
+        case 'B':
+            bdevtype = optarg;
+            break;
         case 'd':
             delay = atoi(optarg);
             break;
@@ -24,6 +24,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
@@ -31,6 +32,13 @@
 #define TTYCNT_STR "4"
 #define TSTNAME    "lxcconsoletest"
 #define MAXCONSOLES 512
+#define LOGSIZE     65536
+#define LOGSIZE_STR "65536"
+#define LOGROTATE   2
+#define LOGROTATE_STR "2"
+#define BUFSIZE     4096
+#define BUFSIZE_STR "4096"
+#define MARKER      "lxc-console-log-test"
 
 #define TSTERR(fmt, ...) do { \
 	fprintf(stderr, "%s:%d " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
@@ -108,6 +116,199 @@ err1:
 	return ret;
 }
 
+/*
+ * Run @cmd in the container with its output going to /dev/console, then
+ * wait for the console buffer to hold @len bytes ending in @tail and read
+ * them back, clearing the buffer.
+ */
+static int test_console_log_write(struct lxc_container *c, const char *cmd,
+				  uint64_t len, const char *tail,
+				  struct lxc_console_log *log)
+{
+	lxc_attach_options_t attach_options = LXC_ATTACH_OPTIONS_DEFAULT;
+	struct lxc_console_log clear;
+	char *sh;
+	int i, ret;
+
+	sh = malloc(strlen(cmd) + 20);
+	if (!sh)
+		return -1;
+	sprintf(sh, "%s > /dev/console", cmd);
+	ret = c->attach_run_waitl(c, &attach_options, "sh", "sh", "-c", sh,
+				  (char *)NULL);
+	free(sh);
+	if (ret != 0) {
+		TSTERR("writing to the console failed %d", ret);
+		return -1;
+	}
+
+	/* the monitor fills the buffer from its mainloop, give it a moment */
+	for (i = 0; i < 50; i++) {
+		memset(log, 0, sizeof(*log));
+		log->read = true;
+		ret = c->console_log(c, log);
+		if (ret < 0) {
+			TSTERR("console log read failed %d", ret);
+			return -1;
+		}
+		if (log->read_max >= len && log->read_max >= strlen(tail) &&
+		    memcmp(log->data + log->read_max - strlen(tail), tail,
+			   strlen(tail)) == 0)
+			break;
+		free(log->data);
+		log->data = NULL;
+		usleep(100000);
+	}
+	if (i == 50) {
+		TSTERR("%s did not show up in the console log", tail);
+		return -1;
+	}
+
+	memset(&clear, 0, sizeof(clear));
+	clear.clear = true;
+	ret = c->console_log(c, &clear);
+	if (ret < 0) {
+		TSTERR("console log clear failed %d", ret);
+		free(log->data);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Write a known string to the console and check that exactly that is read
+ * back, then write past the size of the buffer and check that exactly the
+ * last BUFSIZE bytes written are kept.
+ */
+static int test_console_log(struct lxc_container *c)
+{
+	struct lxc_console_log log;
+	char expected[2000 * 5 + 1];
+	int i, ret = -1;
+
+	/* drop whatever init printed while booting */
+	memset(&log, 0, sizeof(log));
+	log.clear = true;
+	if (c->console_log(c, &log) < 0) {
+		TSTERR("console log clear failed");
+		return -1;
+	}
+	if (log.data || log.read_max) {
+		TSTERR("console log clear returned data");
+		free(log.data);
+		return -1;
+	}
+
+	/* no newline, which the pty would turn into \r\n */
+	if (test_console_log_write(c, "printf %s " MARKER, strlen(MARKER),
+				   MARKER, &log) < 0)
+		return -1;
+	if (log.read_max != strlen(MARKER) ||
+	    memcmp(log.data, MARKER, strlen(MARKER)) != 0) {
+		TSTERR("console log read back %.*s instead of %s",
+		       (int)log.read_max, log.data, MARKER);
+		goto out;
+	}
+	free(log.data);
+
+	for (i = 0; i < 2000; i++)
+		sprintf(expected + i * 5, "%05d", i);
+	if (test_console_log_write(c, "i=0; while [ $i -lt 2000 ]; do "
+				   "printf %05d $i; i=$((i+1)); done",
+				   BUFSIZE, "01999", &log) < 0)
+		return -1;
+	if (log.read_max != BUFSIZE ||
+	    memcmp(log.data, expected + sizeof(expected) - 1 - BUFSIZE,
+		   BUFSIZE) != 0) {
+		TSTERR("console log kept the wrong %llu bytes after wrapping",
+		       (unsigned long long)log.read_max);
+		goto out;
+	}
+	free(log.data);
+
+	memset(&log, 0, sizeof(log));
+	log.read = true;
+	if (c->console_log(c, &log) < 0) {
+		TSTERR("console log read failed");
+		return -1;
+	}
+	if (log.read_max) {
+		TSTERR("console log not empty after clearing it");
+		goto out;
+	}
+	ret = 0;
+
+out:
+	free(log.data);
+	return ret;
+}
+
+/* the size of @path, -1 if it doesn't exist */
+static off_t test_console_log_size(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+	return st.st_size;
+}
+
+/*
+ * Write well past the size cap of the console log from inside the
+ * container, and check that the log was rotated and capped, keeping
+ * LOGROTATE old logs. The monitor reads the console in chunks smaller
+ * than LOGSIZE, so no log may grow past it.
+ */
+static int test_console_log_rotate(struct lxc_container *c)
+{
+	char path[1024];
+	const char *cmd = "i=0; while [ $i -lt 4000 ]; do "
+		"echo 0123456789012345678901234567890123456789012345678; "
+		"i=$((i+1)); done > /dev/console";
+	lxc_attach_options_t attach_options = LXC_ATTACH_OPTIONS_DEFAULT;
+	off_t size;
+	int i, ret;
+
+	ret = c->attach_run_waitl(c, &attach_options, "sh", "sh", "-c", cmd,
+				  (char *)NULL);
+	if (ret != 0) {
+		TSTERR("writing to the console failed %d", ret);
+		return -1;
+	}
+
+	/* the monitor writes the log from its mainloop, give it a moment */
+	snprintf(path, sizeof(path), "%s/%s/console.log.%d",
+		 c->config_path, c->name, LOGROTATE);
+	for (i = 0; i < 50 && test_console_log_size(path) < 0; i++)
+		usleep(100000);
+
+	for (i = 0; i <= LOGROTATE + 1; i++) {
+		if (i)
+			snprintf(path, sizeof(path), "%s/%s/console.log.%d",
+				 c->config_path, c->name, i);
+		else
+			snprintf(path, sizeof(path), "%s/%s/console.log",
+				 c->config_path, c->name);
+		size = test_console_log_size(path);
+		if (i > LOGROTATE) {
+			if (size >= 0) {
+				TSTERR("%s should have been dropped", path);
+				return -1;
+			}
+			continue;
+		}
+		if (size < 0) {
+			TSTERR("%s is missing", path);
+			return -1;
+		}
+		if (size > LOGSIZE || (i && size == 0)) {
+			TSTERR("%s has a bad size %ld", path, (long)size);
+			return -1;
+		}
+	}
+	return 0;
+}
+
 /* test_container: test console function
  *
  * @lxcpath  : the lxcpath in which to create the container
@@ -121,6 +322,7 @@ static int test_console(const char *lxcpath,
 {
 	int ret;
 	struct lxc_container *c = NULL;
+	char logpath[1024];
 
 	if (lxcpath) {
 		ret = mkdir(lxcpath, 0755);
@@ -146,6 +348,12 @@ static int test_console(const char *lxcpath,
 	}
 	c->load_config(c, NULL);
 	c->set_config_item(c, "lxc.tty", TTYCNT_STR);
+	c->set_config_item(c, "lxc.console.buffer_size", BUFSIZE_STR);
+	snprintf(logpath, sizeof(logpath), "%s/%s/console.log",
+		 c->config_path, name);
+	c->set_config_item(c, "lxc.console.logfile", logpath);
+	c->set_config_item(c, "lxc.console.size", LOGSIZE_STR);
+	c->set_config_item(c, "lxc.console.rotate", LOGROTATE_STR);
 	c->save_config(c, NULL);
 	c->want_daemonize(c, true);
 	if (!c->startl(c, 0, NULL)) {
@@ -154,6 +362,10 @@ static int test_console(const char *lxcpath,
 	}
 
 	ret = test_console_running_container(c);
+	if (!ret)
+		ret = test_console_log(c);
+	if (!ret)
+		ret = test_console_log_rotate(c);
 
 	c->stop(c);
 out3:
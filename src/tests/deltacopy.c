@@ -0,0 +1,246 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Copies an overlayfs upper layer with lxc_copy_delta() and merges it into
+ * its lower layer with lxc_flatten_overlay(), with whiteouts, opaque
+ * directories, and files and directories replaced by one another.  Layers
+ * with renamed directories or metadata-only copies must not be flattened.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "lxc/deltacopy.h"
+
+#define OPAQUE "trusted.overlay.opaque"
+
+static int mk_dir(const char *path)
+{
+	if (mkdir(path, 0755) < 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static int mk_file(const char *path, const char *content)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	fputs(content, f);
+	return fclose(f);
+}
+
+static int mk_whiteout(const char *path)
+{
+	if (mknod(path, S_IFCHR | 0000, makedev(0, 0)) < 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static int set_xattr(const char *path, const char *name, const char *value)
+{
+	if (lsetxattr(path, name, value, strlen(value), 0) < 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static bool has_content(const char *path, const char *content)
+{
+	char buf[64] = { 0 };
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = '\0';
+	fclose(f);
+	return strcmp(buf, content) == 0;
+}
+
+static bool exists(const char *path, mode_t type)
+{
+	struct stat st;
+
+	if (lstat(path, &st) < 0)
+		return false;
+	return (st.st_mode & S_IFMT) == type;
+}
+
+static bool is_whiteout(const char *path)
+{
+	struct stat st;
+
+	return lstat(path, &st) == 0 && S_ISCHR(st.st_mode) &&
+	       st.st_rdev == makedev(0, 0);
+}
+
+static bool has_opaque(const char *path)
+{
+	char v;
+
+	return lgetxattr(path, OPAQUE, &v, 1) == 1 && v == 'y';
+}
+
+/*
+ * lower/                        upper/
+ *   file      "lower"             file      "upper"
+ *   dir2file/ x                   dir2file  "file"
+ *   file2dir  "file"              file2dir/ y
+ *   gone      "lower"             gone      whiteout
+ *                                 nothing   whiteout
+ *   opaque/   x                   opaque/   z, opaque
+ *   merged/   x                   merged/   y
+ */
+static int make_layers(void)
+{
+	return mk_dir("lower") || mk_dir("upper") ||
+	       mk_file("lower/file", "lower") ||
+	       mk_file("upper/file", "upper") ||
+	       mk_dir("lower/dir2file") ||
+	       mk_file("lower/dir2file/x", "x") ||
+	       mk_file("upper/dir2file", "file") ||
+	       mk_file("lower/file2dir", "file") ||
+	       mk_dir("upper/file2dir") ||
+	       mk_file("upper/file2dir/y", "y") ||
+	       mk_file("lower/gone", "lower") ||
+	       mk_whiteout("upper/gone") ||
+	       mk_whiteout("upper/nothing") ||
+	       mk_dir("lower/opaque") ||
+	       mk_file("lower/opaque/x", "x") ||
+	       mk_dir("upper/opaque") ||
+	       mk_file("upper/opaque/z", "z") ||
+	       set_xattr("upper/opaque", OPAQUE, "y") ||
+	       mk_dir("lower/merged") ||
+	       mk_file("lower/merged/x", "x") ||
+	       mk_dir("upper/merged") ||
+	       mk_file("upper/merged/y", "y");
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/lxc-deltacopy-XXXXXX", cmd[128];
+	int ret = EXIT_FAILURE;
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "the deltacopy test must be run as root\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!mkdtemp(dir) || chdir(dir) < 0) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	if (make_layers())
+		goto out;
+
+	if (lxc_copy_delta("upper", "copy", 2) != 0) {
+		fprintf(stderr, "%s: %d: failed to copy the upper layer\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!has_content("copy/file", "upper") ||
+	    !exists("copy/dir2file", S_IFREG) ||
+	    !exists("copy/file2dir/y", S_IFREG)) {
+		fprintf(stderr, "%s: %d: files and directories were not copied\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!is_whiteout("copy/gone") || !is_whiteout("copy/nothing")) {
+		fprintf(stderr, "%s: %d: whiteouts were not copied\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!has_opaque("copy/opaque")) {
+		fprintf(stderr, "%s: %d: opaque directory was not copied\n", __FILE__, __LINE__);
+		goto out;
+	}
+
+	if (lxc_flatten_overlay("lower", "upper", "flat", 2) != 0) {
+		fprintf(stderr, "%s: %d: failed to flatten the layers\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!has_content("flat/file", "upper")) {
+		fprintf(stderr, "%s: %d: a file did not replace the lower one\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!exists("flat/dir2file", S_IFREG) ||
+	    !has_content("flat/dir2file", "file")) {
+		fprintf(stderr, "%s: %d: a file did not replace a lower directory\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!exists("flat/file2dir", S_IFDIR) ||
+	    !exists("flat/file2dir/y", S_IFREG)) {
+		fprintf(stderr, "%s: %d: a directory did not replace a lower file\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (exists("flat/gone", S_IFREG) || exists("flat/gone", S_IFCHR) ||
+	    exists("flat/nothing", S_IFCHR)) {
+		fprintf(stderr, "%s: %d: whiteouts did not remove what they hide\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!exists("flat/opaque/z", S_IFREG) ||
+	    exists("flat/opaque/x", S_IFREG) || has_opaque("flat/opaque")) {
+		fprintf(stderr, "%s: %d: an opaque directory did not replace the lower one\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!exists("flat/merged/x", S_IFREG) ||
+	    !exists("flat/merged/y", S_IFREG)) {
+		fprintf(stderr, "%s: %d: directories were not merged\n", __FILE__, __LINE__);
+		goto out;
+	}
+
+	if (mk_dir("redirect") || mk_dir("redirect/moved") ||
+	    set_xattr("redirect/moved", "trusted.overlay.redirect", "merged") ||
+	    mk_dir("metacopy") || mk_file("metacopy/file", "") ||
+	    set_xattr("metacopy/file", "user.overlay.metacopy", ""))
+		goto out;
+	if (lxc_flatten_overlay("lower", "redirect", "flat2", 2) == 0) {
+		fprintf(stderr, "%s: %d: a renamed directory was flattened\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (lxc_flatten_overlay("lower", "metacopy", "flat3", 2) == 0) {
+		fprintf(stderr, "%s: %d: a metadata-only copy was flattened\n", __FILE__, __LINE__);
+		goto out;
+	}
+
+	ret = EXIT_SUCCESS;
+out:
+	if (chdir("/") < 0)
+		ret = EXIT_FAILURE;
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if (system(cmd) != 0)
+		ret = EXIT_FAILURE;
+	if (ret == EXIT_SUCCESS)
+		printf("All tests passed\n");
+	exit(ret);
+}
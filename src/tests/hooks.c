@@ -0,0 +1,221 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Runs pre-start hooks one after the other and in parallel
+ * (lxc.hook.parallel), and checks that lxc.hook.timeout kills hooks which
+ * run too long, even once they closed their output, but not hooks which
+ * exited and left something in the background holding it.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lxc/conf.h"
+#include "lxc/confile.h"
+
+static double now_s(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_file(const char *path, const char *content, mode_t mode)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	fputs(content, f);
+	fclose(f);
+	return chmod(path, mode);
+}
+
+/* the pid a hook wrote to @path, or -1 */
+static pid_t read_pid(const char *path)
+{
+	int pid = -1;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%d", &pid) != 1)
+		pid = -1;
+	fclose(f);
+	return pid;
+}
+
+static bool pid_alive(pid_t pid)
+{
+	char path[64], state = 0;
+	FILE *f;
+
+	/* a zombie waiting for init to reap it counts as dead */
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+	if (fscanf(f, "%*d (%*[^)]) %c", &state) != 1)
+		state = 0;
+	fclose(f);
+	return state && state != 'Z';
+}
+
+/*
+ * Run the pre-start hooks @hooks (space separated, in @dir) with @parallel
+ * and @timeout.  Returns what run_lxc_hooks() did, and stores how long it
+ * took in @secs.
+ */
+static int run_hooks(const char *dir, const char *hooks, int parallel,
+		     int timeout, double *secs)
+{
+	char *config = "config", *h, *list, *saveptr = NULL;
+	struct lxc_conf *conf;
+	double start;
+	int ret;
+	FILE *f;
+
+	f = fopen(config, "w");
+	if (!f) {
+		perror(config);
+		return -2;
+	}
+	fprintf(f, "lxc.hook.parallel = %d\nlxc.hook.timeout = %d\n",
+		parallel, timeout);
+	list = strdup(hooks);
+	for (h = strtok_r(list, " ", &saveptr); h;
+	     h = strtok_r(NULL, " ", &saveptr))
+		fprintf(f, "lxc.hook.pre-start = %s/%s\n", dir, h);
+	free(list);
+	fclose(f);
+
+	conf = lxc_conf_init();
+	if (!conf || lxc_config_read(config, conf) < 0) {
+		fprintf(stderr, "failed to read %s\n", config);
+		return -2;
+	}
+
+	start = now_s();
+	ret = run_lxc_hooks("hooktest", "pre-start", conf, dir, NULL);
+	*secs = now_s() - start;
+	lxc_conf_free(conf);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/lxc-hooks-XXXXXX", cmd[64];
+	int ret = EXIT_FAILURE, hret;
+	double secs;
+	pid_t pid;
+
+	if (!mkdtemp(dir) || chdir(dir) < 0) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+
+	if (write_file("sleep1", "#!/bin/sh\necho sleeping\nsleep 1\n", 0755) ||
+	    write_file("fail", "#!/bin/sh\nexit 3\n", 0755) ||
+	    /* closes its output, then hangs with a child */
+	    write_file("quiet", "#!/bin/sh\nexec >/dev/null\n"
+		       "sleep 1000 &\necho $! > $(dirname $0)/quiet.pid\n"
+		       "wait\n", 0755) ||
+	    /* exits, leaving a child holding its output */
+	    write_file("background", "#!/bin/sh\n"
+		       "sleep 1000 &\necho $! > $(dirname $0)/background.pid\n"
+		       "echo done\n", 0755))
+		goto out;
+
+	if (run_hooks(dir, "sleep1 sleep1", 0, 0, &secs) != 0 || secs < 2) {
+		fprintf(stderr, "%s: %d: two hooks one after the other took %.2fs\n",
+			__FILE__, __LINE__, secs);
+		goto out;
+	}
+
+	if (run_hooks(dir, "sleep1 sleep1", 1, 0, &secs) != 0 ||
+	    secs < 1 || secs >= 1.9) {
+		fprintf(stderr, "%s: %d: two hooks in parallel took %.2fs\n",
+			__FILE__, __LINE__, secs);
+		goto out;
+	}
+
+	if (run_hooks(dir, "sleep1 fail", 1, 0, &secs) == 0) {
+		fprintf(stderr, "%s: %d: a failing hook in parallel succeeded\n",
+			__FILE__, __LINE__);
+		goto out;
+	}
+
+	if (run_hooks(dir, "quiet", 0, 1, &secs) == 0 || secs >= 3) {
+		fprintf(stderr, "%s: %d: a hook which closed its output did not time out (%.2fs)\n",
+			__FILE__, __LINE__, secs);
+		goto out;
+	}
+	pid = read_pid("quiet.pid");
+	if (pid <= 0 || pid_alive(pid)) {
+		fprintf(stderr, "%s: %d: the timed out hook's child was not killed\n",
+			__FILE__, __LINE__);
+		goto out;
+	}
+
+	hret = run_hooks(dir, "background", 0, 5, &secs);
+	pid = read_pid("background.pid");
+	if (pid > 0)
+		kill(pid, SIGKILL);
+	if (hret != 0 || secs >= 2) {
+		fprintf(stderr, "%s: %d: a hook which left a child behind took %.2fs\n",
+			__FILE__, __LINE__, secs);
+		goto out;
+	}
+
+	if (unlink("quiet.pid") < 0) {
+		fprintf(stderr, "%s: %d: failed to remove quiet.pid\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (run_hooks(dir, "sleep1 quiet", 1, 2, &secs) == 0 || secs >= 4) {
+		fprintf(stderr, "%s: %d: a parallel hook did not time out (%.2fs)\n",
+			__FILE__, __LINE__, secs);
+		goto out;
+	}
+	pid = read_pid("quiet.pid");
+	if (pid <= 0 || pid_alive(pid)) {
+		fprintf(stderr, "%s: %d: the timed out parallel hook's child was not killed\n",
+			__FILE__, __LINE__);
+		goto out;
+	}
+
+	ret = EXIT_SUCCESS;
+out:
+	if (chdir("/") < 0)
+		ret = EXIT_FAILURE;
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if (system(cmd) != 0)
+		ret = EXIT_FAILURE;
+	if (ret == EXIT_SUCCESS)
+		printf("All tests passed\n");
+	exit(ret);
+}
@@ -0,0 +1,269 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Shifts a small tree with lxc_shift_ids(), from host ids into an id map
+ * and then from that map into another, and checks the owners, the ACL
+ * entries and that setuid and setgid bits survive the chown.
+ */
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "lxc/conf.h"
+#include "lxc/idshift.h"
+#include "lxc/list.h"
+
+#define ACL_ACCESS	"system.posix_acl_access"
+#define ACL_DEFAULT	"system.posix_acl_default"
+
+/* the layout of the ACL xattrs, see linux/posix_acl_xattr.h */
+#define ACL_VERSION	0x0002
+#define ACL_USER_OBJ	0x01
+#define ACL_USER	0x02
+#define ACL_GROUP_OBJ	0x04
+#define ACL_GROUP	0x08
+#define ACL_MASK	0x10
+#define ACL_OTHER	0x20
+
+struct acl_entry {
+	uint16_t tag;
+	uint16_t perm;
+	uint32_t id;
+};
+
+struct acl {
+	uint32_t version;
+	struct acl_entry e[6];
+};
+
+static struct lxc_list *make_map(unsigned long hostid)
+{
+	struct lxc_list *map, *item;
+	struct id_map *m;
+	int i;
+
+	map = malloc(sizeof(*map));
+	if (!map)
+		return NULL;
+	lxc_list_init(map);
+	for (i = 0; i < 2; i++) {
+		item = malloc(sizeof(*item));
+		m = malloc(sizeof(*m));
+		if (!item || !m)
+			return NULL;
+		m->idtype = i ? ID_TYPE_GID : ID_TYPE_UID;
+		m->nsid = 0;
+		m->hostid = hostid;
+		m->range = 65536;
+		item->elem = m;
+		lxc_list_add_tail(map, item);
+	}
+	return map;
+}
+
+static void free_map(struct lxc_list *map)
+{
+	struct lxc_list *it, *next;
+
+	if (!map)
+		return;
+	lxc_list_for_each_safe(it, map, next) {
+		lxc_list_del(it);
+		free(it->elem);
+		free(it);
+	}
+	free(map);
+}
+
+/* an ACL giving user @uid and group @gid access */
+static int set_acl(const char *path, const char *name, uint32_t uid,
+		   uint32_t gid)
+{
+	struct acl acl = {
+		.version = htole32(ACL_VERSION),
+		.e = {
+			{ htole16(ACL_USER_OBJ), htole16(7), htole32(-1) },
+			{ htole16(ACL_USER), htole16(5), htole32(uid) },
+			{ htole16(ACL_GROUP_OBJ), htole16(5), htole32(-1) },
+			{ htole16(ACL_GROUP), htole16(5), htole32(gid) },
+			{ htole16(ACL_MASK), htole16(7), htole32(-1) },
+			{ htole16(ACL_OTHER), htole16(5), htole32(-1) },
+		},
+	};
+
+	if (lsetxattr(path, name, &acl, sizeof(acl), 0) < 0) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+static bool has_acl(const char *path, const char *name, uint32_t uid,
+		    uint32_t gid)
+{
+	struct acl acl;
+
+	if (lgetxattr(path, name, &acl, sizeof(acl)) != sizeof(acl))
+		return false;
+	return le32toh(acl.e[1].id) == uid && le32toh(acl.e[3].id) == gid;
+}
+
+static int make_file(const char *path, uid_t uid, gid_t gid, mode_t mode)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 || fchown(fd, uid, gid) < 0 || fchmod(fd, mode) < 0) {
+		perror(path);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+static bool is_owned(const char *path, uid_t uid, gid_t gid, mode_t mode)
+{
+	struct stat st;
+
+	if (lstat(path, &st) < 0)
+		return false;
+	if (st.st_uid != uid || st.st_gid != gid)
+		return false;
+	return !mode || (st.st_mode & 07777) == mode;
+}
+
+/*
+ * tree/              0:0
+ *   setuid           0:0          04755
+ *   setgid           1000:1000    02755
+ *   link -> setuid   7:7
+ *   outside          70000:70000  (not covered by the maps)
+ *   acl/             5:6          access and default ACLs for 1000:2000
+ */
+static int make_tree(void)
+{
+	if (mkdir("tree", 0755) < 0 || mkdir("tree/acl", 0755) < 0 ||
+	    chown("tree/acl", 5, 6) < 0) {
+		perror("tree");
+		return -1;
+	}
+	if (symlink("setuid", "tree/link") < 0 ||
+	    lchown("tree/link", 7, 7) < 0) {
+		perror("tree/link");
+		return -1;
+	}
+	return make_file("tree/setuid", 0, 0, 04755) ||
+	       make_file("tree/setgid", 1000, 1000, 02755) ||
+	       make_file("tree/outside", 70000, 70000, 0644) ||
+	       set_acl("tree/acl", ACL_ACCESS, 1000, 2000) ||
+	       set_acl("tree/acl", ACL_DEFAULT, 1000, 2000);
+}
+
+/* check the tree once shifted by @base */
+static bool check_tree(unsigned long base)
+{
+	if (!is_owned("tree", base, base, 0) ||
+	    !is_owned("tree/link", base + 7, base + 7, 0) ||
+	    !is_owned("tree/acl", base + 5, base + 6, 0)) {
+		fprintf(stderr, "%s: %d: bad owners\n", __FILE__, __LINE__);
+		return false;
+	}
+	if (!is_owned("tree/setuid", base, base, 04755) ||
+	    !is_owned("tree/setgid", base + 1000, base + 1000, 02755)) {
+		fprintf(stderr, "%s: %d: setuid or setgid bit lost\n", __FILE__, __LINE__);
+		return false;
+	}
+	if (!has_acl("tree/acl", ACL_ACCESS, base + 1000, base + 2000) ||
+	    !has_acl("tree/acl", ACL_DEFAULT, base + 1000, base + 2000)) {
+		fprintf(stderr, "%s: %d: bad ACL entries\n", __FILE__, __LINE__);
+		return false;
+	}
+	if (!is_owned("tree/outside", 70000, 70000, 0)) {
+		fprintf(stderr, "%s: %d: unmapped ids were shifted\n", __FILE__, __LINE__);
+		return false;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_list *map1 = NULL, *map2 = NULL;
+	char dir[] = "/tmp/lxc-idshift-XXXXXX", cmd[128];
+	int ret = EXIT_FAILURE;
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "the idshift test must be run as root\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!mkdtemp(dir) || chdir(dir) < 0) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	map1 = make_map(100000);
+	map2 = make_map(300000);
+	if (!map1 || !map2 || make_tree())
+		goto out;
+
+	if (lxc_shift_ids("tree", NULL, map1, "progress", 2) != 0) {
+		fprintf(stderr, "%s: %d: failed to shift host ids into a map\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!check_tree(100000))
+		goto out;
+	if (access("progress", F_OK) == 0 || errno != ENOENT) {
+		fprintf(stderr, "%s: %d: the progress file was left behind\n", __FILE__, __LINE__);
+		goto out;
+	}
+
+	if (lxc_shift_ids("tree", NULL, map1, NULL, 2) != 0) {
+		fprintf(stderr, "%s: %d: failed to shift again into the same map\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!check_tree(100000))
+		goto out;
+
+	if (lxc_shift_ids("tree", map1, map2, NULL, 2) != 0) {
+		fprintf(stderr, "%s: %d: failed to shift from a map into another\n", __FILE__, __LINE__);
+		goto out;
+	}
+	if (!check_tree(300000))
+		goto out;
+
+	ret = EXIT_SUCCESS;
+out:
+	free_map(map1);
+	free_map(map2);
+	if (chdir("/") < 0)
+		ret = EXIT_FAILURE;
+	snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+	if (system(cmd) != 0)
+		ret = EXIT_FAILURE;
+	if (ret == EXIT_SUCCESS)
+		printf("All tests passed\n");
+	exit(ret);
+}
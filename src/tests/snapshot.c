@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "lxc/lxc.h"
 
 #define MYNAME "snapxxx1"
@@ -32,7 +33,9 @@
 static void try_to_remove(void)
 {
 	struct lxc_container *c;
-	char snappath[1024];
+	char snappath[1024], snapname[20];
+	int i;
+
 	c = lxc_container_new(RESTNAME, NULL);
 	if (c) {
 		if (c->is_defined(c))
@@ -40,11 +43,14 @@ static void try_to_remove(void)
 		lxc_container_put(c);
 	}
 	snprintf(snappath, 1024, "%ssnaps/%s", lxc_get_global_config_item("lxc.lxcpath"), MYNAME);
-	c = lxc_container_new("snap0", snappath);
-	if (c) {
-		if (c->is_defined(c))
-			c->destroy(c);
-		lxc_container_put(c);
+	for (i = 0; i < 4; i++) {
+		snprintf(snapname, 20, "snap%d", i);
+		c = lxc_container_new(snapname, snappath);
+		if (c) {
+			if (c->is_defined(c))
+				c->destroy(c);
+			lxc_container_put(c);
+		}
 	}
 	c = lxc_container_new(MYNAME2, NULL);
 	if (c) {
@@ -60,6 +66,106 @@ static void try_to_remove(void)
 	}
 }
 
+/*
+ * Check that c's snapshot list holds exactly the n snapshots in names,
+ * in any order.
+ */
+static bool snaps_are(struct lxc_container *c, const char **names, int n)
+{
+	struct lxc_snapshot *s = NULL;
+	int i, j, count;
+	bool ret = true;
+
+	count = c->snapshot_list(c, &s);
+	if (count < 0)
+		return false;
+	if (count != n)
+		ret = false;
+	for (i = 0; ret && i < n; i++) {
+		for (j = 0; j < count; j++)
+			if (strcmp(s[j].name, names[i]) == 0)
+				break;
+		if (j == count)
+			ret = false;
+	}
+	for (i = 0; i < count; i++)
+		s[i].free(&s[i]);
+	free(s);
+	return ret;
+}
+
+/*
+ * Exercise the snapshot index.  Expects c to have had snap0 taken and
+ * destroyed already.
+ */
+static bool test_snapshot_index(struct lxc_container *c)
+{
+	const char *snaps12[] = { "snap1", "snap2" };
+	const char *snaps13[] = { "snap1", "snap3" };
+	char path[1024];
+	FILE *f;
+
+	snprintf(path, 1024, "%ssnaps/%s/.index", c->config_path, c->name);
+
+	// snap0 is gone, but its number must not be handed out again
+	if (c->snapshot(c, NULL) != 1) {
+		fprintf(stderr, "%s: %d: destroyed snap0 was reused\n", __FILE__, __LINE__);
+		return false;
+	}
+	if (c->snapshot(c, NULL) != 2) {
+		fprintf(stderr, "%s: %d: failed to create snap2\n", __FILE__, __LINE__);
+		return false;
+	}
+	if (!snaps_are(c, snaps12, 2)) {
+		fprintf(stderr, "%s: %d: bad snapshot list\n", __FILE__, __LINE__);
+		return false;
+	}
+
+	if (unlink(path) < 0) {
+		fprintf(stderr, "%s: %d: failed to remove %s\n", __FILE__, __LINE__, path);
+		return false;
+	}
+	if (!snaps_are(c, snaps12, 2)) {
+		fprintf(stderr, "%s: %d: bad snapshot list after removing the index\n", __FILE__, __LINE__);
+		return false;
+	}
+
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "%s: %d: failed to open %s\n", __FILE__, __LINE__, path);
+		return false;
+	}
+	fprintf(f, "garbage\nsnap7\n");
+	fclose(f);
+	if (!snaps_are(c, snaps12, 2)) {
+		fprintf(stderr, "%s: %d: bad snapshot list after corrupting the index\n", __FILE__, __LINE__);
+		return false;
+	}
+
+	if (!c->snapshot_destroy(c, "snap2")) {
+		fprintf(stderr, "%s: %d: failed to destroy snap2\n", __FILE__, __LINE__);
+		return false;
+	}
+	if (c->snapshot(c, NULL) != 3) {
+		fprintf(stderr, "%s: %d: destroyed snap2 was reused\n", __FILE__, __LINE__);
+		return false;
+	}
+	if (!snaps_are(c, snaps13, 2)) {
+		fprintf(stderr, "%s: %d: bad snapshot list after destroy\n", __FILE__, __LINE__);
+		return false;
+	}
+
+	if (!c->snapshot_destroy(c, "snap1") || !c->snapshot_destroy(c, "snap3")) {
+		fprintf(stderr, "%s: %d: failed to destroy snapshots\n", __FILE__, __LINE__);
+		return false;
+	}
+	if (!snaps_are(c, NULL, 0)) {
+		fprintf(stderr, "%s: %d: snapshots left after destroy\n", __FILE__, __LINE__);
+		return false;
+	}
+	return true;
+}
+
 int main(int argc, char *argv[])
 {
 	struct lxc_container *c, *c2 = NULL;
@@ -133,6 +239,8 @@ int main(int argc, char *argv[])
 		goto err;
 	}
 
+	if (!test_snapshot_index(c))
+		goto err;
 
 	c2 = c->clone(c, MYNAME2, NULL, LXC_CLONE_SNAPSHOT, "overlayfs", NULL, 0, NULL);
 	if (!c2) {
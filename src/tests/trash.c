@@ -0,0 +1,244 @@
+/* liblxcapi
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Destroys a snapshot and a container with lxc.destroy.deferred = 1, and
+ * checks that they are gone right away, that nothing is left behind in
+ * the snapshot directory, and that the trash is emptied in the background.
+ * lxc.destroy.deferred is added to the system configuration for the
+ * duration of the test.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <lxc/lxccontainer.h>
+
+#include "lxc/utils.h"
+
+#define MYNAME "trashxxx1"
+
+static char lxcpath[] = "/tmp/lxc-trash-XXXXXX";
+static char *saved_conf;
+static size_t saved_len;
+static bool had_conf;
+
+static bool set_deferred(void)
+{
+	char *dir;
+	FILE *f;
+	long len;
+
+	f = fopen(LXC_GLOBAL_CONF, "r");
+	if (f) {
+		had_conf = true;
+		fseek(f, 0, SEEK_END);
+		len = ftell(f);
+		rewind(f);
+		saved_conf = malloc(len + 1);
+		if (!saved_conf || fread(saved_conf, 1, len, f) != len) {
+			fclose(f);
+			return false;
+		}
+		saved_len = len;
+		fclose(f);
+	}
+
+	dir = strdup(LXC_GLOBAL_CONF);
+	if (!dir || mkdir_p(dirname(dir), 0755) < 0) {
+		free(dir);
+		return false;
+	}
+	free(dir);
+
+	f = fopen(LXC_GLOBAL_CONF, "a");
+	if (!f) {
+		perror(LXC_GLOBAL_CONF);
+		return false;
+	}
+	fprintf(f, "\nlxc.destroy.deferred = 1\n");
+	return fclose(f) == 0;
+}
+
+static void restore_conf(void)
+{
+	FILE *f;
+
+	if (!had_conf) {
+		unlink(LXC_GLOBAL_CONF);
+		return;
+	}
+	f = fopen(LXC_GLOBAL_CONF, "w");
+	if (!f || fwrite(saved_conf, 1, saved_len, f) != saved_len)
+		fprintf(stderr, "failed to restore %s\n", LXC_GLOBAL_CONF);
+	if (f)
+		fclose(f);
+	free(saved_conf);
+}
+
+/* a container with a small rootfs of plain files in @lxcpath */
+static struct lxc_container *make_container(void)
+{
+	struct lxc_container *c;
+	char path[1024];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/" MYNAME "/rootfs/etc", lxcpath);
+	if (mkdir_p(path, 0755))
+		return NULL;
+	snprintf(path, sizeof(path), "%s/" MYNAME "/rootfs/etc/hostname", lxcpath);
+	f = fopen(path, "w");
+	if (!f)
+		return NULL;
+	fprintf(f, MYNAME "\n");
+	fclose(f);
+
+	snprintf(path, sizeof(path), "%s/" MYNAME "/config", lxcpath);
+	f = fopen(path, "w");
+	if (!f)
+		return NULL;
+	fprintf(f, "lxc.utsname = " MYNAME "\nlxc.rootfs = %s/" MYNAME "/rootfs\n",
+		lxcpath);
+	fclose(f);
+
+	c = lxc_container_new(MYNAME, lxcpath);
+	if (c && !c->is_defined(c)) {
+		lxc_container_put(c);
+		return NULL;
+	}
+	return c;
+}
+
+/* the number of entries in @path other than . and .. and @except */
+static int count_entries(const char *path, const char *except)
+{
+	struct dirent *d;
+	DIR *dir;
+	int n = 0;
+
+	dir = opendir(path);
+	if (!dir)
+		return errno == ENOENT ? 0 : -1;
+	while ((d = readdir(dir))) {
+		if (!strcmp(d->d_name, ".") || !strcmp(d->d_name, ".."))
+			continue;
+		if (except && !strcmp(d->d_name, except))
+			continue;
+		n++;
+	}
+	closedir(dir);
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	struct lxc_container *c = NULL, *snap;
+	struct lxc_snapshot *s;
+	char path[1024], cmd[1024];
+	int i, n, ret = 1;
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "the trash test must be run as root\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!mkdtemp(lxcpath)) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	if (!set_deferred())
+		goto out;
+
+	c = make_container();
+	if (!c) {
+		fprintf(stderr, "%d: failed to make a container\n", __LINE__);
+		goto out;
+	}
+
+	if (c->snapshot(c, NULL) != 0 || c->snapshot(c, NULL) != 1) {
+		fprintf(stderr, "%d: failed to snapshot the container\n", __LINE__);
+		goto out;
+	}
+	if (!c->snapshot_destroy(c, "snap0")) {
+		fprintf(stderr, "%d: failed to destroy snap0\n", __LINE__);
+		goto out;
+	}
+
+	snprintf(path, sizeof(path), "%ssnaps/" MYNAME, lxcpath);
+	snap = lxc_container_new("snap0", path);
+	if (!snap || snap->is_defined(snap)) {
+		fprintf(stderr, "%d: snap0 is still defined\n", __LINE__);
+		lxc_container_put(snap);
+		goto out;
+	}
+	lxc_container_put(snap);
+
+	// only snap1 and the index are left in the snapshot directory
+	if (count_entries(path, NULL) != 2) {
+		fprintf(stderr, "%d: %s was left with stray entries\n", __LINE__, path);
+		goto out;
+	}
+	n = c->snapshot_list(c, &s);
+	if (n != 1 || strcmp(s[0].name, "snap1") != 0) {
+		fprintf(stderr, "%d: bad snapshot list after destroying snap0\n", __LINE__);
+		goto out;
+	}
+	for (i = 0; i < n; i++)
+		s[i].free(&s[i]);
+	free(s);
+
+	if (!c->snapshot_destroy(c, "snap1") || !c->destroy(c)) {
+		fprintf(stderr, "%d: failed to destroy the container\n", __LINE__);
+		goto out;
+	}
+	if (c->is_defined(c)) {
+		fprintf(stderr, "%d: " MYNAME " is still defined\n", __LINE__);
+		goto out;
+	}
+
+	// the reaper runs in the background, give it some time
+	snprintf(path, sizeof(path), "%s/.trash", lxcpath);
+	if (access(path, F_OK) < 0) {
+		fprintf(stderr, "%d: nothing was moved to %s\n", __LINE__, path);
+		goto out;
+	}
+	for (i = 0; i < 100; i++) {
+		n = count_entries(path, ".reaper");
+		if (n <= 0)
+			break;
+		usleep(100000);
+	}
+	if (n != 0) {
+		fprintf(stderr, "%d: the trash was not emptied\n", __LINE__);
+		goto out;
+	}
+
+	printf("All tests passed\n");
+	ret = 0;
+
+out:
+	lxc_container_put(c);
+	restore_conf();
+	snprintf(cmd, sizeof(cmd), "rm -rf %s %ssnaps", lxcpath, lxcpath);
+	if (system(cmd) != 0)
+		ret = 1;
+	exit(ret);
+}